@@ -142,9 +142,10 @@ void report_assert_msg(const std::string& m)
 }
 
 namespace {
-	int silence_on_assert = 0;
-	int throw_validation_failure = 0;
-	int throw_fatal = 0;
+	//recover scopes only apply to the thread they're created on.
+	thread_local int silence_on_assert = 0;
+	thread_local int throw_validation_failure = 0;
+	thread_local int throw_fatal = 0;
 }
 
 validation_failure_exception::validation_failure_exception(const std::string& m)
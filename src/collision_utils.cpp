@@ -29,6 +29,7 @@
 #include "object_events.hpp"
 #include "rectangle_rotator.hpp"
 #include "solid_map.hpp"
+#include "user_collision_grid.hpp"
 
 namespace
 {
@@ -43,6 +44,27 @@ namespace
 
 		return ypos + delta_y;
 	}
+
+	//Gets the mask of where the entity is solid, mirrored or offset to match
+	//which way it's facing and whether it's upside down, along with where the
+	//mask's top left corner is in the level.
+	const PixelMask& get_solid_mask(const Entity& e, const SolidInfo& solid, int* xpos, int* ypos)
+	{
+		const rect& area = solid.area();
+
+		*ypos = e.y() + area.y();
+		if(e.isUpsideDown()) {
+			*ypos -= translate_y_for_inverted_solid(0, e.frameRect(), area);
+		}
+
+		if(e.isFacingRight()) {
+			*xpos = e.x() + area.x();
+			return solid.mask();
+		}
+
+		*xpos = e.x() + e.getCurrentFrame().width() - area.x() - area.w();
+		return solid.mirroredMask();
+	}
 }
 
 void CollisionInfo::readSurfInfo()
@@ -294,6 +316,20 @@ bool entity_collides_with_entity(const Entity& e, const Entity& other, Collision
 	const SolidInfo* other_solid = other.solid();
 	assert(our_solid && other_solid);
 
+	int our_mask_x, our_mask_y, other_mask_x, other_mask_y;
+	const PixelMask& our_mask = get_solid_mask(e, *our_solid, &our_mask_x, &our_mask_y);
+	const PixelMask& other_mask = get_solid_mask(other, *other_solid, &other_mask_x, &other_mask_y);
+
+	//test whole words of pixels first, the same pixels as the loop below,
+	//which is then only needed to find out which solid areas collided.
+	if(!PixelMask::overlaps(&our_mask, our_mask_x, our_mask_y, &other_mask, other_mask_x, other_mask_y, rect(area.x(), area.y(), area.w(), area.h()+1))) {
+		return false;
+	}
+
+	if(!info) {
+		return true;
+	}
+
 	const Frame& our_frame = e.getCurrentFrame();
 	const Frame& other_frame = other.getCurrentFrame();
 
@@ -622,12 +658,22 @@ int entity_user_collision(const Entity& a, const Entity& b, CollisionPair* areas
 				//enough accuracy and is 4x faster.
 				const int Stride = 2;
 				const rect intersection = intersection_rect(rect_a, rect_b);
-				for(int y = intersection.y(); y <= intersection.y2() && !found; y += Stride) {
-					for(int x = intersection.x(); x <= intersection.x2(); x += Stride) {
-						if((area_a.no_alpha_check || !fa.isAlpha(x - a.x(), y - a.y(), time_a, a.isFacingRight())) &&
-						   (area_b.no_alpha_check || !fb.isAlpha(x - b.x(), y - b.y(), time_b, b.isFacingRight()))) {
-							found = true;
-							break;
+
+				const PixelMask* mask_a = area_a.no_alpha_check ? nullptr : fa.getAlphaMask(time_a, a.isFacingRight());
+				const PixelMask* mask_b = area_b.no_alpha_check ? nullptr : fb.getAlphaMask(time_b, b.isFacingRight());
+				if((mask_a || area_a.no_alpha_check) && (mask_b || area_b.no_alpha_check)) {
+					//test 64 pixels at a time. A null mask has every pixel
+					//set, and the area tested runs to x2() and y2() inclusive
+					//like the loop below.
+					found = PixelMask::overlaps(mask_a, a.x(), a.y(), mask_b, b.x(), b.y(), rect(intersection.x(), intersection.y(), intersection.w()+1, intersection.h()+1), Stride);
+				} else {
+					for(int y = intersection.y(); y <= intersection.y2() && !found; y += Stride) {
+						for(int x = intersection.x(); x <= intersection.x2(); x += Stride) {
+							if((area_a.no_alpha_check || !fa.isAlpha(x - a.x(), y - a.y(), time_a, a.isFacingRight())) &&
+							   (area_b.no_alpha_check || !fb.isAlpha(x - b.x(), y - b.y(), time_b, b.isFacingRight()))) {
+								found = true;
+								break;
+							}
 						}
 					}
 				}
@@ -762,6 +808,30 @@ int get_collision_event_id(const std::string& area)
 
 }
 
+namespace
+{
+//gets a rect which contains every pixel entity_user_collision() might test
+//for the entity, including rotated collision areas.
+rect get_user_collision_bounds(const Entity& e)
+{
+	const Frame& f = e.getCurrentFrame();
+	const bool rotated = e.currentRotation() != 0;
+
+	rect result;
+	for(const auto& area : f.getCollisionAreas()) {
+		rect r = e.calculateCollisionRect(f, area);
+		if(rotated) {
+			const int radius = static_cast<int>(ceil(sqrt(float(r.w()*r.w() + r.h()*r.h()))/2.0f)) + 1;
+			r = rect(r.x() + r.w()/2 - radius, r.y() + r.h()/2 - radius, radius*2, radius*2);
+		}
+
+		result = rect_union(result, r);
+	}
+
+	return result;
+}
+}
+
 void detect_user_collisions(Level& lvl)
 {
 	std::vector<EntityPtr> chars;
@@ -772,6 +842,18 @@ void detect_user_collisions(Level& lvl)
 		}
 	}
 
+	//broad phase: only pairs of objects whose collision areas are close
+	//to each other are passed on to entity_user_collision().
+	UserCollisionGrid& grid = lvl.user_collision_grid();
+	grid.beginUpdate();
+	for(int n = 0; n != static_cast<int>(chars.size()); ++n) {
+		grid.update(chars[n].get(), n, get_user_collision_bounds(*chars[n]));
+	}
+	grid.endUpdate();
+
+	std::vector<std::pair<int, int> > candidates;
+	grid.getCandidatePairs(&candidates);
+
 	typedef std::pair<EntityPtr, const std::string*> collision_key;
 	std::map<collision_key, std::vector<collision_key> > collision_info;
 
@@ -779,30 +861,28 @@ void detect_user_collisions(Level& lvl)
 
 	const int MaxCollisions = 16;
 	CollisionPair collision_buf[MaxCollisions];
-	for(std::vector<EntityPtr>::const_iterator i = chars.begin(); i != chars.end(); ++i) {
-		for(std::vector<EntityPtr>::const_iterator j = i + 1; j != chars.end(); ++j) {
-			const EntityPtr& a = *i;
-			const EntityPtr& b = *j;
-			if(a == b ||
-			   ((a->getWeakCollideDimensions()&b->getCollideDimensions()) == 0 &&
-			   (a->getCollideDimensions()&b->getWeakCollideDimensions()) == 0)) {
-				//the objects do not share a dimension, and so can't collide.
-				continue;
-			}
+	for(const std::pair<int, int>& candidate : candidates) {
+		const EntityPtr& a = chars[candidate.first];
+		const EntityPtr& b = chars[candidate.second];
+		if(a == b ||
+		   ((a->getWeakCollideDimensions()&b->getCollideDimensions()) == 0 &&
+		   (a->getCollideDimensions()&b->getWeakCollideDimensions()) == 0)) {
+			//the objects do not share a dimension, and so can't collide.
+			continue;
+		}
 
-			int ncollisions = entity_user_collision(*a, *b, collision_buf, MaxCollisions);
-			if(ncollisions > MaxCollisions) {
-				ncollisions = MaxCollisions;
-			}
+		int ncollisions = entity_user_collision(*a, *b, collision_buf, MaxCollisions);
+		if(ncollisions > MaxCollisions) {
+			ncollisions = MaxCollisions;
+		}
 
-			for(int n = 0; n != ncollisions; ++n) {
-				{
-					collision_info[collision_key(a, collision_buf[n].first)].emplace_back(b, collision_buf[n].second);
-				}
+		for(int n = 0; n != ncollisions; ++n) {
+			{
+				collision_info[collision_key(a, collision_buf[n].first)].emplace_back(b, collision_buf[n].second);
+			}
 
-				{
-					collision_info[collision_key(b, collision_buf[n].second)].emplace_back(a, collision_buf[n].first);
-				}
+			{
+				collision_info[collision_key(b, collision_buf[n].second)].emplace_back(a, collision_buf[n].first);
 			}
 		}
 	}
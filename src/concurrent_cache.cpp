@@ -0,0 +1,190 @@
+/*
+	Copyright (C) 2003-2014 by David White <davewx7@gmail.com>
+
+	This software is provided 'as-is', without any express or implied
+	warranty. In no event will the authors be held liable for any damages
+	arising from the use of this software.
+
+	Permission is granted to anyone to use this software for any purpose,
+	including commercial applications, and to alter it and redistribute it
+	freely, subject to the following restrictions:
+
+	   1. The origin of this software must not be misrepresented; you must not
+	   claim that you wrote the original software. If you use this software
+	   in a product, an acknowledgement in the product documentation would be
+	   appreciated but is not required.
+
+	   2. Altered source versions must be plainly marked as such, and must not be
+	   misrepresented as being the original software.
+
+	   3. This notice may not be removed or altered from any source
+	   distribution.
+*/
+
+
+#include <algorithm>
+#include <mutex>
+#include <thread>
+
+#include "concurrent_cache.hpp"
+#include "unit_test.hpp"
+
+namespace
+{
+	std::mutex& registry_mutex()
+	{
+		static std::mutex instance;
+		return instance;
+	}
+
+	std::vector<const ConcurrentCacheBase*>& registry()
+	{
+		static std::vector<const ConcurrentCacheBase*> instance;
+		return instance;
+	}
+}
+
+ConcurrentCacheBase::ConcurrentCacheBase(const char* name) : name_(name), hits_(0), misses_(0), evictions_(0)
+{
+	if(name_ != nullptr) {
+		std::lock_guard<std::mutex> lock(registry_mutex());
+		registry().push_back(this);
+	}
+}
+
+ConcurrentCacheBase::~ConcurrentCacheBase()
+{
+	if(name_ != nullptr) {
+		std::lock_guard<std::mutex> lock(registry_mutex());
+		std::vector<const ConcurrentCacheBase*>& v = registry();
+		v.erase(std::remove(v.begin(), v.end(), this), v.end());
+	}
+}
+
+void ConcurrentCacheBase::fillStats(ConcurrentCacheStats* stats) const
+{
+	stats->name = name_ ? name_ : "";
+	stats->hits = hits_;
+	stats->misses = misses_;
+	stats->evictions = evictions_;
+}
+
+std::vector<ConcurrentCacheStats> ConcurrentCacheBase::getAllStats()
+{
+	std::vector<ConcurrentCacheStats> result;
+	std::lock_guard<std::mutex> lock(registry_mutex());
+	for(const ConcurrentCacheBase* cache : registry()) {
+		result.push_back(cache->getStats());
+	}
+
+	return result;
+}
+
+UNIT_TEST(concurrent_cache_lru_eviction)
+{
+	//every entry costs 10 bytes and there's one shard, so the budget
+	//holds exactly three entries.
+	ConcurrentCache<int, int> cache(nullptr, 30, [](int key, int value) { return size_t(10); }, 1);
+
+	cache.put(1, 100);
+	cache.put(2, 200);
+	cache.put(3, 300);
+	CHECK_EQ(cache.get(1), 100);
+
+	//2 is now the least recently used.
+	cache.put(4, 400);
+	CHECK_EQ(static_cast<int>(cache.size()), 3);
+	CHECK_EQ(cache.count(2), 0);
+	CHECK_EQ(cache.count(1), 1);
+	CHECK_EQ(cache.count(4), 1);
+
+	//replacing an entry doesn't change the total.
+	cache.put(4, 401);
+	CHECK_EQ(static_cast<int>(cache.size()), 3);
+	CHECK_EQ(cache.get(4), 401);
+
+	CHECK_EQ(cache.get(2), 0);
+
+	ConcurrentCacheStats stats = cache.getStats();
+	CHECK_EQ(static_cast<int>(stats.hits), 2);
+	CHECK_EQ(static_cast<int>(stats.misses), 1);
+	CHECK_EQ(static_cast<int>(stats.evictions), 1);
+	CHECK_EQ(static_cast<int>(stats.bytes), 30);
+
+	cache.erase(1);
+	CHECK_EQ(static_cast<int>(cache.getStats().bytes), 20);
+	cache.clear();
+	CHECK_EQ(static_cast<int>(cache.size()), 0);
+}
+
+UNIT_TEST(concurrent_cache_unbounded)
+{
+	ConcurrentCache<std::string, int> cache;
+	for(int n = 0; n != 1000; ++n) {
+		cache.put(std::to_string(n), n);
+	}
+
+	CHECK_EQ(static_cast<int>(cache.size()), 1000);
+	CHECK_EQ(cache.get("999"), 999);
+
+	std::vector<std::string> keys = cache.getKeys();
+	CHECK_EQ(static_cast<int>(keys.size()), 1000);
+}
+
+namespace
+{
+	//each thread does a mix of mostly lookups and some insertions on a
+	//shared set of keys, the access pattern of worker threads loading a
+	//level.
+	void run_cache_contention(int benchmark_iterations, int nthreads, int nshards)
+	{
+		const int NumKeys = 4096;
+		const int OpsPerThread = 20000;
+
+		ConcurrentCache<int, int> cache(nullptr, 0, ConcurrentCache<int, int>::size_fn(), nshards);
+		for(int n = 0; n != NumKeys; ++n) {
+			cache.put(n, n);
+		}
+
+		while(benchmark_iterations--) {
+			std::vector<std::thread> threads;
+			for(int t = 0; t != nthreads; ++t) {
+				threads.push_back(std::thread([&cache, t]() {
+					unsigned int seed = t*7919 + 1;
+					for(int n = 0; n != OpsPerThread; ++n) {
+						seed = seed*1103515245 + 12345;
+						const int key = (seed >> 8)%NumKeys;
+						if(n%16 == 0) {
+							cache.put(key, n);
+						} else {
+							cache.get(key);
+						}
+					}
+				}));
+			}
+
+			for(std::thread& t : threads) {
+				t.join();
+			}
+		}
+	}
+}
+
+BENCHMARK_ARG(concurrent_cache_contention, int nthreads)
+{
+	run_cache_contention(benchmark_iterations, nthreads, ConcurrentCache<int, int>::DefaultShards);
+}
+
+BENCHMARK_ARG_CALL(concurrent_cache_contention, sharded_threads_1, 1);
+BENCHMARK_ARG_CALL(concurrent_cache_contention, sharded_threads_4, 4);
+BENCHMARK_ARG_CALL(concurrent_cache_contention, sharded_threads_8, 8);
+
+BENCHMARK_ARG(concurrent_cache_one_shard_contention, int nthreads)
+{
+	//a single shard behaves like a cache behind one global lock.
+	run_cache_contention(benchmark_iterations, nthreads, 1);
+}
+
+BENCHMARK_ARG_CALL(concurrent_cache_one_shard_contention, one_shard_threads_1, 1);
+BENCHMARK_ARG_CALL(concurrent_cache_one_shard_contention, one_shard_threads_4, 4);
+BENCHMARK_ARG_CALL(concurrent_cache_one_shard_contention, one_shard_threads_8, 8);
@@ -23,71 +23,210 @@
 
 #pragma once
 
-#include <map>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <memory>
+#include <string>
+#include <unordered_map>
 #include <vector>
 
 #include "thread.hpp"
 
-template<typename Key, typename Value>
-class ConcurrentCache
+struct ConcurrentCacheStats
+{
+	std::string name;
+	uint64_t hits, misses, evictions;
+	size_t entries, bytes, max_bytes;
+};
+
+//Keeps hit/miss counters for a cache and, if the cache is given a name,
+//registers it so its statistics can be queried from the debug console.
+class ConcurrentCacheBase
 {
 public:
-	typedef std::map<Key, Value> map_type;
+	explicit ConcurrentCacheBase(const char* name);
+	virtual ~ConcurrentCacheBase();
 
-	size_t size() const { threading::lock l(mutex_); return map_.size(); }
+	virtual ConcurrentCacheStats getStats() const = 0;
 
-	const Value& get(const Key& key) {
-		threading::lock l(mutex_);
-		typename map_type::const_iterator itor = map_.find(key);
-		if(itor != map_.end()) {
-			return itor->second;
-		} else {
-			static const Value empty_result = Value();
-			return empty_result;
+	static std::vector<ConcurrentCacheStats> getAllStats();
+
+protected:
+	void fillStats(ConcurrentCacheStats* stats) const;
+
+	const char* name_;
+	std::atomic<uint64_t> hits_, misses_, evictions_;
+
+private:
+	ConcurrentCacheBase(const ConcurrentCacheBase&);
+	void operator=(const ConcurrentCacheBase&);
+};
+
+//A thread-safe map split into shards by key hash, each with its own lock,
+//so threads looking up different keys rarely contend.
+//
+//If max_bytes is non-zero, entries are evicted least recently used first
+//once the total size reported by size_fn exceeds it. The budget is split
+//evenly between the shards.
+template<typename Key, typename Value, typename Hash=std::hash<Key>>
+class ConcurrentCache : public ConcurrentCacheBase
+{
+public:
+	typedef std::function<size_t(const Key&, const Value&)> size_fn;
+
+	enum { DefaultShards = 16 };
+
+	explicit ConcurrentCache(const char* name=nullptr, size_t max_bytes=0, size_fn fn=size_fn(), int nshards=DefaultShards)
+	  : ConcurrentCacheBase(name), shards_(new Shard[nshards]), nshards_(nshards),
+	    max_bytes_(max_bytes), shard_max_bytes_(max_bytes/nshards), size_fn_(fn)
+	{}
+
+	size_t size() const {
+		size_t result = 0;
+		for(int n = 0; n != nshards_; ++n) {
+			threading::lock l(shards_[n].mutex);
+			result += shards_[n].index.size();
 		}
+
+		return result;
+	}
+
+	//returns a copy of the value for key, or a default constructed value
+	//if it's not in the cache.
+	Value get(const Key& key) {
+		Value result = Value();
+		tryGet(key, &result);
+		return result;
+	}
+
+	bool tryGet(const Key& key, Value* result) {
+		Shard& shard = getShard(key);
+		threading::lock l(shard.mutex);
+		auto itor = shard.index.find(key);
+		if(itor == shard.index.end()) {
+			++misses_;
+			return false;
+		}
+
+		++hits_;
+		shard.lru.splice(shard.lru.begin(), shard.lru, itor->second);
+		*result = itor->second->value;
+		return true;
 	}
 
 	void put(const Key& key, const Value& value) {
-		threading::lock l(mutex_);
-		map_[key] = value;
+		const size_t nbytes = max_bytes_ && size_fn_ ? size_fn_(key, value) : 0;
+
+		Shard& shard = getShard(key);
+		threading::lock l(shard.mutex);
+		auto itor = shard.index.find(key);
+		if(itor != shard.index.end()) {
+			shard.bytes -= itor->second->bytes;
+			itor->second->value = value;
+			itor->second->bytes = nbytes;
+			shard.lru.splice(shard.lru.begin(), shard.lru, itor->second);
+		} else {
+			Entry entry = { key, value, nbytes };
+			shard.lru.push_front(entry);
+			shard.index[key] = shard.lru.begin();
+		}
+
+		shard.bytes += nbytes;
+
+		//never evict the entry just added, even if it alone is over budget.
+		while(max_bytes_ && shard.bytes > shard_max_bytes_ && shard.lru.size() > 1) {
+			const Entry& victim = shard.lru.back();
+			shard.bytes -= victim.bytes;
+			shard.index.erase(victim.key);
+			shard.lru.pop_back();
+			++evictions_;
+		}
 	}
 
 	void erase(const Key& key) {
-		threading::lock l(mutex_);
-		map_.erase(key);
+		Shard& shard = getShard(key);
+		threading::lock l(shard.mutex);
+		auto itor = shard.index.find(key);
+		if(itor != shard.index.end()) {
+			shard.bytes -= itor->second->bytes;
+			shard.lru.erase(itor->second);
+			shard.index.erase(itor);
+		}
 	}
 
 	int count(const Key& key) const {
-		threading::lock l(mutex_);
-		return map_.count(key);
+		const Shard& shard = getShard(key);
+		threading::lock l(shard.mutex);
+		return static_cast<int>(shard.index.count(key));
 	}
 
 	void clear() {
-		threading::lock l(mutex_);
-		map_.clear();
+		for(int n = 0; n != nshards_; ++n) {
+			threading::lock l(shards_[n].mutex);
+			shards_[n].index.clear();
+			shards_[n].lru.clear();
+			shards_[n].bytes = 0;
+		}
 	}
 
-	std::vector<Key> getKeys() {
+	std::vector<Key> getKeys() const {
 		std::vector<Key> result;
-		threading::lock l(mutex_);
-		for(const auto& i : map_) {
-			result.push_back(i.first);
+		for(int n = 0; n != nshards_; ++n) {
+			threading::lock l(shards_[n].mutex);
+			for(const Entry& entry : shards_[n].lru) {
+				result.push_back(entry.key);
+			}
 		}
 
 		return result;
 	}
 
-	struct lock : public threading::lock {
-		explicit lock(ConcurrentCache& cache) : threading::lock(cache.mutex_), cache_(cache) {
+	ConcurrentCacheStats getStats() const override {
+		ConcurrentCacheStats stats;
+		fillStats(&stats);
+		stats.entries = 0;
+		stats.bytes = 0;
+		stats.max_bytes = max_bytes_;
+		for(int n = 0; n != nshards_; ++n) {
+			threading::lock l(shards_[n].mutex);
+			stats.entries += shards_[n].index.size();
+			stats.bytes += shards_[n].bytes;
 		}
 
-		map_type& map() const { return cache_.map_; }
+		return stats;
+	}
 
-	private:
-		ConcurrentCache& cache_;
+private:
+	struct Entry {
+		Key key;
+		Value value;
+		size_t bytes;
 	};
 
-private:
-	map_type map_;
-	mutable threading::mutex mutex_;
+	typedef std::list<Entry> lru_list;
+
+	struct Shard {
+		Shard() : bytes(0) {}
+		mutable threading::mutex mutex;
+
+		//most recently used at the front.
+		lru_list lru;
+		std::unordered_map<Key, typename lru_list::iterator, Hash> index;
+		size_t bytes;
+	};
+
+	Shard& getShard(const Key& key) const {
+		//mix the high bits in, since some hashes (e.g. of pointers) have
+		//little entropy in the low bits.
+		const uint64_t h = Hash()(key);
+		return shards_[(h ^ (h >> 16) ^ (h >> 32)) % nshards_];
+	}
+
+	std::unique_ptr<Shard[]> shards_;
+	int nshards_;
+
+	size_t max_bytes_, shard_max_bytes_;
+	size_fn size_fn_;
 };
@@ -27,6 +27,7 @@
 #include "Canvas.hpp"
 #include "ClipScope.hpp"
 #include "ColorScope.hpp"
+#include "DisplayDeviceNull.hpp"
 #include "Font.hpp"
 #include "ModelMatrixScope.hpp"
 #include "ParticleSystem.hpp"
@@ -34,11 +35,13 @@
 #include "SceneGraph.hpp"
 #include "SceneNode.hpp"
 #include "StencilScope.hpp"
+#include "Surface.hpp"
 #include "WindowManager.hpp"
 
 #include <stdio.h>
 
 #include <cassert>
+#include <functional>
 #include <iostream>
 
 #include "asserts.hpp"
@@ -68,9 +71,11 @@
 #include "playable_custom_object.hpp"
 #include "preferences.hpp"
 #include "profile_timer.hpp"
+#include "random.hpp"
 #include "rectangle_rotator.hpp"
 #include "screen_handling.hpp"
 #include "string_utils.hpp"
+#include "TextureObject.hpp"
 #include "variant.hpp"
 #include "variant_utils.hpp"
 #include "unit_test.hpp"
@@ -93,6 +98,9 @@ public:
 		prev_prop_(obj.active_property_),
 		pop_value_stack_(false)
 	{
+		//properties of other objects can't be evaluated in isolation,
+		//since their value stacks might be in use on another thread.
+		game_logic::Formula::failIfIsolatedContext(&obj);
 		obj_.active_property_ = prop_num;
 		if(value) {
 			obj_.value_stack_.push(*value);
@@ -205,6 +213,7 @@ CustomObject::CustomObject(variant node)
 	editor_only_(node["editor_only"].as_bool(false)),
 	collides_with_level_(node["collides_with_level"].as_bool(type_->collidesWithLevel())),
 	currently_handling_die_event_(0),
+	isolated_process_cycle_(-1),
 	use_absolute_screen_coordinates_(node["use_absolute_screen_coordinates"].as_bool(type_->useAbsoluteScreenCoordinates())),
 	paused_(false),
 	shader_flags_(0),
@@ -578,6 +587,7 @@ CustomObject::CustomObject(const std::string& type, int x, int y, bool face_righ
 	collides_with_level_(type_->collidesWithLevel()),
 	min_difficulty_(-1), max_difficulty_(-1),
 	currently_handling_die_event_(0),
+	isolated_process_cycle_(-1),
 	use_absolute_screen_coordinates_(type_->useAbsoluteScreenCoordinates()),
 	paused_(false),
 	shader_flags_(0),
@@ -716,6 +726,7 @@ CustomObject::CustomObject(const CustomObject& o)
 	editor_only_(o.editor_only_),
 	collides_with_level_(o.collides_with_level_),
 	currently_handling_die_event_(0),
+	isolated_process_cycle_(-1),
 	//do NOT copy widgets since they do not support deep copying
 	//and re-seating references is difficult.
 	//widgets_(o.widgets_),
@@ -1268,6 +1279,8 @@ CustomObjectDrawZOrderManager::~CustomObjectDrawZOrderManager()
 		return;
 	}
 
+	Frame::flushSpriteBatch();
+
 	for(const auto& p : g_batch_draw_objects) {
 		p.second.objects.front()->draw(p.second.xx, p.second.yy);
 	}
@@ -1281,8 +1294,37 @@ CustomObjectDrawZOrderManager::~CustomObjectDrawZOrderManager()
 
 extern int g_camera_extend_x, g_camera_extend_y;
 
+bool CustomObject::drawsOnlySprite() const
+{
+	if(frame_ == nullptr || shader_ || !type_->drawBatchID().empty() || type_->isShadow()) {
+		return false;
+	}
+
+	if(!blur_objects_.empty() || !attachedObjects().empty() || !effects_shaders_.empty() || !draw_primitives_.empty() || !widgets_.empty() || !particle_systems_.empty()) {
+		return false;
+	}
+
+	if(driver_ || text_ || particles_ || document_ || draw_color_ || draw_area_ || clip_area_ || custom_draw_ || !custom_draw_xy_.empty() || use_absolute_screen_coordinates_) {
+		return false;
+	}
+
+	if(getRotateZ() != decimal() || g_debug_object_solid || preferences::show_debug_hitboxes() || !Level::current().debug_properties().empty()) {
+		return false;
+	}
+
+	return !platform_area_ || platform_offsets_.empty() || !Level::current().in_editor();
+}
+
 void CustomObject::draw(int xx, int yy) const
 {
+	//Sprites are only batched between objects in the same zorder, as
+	//drawn by the level. Anything else must be drawn after the sprites
+	//already queued.
+	const bool batch_sprite = g_draw_zorder_manager_active && drawsOnlySprite();
+	if(!batch_sprite) {
+		Frame::flushSpriteBatch();
+	}
+
 	for(auto b : blur_objects_) {
 		const_cast<BlurObject*>(b.get())->draw(xx, yy);
 	}
@@ -1399,6 +1441,8 @@ void CustomObject::draw(int xx, int yy) const
 
 	if(type_->isHiddenInGame() && !Level::current().in_editor()) {
 		//pass
+	} else if(batch_sprite && frame_->addToSpriteBatch(draw_x, draw_y, isFacingRight(), isUpsideDown(), time_in_frame_, draw_scale_ ? draw_scale_->as_float32() : 1.0f)) {
+		//queued to be drawn along with the sprites around it.
 	} else if(batch != nullptr) {
 		using namespace KRE;
 
@@ -1678,6 +1722,8 @@ void CustomObject::checkInitialized()
 
 void CustomObject::process(Level& lvl)
 {
+	markStateChanged();
+
 	if(paused_) {
 		return;
 	}
@@ -2532,7 +2578,9 @@ void CustomObject::process(Level& lvl)
 
 void CustomObject::staticProcess(Level& lvl)
 {
-	handleEvent(OBJECT_EVENT_PROCESS);
+	if(!runIsolatedProcess(lvl.cycle())) {
+		handleEvent(OBJECT_EVENT_PROCESS);
+	}
 	handleEvent(frame_->processEventId());
 
 	if(type_->timerFrequency() > 0 && (cycle_%type_->timerFrequency()) == 0) {
@@ -3698,20 +3746,40 @@ int CustomObject::getValueSlot(const std::string& key) const
 
 variant CustomObject::getValue(const std::string& key) const
 {
-	const int slot = type_->callableDefinition()->getSlot(key);
-	if(slot >= 0 && slot < NUM_CUSTOM_OBJECT_PROPERTIES) {
-		return getValueBySlot(slot);
+	return getResolvedValue(key, type_->resolveLookup(key));
+}
+
+variant CustomObject::getValueCached(const std::string& key, game_logic::LookupCache& cache) const
+{
+	return getResolvedValue(key, getCachedResolution(key, cache));
+}
+
+int CustomObject::getCachedResolution(const std::string& key, game_logic::LookupCache& cache) const
+{
+	int resolution = cache.get(type_->getLookupCacheId());
+	if(resolution < 0) {
+		resolution = type_->resolveLookup(key);
+		cache.set(type_->getLookupCacheId(), resolution);
 	}
 
-	std::map<std::string, CustomObjectType::PropertyEntry>::const_iterator property_itor = type_->properties().find(key);
-	if(property_itor != type_->properties().end()) {
-		if(property_itor->second.getter) {
-			ActivePropertyScope scope(*this, property_itor->second.storage_slot);
-			return property_itor->second.getter->execute(*this);
-		} else if(property_itor->second.const_value) {
-			return *property_itor->second.const_value;
-		} else if(property_itor->second.storage_slot >= 0) {
-			variant result = get_property_data(property_itor->second.storage_slot);
+	return resolution;
+}
+
+variant CustomObject::getResolvedValue(const std::string& key, int resolution) const
+{
+	if(resolution < CustomObjectType::LOOKUP_PROPERTY) {
+		return getValueBySlot(resolution);
+	}
+
+	if(resolution != CustomObjectType::LOOKUP_DYNAMIC) {
+		const CustomObjectType::PropertyEntry& e = type_->getSlotProperties()[resolution - CustomObjectType::LOOKUP_PROPERTY];
+		if(e.getter) {
+			ActivePropertyScope scope(*this, e.storage_slot);
+			return e.getter->execute(*this);
+		} else if(e.const_value) {
+			return *e.const_value;
+		} else {
+			variant result = get_property_data(e.storage_slot);
 			result.strengthen();
 			return result;
 		}
@@ -3765,6 +3833,8 @@ void CustomObject::getInputs(std::vector<game_logic::FormulaInput>* inputs) cons
 
 void CustomObject::setValue(const std::string& key, const variant& value)
 {
+	markStateChanged();
+
 	const int slot = CustomObjectCallable::getKeySlot(key);
 	if(slot != -1) {
 		setValueBySlot(slot, value);
@@ -4053,6 +4123,8 @@ void CustomObject::setValue(const std::string& key, const variant& value)
 
 void CustomObject::setValueBySlot(int slot, const variant& value)
 {
+	markStateChanged();
+
 	switch(slot) {
 	case CUSTOM_OBJECT_DATA: {
 		ASSERT_LOG(active_property_ >= 0, "Illegal access of 'data' in object when not in writable property");
@@ -5377,6 +5449,28 @@ EntityPtr CustomObject::backup() const
 	return res;
 }
 
+size_t CustomObject::memoryUsage() const
+{
+	size_t result = sizeof(CustomObject) + frame_name_.capacity();
+	for(const variant& v : property_data_) {
+		result += variant_memory_usage(v);
+	}
+
+	for(const variant& v : vars_->values()) {
+		result += variant_memory_usage(v);
+	}
+
+	for(const variant& v : tmp_vars_->values()) {
+		result += variant_memory_usage(v);
+	}
+
+	for(const std::pair<const std::string, variant>& p : tags_->values()) {
+		result += p.first.capacity() + variant_memory_usage(p.second);
+	}
+
+	return result;
+}
+
 bool CustomObject::handleEvent(const std::string& event, const FormulaCallable* context)
 {
 	return handleEvent(get_object_event_id(event), context);
@@ -5445,6 +5539,8 @@ namespace
 
 bool CustomObject::handleEventInternal(int event, const FormulaCallable* context, bool executeCommands_now)
 {
+	markStateChanged();
+
 	if(paused_ && event != OBJECT_EVENT_BEING_REMOVED) {
 		static const int MouseLeaveID = get_object_event_id("mouse_leave");
 		if(event != MouseLeaveID) {
@@ -5469,17 +5565,7 @@ bool CustomObject::handleEventInternal(int event, const FormulaCallable* context
 #endif
 
 	const game_logic::Formula* handlers[2];
-	int nhandlers = 0;
-
-	if(size_t(event) < event_handlers_.size() && event_handlers_[event]) {
-		handlers[nhandlers++] = event_handlers_[event].get();
-	}
-
-	const game_logic::Formula* type_handler = type_->getEventHandler(event).get();
-	if(type_handler != nullptr) {
-		handlers[nhandlers++] = type_handler;
-	}
-
+	const int nhandlers = getEventHandlers(event, handlers);
 	if(!nhandlers) {
 		return false;
 	}
@@ -5537,6 +5623,133 @@ bool CustomObject::handleEventInternal(int event, const FormulaCallable* context
 	return true;
 }
 
+int CustomObject::getEventHandlers(int event, const game_logic::Formula** handlers) const
+{
+	int nhandlers = 0;
+
+	if(size_t(event) < event_handlers_.size() && event_handlers_[event]) {
+		handlers[nhandlers++] = event_handlers_[event].get();
+	}
+
+	const game_logic::Formula* type_handler = type_->getEventHandler(event).get();
+	if(type_handler != nullptr) {
+		handlers[nhandlers++] = type_handler;
+	}
+
+	return nhandlers;
+}
+
+bool CustomObject::hasAnyEventHandler() const
+{
+	return (static_cast<size_t>(OBJECT_EVENT_ANY) < event_handlers_.size() && event_handlers_[OBJECT_EVENT_ANY]) || type_->getEventHandler(OBJECT_EVENT_ANY);
+}
+
+bool CustomObject::prepareIsolatedProcess(int cycle)
+{
+	isolated_process_cycle_ = -1;
+	isolated_process_commands_.clear();
+
+	if(paused_ || hitpoints_ <= 0 || hasAnyEventHandler() || preferences::edit_and_continue()) {
+		return false;
+	}
+
+	const game_logic::Formula* handlers[2];
+	const int nhandlers = getEventHandlers(OBJECT_EVENT_PROCESS, handlers);
+	if(!nhandlers) {
+		return false;
+	}
+
+	try {
+		//anything going wrong is left for when the event is handled as
+		//usual, which reports it in the normal way.
+		const assert_recover_scope recover_scope(SilenceAsserts);
+		const rng::DisallowScope disallow_random;
+		const game_logic::Formula::IsolatedContext isolated_context(this);
+		BackupCallableStackScope callable_scope(&backup_callable_stack_, nullptr);
+
+		for(int n = 0; n != nhandlers; ++n) {
+			isolated_process_commands_.emplace_back(handlers[n], handlers[n]->execute(*this));
+		}
+	} catch(const validation_failure_exception&) {
+		isolated_process_commands_.clear();
+		return false;
+	} catch(const rng::Disallowed&) {
+		isolated_process_commands_.clear();
+		return false;
+	} catch(const game_logic::isolated_context_exception&) {
+		isolated_process_commands_.clear();
+		return false;
+	}
+
+	isolated_process_cycle_ = cycle;
+	return true;
+}
+
+void CustomObject::discardIsolatedProcess()
+{
+	isolated_process_cycle_ = -1;
+	isolated_process_commands_.clear();
+}
+
+bool CustomObject::runIsolatedProcess(int cycle)
+{
+	if(isolated_process_cycle_ != cycle) {
+		return false;
+	}
+
+	isolated_process_cycle_ = -1;
+	std::vector<std::pair<const game_logic::Formula*, variant>> commands;
+	commands.swap(isolated_process_commands_);
+
+	//objects processed earlier may have changed which handlers this one
+	//has, in which case it handles the event as usual.
+	const game_logic::Formula* handlers[2];
+	const int nhandlers = getEventHandlers(OBJECT_EVENT_PROCESS, handlers);
+	if(nhandlers != static_cast<int>(commands.size()) || hasAnyEventHandler()) {
+		return false;
+	}
+
+	for(int n = 0; n != nhandlers; ++n) {
+		if(handlers[n] != commands[n].first) {
+			return false;
+		}
+	}
+
+	if(paused_ || hitpoints_ <= 0) {
+		return true;
+	}
+
+	BackupCallableStackScope callable_scope(&backup_callable_stack_, nullptr);
+
+	for(const auto& cmd : commands) {
+#ifndef DISABLE_FORMULA_PROFILER
+		formula_profiler::CustomObjectEventFrame event_frame = { type_.get(), OBJECT_EVENT_PROCESS, true };
+		event_call_stack.emplace_back(event_frame);
+#endif
+
+		++events_handled_per_second;
+
+		bool result = false;
+
+		try {
+			formula_profiler::Instrument instrumentation("COMMANDS", cmd.first);
+			result = executeCommand(cmd.second);
+		} catch(const validation_failure_exception& e) {
+			current_error_msg = "Runtime error executing event commands: " + e.msg;
+			throw e;
+		}
+
+#ifndef DISABLE_FORMULA_PROFILER
+		event_call_stack.pop_back();
+#endif
+		if(!result) {
+			break;
+		}
+	}
+
+	return true;
+}
+
 void CustomObject::resolveDelayedEvents()
 {
 	if(delayed_commands_.empty()) {
@@ -5901,6 +6114,10 @@ void CustomObject::surrenderReferences(GarbageCollector* collector)
 
 	collector->surrenderPtr(&document_, "XHTML_DOCUMENT");
 
+	for(std::pair<const game_logic::Formula*, variant>& p : isolated_process_commands_) {
+		collector->surrenderVariant(&p.second, "ISOLATED_PROCESS_COMMANDS");
+	}
+
 	for(auto move : animated_movement_) {
 		collector->surrenderVariant(&move->on_begin, "ANIMATE_ON_BEGIN");
 		collector->surrenderVariant(&move->on_process, "ANIMATE_ON_PROCESS");
@@ -6385,6 +6602,19 @@ BENCHMARK_ARG(custom_object_get_attr, const std::string& attr)
 BENCHMARK_ARG_CALL(custom_object_get_attr, easy_lookup, "x");
 BENCHMARK_ARG_CALL(custom_object_get_attr, hard_lookup, "xxxx");
 
+//the same lookups made through an inline cache, as formulas make them.
+BENCHMARK_ARG(custom_object_get_attr_cached, const std::string& attr)
+{
+	static CustomObject* obj = new CustomObject("ant_black", 0, 0, false);
+	game_logic::LookupCache cache;
+	BENCHMARK_LOOP {
+		obj->queryValueCached(attr, cache);
+	}
+}
+
+BENCHMARK_ARG_CALL(custom_object_get_attr_cached, easy_lookup_cached, "x");
+BENCHMARK_ARG_CALL(custom_object_get_attr_cached, hard_lookup_cached, "xxxx");
+
 BENCHMARK_ARG(custom_object_handle_event, const std::string& object_event)
 {
 	auto i = std::find(object_event.begin(), object_event.end(), ':');
@@ -6404,3 +6634,163 @@ BENCHMARK_ARG(custom_object_handle_event, const std::string& object_event)
 BENCHMARK_ARG_CALL(custom_object_handle_event, ant_non_exist, "ant_black:blahblah");
 
 BENCHMARK_ARG_CALL_COMMAND_LINE(custom_object_handle_event);
+
+extern bool g_auto_batch_sprites;
+
+//Checks that consecutive sprites which can be drawn together are drawn
+//with one draw call, and that anything which can't be flushes the sprites
+//queued before it. Run with --renderer=null so draw calls can be counted.
+UTILITY(test_sprite_batching)
+{
+	auto device = std::dynamic_pointer_cast<KRE::DisplayDeviceNull>(KRE::DisplayDevice::getCurrent());
+	ASSERT_LOG(device != nullptr, "test_sprite_batching must be run with --renderer=null");
+
+	auto create_frame = [](const std::string& id, KRE::TexturePtr tex) {
+		variant_builder node;
+		node.add("id", id);
+		node.add("fbo", variant(new TextureObject(tex)));
+		node.add("clear_fbo", false);
+		node.add("rect", rect(0, 0, 16, 16).write());
+		return FramePtr(new Frame(node.build()));
+	};
+
+	KRE::TexturePtr texture_a = KRE::Texture::createTexture(KRE::Surface::create(16, 16, KRE::PixelFormat::PF::PIXELFORMAT_ARGB8888));
+	KRE::TexturePtr texture_b = KRE::Texture::createTexture(KRE::Surface::create(16, 16, KRE::PixelFormat::PF::PIXELFORMAT_ARGB8888));
+	FramePtr frame_a = create_frame("a", texture_a);
+	FramePtr frame_a2 = create_frame("a2", texture_a);
+	FramePtr frame_b = create_frame("b", texture_b);
+	FramePtr frame_shader = create_frame("shader", texture_a);
+	frame_shader->blit_target_.setShader(device->getShaderProgram("test_sprite_batching"));
+
+	//the draw calls the device makes while fn runs, which must all be
+	//for sprites.
+	auto count_draws = [&device](std::function<void()> fn) {
+		Frame::flushSpriteBatch();
+		Frame::resetSpriteBatchStats();
+		device->clearRecording();
+		device->startRecording();
+		fn();
+		Frame::flushSpriteBatch();
+		device->stopRecording();
+
+		const int draws = device->countEvents(KRE::RenderEvent::Type::DRAW);
+		ASSERT_EQ(draws, Frame::getSpriteBatchStats().draws);
+		return draws;
+	};
+
+	auto add = [](const FramePtr& f, int x) {
+		ASSERT_LOG(f->addToSpriteBatch(x, 0, true, false, 0, 1.0f), "Sprite batching is disabled");
+	};
+
+	//sprites are only drawn once flushed, and all in one draw call when
+	//they share their state, even across frames using the same texture.
+	ASSERT_EQ(count_draws([&]() {
+		for(int n = 0; n != 5; ++n) {
+			add(n%2 ? frame_a : frame_a2, n*20);
+		}
+		ASSERT_EQ(device->countEvents(KRE::RenderEvent::Type::DRAW), 0);
+	}), 1);
+	ASSERT_EQ(Frame::getSpriteBatchStats().sprites, 5);
+
+	ASSERT_EQ(count_draws([&]() {
+		add(frame_a, 0);
+		add(frame_a, 20);
+		add(frame_b, 40);
+		add(frame_b, 60);
+		add(frame_a, 80);
+	}), 3);
+
+	ASSERT_EQ(count_draws([&]() {
+		add(frame_a, 0);
+		add(frame_shader, 20);
+		add(frame_shader, 40);
+	}), 2);
+
+	ASSERT_EQ(count_draws([&]() {
+		add(frame_a, 0);
+		{
+			KRE::ColorScope color_scope(KRE::Color(255, 0, 0));
+			add(frame_a, 20);
+			add(frame_a, 40);
+		}
+		add(frame_a, 60);
+	}), 3);
+
+	ASSERT_EQ(count_draws([&]() {
+		add(frame_a, 0);
+		{
+			KRE::BlendModeScope blend_scope(KRE::BlendModeConstants::BM_ONE, KRE::BlendModeConstants::BM_ONE);
+			add(frame_a, 20);
+		}
+	}), 2);
+
+	//with batching off every sprite is drawn by itself.
+	g_auto_batch_sprites = false;
+	ASSERT_EQ(count_draws([&]() {
+		for(int n = 0; n != 3; ++n) {
+			ASSERT_LOG(!frame_a->addToSpriteBatch(n*20, 0, true, false, 0, 1.0f), "Sprite batched while batching is disabled");
+			frame_a->draw(nullptr, n*20, 0);
+		}
+	}), 3);
+	g_auto_batch_sprites = true;
+
+	Level* lvl = new Level("test.cfg");
+	variant lvl_holder(lvl);
+	lvl->finishLoading();
+	lvl->setAsCurrentLevel();
+
+	std::vector<ffl::IntrusivePtr<CustomObject>> ants;
+	for(int n = 0; n != 4; ++n) {
+		ants.emplace_back(new CustomObject("ant_black", 100 + n*50, 100, true));
+		lvl->add_character(ants.back().get());
+	}
+
+	//a rotated object can't be drawn as a plain sprite.
+	ants[2]->setRotateZ(45.0f);
+	ASSERT_LOG(ants[0]->drawsOnlySprite(), "An object drawing only its sprite can't be batched");
+	ASSERT_LOG(!ants[2]->drawsOnlySprite(), "A rotated object can be batched");
+
+	//objects are batched while drawn by the level within a zorder, and
+	//the batch is drawn when the zorder is done.
+	Frame::resetSpriteBatchStats();
+	{
+		CustomObjectDrawZOrderManager draw_manager;
+		for(const auto& ant : ants) {
+			ant->draw(0, 0);
+		}
+
+		//the first two were flushed by the rotated object, which was then
+		//drawn by itself. The last is still queued.
+		ASSERT_EQ(Frame::getSpriteBatchStats().draws, 2);
+	}
+	ASSERT_EQ(Frame::getSpriteBatchStats().sprites, 4);
+	ASSERT_EQ(Frame::getSpriteBatchStats().draws, 3);
+
+	//outside of a zorder objects are drawn as they are drawn.
+	Frame::resetSpriteBatchStats();
+	ants[0]->draw(0, 0);
+	ASSERT_EQ(Frame::getSpriteBatchStats().draws, 1);
+
+#ifndef NO_EDITOR
+	//the editor draws each object's group after it, so flushes after every
+	//object. Adding the objects adds a draw call for each of them.
+	lvl->set_editor();
+	for(const auto& ant : ants) {
+		lvl->remove_character(ant.get());
+	}
+	lvl->draw(0, 0, 800, 600);
+	const Frame::SpriteBatchStats without_ants = Frame::getSpriteBatchStats();
+
+	for(const auto& ant : ants) {
+		lvl->add_character(ant.get());
+	}
+	lvl->draw(0, 0, 800, 600);
+	const Frame::SpriteBatchStats with_ants = Frame::getSpriteBatchStats();
+
+	ASSERT_EQ(with_ants.sprites - without_ants.sprites, 4);
+	ASSERT_EQ(with_ants.draws - without_ants.draws, 4);
+	lvl->set_editor(false);
+#endif
+
+	std::cout << "Sprite batching tests passed\n";
+}
@@ -172,6 +172,7 @@ public:
 
 	virtual EntityPtr clone() const override;
 	virtual EntityPtr backup() const override;
+	virtual size_t memoryUsage() const override;
 
 	game_logic::ConstFormulaPtr getEventHandler(int key) const override;
 	void setEventHandler(int, game_logic::ConstFormulaPtr f) override;
@@ -215,6 +216,17 @@ public:
 
 	virtual void resolveDelayedEvents() override;
 
+	//for objects whose type has isolated_process set: evaluates the process
+	//event handlers ahead of the object being processed in the given
+	//cycle, so their commands can be run when it is. May be called from
+	//any thread while nothing else changes the level. Returns false if the
+	//event will be handled as usual instead.
+	bool prepareIsolatedProcess(int cycle);
+
+	//drops any commands prepareIsolatedProcess() left which weren't run,
+	//such as when the object was destroyed before it was processed.
+	void discardIsolatedProcess();
+
 	virtual bool serializable() const override;
 
 	void setSoundVolume(float volume, float nseconds=0.0) override;
@@ -294,7 +306,14 @@ protected:
 	virtual void control(const Level& lvl) override;
 	int getValueSlot(const std::string& key) const override;
 	variant getValue(const std::string& key) const override;
+	variant getValueCached(const std::string& key, game_logic::LookupCache& cache) const override;
 	variant getValueBySlot(int slot) const override;
+
+	//how the object's type resolves key, found using cache if possible.
+	int getCachedResolution(const std::string& key, game_logic::LookupCache& cache) const;
+
+	//gets key given how the object's type resolves it.
+	variant getResolvedValue(const std::string& key, int resolution) const;
 	void setValue(const std::string& key, const variant& value) override;
 	void setValueBySlot(int slot, const variant& value) override;
 
@@ -347,6 +366,10 @@ private:
 	void initProperties(bool defer=false);
 	void initProperty(const CustomObjectType::PropertyEntry& e);
 	CustomObject& operator=(const CustomObject& o);
+
+	//true if draw() would do nothing more than draw the current frame
+	//untransformed, so it can be batched with other sprites.
+	bool drawsOnlySprite() const;
 	struct Accessor;
 
 	struct gc_object_reference {
@@ -453,6 +476,9 @@ private:
 
 	friend class ActivePropertyScope;
 
+	//checks which objects drawsOnlySprite() lets be batched.
+	friend void UTILITY_test_sprite_batching(const std::vector<std::string>& args);
+
 	EntityPtr last_hit_by_;
 	int last_hit_by_anim_;
 	int current_animation_id_;
@@ -555,6 +581,19 @@ private:
 
 	int currently_handling_die_event_;
 
+	int getEventHandlers(int event, const game_logic::Formula** handlers) const;
+	bool hasAnyEventHandler() const;
+
+	//if the process event handlers were evaluated ahead of time for this
+	//cycle, runs the commands they returned. Returns false if the event
+	//still has to be handled.
+	bool runIsolatedProcess(int cycle);
+
+	//the cycle the process event handlers were evaluated ahead of time for
+	//and the commands each returned.
+	int isolated_process_cycle_;
+	std::vector<std::pair<const game_logic::Formula*, variant>> isolated_process_commands_;
+
 	typedef std::set<gui::WidgetPtr, gui::WidgetSortZOrder> widget_list;
 	widget_list widgets_;
 
@@ -1654,6 +1654,8 @@ namespace
 	FUNCTION_DEF_IMPL
 
 		Formula::failIfStaticContext();
+		//objects can't be created while evaluating in isolation.
+		Formula::failIfIsolatedContext();
 
 		variant obj_type = EVAL_ARG(0);
 
@@ -1854,6 +1856,7 @@ namespace
 	FUNCTION_DEF_IMPL
 
 		Formula::failIfStaticContext();
+		Formula::failIfIsolatedContext();
 
 		const std::string type = EVAL_ARG(0).as_string();
 		const int x = EVAL_ARG(1).as_int();
@@ -1898,6 +1901,7 @@ namespace
 	FUNCTION_DEF(object, 1, 5, "object(string type_id, int midpoint_x, int midpoint_y, (optional) map properties) -> object: constructs and returns a new object. Note that the difference between this and spawn is that spawn returns a command to actually place the object in the Level. object only creates the object and returns it. It may be stored for later use.")
 
 		Formula::failIfStaticContext();
+		Formula::failIfIsolatedContext();
 
 		variant obj_type = EVAL_ARG(0);
 
@@ -2093,6 +2097,7 @@ namespace
 
 	FUNCTION_DEF(object_playable, 1, 5, "object_playable(string type_id, int midpoint_x, int midpoint_y, int facing, (optional) map properties) -> object: constructs and returns a new object. Note that the difference between this and spawn is that spawn returns a command to actually place the object in the Level. object_playable only creates the playable object and returns it. It may be stored for later use.")
 		Formula::failIfStaticContext();
+		Formula::failIfIsolatedContext();
 		const std::string type = EVAL_ARG(0).as_string();
 		ffl::IntrusivePtr<CustomObject> obj;
 
@@ -4590,3 +4595,32 @@ FunctionSymbolTable& get_custom_object_functions_symbol_table()
 	static CustomObjectFunctionSymbolTable table;
 	return table;
 }
+
+UNIT_TEST(spawn_fails_in_isolated_context)
+{
+	const char* formulas[] = {
+		"spawn('ant_black', 0, 0, 1)",
+		"spawn_player('ant_black', 0, 0, 1)",
+		"object('ant_black', 0, 0, 1)",
+		"object_playable('ant_black', 0, 0, 1)",
+	};
+
+	game_logic::MapFormulaCallable* callable = new game_logic::MapFormulaCallable;
+	variant ref(callable);
+
+	const size_t nobjects = CustomObject::getAll().size();
+	for(const char* formula : formulas) {
+		const game_logic::Formula f(variant(formula), &get_custom_object_functions_symbol_table());
+
+		bool failed = false;
+		try {
+			const game_logic::Formula::IsolatedContext isolated_context(callable);
+			f.execute(*callable);
+		} catch(const game_logic::isolated_context_exception&) {
+			failed = true;
+		}
+
+		CHECK(failed, "isolated evaluation of " << formula << " didn't fail");
+		CHECK_EQ(CustomObject::getAll().size(), nobjects);
+	}
+}
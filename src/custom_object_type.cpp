@@ -21,6 +21,7 @@
 	   distribution.
 */
 
+#include <atomic>
 #include <cassert>
 #include <iostream>
 
@@ -35,6 +36,7 @@
 #include "ffl_dom.hpp"
 #include "formatter.hpp"
 #include "formula.hpp"
+#include "formula_bytecode_cache.hpp"
 #include "formula_constants.hpp"
 #include "formula_function_registry.hpp"
 #include "formula_profiler.hpp"
@@ -690,7 +692,14 @@ void init_object_definition(variant node, const std::string& id_, CustomObjectCa
 					callable_definition_->getEntry(n)->access_count = 0;
 				}
 
-				game_logic::FormulaPtr f = game_logic::Formula::createOptionalFormula(value, &get_custom_object_functions_symbol_table(), callable_definition_);
+				//a formula taken from the bytecode cache isn't compiled, so
+				//wouldn't count the slots it accesses.
+				game_logic::FormulaPtr f;
+				{
+					const formula_bytecode_cache::BypassScope bypass_bytecode_cache;
+					f = game_logic::Formula::createOptionalFormula(value, &get_custom_object_functions_symbol_table(), callable_definition_);
+				}
+
 				bool inferred = true;
 				for(int n = 0; n != callable_definition_->getNumSlots(); ++n) {
 					const game_logic::FormulaCallableDefinition::Entry* entry = callable_definition_->getEntry(n);
@@ -1021,6 +1030,8 @@ CustomObjectTypePtr CustomObjectType::recreate(const std::string& id,
 				recover_scope.reset(new assert_recover_scope);
 			}
 
+			const formula_bytecode_cache::Scope bytecode_cache_scope("object:" + id, node);
+
 			//create the object
 			CustomObjectTypePtr result(new CustomObjectType(node["id"].as_string(), node, nullptr, old_type));
 			object_prototype_paths[id] = proto_paths;
@@ -1411,6 +1422,13 @@ void CustomObjectType::initEventHandlers(variant node,
 
 namespace
 {
+	unsigned int next_lookup_cache_id()
+	{
+		//ids start at 1 since 0 means an empty lookup cache.
+		static std::atomic<unsigned int> id(0);
+		return ++id;
+	}
+
 	std::vector<std::string>& get_custom_object_type_stack()
 	{
 		static std::vector<std::string> res;
@@ -1431,6 +1449,21 @@ namespace
 
 void init_level_definition();
 
+int CustomObjectType::resolveLookup(const std::string& key) const
+{
+	const int slot = callable_definition_->getSlot(key);
+	if(slot >= 0 && slot < NUM_CUSTOM_OBJECT_PROPERTIES) {
+		return slot;
+	}
+
+	auto itor = properties_.find(key);
+	if(itor != properties_.end() && itor->second.slot >= 0 && (itor->second.getter || itor->second.const_value || itor->second.storage_slot >= 0)) {
+		return LOOKUP_PROPERTY + itor->second.slot;
+	}
+
+	return LOOKUP_DYNAMIC;
+}
+
 CustomObjectType::CustomObjectType(const std::string& id, variant node, const CustomObjectType* base_type, const CustomObjectType* old_type)
   : id_(id),
     numeric_id_(getObjectTypeIndex(id)),
@@ -1482,6 +1515,7 @@ CustomObjectType::CustomObjectType(const std::string& id, variant node, const Cu
 	hidden_in_game_(node["hidden_in_game"].as_bool(false)),
 	auto_anchor_(node["auto_anchor"].as_bool(g_auto_anchor_objects)),
 	stateless_(node["stateless"].as_bool(false)),
+	isolated_process_(node["isolated_process"].as_bool(false)),
 	platform_offsets_(node["platform_offsets"].as_list_int_optional()),
 	slot_properties_base_(-1),
 	use_absolute_screen_coordinates_(node["use_absolute_screen_coordinates"].as_bool(false)),
@@ -1492,7 +1526,8 @@ CustomObjectType::CustomObjectType(const std::string& id, variant node, const Cu
 	particle_system_desc_(node["particles"]),
 	preload_objects_(node["preload_objects"].as_list_string_optional()),
 	document_(nullptr),
-	draw_batch_id_(node["draw_batch_id"].as_string_default(""))
+	draw_batch_id_(node["draw_batch_id"].as_string_default("")),
+	lookup_cache_id_(next_lookup_cache_id())
 {
 	ObjectTypesSpawnedTracker types_spawned;
 
@@ -2260,6 +2295,32 @@ END_FUNCTION_DEF(anura_objects)
 
 #include "Texture.hpp"
 
+UNIT_TEST(custom_object_type_inference_with_bytecode_cache)
+{
+	//'total' can only be inferred once 'base' has been, so inference takes
+	//more than one pass over the properties.
+	const variant node = json::parse("{id: 'unit_test_inferred_properties', is_strict: true, properties: {total: 'base + scale', base: '2', scale: 'base * 0.5'}}");
+
+	auto inferred_types = [&node]() {
+		const CustomObjectTypePtr type(new CustomObjectType(node["id"].as_string(), node));
+		std::string result;
+		for(const char* id : { "total", "base", "scale" }) {
+			const game_logic::FormulaCallableDefinition::Entry* entry = type->callableDefinition()->getEntryById(id);
+			ASSERT_LOG(entry && entry->variant_type, "No type inferred for " << id);
+			result += std::string(id) + ":" + entry->variant_type->to_string() + " ";
+		}
+		return result;
+	};
+
+	const std::string expected = inferred_types();
+
+	//compiled cold, storing in the cache, then warm from it.
+	for(int n = 0; n != 2; ++n) {
+		const formula_bytecode_cache::Scope scope("unit_test:custom_object_type_inference", node);
+		CHECK_EQ(inferred_types(), expected);
+	}
+}
+
 BENCHMARK(CustomObjectTypeLoad)
 {
 	static std::map<std::string,std::string> file_paths;
@@ -272,6 +272,7 @@ public:
 	bool editorForceStanding() const { return editor_force_standing_; }
 	bool isHiddenInGame() const { return hidden_in_game_; }
 	bool stateless() const { return stateless_; }
+	bool isolatedProcess() const { return isolated_process_; }
 
 	static void ReloadFilePaths();
 
@@ -294,6 +295,15 @@ public:
 	const std::vector<std::string>& preloadObjects() const { return preload_objects_; }
 
 	const std::string& drawBatchID() const { return draw_batch_id_; }
+
+	//How a name looked up on objects of this type is found: a builtin
+	//slot, LOOKUP_PROPERTY plus the index of a property in
+	//getSlotProperties(), or LOOKUP_DYNAMIC if it has to be searched for
+	//in the object. A resolution is only valid for the type it came from,
+	//identified by getLookupCacheId().
+	enum { LOOKUP_PROPERTY = 0x10000, LOOKUP_DYNAMIC = 0x20000 };
+	int resolveLookup(const std::string& key) const;
+	unsigned int getLookupCacheId() const { return lookup_cache_id_; }
 private:
 	void initSubObjects(variant node, const CustomObjectType* old_type);
 
@@ -419,6 +429,15 @@ private:
 	//later will not deep copy the object, just have another reference to it.
 	bool stateless_;
 
+	//the object's process event handlers only read the world, so they can
+	//be evaluated on worker threads ahead of the object being processed,
+	//seeing the world as it was at the start of the cycle. The commands
+	//they return are still run in order when the object is processed.
+	//They mustn't call property getters of other objects, draw random
+	//numbers, or use level data which is built lazily such as
+	//pathfinding grids.
+	bool isolated_process_;
+
 	std::vector<int> platform_offsets_;
 
 	//does this object use strict checking?
@@ -443,4 +462,6 @@ private:
 	xhtml::DocumentObjectPtr document_;
 
 	std::string draw_batch_id_;
+
+	unsigned int lookup_cache_id_;
 };
@@ -21,7 +21,15 @@
 	   distribution.
 */
 
+#include <algorithm>
+#include <cstdio>
 #include <deque>
+#include <map>
+#include <sstream>
+
+#if defined(__linux__) || defined(__APPLE__)
+#include <unistd.h>
+#endif
 
 #include "db_client.hpp"
 #include "filesystem.hpp"
@@ -32,6 +40,9 @@
 
 PREF_STRING(db_json_file, "", "The file to output database content to when using a file to simulate a database");
 PREF_STRING(db_key_prefix, "", "Prefix to put before all requests for keys.");
+PREF_STRING(db_backend, "json", "The file format used to simulate a database: 'json' rewrites a single json document, 'log' appends changes to a log file");
+PREF_STRING(db_log_file, "", "The file to store database content in when using the 'log' database backend");
+PREF_INT(db_log_compact_min_kb, 1024, "The database log is compacted once it has at least this many KB of superseded records, and they outnumber live records");
 
 BEGIN_DEFINE_CALLABLE_NOBASE(DbClient)
 BEGIN_DEFINE_FN(read_modify_write, "(string, function(any)->any) ->commands")
@@ -156,8 +167,430 @@ namespace
 		bool dirty_;
 		std::string prefix_;
 	};
+
+	// A database stored as an append-only log of records, with an in-memory
+	// index from each key to where its latest document is in the log. Puts
+	// and removes append a record rather than rewriting the whole database.
+	// Records are buffered and written out together on process(), then
+	// synced to disk.
+	//
+	// Each record is a header line followed by the key and the document:
+	//   P <key length> <doc length> <checksum>\n<key><doc>\n
+	// Removes are written as D records with an empty document. When the log
+	// is loaded a truncated or corrupt record, such as one being written
+	// when the process died, ends the log and it is rewritten without it.
+	//
+	// Once enough of the log consists of records which have been
+	// superseded, the log is compacted by writing the live records to a new
+	// file and renaming it over the old one.
+	class LogStructuredDbClient : public DbClient
+	{
+	public:
+		LogStructuredDbClient(const std::string& fname, const std::string& prefix) : fname_(fname), prefix_(prefix), file_(nullptr), file_size_(0), live_bytes_(0), dead_bytes_(0) {
+			if(sys::file_exists(fname_) && !load(sys::read_file(fname_))) {
+				LOG_ERROR("Database log " << fname_ << " was truncated or corrupt after " << file_size_ << " bytes. Recovering the records before that point.");
+				openLog();
+				compact();
+			} else {
+				openLog();
+			}
+		}
+
+		~LogStructuredDbClient() {
+			flush();
+			if(file_) {
+				fclose(file_);
+			}
+		}
+
+		bool process(int timeout_us) override {
+			flush();
+			if(dead_bytes_ > static_cast<int64_t>(g_db_log_compact_min_kb)*1024 && dead_bytes_ > live_bytes_) {
+				compact();
+			}
+
+			return false;
+		}
+
+		void put(const std::string& rkey, variant doc, std::function<void()> on_done, std::function<void()> on_error, PUT_OPERATION op=PUT_SET) override
+		{
+			const std::string key = prefix_ + rkey;
+			auto itor = index_.find(key);
+			if((op == PUT_ADD && itor != index_.end()) || (op == PUT_REPLACE && itor == index_.end())) {
+				on_error();
+				return;
+			}
+
+			if(op == PUT_APPEND) {
+				std::vector<variant> val;
+				if(itor != index_.end()) {
+					variant existing = readDoc(itor->second);
+					if(existing.is_list()) {
+						val = existing.as_list();
+					}
+				}
+
+				val.push_back(doc);
+				doc = variant(&val);
+			}
+
+			appendRecord('P', key, doc.write_json(false));
+			on_done();
+		}
+
+		void get(const std::string& rkey, std::function<void(variant)> on_done, int lock_seconds, GET_OPERATION op) override {
+			auto itor = index_.find(prefix_ + rkey);
+			if(itor == index_.end()) {
+				on_done(variant());
+				return;
+			}
+
+			on_done(readDoc(itor->second));
+		}
+
+		void remove(const std::string& rkey) override {
+			const std::string key = prefix_ + rkey;
+			if(index_.count(key)) {
+				appendRecord('D', key, "");
+			}
+		}
+
+		void getKeysWithPrefix(const std::string& rkey, std::function<void(std::vector<variant>)> on_done) override {
+			const std::string key = prefix_ + rkey;
+			std::vector<variant> result;
+			for(auto itor = index_.lower_bound(key); itor != index_.end() && itor->first.compare(0, key.size(), key) == 0; ++itor) {
+				result.emplace_back(itor->first.substr(prefix_.size()));
+			}
+
+			on_done(result);
+		}
+
+	private:
+		struct Location {
+			int64_t offset;
+			int length;
+			int record_length;
+		};
+
+		static unsigned int checksum(const char* begin, const char* end, unsigned int hash=2166136261U) {
+			for(; begin != end; ++begin) {
+				hash = (hash ^ static_cast<unsigned char>(*begin))*16777619U;
+			}
+			return hash;
+		}
+
+		static std::string formatRecord(char type, const std::string& key, const std::string& doc) {
+			unsigned int sum = checksum(key.data(), key.data() + key.size());
+			sum = checksum(doc.data(), doc.data() + doc.size(), sum);
+
+			std::ostringstream s;
+			s << type << " " << key.size() << " " << doc.size() << " " << sum << "\n" << key << doc << "\n";
+			return s.str();
+		}
+
+		// Parses the records in the log, building the index. Returns false
+		// if it stopped early at a bad record. file_size_ is left as the
+		// size of the good prefix of the log.
+		bool load(const std::string& contents) {
+			const char* begin = contents.data();
+			const char* end = begin + contents.size();
+			const char* p = begin;
+			while(p != end) {
+				const char* eol = std::find(p, end, '\n');
+				if(eol == end || eol - p < 2 || (p[0] != 'P' && p[0] != 'D') || p[1] != ' ') {
+					return false;
+				}
+
+				std::istringstream header(std::string(p + 2, eol));
+				size_t key_len = 0, doc_len = 0;
+				unsigned int sum = 0;
+				if(!(header >> key_len >> doc_len >> sum)) {
+					return false;
+				}
+
+				const char* key = eol + 1;
+				if(static_cast<size_t>(end - key) < key_len + doc_len + 1 || key[key_len + doc_len] != '\n') {
+					return false;
+				}
+
+				const char* doc = key + key_len;
+				if(checksum(doc, doc + doc_len, checksum(key, doc)) != sum) {
+					return false;
+				}
+
+				const char* next = doc + doc_len + 1;
+				const Location loc = { doc - begin, static_cast<int>(doc_len), static_cast<int>(next - p) };
+				updateIndex(p[0], std::string(key, doc), loc);
+
+				p = next;
+				file_size_ = p - begin;
+			}
+
+			return true;
+		}
+
+		void updateIndex(char type, const std::string& key, const Location& loc) {
+			auto itor = index_.find(key);
+			if(itor != index_.end()) {
+				live_bytes_ -= itor->second.record_length;
+				dead_bytes_ += itor->second.record_length;
+			}
+
+			if(type == 'D') {
+				dead_bytes_ += loc.record_length;
+				if(itor != index_.end()) {
+					index_.erase(itor);
+				}
+				return;
+			}
+
+			live_bytes_ += loc.record_length;
+			if(itor != index_.end()) {
+				itor->second = loc;
+			} else {
+				index_[key] = loc;
+			}
+		}
+
+		void appendRecord(char type, const std::string& key, const std::string& doc) {
+			const int64_t offset = file_size_ + pending_.size();
+			const std::string record = formatRecord(type, key, doc);
+			const Location loc = { offset + static_cast<int64_t>(record.size() - doc.size() - 1), static_cast<int>(doc.size()), static_cast<int>(record.size()) };
+			pending_ += record;
+			updateIndex(type, key, loc);
+		}
+
+		std::string readRaw(const Location& loc) {
+			std::string doc;
+			if(loc.offset >= file_size_) {
+				doc = pending_.substr(static_cast<size_t>(loc.offset - file_size_), loc.length);
+			} else {
+				doc.resize(loc.length);
+				seekFile(file_, loc.offset);
+				const size_t nread = fread(&doc[0], 1, doc.size(), file_);
+				ASSERT_LOG(nread == doc.size(), "Failed to read document from database log " << fname_);
+			}
+
+			return doc;
+		}
+
+		variant readDoc(const Location& loc) {
+			return json::parse(readRaw(loc), json::JSON_PARSE_OPTIONS::NO_PREPROCESSOR);
+		}
+
+		void openLog() {
+			file_ = fopen(fname_.c_str(), sys::file_exists(fname_) ? "r+b" : "w+b");
+			ASSERT_LOG(file_ != nullptr, "Could not open database log " << fname_);
+		}
+
+		// long is 32 bits on Windows, so fseek() can't reach past 2GB there.
+		static void seekFile(FILE* file, int64_t offset) {
+#if defined(_MSC_VER)
+			const int res = _fseeki64(file, offset, SEEK_SET);
+#else
+			const int res = fseeko(file, static_cast<off_t>(offset), SEEK_SET);
+#endif
+			ASSERT_LOG(res == 0, "Failed to seek to " << offset << " in database log");
+		}
+
+		static int64_t tellFile(FILE* file) {
+#if defined(_MSC_VER)
+			return _ftelli64(file);
+#else
+			return ftello(file);
+#endif
+		}
+
+		static void syncFile(FILE* file) {
+			fflush(file);
+#if defined(__linux__) || defined(__APPLE__)
+			fsync(fileno(file));
+#endif
+		}
+
+		void flush() {
+			if(pending_.empty() || file_ == nullptr) {
+				return;
+			}
+
+			seekFile(file_, file_size_);
+			const size_t nwritten = fwrite(pending_.data(), 1, pending_.size(), file_);
+			ASSERT_LOG(nwritten == pending_.size(), "Failed to write to database log " << fname_);
+			syncFile(file_);
+
+			file_size_ += pending_.size();
+			ASSERT_LOG(tellFile(file_) == file_size_, "Database log " << fname_ << " is not the expected size after writing to it");
+			pending_.clear();
+		}
+
+		// Rewrites the log with only the latest record for each key. The new
+		// log is fully written and synced before it replaces the old one, so
+		// a crash part way through leaves the old log intact.
+		void compact() {
+			std::string contents;
+			for(const auto& p : index_) {
+				contents += formatRecord('P', p.first, readRaw(p.second));
+			}
+
+			const std::string tmp_fname = fname_ + ".compact";
+			FILE* tmp = fopen(tmp_fname.c_str(), "wb");
+			ASSERT_LOG(tmp != nullptr, "Could not open " << tmp_fname << " to compact the database log");
+			const size_t nwritten = fwrite(contents.data(), 1, contents.size(), tmp);
+			ASSERT_LOG(nwritten == contents.size(), "Failed to write to " << tmp_fname);
+			syncFile(tmp);
+			fclose(tmp);
+
+			if(file_) {
+				fclose(file_);
+				file_ = nullptr;
+			}
+
+			sys::move_file(tmp_fname, fname_);
+
+			index_.clear();
+			file_size_ = 0;
+			live_bytes_ = dead_bytes_ = 0;
+			pending_.clear();
+			load(contents);
+			openLog();
+		}
+
+		std::string fname_;
+		std::string prefix_;
+
+		FILE* file_;
+		int64_t file_size_;
+
+		// records which have been appended but not yet written to the file.
+		std::string pending_;
+
+		std::map<std::string, Location> index_;
+		int64_t live_bytes_, dead_bytes_;
+	};
+}
+
+namespace
+{
+	variant get_sync(DbClient& client, const std::string& key)
+	{
+		variant result;
+		client.get(key, [&result](variant doc) { result = doc; });
+		return result;
+	}
+
+	variant make_benchmark_account(int n)
+	{
+		variant_builder builder;
+		builder.add("id", n);
+		builder.add("name", "player" + std::to_string(n));
+		builder.add("rating", 1500 + n%400);
+		builder.add("games_played", n%1000);
+		return builder.build();
+	}
+}
+
+UNIT_TEST(db_log_client)
+{
+	//the log is removed even if a check fails part way through.
+	struct RemoveLogFile
+	{
+		explicit RemoveLogFile(const std::string& f) : fname(f) { sys::remove_file(fname); }
+		~RemoveLogFile() { sys::remove_file(fname); }
+		std::string fname;
+	};
+
+	const std::string fname = sys::get_temp_dir() + "/anura-test-db.log";
+	const RemoveLogFile remove_log(fname);
+
+	{
+		DbClientPtr client(new LogStructuredDbClient(fname, ""));
+		for(int n = 0; n != 100; ++n) {
+			client->put("account:" + std::to_string(n), variant(n), [](){}, [](){});
+		}
+		client->put("other", variant("x"), [](){}, [](){});
+		client->remove("account:7");
+		client->put("account:8", variant("eight"), [](){}, [](){});
+
+		bool add_failed = false;
+		client->put("account:9", variant(0), [](){}, [&add_failed](){ add_failed = true; }, DbClient::PUT_ADD);
+		CHECK(add_failed, "PUT_ADD succeeded on an existing key");
+
+		client->process();
+	}
+
+	//simulate a crash part way through writing a record.
+	sys::write_file(fname, sys::read_file(fname) + "P 9 5 12345\naccount:");
+
+	{
+		DbClientPtr client(new LogStructuredDbClient(fname, ""));
+		CHECK_EQ(get_sync(*client, "account:3"), variant(3));
+		CHECK_EQ(get_sync(*client, "account:8"), variant("eight"));
+		CHECK(get_sync(*client, "account:7").is_null(), "removed key still present");
+
+		std::vector<variant> keys;
+		client->getKeysWithPrefix("account:", [&keys](std::vector<variant> v) { keys = v; });
+		CHECK_EQ(static_cast<int>(keys.size()), 99);
+
+		client->put("account:3", variant(33), [](){}, [](){});
+		client->process();
+	}
+
+	{
+		DbClientPtr client(new LogStructuredDbClient(fname, ""));
+		CHECK_EQ(get_sync(*client, "account:3"), variant(33));
+		CHECK_EQ(get_sync(*client, "other"), variant("x"));
+	}
+}
+
+BENCHMARK_ARG(db_client_put, const std::string& backend)
+{
+	//a database of many accounts, as a matchmaking server might keep, where
+	//one account is updated and then flushed to disk each iteration.
+	const int NumAccounts = 20000;
+
+	//the database is kept between runs of the benchmark, and its file is
+	//removed when the program exits.
+	struct BenchmarkDb
+	{
+		~BenchmarkDb() {
+			if(client) {
+				client.reset();
+				sys::remove_file(fname);
+			}
+		}
+		DbClientPtr client;
+		std::string fname;
+	};
+
+	static std::map<std::string, BenchmarkDb> dbs;
+	BenchmarkDb& db = dbs[backend];
+	DbClientPtr& client = db.client;
+	if(!client) {
+		db.fname = sys::get_temp_dir() + "/anura-benchmark-db." + backend;
+		sys::remove_file(db.fname);
+		if(backend == "log") {
+			client.reset(new LogStructuredDbClient(db.fname, ""));
+		} else {
+			client.reset(new FileBackedDbClient(db.fname, ""));
+		}
+
+		for(int n = 0; n != NumAccounts; ++n) {
+			client->put("account:" + std::to_string(n), make_benchmark_account(n), [](){}, [](){});
+		}
+		client->process();
+	}
+
+	int n = 0;
+	BENCHMARK_LOOP {
+		client->put("account:" + std::to_string(n%NumAccounts), make_benchmark_account(n), [](){}, [](){});
+		client->process();
+		++n;
+	}
 }
 
+BENCHMARK_ARG_CALL(db_client_put, json_file, "json");
+BENCHMARK_ARG_CALL(db_client_put, log_file, "log");
+
 #ifndef USE_DBCLIENT
 
 DbClientPtr DbClient::create(const char* prefix)
@@ -165,6 +598,9 @@ DbClientPtr DbClient::create(const char* prefix)
 	if(prefix == nullptr) {
 		prefix = g_db_key_prefix.c_str();
 	}
+	if(g_db_backend == "log") {
+		return DbClientPtr(new LogStructuredDbClient(g_db_log_file.empty() ? "db.log" : g_db_log_file.c_str(), prefix));
+	}
 	return DbClientPtr(new FileBackedDbClient(g_db_json_file.empty() ? "db.json" : g_db_json_file.c_str(), prefix));
 }
 
@@ -544,7 +980,9 @@ DbClientPtr DbClient::create(const char* prefix)
 	if(prefix == nullptr) {
 		prefix = g_db_key_prefix.c_str();
 	}
-	if(g_db_json_file.empty()) {
+	if(g_db_backend == "log" && !g_db_log_file.empty()) {
+		return DbClientPtr(new LogStructuredDbClient(g_db_log_file, prefix));
+	} else if(g_db_json_file.empty()) {
 		return DbClientPtr(new CouchbaseDbClient(prefix));
 	} else {
 		return DbClientPtr(new FileBackedDbClient(g_db_json_file, prefix));
@@ -55,7 +55,8 @@ Entity::Entity(variant node)
 	platform_motion_x_(node["platform_motion_x"].as_int()),
 	mouse_over_entity_(false), being_dragged_(false), mouse_button_state_(0),
 	mouseover_delay_(0), mouseover_trigger_cycle_(std::numeric_limits<int>::max()),
-	true_z_(false), tx_(node["x"].as_decimal().as_float()), ty_(node["y"].as_decimal().as_float()), tz_(0.0f)
+	true_z_(false), tx_(node["x"].as_decimal().as_float()), ty_(node["y"].as_decimal().as_float()), tz_(0.0f),
+	state_generation_(0)
 {
 	if(node.has_key("anchorx")) {
 		setAnchorX(node["anchorx"].as_decimal());
@@ -79,7 +80,8 @@ Entity::Entity(int x, int y, bool face_right)
 	weak_solid_dimensions_(0), weak_collide_dimensions_(0),	platform_motion_x_(0),
 	mouse_over_entity_(false), being_dragged_(false), mouse_button_state_(0),
 	mouseover_delay_(0), mouseover_trigger_cycle_(std::numeric_limits<int>::max()),
-	true_z_(false), tx_(double(x)), ty_(double(y)), tz_(0.0f)
+	true_z_(false), tx_(double(x)), ty_(double(y)), tz_(0.0f),
+	state_generation_(0)
 {
 	for(bool& b : controls_) {
 		b = false;
@@ -222,6 +224,7 @@ void Entity::process(Level& lvl)
 
 void Entity::setFacingRight(bool facing)
 {
+	markStateChanged();
 	if(facing == face_right_) {
 		return;
 	}
@@ -236,6 +239,7 @@ void Entity::setFacingRight(bool facing)
 
 void Entity::setUpsideDown(bool facing)
 {
+	markStateChanged();
 	const int start_y = solid_rect_.y();
 	upside_down_ = facing;
 	calculateSolidRect();
@@ -81,13 +81,13 @@ public:
 
 	virtual void shiftPosition(int x, int y) { x_ += x*100; y_ += y*100; prev_feet_x_ += x; prev_feet_y_ += y; calculateSolidRect(); }
 
-	void setPos(const point& p) { x_ = p.x*100; y_ = p.y*100; calculateSolidRect(); }
-	void setPos(int x, int y) { x_ = x*100; y_ = y*100; calculateSolidRect(); }
-	void setX(int x) { x_ = x*100; calculateSolidRect(); }
-	void setY(int y) { y_ = y*100; calculateSolidRect(); }
+	void setPos(const point& p) { x_ = p.x*100; y_ = p.y*100; calculateSolidRect(); markStateChanged(); }
+	void setPos(int x, int y) { x_ = x*100; y_ = y*100; calculateSolidRect(); markStateChanged(); }
+	void setX(int x) { x_ = x*100; calculateSolidRect(); markStateChanged(); }
+	void setY(int y) { y_ = y*100; calculateSolidRect(); markStateChanged(); }
 
-	void setCentiX(int x) { x_ = x; calculateSolidRect(); }
-	void setCentiY(int y) { y_ = y; calculateSolidRect(); }
+	void setCentiX(int x) { x_ = x; calculateSolidRect(); markStateChanged(); }
+	void setCentiY(int y) { y_ = y; calculateSolidRect(); markStateChanged(); }
 
 	int x() const { return x_/100 - (x_ < 0 && x_%100 ? 1 : 0); }
 	int y() const { return y_/100 - (y_ < 0 && y_%100 ? 1 : 0); }
@@ -98,8 +98,8 @@ public:
 	int zorder() const { return zorder_; }
 	int zSubOrder() const { return zsub_order_; }
 
-	void setZOrder(int z) { zorder_ = z; }
-	void setZSubOrder(int z) { zsub_order_ = z; }
+	void setZOrder(int z) { zorder_ = z; markStateChanged(); }
+	void setZSubOrder(int z) { zsub_order_ = z; markStateChanged(); }
 
 	public:
 
@@ -112,7 +112,7 @@ public:
 	virtual int velocityY() const { return 0; }
 
 	int group() const { return group_; }
-	void setGroup(int group) { group_ = group; }
+	void setGroup(int group) { group_ = group; markStateChanged(); }
 
 	virtual bool isStandable(int x, int y, int* friction=nullptr, int* traction=nullptr, int* adjust_y=nullptr) const { return false; }
 
@@ -220,6 +220,16 @@ public:
 	virtual EntityPtr clone() const { return EntityPtr(); }
 	virtual EntityPtr backup() const = 0;
 
+	//changes whenever the entity's state may have changed: when it is
+	//processed, handles an event, has a value set or is moved. The level
+	//history uses this to avoid copying entities which haven't changed.
+	unsigned int stateGeneration() const { return state_generation_; }
+	void markStateChanged() { ++state_generation_; }
+
+	//the approximate number of bytes a copy of this entity takes up, such
+	//as the copies made by backup().
+	virtual size_t memoryUsage() const { return sizeof(Entity); }
+
 	virtual void generateCurrent(const Entity& target, int* velocity_x, int* velocity_y) const;
 
 	virtual game_logic::ConstFormulaPtr getEventHandler(int key) const { return game_logic::ConstFormulaPtr(); }
@@ -441,6 +451,8 @@ private:
 
 	bool true_z_;
 	double tx_, ty_, tz_;
+
+	unsigned int state_generation_;
 };
 
 bool zorder_compare(const EntityPtr& e1, const EntityPtr& e2);
@@ -604,4 +604,9 @@ namespace sys
 	{
 		return boost::filesystem::current_path().generic_string();
 	}
+
+	std::string get_temp_dir()
+	{
+		return boost::filesystem::temp_directory_path().generic_string();
+	}
 }
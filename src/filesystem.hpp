@@ -96,4 +96,7 @@ namespace sys
 	void set_file_executable(const std::string& path);
 
 	std::string get_cwd();
+
+	//the system's directory for temporary files.
+	std::string get_temp_dir();
 }
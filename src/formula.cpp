@@ -22,6 +22,7 @@
 */
 
 #include <algorithm>
+#include <atomic>
 #include <boost/lexical_cast.hpp>
 #include <boost/optional/optional.hpp>
 #include <cmath>
@@ -37,6 +38,7 @@
 #include "logger.hpp"
 #include "formatter.hpp"
 #include "formula.hpp"
+#include "formula_bytecode_cache.hpp"
 #include "formula_callable.hpp"
 #include "formula_callable_definition.hpp"
 #include "formula_constants.hpp"
@@ -70,9 +72,38 @@ namespace
 	PREF_BOOL(ffl_vm_opt_constant_lookups, true, "Optimize contant lookups in VM");
 	PREF_BOOL(ffl_vm_opt_inline, true, "Try to inline FFL calls.");
 	PREF_BOOL(ffl_vm_opt_replace_where, true, "Try to replace trivial where calls.");
+	PREF_BOOL(ffl_vm_opt_specialize, true, "Use type-specialized instructions and peephole optimize VM code before executing it.");
 
-	//the last formula that was executed; used for outputting debugging info.
-	const game_logic::Formula* last_executed_formula;
+	//identifies the settings which affect the bytecode formulas compile to.
+	int get_compile_options()
+	{
+		return (g_ffl_vm_opt_library_lookups ? 1 : 0) |
+		       (g_ffl_vm_opt_constant_lookups ? 2 : 0) |
+		       (g_ffl_vm_opt_inline ? 4 : 0) |
+		       (g_ffl_vm_opt_replace_where ? 8 : 0) |
+		       (g_ffl_vm_opt_specialize ? 16 : 0);
+	}
+
+	//incremented whenever a formula defines a function in its symbol table.
+	std::atomic<int> g_function_definitions(0);
+
+	//parses a type written by variant_type::to_string(), giving null if it
+	//can't be parsed back.
+	variant_type_ptr parse_cached_type(const std::string& type_str)
+	{
+		try {
+			const assert_recover_scope recover_scope;
+			return parse_variant_type(variant(type_str));
+		} catch(const validation_failure_exception&) {
+		} catch(const formula_tokenizer::TokenError&) {
+		}
+
+		return variant_type_ptr();
+	}
+
+	//the last formula that was executed on this thread; used for
+	//outputting debugging info.
+	thread_local const game_logic::Formula* last_executed_formula;
 
 	bool g_verbatim_string_expressions = false;
 
@@ -334,6 +365,15 @@ namespace game_logic
 				t->set_expr(this);
 			}
 
+			//creates an expression for the whole of a formula from a VM which
+			//already has its debug info, such as one from the bytecode cache.
+			VMExpression(VirtualMachine& vm, variant_type_ptr t, const variant& parent_formula) : FormulaExpression("_vm"), vm_(vm), type_(t), can_reduce_to_variant_(false)
+			{
+				const std::string& s = parent_formula.as_string();
+				setDebugInfo(parent_formula, s.begin(), s.end());
+				t->set_expr(this);
+			}
+
 			bool canCreateVM() const override {
 				return true;
 			}
@@ -363,11 +403,21 @@ namespace game_logic
 			formula_vm::VirtualMachine& get_vm() { return vm_; }
 			const formula_vm::VirtualMachine& get_vm() const { return vm_; }
 
+			//makes a peephole optimized copy of the VM to execute. The
+			//original is kept as-is since it's what gets inlined and
+			//inspected when building other expressions.
+			void optimizeForExecution() {
+				if(!optimized_vm_) {
+					optimized_vm_.reset(new formula_vm::VirtualMachine(vm_));
+					optimized_vm_->optimize();
+				}
+			}
+
 		private:
 			variant execute(const FormulaCallable& variables) const override {
 //				Formula::failIfStaticContext();
 
-				variant result = vm_.execute(variables);
+				variant result = optimized_vm_ ? optimized_vm_->execute(variables) : vm_.execute(variables);
 				return result;
 			}
 
@@ -376,6 +426,7 @@ namespace game_logic
 			}
 
 			formula_vm::VirtualMachine vm_;
+			std::unique_ptr<formula_vm::VirtualMachine> optimized_vm_;
 			variant_type_ptr type_;
 
 			variant variant_;
@@ -816,6 +867,9 @@ namespace game_logic
 			explicit ConstIdentifierExpression(const std::string& id)
 			: FormulaExpression("_const_id"), v_(get_constant(id))
 			{
+				//constants such as the screen size, key bindings and the
+				//player's password can change between runs.
+				formula_bytecode_cache::mark_uncacheable();
 			}
 
 		private:
@@ -1156,7 +1210,7 @@ namespace {
 			}
 
 			variant execute(const FormulaCallable& variables) const override {
-				variant result = variables.queryValue(id_);
+				variant result = variables.queryValueCached(id_, lookup_cache_);
 				if(result.is_null() && function_) {
 					return function_->evaluate(variables);
 				}
@@ -1212,6 +1266,8 @@ namespace {
 
 			//If this symbol is a function, this is the value we can return for it.
 			ExpressionPtr function_;
+
+			mutable LookupCache lookup_cache_;
 		};
 
 		class InstantiateGenericExpression : public FormulaExpression {
@@ -2456,7 +2512,7 @@ namespace {
 			void emitVM(formula_vm::VirtualMachine& vm) const override {
 				left_->emitVM(vm);
 				right_->emitVM(vm);
-				vm.addInstruction(op_);
+				vm.addInstruction(getVMOp());
 			}
 
 		private:
@@ -2779,13 +2835,38 @@ namespace {
 					formula_vm::VirtualMachine vm;
 					left_->emitVM(vm);
 					right_->emitVM(vm);
-					vm.addInstruction(op_);
+					vm.addInstruction(getVMOp());
 					return ExpressionPtr(new VMExpression(vm, queryVariantType(), *this));
 				}
 
 				return ExpressionPtr();
 			}
 
+			static variant::TYPE getStaticType(const ExpressionPtr& expr) {
+				variant_type_ptr type = expr->queryVariantType();
+				if(type) {
+					type = type->base_type_no_enum();
+				}
+
+				if(type && type->is_type(variant::VARIANT_TYPE_INT)) {
+					return variant::VARIANT_TYPE_INT;
+				} else if(type && type->is_type(variant::VARIANT_TYPE_DECIMAL)) {
+					return variant::VARIANT_TYPE_DECIMAL;
+				}
+
+				return variant::VARIANT_TYPE_NULL;
+			}
+
+			//the instruction to use for this operator. When both sides are
+			//known to be ints or decimals a specialized instruction is used.
+			OP getVMOp() const {
+				if(!g_ffl_vm_opt_specialize) {
+					return op_;
+				}
+
+				return VirtualMachine::specializeBinaryOp(op_, getStaticType(left_), getStaticType(right_));
+			}
+
 			OP op_;
 			ExpressionPtr left_, right_;
 		};
@@ -4411,6 +4492,7 @@ static std::string debugSubexpressionTypes(ConstFormulaPtr & fml)
 
 			const std::string precond = "";
 			symbols->addFormulaFunction(formula_name, fml, Formula::createOptionalFormula(variant(precond), symbols), args, default_args, variant_types);
+			++g_function_definitions;
 			return ExpressionPtr();
 		}
 
@@ -4953,6 +5035,34 @@ void Formula::failIfStaticContext()
 	}
 }
 
+namespace
+{
+	thread_local const FormulaCallable* isolated_context_owner = nullptr;
+
+	struct ExecutionDepthScope {
+		explicit ExecutionDepthScope(int& depth) : depth_(depth) { ++depth_; }
+		~ExecutionDepthScope() { --depth_; }
+		int& depth_;
+	};
+}
+
+Formula::IsolatedContext::IsolatedContext(const FormulaCallable* owner) : old_owner_(isolated_context_owner)
+{
+	isolated_context_owner = owner;
+}
+
+Formula::IsolatedContext::~IsolatedContext()
+{
+	isolated_context_owner = old_owner_;
+}
+
+void Formula::failIfIsolatedContext(const FormulaCallable* allowed)
+{
+	if(isolated_context_owner != nullptr && isolated_context_owner != allowed) {
+		throw isolated_context_exception();
+	}
+}
+
 Formula::StrictCheckScope::StrictCheckScope(bool is_strict, bool is_warnings)
   : old_value(g_strict_formula_checking), old_warning_value(g_strict_formula_checking_warnings)
 {
@@ -5006,6 +5116,31 @@ Formula::Formula(const variant& val, FunctionSymbolTable* symbols, ConstFormulaC
 		str_ = variant(str_.string_cast());
 	}
 
+	formula_bytecode_cache::CompileScope bytecode_cache;
+	const ConstFormulaCallableDefinitionPtr definition = callableDefinition;
+	const int function_definitions = g_function_definitions;
+
+	if(g_ffl_vm && bytecode_cache.active()) {
+		formula_vm::VirtualMachine vm;
+		std::string type_str;
+		if(bytecode_cache.lookup(str_.as_string(), get_compile_options(), definition.get(), str_, &vm, &type_str)) {
+			type_ = parse_cached_type(type_str);
+			if(type_) {
+				VMExpression* vm_expr = new VMExpression(vm, type_, str_);
+				expr_.reset(vm_expr);
+				if(g_ffl_vm_opt_specialize) {
+					vm_expr->optimizeForExecution();
+				}
+
+				str_.add_formula_using_this(this);
+#ifndef NO_EDITOR
+				all_formulae().insert(this);
+#endif
+				return;
+			}
+		}
+	}
+
 	std::vector<Token> tokens;
 	std::string::const_iterator i1 = str_.as_string().begin(), i2 = str_.as_string().end();
 	while(i1 != i2) {
@@ -5117,6 +5252,27 @@ Formula::Formula(const variant& val, FunctionSymbolTable* symbols, ConstFormulaC
 			type_->set_expr(vm_expr.get());
 			expr_ = vm_expr;
 		}
+
+		//formulas which defined functions can't be cached since loading
+		//them from the cache wouldn't define the functions.
+		const VMExpression* top_vm_expr = dynamic_cast<const VMExpression*>(expr_.get());
+		if(bytecode_cache.active() && top_vm_expr && base_expr_.empty() && !global_where_ && g_function_definitions == function_definitions) {
+			const std::string type_str = type_->to_string();
+			variant_type_ptr cached_type = parse_cached_type(type_str);
+			if(cached_type && cached_type->is_equal(*type_)) {
+				bytecode_cache.store(str_.as_string(), get_compile_options(), definition.get(), top_vm_expr->get_vm(), type_str);
+			}
+		}
+
+		if(g_ffl_vm_opt_specialize) {
+			std::vector<ConstExpressionPtr> children = expr_->queryChildrenRecursive();
+			for(const ConstExpressionPtr& child : children) {
+				const VMExpression* vm_child = dynamic_cast<const VMExpression*>(child.get());
+				if(vm_child) {
+					const_cast<VMExpression*>(vm_child)->optimizeForExecution();
+				}
+			}
+		}
 	}
 }
 
@@ -5322,16 +5478,18 @@ variant Formula::execute(const FormulaCallable& variables) const
 	//
 	//Naturally if we throw an exception we DON'T want to restore the
 	//last_executed_formula since we want to report the error.
-	static int execution_stack = 0;
+	static thread_local int execution_stack = 0;
 	const Formula* prev_executed = execution_stack ? last_executed_formula : nullptr;
 	last_executed_formula = this;
 	try {
-		++execution_stack;
+		//the depth has to be unwound even when we throw, or an exception
+		//caught further up the stack leaves every later formula on this
+		//thread thinking it's nested.
+		const ExecutionDepthScope depth_scope(execution_stack);
 
 		const int nguard = guardMatches(variables);
 
 		variant result = (nguard == -1 ? expr_ : base_expr_[nguard].expr)->evaluate(variables);
-		--execution_stack;
 		if(prev_executed) {
 			last_executed_formula = prev_executed;
 		}
@@ -5599,6 +5757,90 @@ UNIT_TEST(formula_multifunction_types_compatible) {
 	CHECK_EQ(Formula(variant("types_compatible('function(string,int) ->any', 'function(int,string) ->any')")).execute().as_bool(), false);
 }
 
+UNIT_TEST(formula_vm_specialize) {
+	static const char* formulas[] = {
+		"(5 + 4)*17 + 12*9 - x",
+		"if(x > 3, x - 3, 3 - x) + if(not (x < 2), 1, 0)",
+		"[a*2 + 1 | a <- range(x)]",
+		"map(range(x), value*1.5 < 4.0)",
+		"filter(range(x*2), value%3 = 0 and value != x)",
+		"f(x, x + 1) where f = def(int a, int b) -> int (a + 1)*(b - 2) - a*b",
+		"m.b + m.a where m = {'a': x, 'b': 2}",
+		"switch(x, 1, 'one', 5, 'five', 'other')",
+	};
+
+	MapFormulaCallable* callable = new MapFormulaCallable;
+	variant ref(callable);
+
+	for(const char* formula : formulas) {
+		g_ffl_vm_opt_specialize = false;
+		Formula generic = Formula(variant(formula));
+		g_ffl_vm_opt_specialize = true;
+		Formula specialized = Formula(variant(formula));
+
+		for(int x = 0; x != 8; ++x) {
+			callable->add("x", variant(x));
+			CHECK(generic.execute(*callable) == specialized.execute(*callable), "specialized VM gives a different result for " << formula << " with x = " << x);
+		}
+	}
+}
+
+UNIT_TEST(formula_bytecode_cache) {
+	if(!g_ffl_vm || !formula_bytecode_cache::enabled()) {
+		return;
+	}
+
+	static const char* formulas[] = {
+		"(x + 4)*17 - x*x",
+		"if(x > 3, {'a': [x, 2.5]}, 'small')",
+		"[x*2, 'a', x > 2 and x < 9]",
+	};
+
+	MapFormulaCallable* callable = new MapFormulaCallable;
+	variant ref(callable);
+	callable->add("x", variant(5));
+
+	std::vector<variant> expected;
+	{
+		const formula_bytecode_cache::Scope scope("unit_test:formula_bytecode_cache", variant("v1"));
+		for(const char* formula : formulas) {
+			expected.push_back(Formula(variant(formula)).execute(*callable));
+		}
+	}
+
+	const int hits = formula_bytecode_cache::get_stats().hits;
+
+	{
+		const formula_bytecode_cache::Scope scope("unit_test:formula_bytecode_cache", variant("v1"));
+		for(int n = 0; n != sizeof(formulas)/sizeof(*formulas); ++n) {
+			Formula f = Formula(variant(formulas[n]));
+			CHECK_EQ(f.execute(*callable), expected[n]);
+			CHECK(f.queryVariantType(), "no type for cached formula");
+		}
+	}
+
+	CHECK_EQ(formula_bytecode_cache::get_stats().hits - hits, static_cast<int>(sizeof(formulas)/sizeof(*formulas)));
+
+	//a different document doesn't use what was cached for the old one.
+	{
+		const formula_bytecode_cache::Scope scope("unit_test:formula_bytecode_cache", variant("v2"));
+		Formula f = Formula(variant(formulas[0]));
+		CHECK_EQ(f.execute(*callable), expected[0]);
+	}
+
+	CHECK_EQ(formula_bytecode_cache::get_stats().hits - hits, static_cast<int>(sizeof(formulas)/sizeof(*formulas)));
+
+	//constants which can change between runs aren't cached.
+	const int stores = formula_bytecode_cache::get_stats().stores;
+	{
+		const formula_bytecode_cache::Scope scope("unit_test:formula_bytecode_cache_constants", variant("v1"));
+		Formula f = Formula(variant("SCREEN_WIDTH + x"));
+		Formula g = Formula(variant("x + 1"));
+	}
+
+	CHECK_EQ(formula_bytecode_cache::get_stats().stores - stores, 1);
+}
+
 UNIT_TEST(formula_list_comprehension) {
 	std::vector<variant> result;
 	for(int n = 0; n != 4; ++n) {
@@ -5861,6 +6103,26 @@ BENCHMARK(formula_add) {
 	}
 }
 
+BENCHMARK(formula_typed_arithmetic) {
+	static MapFormulaCallable* callable = new MapFormulaCallable;
+	callable->add("input", variant(1000));
+	static Formula f(variant("map(range(input), if(value*3 < 1500, value + 1, value - 1))"));
+	BENCHMARK_LOOP {
+		f.execute(*callable);
+	}
+}
+
+BENCHMARK(formula_typed_arithmetic_unspecialized) {
+	static MapFormulaCallable* callable = new MapFormulaCallable;
+	callable->add("input", variant(1000));
+	g_ffl_vm_opt_specialize = false;
+	static Formula f(variant("map(range(input), if(value*3 < 1500, value + 1, value - 1))"));
+	g_ffl_vm_opt_specialize = true;
+	BENCHMARK_LOOP {
+		f.execute(*callable);
+	}
+}
+
 COMMAND_LINE_UTILITY(test_multithread_variants) {
 	std::vector<variant> lists;
 
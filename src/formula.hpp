@@ -45,6 +45,8 @@ namespace game_logic
 	class FunctionSymbolTable;
 	typedef ffl::IntrusivePtr<FormulaExpression> ExpressionPtr;
 
+	struct isolated_context_exception {};
+
 	class Formula
 	{
 	public:
@@ -60,6 +62,19 @@ namespace game_logic
 		//it's attempting to evaluate in a static context.
 		static void failIfStaticContext();
 
+		//used while an object's formulas are evaluated away from the main
+		//thread. Anything that touches state shared with other objects
+		//calls failIfIsolatedContext(), which throws an
+		//isolated_context_exception unless 'allowed' is the object being
+		//evaluated, so the object can be processed on the main thread instead.
+		struct IsolatedContext {
+			explicit IsolatedContext(const FormulaCallable* owner);
+			~IsolatedContext();
+			const FormulaCallable* old_owner_;
+		};
+
+		static void failIfIsolatedContext(const FormulaCallable* allowed=nullptr);
+
 		static variant evaluate(const ConstFormulaPtr& f,
 							const FormulaCallable& variables,
 							variant default_res=variant(0)) {
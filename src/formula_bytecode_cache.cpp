@@ -0,0 +1,730 @@
+/*
+	Copyright (C) 2003-2014 by David White <davewx7@gmail.com>
+
+	This software is provided 'as-is', without any express or implied
+	warranty. In no event will the authors be held liable for any damages
+	arising from the use of this software.
+
+	Permission is granted to anyone to use this software for any purpose,
+	including commercial applications, and to alter it and redistribute it
+	freely, subject to the following restrictions:
+
+	   1. The origin of this software must not be misrepresented; you must not
+	   claim that you wrote the original software. If you use this software
+	   in a product, an acknowledgement in the product documentation would be
+	   appreciated but is not required.
+
+	   2. Altered source versions must be plainly marked as such, and must not be
+	   misrepresented as being the original software.
+
+	   3. This notice may not be removed or altered from any source
+	   distribution.
+*/
+
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <vector>
+
+#include "asserts.hpp"
+#include "decimal.hpp"
+#include "filesystem.hpp"
+#include "formula_bytecode_cache.hpp"
+#include "formula_callable_definition.hpp"
+#include "formula_vm.hpp"
+#include "logger.hpp"
+#include "module.hpp"
+#include "preferences.hpp"
+#include "unit_test.hpp"
+
+namespace formula_bytecode_cache
+{
+	//the entries of a scope. The entries are decoded from what was read
+	//from disk the first time the scope is used.
+	struct ScopeEntries
+	{
+		struct Entry
+		{
+			Entry() : options(0)
+			{}
+
+			std::string formula;
+			int options;
+			std::string definition;
+			std::string type;
+
+			//the serialized VM. Empty if there is no entry at this position.
+			std::string bytecode;
+		};
+
+		ScopeEntries() : decoded(true)
+		{}
+
+		std::string fingerprint;
+		std::vector<Entry> entries;
+
+		bool decoded;
+		std::string raw;
+	};
+
+	namespace
+	{
+		PREF_BOOL(ffl_bytecode_cache, true, "Cache compiled FFL bytecode on disk so unchanged formulas don't have to be compiled when loading");
+
+		const char FileMagic[] = "FFLBC";
+		const int FormatVersion = 2;
+
+		//written after the magic so files from a machine with different
+		//byte order are rejected.
+		const int ByteOrderMarker = 0x01020304;
+
+		enum PLAIN_TYPE { PLAIN_NULL, PLAIN_FALSE, PLAIN_TRUE, PLAIN_INT, PLAIN_DECIMAL, PLAIN_STRING, PLAIN_LIST, PLAIN_MAP };
+
+		struct DefinitionSignature
+		{
+			game_logic::ConstFormulaCallableDefinitionPtr def;
+			int num_slots;
+
+			//the types of each slot when the signature was worked out,
+			//since they can be changed after slots are added.
+			std::vector<variant_type_ptr> types;
+			std::string signature;
+		};
+
+		struct ActiveScope
+		{
+			std::shared_ptr<ScopeEntries> entries;
+			int next_ordinal;
+			int depth;
+
+			//set by mark_uncacheable() for the formula being compiled.
+			bool uncacheable;
+
+			//the definitions formulas in this scope have been compiled
+			//against, which are kept alive so their addresses aren't reused.
+			std::map<const game_logic::FormulaCallableDefinition*, DefinitionSignature> signatures;
+		};
+
+		thread_local std::vector<ActiveScope> t_active_scopes;
+		thread_local int t_bypass_depth = 0;
+
+		std::mutex g_mutex;
+		std::map<std::string, std::shared_ptr<ScopeEntries>> g_scopes;
+		std::string g_fingerprint;
+		bool g_loaded = false;
+		bool g_dirty = false;
+		Stats g_stats;
+
+		uint64_t hash_string(const std::string& s)
+		{
+			//FNV-1a, which is stable between builds unlike std::hash.
+			uint64_t result = 14695981039346656037ULL;
+			for(char c : s) {
+				result ^= static_cast<unsigned char>(c);
+				result *= 1099511628211ULL;
+			}
+
+			return result;
+		}
+
+		std::string hash_to_string(uint64_t hash)
+		{
+			std::ostringstream s;
+			s << std::hex << hash;
+			return s.str();
+		}
+
+		std::string get_cache_path()
+		{
+			return std::string(preferences::user_data_path()) + "/ffl_bytecode.cache";
+		}
+
+		//identifies everything outside a scope its bytecode depends on.
+		std::string calculate_fingerprint()
+		{
+			std::ostringstream s;
+			s << FormatVersion << "|" << preferences::version() << "|" << module::get_module_name() << "|" << module::get_module_version() << "|" << formula_vm::VirtualMachine::getInstructionSetSignature();
+
+			//constants from classes may be folded into bytecode.
+			std::map<std::string, std::string> classes;
+			module::get_unique_filenames_under_dir("data/classes/", &classes, module::MODULE_NO_PREFIX);
+			for(const auto& p : classes) {
+				s << "|" << p.first << ":" << sys::file_mod_time(p.second);
+			}
+
+			return hash_to_string(hash_string(s.str()));
+		}
+
+		//identifies the names and types of a definition's slots, since
+		//bytecode refers to symbols by their slot.
+		std::string calculate_definition_signature(const game_logic::FormulaCallableDefinition* def)
+		{
+			if(def == nullptr) {
+				return "";
+			}
+
+			std::ostringstream s;
+			for(int n = 0; n != def->getNumSlots(); ++n) {
+				const game_logic::FormulaCallableDefinition::Entry* entry = def->getEntry(n);
+				if(entry == nullptr) {
+					s << "|";
+					continue;
+				}
+
+				s << entry->id << ":" << (entry->variant_type ? entry->variant_type->to_string() : "") << ":" << (entry->write_type ? entry->write_type->to_string() : "") << (entry->isPrivate() ? ":private" : "") << (entry->constant_fn ? ":const" : "") << "|";
+			}
+
+			return hash_to_string(hash_string(s.str()));
+		}
+
+		void get_definition_types(const game_logic::FormulaCallableDefinition* def, std::vector<variant_type_ptr>* types)
+		{
+			types->clear();
+			if(def == nullptr) {
+				return;
+			}
+
+			for(int n = 0; n != def->getNumSlots(); ++n) {
+				const game_logic::FormulaCallableDefinition::Entry* entry = def->getEntry(n);
+				types->push_back(entry ? entry->variant_type : variant_type_ptr());
+				types->push_back(entry ? entry->write_type : variant_type_ptr());
+			}
+		}
+
+		//works out each definition once per scope since objects compile
+		//many formulas against the same large definition. It's worked out
+		//again if slots are added or their types are changed.
+		const std::string& get_definition_signature(int scope_index, const game_logic::FormulaCallableDefinition* def)
+		{
+			DefinitionSignature& sig = t_active_scopes[scope_index].signatures[def];
+			const int num_slots = def ? def->getNumSlots() : 0;
+
+			std::vector<variant_type_ptr> types;
+			get_definition_types(def, &types);
+
+			if(sig.def.get() != def || sig.num_slots != num_slots || sig.types != types || sig.signature.empty()) {
+				sig.def.reset(def);
+				sig.num_slots = num_slots;
+				sig.types.swap(types);
+				sig.signature = "s" + calculate_definition_signature(def);
+			}
+
+			return sig.signature;
+		}
+
+		void write_string(const std::string& str, std::string* out)
+		{
+			write_int(static_cast<int>(str.size()), out);
+			*out += str;
+		}
+
+		bool read_string(const char*& p, const char* end, std::string* result)
+		{
+			int len = 0;
+			if(!read_int(p, end, &len) || len < 0 || end - p < len) {
+				return false;
+			}
+
+			result->assign(p, p + len);
+			p += len;
+			return true;
+		}
+
+		bool decode_entries(ScopeEntries& scope)
+		{
+			scope.decoded = true;
+
+			std::string raw;
+			raw.swap(scope.raw);
+
+			const char* p = raw.data();
+			const char* end = p + raw.size();
+
+			int nentries = 0;
+			if(!read_int(p, end, &nentries) || nentries < 0) {
+				return false;
+			}
+
+			std::vector<ScopeEntries::Entry> entries(nentries);
+			for(ScopeEntries::Entry& e : entries) {
+				if(!read_string(p, end, &e.formula) || !read_int(p, end, &e.options) || !read_string(p, end, &e.definition) || !read_string(p, end, &e.type) || !read_string(p, end, &e.bytecode)) {
+					return false;
+				}
+			}
+
+			scope.entries.swap(entries);
+			return true;
+		}
+
+		void encode_entries(const ScopeEntries& scope, std::string* out)
+		{
+			if(!scope.decoded) {
+				*out += scope.raw;
+				return;
+			}
+
+			write_int(static_cast<int>(scope.entries.size()), out);
+			for(const ScopeEntries::Entry& e : scope.entries) {
+				write_string(e.formula, out);
+				write_int(e.options, out);
+				write_string(e.definition, out);
+				write_string(e.type, out);
+				write_string(e.bytecode, out);
+			}
+		}
+
+		//reads the cache from disk. Must be called with g_mutex held.
+		void load_cache()
+		{
+			if(g_loaded) {
+				return;
+			}
+
+			g_loaded = true;
+			g_fingerprint = calculate_fingerprint();
+
+			const std::string path = get_cache_path();
+			if(!sys::file_exists(path)) {
+				return;
+			}
+
+			const std::string contents = sys::read_file(path);
+			const char* p = contents.data();
+			const char* end = p + contents.size();
+
+			const size_t magic_len = sizeof(FileMagic) - 1;
+			if(contents.size() < magic_len || memcmp(p, FileMagic, magic_len) != 0) {
+				LOG_INFO("Ignoring FFL bytecode cache with unrecognized format");
+				return;
+			}
+
+			p += magic_len;
+
+			int marker = 0;
+			std::string fingerprint, checksum;
+			if(!read_int(p, end, &marker) || marker != ByteOrderMarker || !read_string(p, end, &fingerprint) || !read_string(p, end, &checksum)) {
+				LOG_INFO("Ignoring FFL bytecode cache with unrecognized format");
+				return;
+			}
+
+			if(fingerprint != g_fingerprint) {
+				LOG_INFO("FFL bytecode cache is out of date");
+				return;
+			}
+
+			if(checksum != hash_to_string(hash_string(std::string(p, end)))) {
+				LOG_INFO("Ignoring corrupt FFL bytecode cache");
+				return;
+			}
+
+			std::map<std::string, std::shared_ptr<ScopeEntries>> scopes;
+
+			int nscopes = 0;
+			if(!read_int(p, end, &nscopes)) {
+				return;
+			}
+
+			for(int n = 0; n < nscopes; ++n) {
+				std::string name;
+				auto scope = std::make_shared<ScopeEntries>();
+				scope->decoded = false;
+				if(!read_string(p, end, &name) || !read_string(p, end, &scope->fingerprint) || !read_string(p, end, &scope->raw)) {
+					LOG_INFO("Ignoring corrupt FFL bytecode cache");
+					return;
+				}
+
+				scopes[name] = scope;
+			}
+
+			g_scopes.swap(scopes);
+		}
+
+		void save_cache()
+		{
+			std::lock_guard<std::mutex> lock(g_mutex);
+			if(!g_dirty) {
+				return;
+			}
+
+			g_dirty = false;
+
+			std::string body;
+			write_int(static_cast<int>(g_scopes.size()), &body);
+			for(const auto& p : g_scopes) {
+				write_string(p.first, &body);
+				write_string(p.second->fingerprint, &body);
+
+				std::string raw;
+				encode_entries(*p.second, &raw);
+				write_string(raw, &body);
+			}
+
+			std::string contents(FileMagic);
+			write_int(ByteOrderMarker, &contents);
+			write_string(g_fingerprint, &contents);
+			write_string(hash_to_string(hash_string(body)), &contents);
+			contents += body;
+
+			try {
+				sys::write_file(get_cache_path(), contents);
+			} catch(...) {
+				LOG_ERROR("Could not write FFL bytecode cache to " << get_cache_path());
+				return;
+			}
+
+			LOG_INFO("Saved FFL bytecode cache: " << g_scopes.size() << " scopes, " << contents.size() << " bytes. " << g_stats.hits << " hits, " << g_stats.misses << " misses, " << g_stats.stores << " stores");
+		}
+	}
+
+	bool enabled()
+	{
+		return g_ffl_bytecode_cache;
+	}
+
+	Scope::Scope(const std::string& name, const variant& document) : active_(false)
+	{
+		if(!enabled()) {
+			return;
+		}
+
+		const std::string fingerprint = hash_to_string(hash_string(document.write_json()));
+
+		std::shared_ptr<ScopeEntries> entries;
+
+		{
+			std::lock_guard<std::mutex> lock(g_mutex);
+			load_cache();
+
+			std::shared_ptr<ScopeEntries>& scope = g_scopes[name];
+			if(!scope || scope->fingerprint != fingerprint) {
+				scope = std::make_shared<ScopeEntries>();
+				scope->fingerprint = fingerprint;
+				g_dirty = true;
+			} else if(!scope->decoded && !decode_entries(*scope)) {
+				scope->entries.clear();
+				g_dirty = true;
+			}
+
+			entries = scope;
+		}
+
+		ActiveScope active;
+		active.entries = entries;
+		active.next_ordinal = 0;
+		active.depth = 0;
+		active.uncacheable = false;
+		t_active_scopes.push_back(active);
+		active_ = true;
+	}
+
+	Scope::~Scope()
+	{
+		if(active_) {
+			t_active_scopes.pop_back();
+		}
+	}
+
+	BypassScope::BypassScope()
+	{
+		++t_bypass_depth;
+	}
+
+	BypassScope::~BypassScope()
+	{
+		--t_bypass_depth;
+	}
+
+	CompileScope::CompileScope() : ordinal_(-1), scope_index_(-1), counted_(false)
+	{
+		if(t_active_scopes.empty() || t_bypass_depth > 0) {
+			return;
+		}
+
+		counted_ = true;
+		ActiveScope& scope = t_active_scopes.back();
+		if(scope.depth++ == 0) {
+			entries_ = scope.entries;
+			ordinal_ = scope.next_ordinal++;
+			scope_index_ = static_cast<int>(t_active_scopes.size()) - 1;
+			scope.uncacheable = false;
+		}
+	}
+
+	CompileScope::~CompileScope()
+	{
+		if(counted_) {
+			--t_active_scopes.back().depth;
+		}
+	}
+
+	bool CompileScope::lookup(const std::string& formula, int options, const game_logic::FormulaCallableDefinition* def, const variant& parent_formula, formula_vm::VirtualMachine* vm, std::string* type) const
+	{
+		if(!entries_) {
+			return false;
+		}
+
+		const std::string& definition = get_definition_signature(scope_index_, def);
+
+		std::lock_guard<std::mutex> lock(g_mutex);
+		if(ordinal_ < static_cast<int>(entries_->entries.size())) {
+			const ScopeEntries::Entry& e = entries_->entries[ordinal_];
+			if(e.bytecode.empty() == false && e.options == options && e.definition == definition && e.formula == formula) {
+				const char* p = e.bytecode.data();
+				const char* end = p + e.bytecode.size();
+				if(vm->deserialize(p, end, parent_formula) && p == end) {
+					*type = e.type;
+					++g_stats.hits;
+					return true;
+				}
+			}
+		}
+
+		++g_stats.misses;
+		return false;
+	}
+
+	void CompileScope::store(const std::string& formula, int options, const game_logic::FormulaCallableDefinition* def, const formula_vm::VirtualMachine& vm, const std::string& type) const
+	{
+		if(!entries_ || t_active_scopes[scope_index_].uncacheable) {
+			return;
+		}
+
+		const std::string& definition = get_definition_signature(scope_index_, def);
+
+		std::string bytecode;
+		if(!vm.serialize(&bytecode)) {
+			return;
+		}
+
+		std::lock_guard<std::mutex> lock(g_mutex);
+		if(static_cast<int>(entries_->entries.size()) <= ordinal_) {
+			entries_->entries.resize(ordinal_+1);
+		}
+
+		ScopeEntries::Entry& e = entries_->entries[ordinal_];
+		e.formula = formula;
+		e.options = options;
+		e.definition = definition;
+		e.type = type;
+		e.bytecode.swap(bytecode);
+
+		++g_stats.stores;
+		g_dirty = true;
+	}
+
+	void mark_uncacheable()
+	{
+		if(!t_active_scopes.empty() && t_active_scopes.back().depth > 0) {
+			t_active_scopes.back().uncacheable = true;
+		}
+	}
+
+	void write_int(int n, std::string* out)
+	{
+		out->append(reinterpret_cast<const char*>(&n), sizeof(n));
+	}
+
+	bool read_int(const char*& p, const char* end, int* result)
+	{
+		if(static_cast<size_t>(end - p) < sizeof(*result)) {
+			return false;
+		}
+
+		memcpy(result, p, sizeof(*result));
+		p += sizeof(*result);
+		return true;
+	}
+
+	bool write_plain_variant(const variant& v, std::string* out)
+	{
+		switch(v.type()) {
+		case variant::VARIANT_TYPE_NULL:
+			*out += static_cast<char>(PLAIN_NULL);
+			return true;
+		case variant::VARIANT_TYPE_BOOL:
+			*out += static_cast<char>(v.as_bool() ? PLAIN_TRUE : PLAIN_FALSE);
+			return true;
+		case variant::VARIANT_TYPE_INT:
+			*out += static_cast<char>(PLAIN_INT);
+			write_int(v.as_int(), out);
+			return true;
+		case variant::VARIANT_TYPE_DECIMAL: {
+			*out += static_cast<char>(PLAIN_DECIMAL);
+			const int64_t value = v.as_decimal().value();
+			out->append(reinterpret_cast<const char*>(&value), sizeof(value));
+			return true;
+		}
+		case variant::VARIANT_TYPE_STRING:
+			*out += static_cast<char>(PLAIN_STRING);
+			write_string(v.as_string(), out);
+			return true;
+		case variant::VARIANT_TYPE_LIST:
+			*out += static_cast<char>(PLAIN_LIST);
+			write_int(v.num_elements(), out);
+			for(int n = 0; n != v.num_elements(); ++n) {
+				if(!write_plain_variant(v[n], out)) {
+					return false;
+				}
+			}
+
+			return true;
+		case variant::VARIANT_TYPE_MAP:
+			*out += static_cast<char>(PLAIN_MAP);
+			write_int(static_cast<int>(v.as_map().size()), out);
+			for(const auto& p : v.as_map()) {
+				if(!write_plain_variant(p.first, out) || !write_plain_variant(p.second, out)) {
+					return false;
+				}
+			}
+
+			return true;
+		default:
+			return false;
+		}
+	}
+
+	bool read_plain_variant(const char*& p, const char* end, variant* result)
+	{
+		if(p == end) {
+			return false;
+		}
+
+		const int type = *p++;
+		switch(type) {
+		case PLAIN_NULL:
+			*result = variant();
+			return true;
+		case PLAIN_FALSE:
+		case PLAIN_TRUE:
+			*result = variant::from_bool(type == PLAIN_TRUE);
+			return true;
+		case PLAIN_INT: {
+			int n = 0;
+			if(!read_int(p, end, &n)) {
+				return false;
+			}
+
+			*result = variant(n);
+			return true;
+		}
+		case PLAIN_DECIMAL: {
+			int64_t value = 0;
+			if(static_cast<size_t>(end - p) < sizeof(value)) {
+				return false;
+			}
+
+			memcpy(&value, p, sizeof(value));
+			p += sizeof(value);
+			*result = variant(decimal::from_raw_value(value));
+			return true;
+		}
+		case PLAIN_STRING: {
+			std::string s;
+			if(!read_string(p, end, &s)) {
+				return false;
+			}
+
+			*result = variant(s);
+			return true;
+		}
+		case PLAIN_LIST: {
+			int nitems = 0;
+			if(!read_int(p, end, &nitems) || nitems < 0 || end - p < nitems) {
+				return false;
+			}
+
+			std::vector<variant> items(nitems);
+			for(variant& item : items) {
+				if(!read_plain_variant(p, end, &item)) {
+					return false;
+				}
+			}
+
+			*result = variant(&items);
+			return true;
+		}
+		case PLAIN_MAP: {
+			int nitems = 0;
+			if(!read_int(p, end, &nitems) || nitems < 0 || end - p < nitems) {
+				return false;
+			}
+
+			std::map<variant, variant> items;
+			for(int n = 0; n != nitems; ++n) {
+				variant key, value;
+				if(!read_plain_variant(p, end, &key) || !read_plain_variant(p, end, &value)) {
+					return false;
+				}
+
+				items[key] = value;
+			}
+
+			*result = variant(&items);
+			return true;
+		}
+		default:
+			return false;
+		}
+	}
+
+	void invalidate()
+	{
+		std::lock_guard<std::mutex> lock(g_mutex);
+		if(!g_loaded) {
+			return;
+		}
+
+		//scopes in use keep their entries but they will no longer be saved.
+		g_scopes.clear();
+		g_fingerprint = calculate_fingerprint();
+		g_dirty = true;
+	}
+
+	Stats get_stats()
+	{
+		std::lock_guard<std::mutex> lock(g_mutex);
+		return g_stats;
+	}
+
+	Manager::Manager()
+	{
+	}
+
+	Manager::~Manager()
+	{
+		save_cache();
+	}
+}
+
+UNIT_TEST(formula_bytecode_cache_plain_variants) {
+	using namespace formula_bytecode_cache;
+
+	std::vector<variant> items;
+	items.emplace_back(5);
+	items.emplace_back(decimal::from_string("-2.25"));
+	items.emplace_back("abc");
+	items.push_back(variant::from_bool(true));
+	items.emplace_back();
+
+	std::map<variant, variant> m;
+	m[variant("list")] = variant(&items);
+	m[variant(4)] = variant("four");
+	const variant v(&m);
+
+	std::string data;
+	CHECK(write_plain_variant(v, &data), "could not write plain variant");
+
+	variant result;
+	const char* p = data.data();
+	CHECK(read_plain_variant(p, p + data.size(), &result), "could not read plain variant");
+	CHECK_EQ(p, data.data() + data.size());
+	CHECK_EQ(result, v);
+
+	//truncated data is rejected rather than read past.
+	for(size_t n = 0; n < data.size(); ++n) {
+		const char* q = data.data();
+		CHECK(!read_plain_variant(q, q + n, &result), "read truncated plain variant");
+	}
+}
@@ -0,0 +1,138 @@
+/*
+	Copyright (C) 2003-2014 by David White <davewx7@gmail.com>
+
+	This software is provided 'as-is', without any express or implied
+	warranty. In no event will the authors be held liable for any damages
+	arising from the use of this software.
+
+	Permission is granted to anyone to use this software for any purpose,
+	including commercial applications, and to alter it and redistribute it
+	freely, subject to the following restrictions:
+
+	   1. The origin of this software must not be misrepresented; you must not
+	   claim that you wrote the original software. If you use this software
+	   in a product, an acknowledgement in the product documentation would be
+	   appreciated but is not required.
+
+	   2. Altered source versions must be plainly marked as such, and must not be
+	   misrepresented as being the original software.
+
+	   3. This notice may not be removed or altered from any source
+	   distribution.
+*/
+
+#pragma once
+
+#include <memory>
+#include <string>
+
+#include "formula_callable_definition_fwd.hpp"
+#include "variant.hpp"
+
+namespace formula_vm
+{
+	class VirtualMachine;
+}
+
+//A cache on disk of the bytecode formulas compile to, so formulas which
+//haven't changed since the last run can skip being parsed and compiled.
+//
+//Formulas are cached in scopes, such as the loading of an object type.
+//A scope is identified by a name and by the contents of the document its
+//formulas come from. Loading the same document compiles the same formulas
+//in the same order, so within a scope a formula is identified by its
+//position and verified against its text. Only formulas compiled directly
+//in a scope use the cache, not those compiled as part of compiling them.
+//
+//The whole cache is thrown away when the engine, the instruction set or
+//any FFL class file changes. Formulas which fold in values that can differ
+//between runs, such as preferences or the screen size, aren't cached.
+namespace formula_bytecode_cache
+{
+	bool enabled();
+
+	struct ScopeEntries;
+
+	//while a scope exists formulas compiled on this thread use the cache.
+	class Scope
+	{
+	public:
+		Scope(const std::string& name, const variant& document);
+		~Scope();
+
+		Scope(const Scope&) = delete;
+		void operator=(const Scope&) = delete;
+	private:
+		bool active_;
+	};
+
+	//while one exists formulas compiled on this thread don't use the cache.
+	//Used when compiling has side effects a cached formula wouldn't have,
+	//such as counting which slots of a definition are accessed.
+	class BypassScope
+	{
+	public:
+		BypassScope();
+		~BypassScope();
+
+		BypassScope(const BypassScope&) = delete;
+		void operator=(const BypassScope&) = delete;
+	};
+
+	//created by a formula while it is being compiled.
+	class CompileScope
+	{
+	public:
+		CompileScope();
+		~CompileScope();
+
+		CompileScope(const CompileScope&) = delete;
+		void operator=(const CompileScope&) = delete;
+
+		bool active() const { return ordinal_ >= 0; }
+
+		//'options' identifies the compiler settings the formula is compiled
+		//with and 'def' the definition it's compiled against, which must
+		//have the same slot names and types as when the entry was stored.
+		//Returns false if there is no matching entry.
+		bool lookup(const std::string& formula, int options, const game_logic::FormulaCallableDefinition* def, const variant& parent_formula, formula_vm::VirtualMachine* vm, std::string* type) const;
+
+		//does nothing if mark_uncacheable() was called while compiling.
+		void store(const std::string& formula, int options, const game_logic::FormulaCallableDefinition* def, const formula_vm::VirtualMachine& vm, const std::string& type) const;
+	private:
+		std::shared_ptr<ScopeEntries> entries_;
+		int ordinal_;
+		int scope_index_;
+		bool counted_;
+	};
+
+	//called while a formula is compiled when it folds in a value which can
+	//differ between runs, so the formula isn't stored.
+	void mark_uncacheable();
+
+	void write_int(int n, std::string* out);
+	bool read_int(const char*& p, const char* end, int* result);
+
+	//writes and reads the plain data values bytecode may contain: null,
+	//bools, ints, decimals, strings and lists and maps of them.
+	bool write_plain_variant(const variant& v, std::string* out);
+	bool read_plain_variant(const char*& p, const char* end, variant* result);
+
+	//discards everything cached, such as when an FFL class changes.
+	void invalidate();
+
+	struct Stats
+	{
+		int hits, misses, stores;
+	};
+
+	Stats get_stats();
+
+	//loads the cache when created and saves it when destroyed.
+	class Manager
+	{
+	public:
+		Manager();
+		~Manager();
+	};
+}
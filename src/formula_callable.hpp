@@ -23,6 +23,8 @@
 
 #pragma once
 
+#include <atomic>
+#include <cstdint>
 #include <functional>
 #include <iostream>
 #include <map>
@@ -45,6 +47,39 @@ namespace game_logic
 
 	class FormulaCallableVisitor;
 
+	//A cache kept at a place in a formula which looks up a value by name.
+	//A callable which can resolve the name to something quicker to look up
+	//stores that here, along with an id for what it's valid for, such as
+	//the callable's type. It fits in one word so formulas running on
+	//several threads at once can share it.
+	class LookupCache
+	{
+	public:
+		LookupCache() : value_(0)
+		{}
+
+		LookupCache(const LookupCache& o) : value_(o.value_.load(std::memory_order_relaxed))
+		{}
+
+		LookupCache& operator=(const LookupCache& o) {
+			value_.store(o.value_.load(std::memory_order_relaxed), std::memory_order_relaxed);
+			return *this;
+		}
+
+		//the resolution stored for owner, or -1 if there isn't one.
+		//An owner of 0 is never stored.
+		int get(unsigned int owner) const {
+			const uint64_t v = value_.load(std::memory_order_relaxed);
+			return static_cast<unsigned int>(v >> 32) == owner ? static_cast<int>(v & 0xFFFFFFFFu) : -1;
+		}
+
+		void set(unsigned int owner, int resolution) {
+			value_.store((static_cast<uint64_t>(owner) << 32) | static_cast<uint32_t>(resolution), std::memory_order_relaxed);
+		}
+	private:
+		std::atomic<uint64_t> value_;
+	};
+
 	//interface for objects that can have formulae run on them
 	class FormulaCallable : public GarbageCollectible
 	{
@@ -64,6 +99,15 @@ namespace game_logic
 			return getValue(key);
 		}
 
+		//like queryValue(), but may use cache to find key more quickly.
+		//A cache must only ever be used to look up the one key.
+		variant queryValueCached(const std::string& key, LookupCache& cache) const {
+			if(has_self_ && key == "self") {
+				return variant(this);
+			}
+			return getValueCached(key, cache);
+		}
+
 		variant queryValueBySlot(int slot) const {
 			return getValueBySlot(slot);
 		}
@@ -139,6 +183,7 @@ namespace game_logic
 		virtual void visitValues(FormulaCallableVisitor& visitor) {}
 	private:
 		virtual variant getValue(const std::string& key) const = 0;
+		virtual variant getValueCached(const std::string& key, LookupCache& cache) const { return getValue(key); }
 		virtual variant getValueBySlot(int slot) const;
 
 		virtual bool getConstantValue(const std::string& key, variant* value) const {
@@ -59,6 +59,7 @@
 #include "base64.hpp"
 #include "code_editor_dialog.hpp"
 #include "compress.hpp"
+#include "concurrent_cache.hpp"
 #include "custom_object.hpp"
 #include "dialog.hpp"
 #include "debug_console.hpp"
@@ -2724,7 +2725,7 @@ FUNCTION_DEF_IMPL
 			return variant(new pathfinding::DirectedGraph(&vertex_list, &edges));
 		END_FUNCTION_DEF(create_graph_from_level)
 
-		FUNCTION_DEF(plot_path, 6, 9, "plot_path(level, from_x, from_y, to_x, to_y, heuristic, (optional) weight_expr, (optional) tile_size_x, (optional) tile_size_y) -> list : Returns a list of points to get from (from_x, from_y) to (to_x, to_y)")
+		FUNCTION_DEF(plot_path, 6, 9, "plot_path(level, from_x, from_y, to_x, to_y, heuristic, (optional) weight_expr, (optional) tile_size_x, (optional) tile_size_y) -> list : Returns a list of points to get from (from_x, from_y) to (to_x, to_y). heuristic is an expression using a and b, or one of the strings 'manhattan' or 'euclidean' which are much faster.")
 			int tile_size_x = TileSize;
 			int tile_size_y = TileSize;
 			ExpressionPtr weight_expr = ExpressionPtr();
@@ -2734,20 +2735,50 @@ FUNCTION_DEF_IMPL
 				weight_expr = args()[6];
 			}
 			if(NUM_ARGS == 8) {
-				tile_size_y = tile_size_x = EVAL_ARG(6).as_int();
+				tile_size_y = tile_size_x = EVAL_ARG(7).as_int();
 			} else if(NUM_ARGS == 9) {
-				tile_size_x = EVAL_ARG(6).as_int();
-				tile_size_y = EVAL_ARG(7).as_int();
+				tile_size_x = EVAL_ARG(7).as_int();
+				tile_size_y = EVAL_ARG(8).as_int();
 			}
 			ASSERT_LOG((tile_size_x%2)==0 && (tile_size_y%2)==0, "The tile_size_x and tile_size_y values *must* be even. (" << tile_size_x << "," << tile_size_y << ")");
 			point src(EVAL_ARG(1).as_int(), EVAL_ARG(2).as_int());
 			point dst(EVAL_ARG(3).as_int(), EVAL_ARG(4).as_int());
-			ExpressionPtr heuristic = args()[4];
+			ExpressionPtr heuristic = args()[5];
 			ffl::IntrusivePtr<MapFormulaCallable> callable(new MapFormulaCallable(&variables));
 			return variant(pathfinding::a_star_find_path(lvl, src, dst, heuristic, weight_expr, callable, tile_size_x, tile_size_y));
 		FUNCTION_DYNAMIC_ARGUMENTS
 		END_FUNCTION_DEF(plot_path)
 
+		FUNCTION_DEF(plot_paths, 3, 5, "plot_paths(level, [[from_x, from_y, to_x, to_y]], heuristic, (optional) tile_size_x, (optional) tile_size_y) -> list : Plots many paths at once, sharing the work between threads. heuristic must be 'manhattan' or 'euclidean'. Returns one path per query, in the same format as plot_path().")
+			int tile_size_x = TileSize;
+			int tile_size_y = TileSize;
+			LevelPtr lvl = EVAL_ARG(0).try_convert<Level>();
+			ASSERT_LOG(lvl.get() != nullptr, "plot_paths() requires a level");
+			const pathfinding::BuiltinHeuristic heuristic = pathfinding::get_builtin_heuristic(args()[2]);
+			ASSERT_LOG(heuristic != pathfinding::BuiltinHeuristic::NONE, "plot_paths() requires 'manhattan' or 'euclidean' as its heuristic");
+			if(NUM_ARGS == 4) {
+				tile_size_y = tile_size_x = EVAL_ARG(3).as_int();
+			} else if(NUM_ARGS == 5) {
+				tile_size_x = EVAL_ARG(3).as_int();
+				tile_size_y = EVAL_ARG(4).as_int();
+			}
+			ASSERT_LOG((tile_size_x%2)==0 && (tile_size_y%2)==0, "The tile_size_x and tile_size_y values *must* be even. (" << tile_size_x << "," << tile_size_y << ")");
+
+			const variant queries_variant = EVAL_ARG(1);
+			std::vector<pathfinding::PathQuery> queries;
+			queries.reserve(queries_variant.num_elements());
+			for(const variant& q : queries_variant.as_list()) {
+				const std::vector<int>& v = q.as_list_int();
+				ASSERT_LOG(v.size() == 4, "plot_paths() queries must be lists of [from_x, from_y, to_x, to_y]: " << q.write_json());
+				pathfinding::PathQuery query = { point(v[0], v[1]), point(v[2], v[3]) };
+				queries.push_back(query);
+			}
+
+			std::vector<variant> result = pathfinding::a_star_find_paths(lvl, queries, heuristic, tile_size_x, tile_size_y);
+			return variant(&result);
+		FUNCTION_DYNAMIC_ARGUMENTS
+		END_FUNCTION_DEF(plot_paths)
+
 		FUNCTION_DEF_CTOR(sort, 1, 2, "sort(list, criteria): Returns a nicely-ordered list. If you give it an optional formula such as 'a>b' it will sort it according to that. This example favours larger numbers first instead of the default of smaller numbers first.")
 		FUNCTION_DYNAMIC_ARGUMENTS
 		FUNCTION_DEF_MEMBERS
@@ -5993,6 +6024,30 @@ std::map<std::string, variant>& get_doc_cache(bool prefs_dir) {
 	RETURN_TYPE("[object]")
 	END_FUNCTION_DEF(objects_known_to_gc)
 
+	FUNCTION_DEF(cache_stats, 0, 0, "cache_stats(): gives the hit, miss and eviction counts and sizes of the engine's named caches")
+		//the counters are 64-bit and can outgrow an int, so are given as
+		//decimals, which hold whole numbers up to about 9 trillion.
+		auto count_variant = [](uint64_t n) {
+			return variant(decimal::from_raw_value(static_cast<int64_t>(n)*DECIMAL_PRECISION));
+		};
+
+		std::map<variant,variant> result;
+		for(const ConcurrentCacheStats& stats : ConcurrentCacheBase::getAllStats()) {
+			std::map<variant,variant> m;
+			m[variant("hits")] = count_variant(stats.hits);
+			m[variant("misses")] = count_variant(stats.misses);
+			m[variant("evictions")] = count_variant(stats.evictions);
+			m[variant("entries")] = variant(static_cast<int>(stats.entries));
+			m[variant("bytes")] = count_variant(stats.bytes);
+			m[variant("max_bytes")] = count_variant(stats.max_bytes);
+			result[variant(stats.name)] = variant(&m);
+		}
+
+		return variant(&result);
+	FUNCTION_ARGS_DEF
+	RETURN_TYPE("{string -> {string -> int|decimal}}")
+	END_FUNCTION_DEF(cache_stats)
+
 	class GarbageCollectorForceDestroyer : public GarbageCollector
 	{
 	public:
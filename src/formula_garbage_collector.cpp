@@ -1,7 +1,9 @@
 #include <assert.h>
 #include <algorithm>
+#include <atomic>
 #include <map>
 #include <mutex>
+#include <set>
 #include <thread>
 
 #include <vector>
@@ -14,6 +16,7 @@
 #include "logger.hpp"
 #include "profile_timer.hpp"
 #include "sys.hpp"
+#include "unit_test.hpp"
 
 #include "formula_object.hpp"
 
@@ -25,10 +28,14 @@ std::vector<IntrusivePtr<reference_counted_object>*> getAllIntrusivePtrDebug();
 std::set<variant*>& get_all_global_variants();
 #endif
 
+void notify_incremental_gc_destroyed(GarbageCollectible* item);
+
 namespace {
 	GarbageCollectible* g_head;
 	int g_count;
-	int g_threads;
+	//a counted task may submit further counted tasks, so this can be
+	//incremented off the main thread.
+	std::atomic<int> g_threads;
 	SDL_mutex* g_gc_mutex;
 
 	struct LockGC {
@@ -71,8 +78,7 @@ void GarbageCollectible::incrementWorkerThreads()
 
 void GarbageCollectible::decrementWorkerThreads()
 {
-	--g_threads;
-	if(g_threads == 0) {
+	if(--g_threads == 0) {
 		SDL_DestroyMutex(g_gc_mutex);
 		g_gc_mutex = nullptr;
 	}
@@ -132,6 +138,8 @@ GarbageCollectible::~GarbageCollectible()
 
 	LockGC lock;
 
+	notify_incremental_gc_destroyed(this);
+
 	--g_count;
 	if(prev_ != nullptr) {
 		prev_->next_ = next_;
@@ -226,9 +234,15 @@ namespace {
 class GarbageCollectorImpl : public GarbageCollector
 {
 public:
-	GarbageCollectorImpl(int num_gens=-1) : gens_(num_gens)
+	GarbageCollectorImpl(int num_gens=-1) : gens_(num_gens), preset_items_(false)
 	{}
 
+	//collects only from the given items.
+	explicit GarbageCollectorImpl(std::vector<GarbageCollectible*>* items) : gens_(-1), preset_items_(true)
+	{
+		items_.swap(*items);
+	}
+
 	void surrenderVariant(const variant* v, const char* description) override;
 	void surrenderPtrInternal(ffl::IntrusivePtr<GarbageCollectible>* ptr, const char* description) override;
 
@@ -236,21 +250,27 @@ public:
 	void reap();
 	void debugOutputCollected();
 
+	int numCollected() const { return static_cast<int>(garbage_.size()); }
+
 private:
 	void accumulateAll();
 	void performCollection();
 
-	void destroyReferences(GarbageCollectible* item);
-	void restoreReferences(GarbageCollectible* item);
+	void destroyReferences(int index);
+	void restoreReferences(int index);
 
 	std::vector<variant*> variants_;
 	std::vector<PointerPair> pointers_;
 
-	std::map<GarbageCollectible*, ObjectRecord> records_;
+	//items_ is sorted and records_ has the record for each item at the
+	//same index. garbage_ and saved_ are indexes into them.
+	std::vector<GarbageCollectible*> items_;
+	std::vector<ObjectRecord> records_;
 
-	std::vector<GarbageCollectible*> items_, saved_;
+	std::vector<int> garbage_, saved_;
 
 	int gens_;
+	bool preset_items_;
 };
 
 void GarbageCollectorImpl::surrenderVariant(const variant* v, const char* description)
@@ -289,11 +309,9 @@ void GarbageCollectorImpl::surrenderPtrInternal(ffl::IntrusivePtr<GarbageCollect
 	ptr->reset();
 }
 
-void GarbageCollectorImpl::destroyReferences(GarbageCollectible* item)
+void GarbageCollectorImpl::destroyReferences(int index)
 {
-	auto itor = records_.find(item);
-	ASSERT_LOG(itor != records_.end(), "Could not find item in GC");
-	const ObjectRecord& record = itor->second;
+	const ObjectRecord& record = records_[index];
 	for(int n = record.begin_variant; n != record.end_variant; ++n) {
 		variants_[n]->increment_refcount();
 		*variants_[n] = variant();
@@ -301,11 +319,9 @@ void GarbageCollectorImpl::destroyReferences(GarbageCollectible* item)
 }
 
 
-void GarbageCollectorImpl::restoreReferences(GarbageCollectible* item)
+void GarbageCollectorImpl::restoreReferences(int index)
 {
-	auto itor = records_.find(item);
-	ASSERT_LOG(itor != records_.end(), "Could not find item in GC");
-	const ObjectRecord& record = itor->second;
+	const ObjectRecord& record = records_[index];
 	for(int n = record.begin_variant; n != record.end_variant; ++n) {
 		variants_[n]->increment_refcount();
 	}
@@ -319,42 +335,48 @@ void GarbageCollectorImpl::collect()
 {
 	LockGC lock;
 
-	LOG_DEBUG("Beginning garbage collection of " << g_count << " items");
+	LOG_DEBUG("Beginning garbage collection of " << (preset_items_ ? static_cast<int>(items_.size()) : g_count) << " items");
 	profile::timer timer;
 
 	accumulateAll();
 	performCollection();
 
-	LOG_DEBUG("Garbage collection complete in " << static_cast<int>(timer.get_time()) << "us. Collected " << items_.size() << " objects. " << saved_.size() << " objects remaining; variants: " << variants_.size() << "; pointers: " << pointers_.size());
+	LOG_DEBUG("Garbage collection complete in " << static_cast<int>(timer.get_time()) << "us. Collected " << garbage_.size() << " objects. " << saved_.size() << " objects remaining; variants: " << variants_.size() << "; pointers: " << pointers_.size());
 }
 
 void GarbageCollectorImpl::accumulateAll()
 {
-	items_.reserve(g_count);
-
-	for(GarbageCollectible* p = g_head; p != nullptr; p = p->next_) {
-		if(gens_ < 0 || p->tenure_ < gens_) {
-			p->add_reference();
-			ASSERT_LOG(p->refcount() > 1, "Object with bad refcount: " << p->refcount() << ": " << p->debugObjectName());
-			items_.push_back(p);
-		} else if(p->tenure_ >= gens_) {
-			//the list of objects is sorted in order of tenure,
-			//since we always add at the head, so we don't need to continue
-			//once we found one already tenured.
-			break;
+	if(!preset_items_) {
+		items_.reserve(g_count);
+
+		for(GarbageCollectible* p = g_head; p != nullptr; p = p->next_) {
+			if(gens_ < 0 || p->tenure_ < gens_) {
+				items_.push_back(p);
+			} else if(p->tenure_ >= gens_) {
+				//the list of objects is sorted in order of tenure,
+				//since we always add at the head, so we don't need to continue
+				//once we found one already tenured.
+				break;
+			}
 		}
 	}
 
+	for(GarbageCollectible* p : items_) {
+		p->add_reference();
+		ASSERT_LOG(p->refcount() > 1, "Object with bad refcount: " << p->refcount() << ": " << p->debugObjectName());
+	}
+
 	std::sort(items_.begin(), items_.end());
 
 	pointers_.reserve(items_.size()*2);
 	variants_.reserve(items_.size()*2);
+	records_.resize(items_.size());
 
-	for(GarbageCollectible* p : items_) {
-		ObjectRecord& record = records_[p];
+	for(int n = 0; n != static_cast<int>(items_.size()); ++n) {
+		ObjectRecord& record = records_[n];
 		record.begin_variant = variants_.size();
 		record.begin_pointer = pointers_.size();
-		p->surrenderReferences(this);
+		items_[n]->surrenderReferences(this);
 		record.end_variant = variants_.size();
 		record.end_pointer = pointers_.size();
 	}
@@ -362,29 +384,32 @@ void GarbageCollectorImpl::accumulateAll()
 
 void GarbageCollectorImpl::performCollection()
 {
+	garbage_.resize(items_.size());
+	for(int n = 0; n != static_cast<int>(items_.size()); ++n) {
+		garbage_[n] = n;
+	}
+
 	int nlast = -1;
-	while(nlast != items_.size()) {
-		nlast = items_.size();
+	while(nlast != garbage_.size()) {
+		nlast = garbage_.size();
 
-		int save_count = 0;
-		for(GarbageCollectible*& item : items_) {
+		for(int& index : garbage_) {
+			GarbageCollectible* item = items_[index];
 			if(item->refcount() == 1) {
 				continue;
 			}
 
-			++save_count;
-
-			restoreReferences(item);
-			saved_.push_back(item);
+			restoreReferences(index);
+			saved_.push_back(index);
 			item->tenure_++;
-			item = nullptr;
+			index = -1;
 		}
 
-		items_.erase(std::remove(items_.begin(), items_.end(), nullptr), items_.end());
+		garbage_.erase(std::remove(garbage_.begin(), garbage_.end(), -1), garbage_.end());
 	}
 
-	for(auto item : items_) {
-		destroyReferences(item);
+	for(int index : garbage_) {
+		destroyReferences(index);
 	}
 }
 
@@ -393,12 +418,12 @@ void GarbageCollectorImpl::reap()
 	LockGC lock;
 	profile::timer timer;
 
-	for(auto item : saved_) {
-		item->dec_reference();
+	for(int index : saved_) {
+		items_[index]->dec_reference();
 	}
 
-	for(auto item : items_) {
-		item->dec_reference();
+	for(int index : garbage_) {
+		items_[index]->dec_reference();
 	}
 
 	LOG_DEBUG("Garbage collection reap in " << static_cast<int>(timer.get_time()) << "us.");
@@ -412,8 +437,8 @@ void GarbageCollectorImpl::debugOutputCollected()
 	LOG_INFO("--DELETE REPORT--\n");
 
 	std::map<std::string, int> obj_counts;
-	for(auto item : items_) {
-		obj_counts[item->debugObjectName()]++;
+	for(int index : garbage_) {
+		obj_counts[items_[index]->debugObjectName()]++;
 	}
 
 	std::vector<std::pair<int, std::string> > obj_counts_sorted;
@@ -431,6 +456,297 @@ void GarbageCollectorImpl::debugOutputCollected()
 	LOG_INFO("DELETED " << ncount << " OBJECTS");
 }
 
+//A collection spread over many short steps, so it can run a little each
+//frame. It scans the objects a few at a time, recording which other
+//collectible objects each one refers to but leaving every reference in
+//place, so the game carries on as normal between steps.
+//
+//Objects can change what they refer to between steps, so what is recorded
+//is only an estimate. Anything referenced more times than the recorded
+//references account for must be referenced from outside, and everything
+//reachable from there is kept. What's left are candidates, which are
+//handed to GarbageCollectorImpl in a single step. It only frees objects
+//that are referenced solely by other candidates, so a bad estimate can
+//only cause garbage to be missed until the next cycle, never live objects
+//to be freed. Typically few objects are candidates, so that step is short.
+class IncrementalGarbageCollector : public GarbageCollector
+{
+public:
+	//num_gens works as for GarbageCollectorImpl; objects which have
+	//survived that many collections aren't considered.
+	explicit IncrementalGarbageCollector(int num_gens);
+
+	//does work until budget_us has elapsed, or until max_work units of
+	//work are done if max_work isn't negative. Returns true once the
+	//cycle is complete.
+	bool step(int budget_us, int max_work=-1);
+
+	void objectDestroyed(GarbageCollectible* item) {
+		destroyed_.push_back(item);
+	}
+
+	void surrenderVariant(const variant* v, const char* description) override;
+	void surrenderPtrInternal(ffl::IntrusivePtr<GarbageCollectible>* ptr, const char* description) override;
+
+	int numItems() const { return static_cast<int>(items_.size()); }
+	int numCollected() const { return ncollected_; }
+
+private:
+	enum class PHASE { SORT, SCAN, MARK_ROOTS, MARK, SWEEP, DONE };
+
+	enum { FLAG_DESTROYED = 1, FLAG_REACHABLE = 2 };
+
+	void sortStep();
+	void addEdge(const void* target);
+	int findItem(const void* target) const;
+	void processDestroyed();
+
+	PHASE phase_;
+
+	std::vector<GarbageCollectible*> items_;
+
+	//items_ is sorted a chunk or merge at a time, so sorting a large heap
+	//doesn't have to happen in one step.
+	std::vector<GarbageCollectible*> sort_buf_;
+	size_t sort_width_, pos_;
+
+	//all of these have an entry for each item. The items item n refers
+	//to are edges_[edge_begin_[n]] up to edges_[edge_begin_[n+1]].
+	std::vector<unsigned char> flags_;
+	std::vector<int> internal_refs_;
+	std::vector<int> edge_begin_, edges_;
+
+	std::vector<int> mark_stack_;
+
+	//objects destroyed since the last step.
+	std::vector<GarbageCollectible*> destroyed_;
+
+	int ncollected_;
+};
+
+namespace {
+	IncrementalGarbageCollector* g_incremental_gc;
+
+	//size of the runs items are sorted in before being merged.
+	const size_t SortChunkSize = 4096;
+}
+
+IncrementalGarbageCollector::IncrementalGarbageCollector(int num_gens) : phase_(PHASE::SORT), sort_width_(0), pos_(0), ncollected_(0)
+{
+	LockGC lock;
+	items_.reserve(g_count);
+	for(GarbageCollectible* p = g_head; p != nullptr; p = p->next_) {
+		if(num_gens >= 0 && p->tenure_ >= num_gens) {
+			//tenured objects aren't scanned, so anything they refer to
+			//will be seen as referenced from outside and kept.
+			break;
+		}
+
+		items_.push_back(p);
+	}
+}
+
+bool IncrementalGarbageCollector::step(int budget_us, int max_work)
+{
+	LockGC lock;
+	profile::timer timer;
+
+	if(phase_ != PHASE::SORT) {
+		processDestroyed();
+	}
+
+	int count = 0;
+	while(phase_ != PHASE::SWEEP && (max_work < 0 || count < max_work) && (++count%64 != 0 || timer.get_time() < budget_us)) {
+		switch(phase_) {
+		case PHASE::SORT:
+			sortStep();
+			break;
+
+		case PHASE::SCAN: {
+			if(pos_ == items_.size()) {
+				phase_ = PHASE::MARK_ROOTS;
+				pos_ = 0;
+				break;
+			}
+
+			if((flags_[pos_]&FLAG_DESTROYED) == 0) {
+				items_[pos_]->surrenderReferences(this);
+			}
+
+			edge_begin_.push_back(static_cast<int>(edges_.size()));
+			++pos_;
+			break;
+		}
+
+		case PHASE::MARK_ROOTS: {
+			if(pos_ == items_.size()) {
+				phase_ = PHASE::MARK;
+				break;
+			}
+
+			//the references we found don't account for all of them, so
+			//something outside the objects scanned refers to this.
+			if(flags_[pos_] == 0 && items_[pos_]->refcount() > internal_refs_[pos_]) {
+				flags_[pos_] |= FLAG_REACHABLE;
+				mark_stack_.push_back(static_cast<int>(pos_));
+			}
+
+			++pos_;
+			break;
+		}
+
+		case PHASE::MARK: {
+			if(mark_stack_.empty()) {
+				phase_ = PHASE::SWEEP;
+				break;
+			}
+
+			const int index = mark_stack_.back();
+			mark_stack_.pop_back();
+			for(int n = edge_begin_[index]; n != edge_begin_[index+1]; ++n) {
+				const int target = edges_[n];
+				if(flags_[target] == 0) {
+					flags_[target] |= FLAG_REACHABLE;
+					mark_stack_.push_back(target);
+				}
+			}
+			break;
+		}
+
+		default:
+			break;
+		}
+	}
+
+	if(phase_ != PHASE::SWEEP) {
+		return false;
+	}
+
+	std::vector<GarbageCollectible*> candidates;
+	for(size_t n = 0; n != items_.size(); ++n) {
+		if(flags_[n] == 0) {
+			candidates.push_back(items_[n]);
+		} else if(flags_[n] == FLAG_REACHABLE) {
+			items_[n]->tenure_++;
+		}
+	}
+
+	if(!candidates.empty()) {
+		GarbageCollectorImpl gc(&candidates);
+		gc.collect();
+		gc.reap();
+		ncollected_ = gc.numCollected();
+	}
+
+	phase_ = PHASE::DONE;
+	return true;
+}
+
+void IncrementalGarbageCollector::sortStep()
+{
+	const size_t nitems = items_.size();
+	if(sort_width_ == 0) {
+		//first sort each chunk.
+		const size_t end = std::min(nitems, pos_ + SortChunkSize);
+		std::sort(items_.begin() + pos_, items_.begin() + end);
+		pos_ = end;
+		if(pos_ == nitems) {
+			sort_width_ = SortChunkSize;
+			pos_ = 0;
+			sort_buf_.resize(nitems);
+		}
+	} else if(sort_width_ < nitems) {
+		//then merge pairs of sorted runs, doubling their width each pass.
+		const size_t mid = std::min(nitems, pos_ + sort_width_);
+		const size_t end = std::min(nitems, mid + sort_width_);
+		std::merge(items_.begin() + pos_, items_.begin() + mid, items_.begin() + mid, items_.begin() + end, sort_buf_.begin() + pos_);
+		pos_ = end;
+		if(pos_ == nitems) {
+			items_.swap(sort_buf_);
+			sort_width_ *= 2;
+			pos_ = 0;
+		}
+	}
+
+	if(sort_width_ >= nitems) {
+		sort_buf_.clear();
+		sort_buf_.shrink_to_fit();
+
+		flags_.resize(nitems);
+		internal_refs_.resize(nitems);
+		edge_begin_.reserve(nitems + 1);
+		edge_begin_.push_back(0);
+		edges_.reserve(nitems*2);
+
+		phase_ = PHASE::SCAN;
+		pos_ = 0;
+		processDestroyed();
+	}
+}
+
+int IncrementalGarbageCollector::findItem(const void* target) const
+{
+	auto itor = std::lower_bound(items_.begin(), items_.end(), target);
+	if(itor == items_.end() || *itor != target) {
+		return -1;
+	}
+
+	return static_cast<int>(itor - items_.begin());
+}
+
+void IncrementalGarbageCollector::addEdge(const void* target)
+{
+	const int index = findItem(target);
+	if(index < 0 || (flags_[index]&FLAG_DESTROYED)) {
+		return;
+	}
+
+	edges_.push_back(index);
+	internal_refs_[index]++;
+}
+
+void IncrementalGarbageCollector::processDestroyed()
+{
+	for(GarbageCollectible* p : destroyed_) {
+		const int index = findItem(p);
+		if(index >= 0) {
+			flags_[index] |= FLAG_DESTROYED;
+		}
+	}
+
+	destroyed_.clear();
+}
+
+void IncrementalGarbageCollector::surrenderVariant(const variant* v, const char* description)
+{
+	switch(v->type_ ) {
+	case variant::VARIANT_TYPE_LIST:
+	case variant::VARIANT_TYPE_MAP:
+	case variant::VARIANT_TYPE_CALLABLE:
+	case variant::VARIANT_TYPE_FUNCTION:
+	case variant::VARIANT_TYPE_GENERIC_FUNCTION:
+	case variant::VARIANT_TYPE_MULTI_FUNCTION:
+		addEdge(v->get_addr());
+		break;
+	default:
+		break;
+	}
+}
+
+void IncrementalGarbageCollector::surrenderPtrInternal(ffl::IntrusivePtr<GarbageCollectible>* ptr, const char* description)
+{
+	if(ptr->get() != nullptr) {
+		addEdge(ptr->get());
+	}
+}
+
+void notify_incremental_gc_destroyed(GarbageCollectible* item)
+{
+	if(g_incremental_gc) {
+		g_incremental_gc->objectDestroyed(item);
+	}
+}
+
 namespace {
 	struct Node {
 		std::string id;
@@ -762,6 +1078,28 @@ void GarbageCollectorAnalyzer::run(const char* fname)
 
 namespace {
 	std::vector<std::shared_ptr<GarbageCollectorImpl>> g_reapable_gc;
+
+	//an incremental cycle starts once there are at least this many objects.
+	const int IncrementalGCMinThreshold = 4096;
+	int g_incremental_gc_threshold = IncrementalGCMinThreshold;
+
+	//every few cycles consider all objects, otherwise only those which
+	//have survived fewer than IncrementalGCYoungGens collections.
+	const int IncrementalGCFullCycleInterval = 4;
+	const int IncrementalGCYoungGens = 2;
+	int g_incremental_gc_cycles;
+
+	void setIncrementalGarbageCollector(IncrementalGarbageCollector* gc)
+	{
+		IncrementalGarbageCollector* old_gc;
+		{
+			LockGC lock;
+			old_gc = g_incremental_gc;
+			g_incremental_gc = gc;
+		}
+
+		delete old_gc;
+	}
 }
 
 void runGarbageCollection(int num_gens, bool mandatory)
@@ -776,11 +1114,52 @@ void runGarbageCollection(int num_gens, bool mandatory)
 
 	reapGarbageCollection();
 
-	formula_profiler::Instrument instrument("GC");
-	std::shared_ptr<GarbageCollectorImpl> gc(new GarbageCollectorImpl(num_gens));
-	gc->collect();
-	gc->reap();
-//	g_reapable_gc.push_back(gc);
+	//a full collection makes any partial cycle redundant.
+	setIncrementalGarbageCollector(nullptr);
+
+	profile::timer timer;
+	{
+		formula_profiler::Instrument instrument("GC");
+		std::shared_ptr<GarbageCollectorImpl> gc(new GarbageCollectorImpl(num_gens));
+		gc->collect();
+		gc->reap();
+//		g_reapable_gc.push_back(gc);
+	}
+
+	formula_profiler::record_gc_pause(static_cast<int>(timer.get_time()));
+}
+
+void runIncrementalGarbageCollection(int budget_us)
+{
+	if(GarbageCollector::getGlobalMutex().try_lock() == false) {
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(GarbageCollector::getGlobalMutex(), std::adopt_lock_t());
+
+	if(g_incremental_gc == nullptr) {
+		if(g_count < g_incremental_gc_threshold) {
+			return;
+		}
+
+		const bool full = ++g_incremental_gc_cycles%IncrementalGCFullCycleInterval == 0;
+		setIncrementalGarbageCollector(new IncrementalGarbageCollector(full ? -1 : IncrementalGCYoungGens));
+	}
+
+	profile::timer timer;
+	bool done;
+	{
+		formula_profiler::Instrument instrument("GC");
+		done = g_incremental_gc->step(budget_us);
+	}
+
+	formula_profiler::record_gc_pause(static_cast<int>(timer.get_time()));
+
+	if(done) {
+		LOG_DEBUG("Incremental garbage collection of " << g_incremental_gc->numItems() << " items collected " << g_incremental_gc->numCollected() << " objects");
+		setIncrementalGarbageCollector(nullptr);
+		g_incremental_gc_threshold = std::max<int>(IncrementalGCMinThreshold, g_count + g_count/4);
+	}
 }
 
 void reapGarbageCollection()
@@ -803,3 +1182,171 @@ void runGarbageCollectionDebug(const char* fname)
 
 	GarbageCollectorAnalyzer().run(fname);
 }
+
+namespace {
+	//an object for testing the collectors, which refers to other objects
+	//and records whether it's still alive.
+	class GCTestObject : public GarbageCollectible
+	{
+	public:
+		static std::set<std::string>& liveObjects() {
+			static std::set<std::string> live;
+			return live;
+		}
+
+		explicit GCTestObject(const std::string& name) : name_(name) {
+			liveObjects().insert(name_);
+		}
+
+		~GCTestObject() {
+			liveObjects().erase(name_);
+		}
+
+		const std::string& name() const { return name_; }
+
+		void surrenderReferences(GarbageCollector* collector) override {
+			for(ffl::IntrusivePtr<GCTestObject>& ref : refs) {
+				collector->surrenderPtr(&ref, "REF");
+			}
+		}
+
+		std::string debugObjectName() const override { return "GCTestObject:" + name_; }
+
+		std::vector<ffl::IntrusivePtr<GCTestObject>> refs;
+	private:
+		std::string name_;
+	};
+
+	typedef ffl::IntrusivePtr<GCTestObject> GCTestObjectPtr;
+
+	//creates the objects the collector tests use. Only the returned object
+	//is referenced from outside; the rest are reachable from it or are in
+	//cycles of garbage.
+	GCTestObjectPtr create_gc_test_objects(std::map<std::string, GCTestObject*>& objects)
+	{
+		std::map<std::string, GCTestObjectPtr> ptrs;
+		for(const char* name : {"root", "child", "dropped", "dropped2", "b", "b2", "moved", "d", "d2", "e", "e2", "g", "g2"}) {
+			ptrs[name].reset(new GCTestObject(name));
+			objects[name] = ptrs[name].get();
+		}
+
+		auto link = [&ptrs](const char* from, const char* to) {
+			ptrs[from]->refs.push_back(ptrs[to]);
+		};
+
+		link("root", "child");
+		link("child", "root");
+		link("root", "dropped");
+		link("dropped", "dropped2");
+		link("dropped2", "dropped");
+		link("b", "b2");
+		link("b2", "b");
+		link("b", "moved");
+		link("d", "d2");
+		link("d2", "d");
+		link("e", "e2");
+		link("e2", "e");
+		link("g", "g2");
+		link("g2", "g");
+
+		return ptrs["root"];
+	}
+
+	//changes which objects are garbage, as the game might while a
+	//collection is in progress.
+	void change_gc_test_objects(std::map<std::string, GCTestObject*>& objects, std::vector<GCTestObjectPtr>& held)
+	{
+		GCTestObject* root = objects["root"];
+
+		//a reference moves from garbage to a live object.
+		root->refs.push_back(GCTestObjectPtr(objects["moved"]));
+		objects["b"]->refs.pop_back();
+
+		//a live object is dropped, making garbage.
+		root->refs.erase(std::remove_if(root->refs.begin(), root->refs.end(), [](const GCTestObjectPtr& p) { return p->name() == "dropped"; }), root->refs.end());
+
+		//garbage is referenced from outside again.
+		held.push_back(GCTestObjectPtr(objects["d"]));
+
+		//a new object refers to garbage.
+		GCTestObjectPtr created(new GCTestObject("created"));
+		created->refs.push_back(GCTestObjectPtr(objects["e"]));
+		held.push_back(created);
+	}
+}
+
+UNIT_TEST(incremental_gc_matches_full_collection)
+{
+	//collect everything else first, so the only objects which haven't
+	//survived a collection are the test's.
+	runGarbageCollection();
+	CHECK(GCTestObject::liveObjects().empty(), "Test objects left over");
+
+	std::set<std::string> full_survivors;
+	{
+		std::map<std::string, GCTestObject*> objects;
+		GCTestObjectPtr root = create_gc_test_objects(objects);
+		std::vector<GCTestObjectPtr> held;
+		change_gc_test_objects(objects, held);
+
+		runGarbageCollection();
+		full_survivors = GCTestObject::liveObjects();
+
+		root.reset();
+		held.clear();
+		runGarbageCollection();
+		CHECK(GCTestObject::liveObjects().empty(), "Test objects left over");
+	}
+
+	//the references the incremental collector records go stale when the
+	//objects change part way through the cycle, and these numbers of
+	//slices put the change in each of its phases.
+	for(int change_after : {0, 1, 5, 10, 20, 30, 40, 60, 80}) {
+		std::map<std::string, GCTestObject*> objects;
+		GCTestObjectPtr root = create_gc_test_objects(objects);
+		std::vector<GCTestObjectPtr> held;
+
+		//only considers objects which haven't survived a collection.
+		IncrementalGarbageCollector* gc = new IncrementalGarbageCollector(1);
+		setIncrementalGarbageCollector(gc);
+		bool done = false;
+		for(int n = 0; !done; ++n) {
+			if(n == change_after) {
+				change_gc_test_objects(objects, held);
+			}
+
+			done = gc->step(0, 1);
+		}
+
+		setIncrementalGarbageCollector(nullptr);
+
+		if(held.empty()) {
+			//the cycle finished first.
+			CHECK(GCTestObject::liveObjects() == std::set<std::string>({"root", "child", "dropped", "dropped2"}), "Incremental collection kept garbage or freed live objects");
+		} else {
+			//anything which became garbage during the cycle may survive
+			//until the next one, but nothing else differs from a full
+			//collection.
+			std::set<std::string> live = GCTestObject::liveObjects();
+			live.insert("dropped");
+			live.insert("dropped2");
+			std::set<std::string> expected = full_survivors;
+			expected.insert("dropped");
+			expected.insert("dropped2");
+			CHECK(live == expected, "Incremental collection with changes after " << change_after << " slices kept garbage or freed live objects");
+
+			gc = new IncrementalGarbageCollector(-1);
+			setIncrementalGarbageCollector(gc);
+			while(!gc->step(0, 64)) {
+			}
+
+			setIncrementalGarbageCollector(nullptr);
+			CHECK(GCTestObject::liveObjects() == full_survivors, "Garbage made during an incremental collection wasn't collected by the next");
+		}
+
+		root.reset();
+		held.clear();
+		runGarbageCollection();
+		CHECK(GCTestObject::liveObjects().empty(), "Test objects left over");
+	}
+}
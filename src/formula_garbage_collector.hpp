@@ -32,6 +32,7 @@ public:
 
 	friend class GarbageCollectorImpl;
 	friend class GarbageCollectorAnalyzer;
+	friend class IncrementalGarbageCollector;
 
 #ifdef DEBUG_GARBAGE_COLLECTOR
 	void* operator new(size_t sz);
@@ -64,4 +65,8 @@ private:
 
 void runGarbageCollection(int num_gens=-1, bool mandatory=true);
 void reapGarbageCollection();
+
+//does up to budget_us microseconds of work towards an incremental
+//collection, starting a new cycle if enough objects have been allocated.
+void runIncrementalGarbageCollection(int budget_us);
 void runGarbageCollectionDebug(const char* fname);
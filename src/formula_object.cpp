@@ -35,6 +35,7 @@
 #include "custom_object_functions.hpp"
 #include "filesystem.hpp"
 #include "formula.hpp"
+#include "formula_bytecode_cache.hpp"
 #include "formula_callable.hpp"
 #include "formula_callable_definition.hpp"
 #include "formula_object.hpp"
@@ -524,7 +525,10 @@ std::map<std::string, std::string>& class_path_map()
 			return itor->second;
 		}
 
-		FormulaClassDefinition* def = new FormulaClassDefinition(name, get_class_node(name));
+		const variant node = get_class_node(name);
+		const formula_bytecode_cache::Scope bytecode_cache_scope("class_definition:" + name, node);
+
+		FormulaClassDefinition* def = new FormulaClassDefinition(name, node);
 		class_definitions[name].reset(def);
 		def->init();
 
@@ -951,6 +955,7 @@ std::map<std::string, std::string>& class_path_map()
 
 			record_classes(type, v);
 
+			const formula_bytecode_cache::Scope bytecode_cache_scope("class:" + type, v);
 			ffl::IntrusivePtr<FormulaClass> result(new FormulaClass(type, v));
 			result->setName(type);
 			return result;
@@ -1918,6 +1923,8 @@ void FormulaObject::mapObjectIntoDifferentTree(variant& v, const std::map<Formul
 	void invalidate_class_definition(const std::string& name)
 	{
 		LOG_DEBUG("INVALIDATE CLASS: " << name);
+		formula_bytecode_cache::invalidate();
+
 		for(auto i = class_node_map.begin(); i != class_node_map.end(); ) {
 			const std::string& class_name = i->first;
 			std::string::const_iterator dot = std::find(class_name.begin(), class_name.end(), '.');
@@ -28,6 +28,8 @@
 #include <SDL2/SDL_thread.h>
 #include <SDL2/SDL_timer.h>
 
+#include <algorithm>
+#include <chrono>
 #include <assert.h>
 #include <iostream>
 #include <map>
@@ -56,6 +58,7 @@
 #include "preferences.hpp"
 #include "sound.hpp"
 #include "sys.hpp"
+#include "task_scheduler.hpp"
 #include "unit_test.hpp"
 #include "variant.hpp"
 #include "widget.hpp"
@@ -986,7 +989,7 @@ public:
 		{
 		sound::MemoryUsageInfo status = sound::get_memory_usage_info();
 		frames_.back().num_sound = status.nsounds_cached;
-		frames_.back().sound_usage = status.cache_usage/1024;
+		frames_.back().sound_usage = (status.cache_usage + status.stream_usage)/1024;
 		frames_.back().max_sound = status.max_cache_usage/1024;
 		}
 
@@ -1094,6 +1097,9 @@ namespace formula_profiler
 	{
 		t_ = SDL_GetPerformanceCounter();
 		if(profiler_on) {
+			//the instrumentation records aren't thread safe, so an
+			//isolated evaluation has to be redone on the main thread.
+			game_logic::Formula::failIfIsolatedContext();
 			if(g_profiler_widget) {
 				g_profiler_widget->beginInstrument(id, t_, formula ? formula->strVal() : variant());
 			}
@@ -1103,6 +1109,7 @@ namespace formula_profiler
 	void Instrument::init(const char* id, variant info)
 	{
 		if(profiler_on) {
+			game_logic::Formula::failIfIsolatedContext();
 			id_ = id;
 			if(g_profiler_widget) {
 				g_profiler_widget->beginInstrument(id, SDL_GetPerformanceCounter(), info);
@@ -1136,6 +1143,101 @@ namespace formula_profiler
 		return tsc_to_ns(end_t) - tsc_to_ns(t_);
 	}
 
+	namespace
+	{
+		//upper bounds of the buckets GC pauses are counted in. Anything
+		//longer goes in a final bucket.
+		const int GCPauseBuckets[] = { 100, 250, 500, 1000, 2000, 5000, 10000, 20000 };
+		const int NumGCPauseBuckets = sizeof(GCPauseBuckets)/sizeof(*GCPauseBuckets);
+
+		struct GCPauseHistogram
+		{
+			GCPauseHistogram() : count(0), total_us(0), max_us(0) {
+				memset(buckets, 0, sizeof(buckets));
+			}
+
+			void add(int time_us) {
+				int n = 0;
+				while(n != NumGCPauseBuckets && time_us >= GCPauseBuckets[n]) {
+					++n;
+				}
+
+				buckets[n]++;
+				count++;
+				total_us += time_us;
+				max_us = std::max(max_us, time_us);
+			}
+
+			std::string summary() const {
+				if(count == 0) {
+					return "";
+				}
+
+				std::ostringstream s;
+				s << "GC PAUSES: " << count << " totalling " << total_us << "us; mean " << (total_us/count) << "us; max " << max_us << "us;";
+				for(int n = 0; n <= NumGCPauseBuckets; ++n) {
+					if(buckets[n] == 0) {
+						continue;
+					}
+
+					if(n == NumGCPauseBuckets) {
+						s << " >=" << GCPauseBuckets[n-1] << "us: " << buckets[n] << ";";
+					} else {
+						s << " <" << GCPauseBuckets[n] << "us: " << buckets[n] << ";";
+					}
+				}
+
+				return s.str();
+			}
+
+			int buckets[NumGCPauseBuckets+1];
+			int count;
+			int64_t total_us;
+			int max_us;
+		};
+
+		GCPauseHistogram g_gc_pauses;
+	}
+
+	void record_gc_pause(int time_us)
+	{
+		g_gc_pauses.add(time_us);
+	}
+
+	std::string get_gc_pause_summary()
+	{
+		return g_gc_pauses.summary();
+	}
+
+	std::string get_task_worker_summary()
+	{
+		static std::vector<task_scheduler::WorkerStats> prev_stats;
+		static uint64_t prev_time_ns = 0;
+
+		const std::vector<task_scheduler::WorkerStats> stats = task_scheduler::getWorkerStats();
+		const uint64_t time_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+		const uint64_t elapsed_ns = time_ns - prev_time_ns;
+
+		std::ostringstream s;
+		if(prev_time_ns != 0 && elapsed_ns > 0 && stats.empty() == false) {
+			s << "TASK WORKERS: ";
+			for(int n = 0; n != static_cast<int>(stats.size()); ++n) {
+				task_scheduler::WorkerStats delta = stats[n];
+				if(n < static_cast<int>(prev_stats.size())) {
+					delta.busy_ns -= prev_stats[n].busy_ns;
+					delta.tasks_run -= prev_stats[n].tasks_run;
+					delta.tasks_stolen -= prev_stats[n].tasks_stolen;
+				}
+
+				s << n << ": " << (100*delta.busy_ns)/elapsed_ns << "% busy, " << delta.tasks_run << " tasks (" << delta.tasks_stolen << " stolen); ";
+			}
+		}
+
+		prev_stats = stats;
+		prev_time_ns = time_ns;
+		return s.str();
+	}
+
 	void dump_instrumentation()
 	{
 		static struct timeval prev_call;
@@ -1156,6 +1258,16 @@ namespace formula_profiler
 				LOG_INFO(ss.str());
 			}
 
+			const std::string gc_summary = get_gc_pause_summary();
+			if(gc_summary.empty() == false) {
+				LOG_INFO(gc_summary);
+			}
+
+			const std::string worker_summary = get_task_worker_summary();
+			if(worker_summary.empty() == false) {
+				LOG_INFO(worker_summary);
+			}
+
 			g_instrumentation.clear();
 		}
 
@@ -1416,6 +1528,9 @@ namespace formula_profiler
 				s << (100*cum_sorted_samples[n].first)/total_expr_samples << "% (" << cum_sorted_samples[n].first << ") " << cum_sorted_samples[n].second << "\n";
 			}
 
+			s << "\n\n" << get_gc_pause_summary() << "\n";
+			s << get_task_worker_summary() << "\n";
+
 			if(!output_fname.empty()) {
 				sys::write_file(output_fname, s.str());
 				LOG_INFO("WROTE PROFILE TO " << output_fname);
@@ -76,6 +76,10 @@ namespace formula_profiler
 	};
 
 	inline std::string get_profile_summary() { return ""; }
+
+	inline void record_gc_pause(int time_us) {}
+	inline std::string get_gc_pause_summary() { return ""; }
+	inline std::string get_task_worker_summary() { return ""; }
 }
 
 #else
@@ -158,6 +162,14 @@ namespace formula_profiler
 	};
 
 	std::string get_profile_summary();
+
+	//records how long the game was stopped for one garbage collection
+	//step, so the distribution of pauses can be reported.
+	void record_gc_pause(int time_us);
+	std::string get_gc_pause_summary();
+
+	//how busy each task scheduler worker has been since the last call.
+	std::string get_task_worker_summary();
 }
 
 #endif
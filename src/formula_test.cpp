@@ -157,3 +157,73 @@ BENCHMARK_ARG_CALL(formula, array_str, "['stand', 'walk', 'run', 'jump']");
 BENCHMARK_ARG_CALL(formula, string, "'blah'");
 BENCHMARK_ARG_CALL(formula, null_function, "null()");
 BENCHMARK_ARG_CALL(formula, if_function, "if(4 > 5, 7, 8)");
+BENCHMARK_ARG_CALL(formula, map_small, "{'a': 1, 'b': 2, 'c': 3}");
+BENCHMARK_ARG_CALL(formula, map_large, "{'a': 1, 'b': 2, 'c': 3, 'd': 4, 'e': 5, 'f': 6, 'g': 7, 'h': 8, 'i': 9, 'j': 10, 'k': 11, 'l': 12}");
+BENCHMARK_ARG_CALL(formula, map_lookup, "m.l + m.a where m = {'a': 1, 'b': 2, 'c': 3, 'd': 4, 'e': 5, 'f': 6, 'g': 7, 'h': 8, 'i': 9, 'j': 10, 'k': 11, 'l': 12}");
+BENCHMARK_ARG_CALL(formula, typed_arithmetic, "f(char.strength, char.agility) where f = def(int a, int b) -> int (a + 1)*(b - 2) - a*b");
+BENCHMARK_ARG_CALL(formula, typed_compare_branch, "f(char.strength, char.agility) where f = def(int a, int b) -> int if(a > b, a - b, b - a)");
+BENCHMARK_ARG_CALL(formula, constant_fold, "(5 + 4)*17 + 12*9 - char.strength");
+BENCHMARK_ARG_CALL(formula, dot_lookup, "char.strength + char.agility");
+
+namespace {
+	std::vector<variant> make_map_keys(int nkeys)
+	{
+		std::vector<variant> keys;
+		for(int n = 0; n != nkeys; ++n) {
+			keys.emplace_back("attribute_" + std::to_string(n));
+		}
+		return keys;
+	}
+
+	variant make_map(const std::vector<variant>& keys)
+	{
+		std::map<variant,variant> m;
+		for(int n = 0; n != static_cast<int>(keys.size()); ++n) {
+			m[keys[n]] = variant(n);
+		}
+		return variant(&m);
+	}
+}
+
+BENCHMARK_ARG(map_construct, int nkeys)
+{
+	const std::vector<variant> keys = make_map_keys(nkeys);
+	BENCHMARK_LOOP {
+		make_map(keys);
+	}
+}
+
+BENCHMARK_ARG_CALL(map_construct, construct_keys_4, 4);
+BENCHMARK_ARG_CALL(map_construct, construct_keys_16, 16);
+BENCHMARK_ARG_CALL(map_construct, construct_keys_256, 256);
+
+BENCHMARK_ARG(map_lookup, int nkeys)
+{
+	const std::vector<variant> keys = make_map_keys(nkeys);
+	const variant m = make_map(keys);
+	BENCHMARK_LOOP {
+		for(const variant& key : keys) {
+			m[key];
+		}
+	}
+}
+
+BENCHMARK_ARG_CALL(map_lookup, lookup_keys_4, 4);
+BENCHMARK_ARG_CALL(map_lookup, lookup_keys_16, 16);
+BENCHMARK_ARG_CALL(map_lookup, lookup_keys_256, 256);
+
+BENCHMARK_ARG(map_tree_lookup, int nkeys)
+{
+	//the same lookups going directly to the tree, without the index.
+	const std::vector<variant> keys = make_map_keys(nkeys);
+	const variant m = make_map(keys);
+	BENCHMARK_LOOP {
+		for(const variant& key : keys) {
+			m.as_map().find(key);
+		}
+	}
+}
+
+BENCHMARK_ARG_CALL(map_tree_lookup, tree_keys_4, 4);
+BENCHMARK_ARG_CALL(map_tree_lookup, tree_keys_16, 16);
+BENCHMARK_ARG_CALL(map_tree_lookup, tree_keys_256, 256);
@@ -1,9 +1,12 @@
+#include <algorithm>
+#include <cstring>
 #include <limits>
 #include <sstream>
 #include <vector>
 
 #include "asserts.hpp"
 #include "formula.hpp"
+#include "formula_bytecode_cache.hpp"
 #include "formula_function.hpp"
 #include "formula_function_registry.hpp"
 #include "formula_interface.hpp"
@@ -43,7 +46,7 @@ static bool incrementVec(std::vector<int>& v, const std::vector<int>& max_values
 	return false;
 }
 
-int g_vmDepth = 0;
+thread_local int g_vmDepth = 0;
 
 struct VMOverflowGuard {
 	VMOverflowGuard() {
@@ -244,6 +247,201 @@ void VirtualMachine::executeInternal(const FormulaCallable& variables, std::vect
 			break;
 		}
 
+		//the specialized operators check their operands really are of the
+		//expected type since the static type of an expression isn't a
+		//guarantee in code which isn't strictly checked.
+		case OP_ADD_INT: {
+			variant& left = stack[stack.size()-2];
+			const variant& right = stack.back();
+			if(left.is_int() && right.is_int()) {
+				left.int_addr() += right.as_int();
+			} else {
+				left = left + right;
+			}
+			stack.pop_back();
+			break;
+		}
+
+		case OP_SUB_INT: {
+			variant& left = stack[stack.size()-2];
+			const variant& right = stack.back();
+			if(left.is_int() && right.is_int()) {
+				left.int_addr() -= right.as_int();
+			} else {
+				left = left - right;
+			}
+			stack.pop_back();
+			break;
+		}
+
+		case OP_MUL_INT: {
+			variant& left = stack[stack.size()-2];
+			const variant& right = stack.back();
+			if(left.is_int() && right.is_int()) {
+				left.int_addr() *= right.as_int();
+			} else {
+				left = left * right;
+			}
+			stack.pop_back();
+			break;
+		}
+
+		case OP_LT_INT: {
+			variant& left = stack[stack.size()-2];
+			const variant& right = stack.back();
+			if(left.is_int() && right.is_int()) {
+				left = variant::from_bool(left.as_int() < right.as_int());
+			} else {
+				left = variant::from_bool(left < right);
+			}
+			stack.pop_back();
+			break;
+		}
+
+		case OP_LTE_INT: {
+			variant& left = stack[stack.size()-2];
+			const variant& right = stack.back();
+			if(left.is_int() && right.is_int()) {
+				left = variant::from_bool(left.as_int() <= right.as_int());
+			} else {
+				left = variant::from_bool(left <= right);
+			}
+			stack.pop_back();
+			break;
+		}
+
+		case OP_GT_INT: {
+			variant& left = stack[stack.size()-2];
+			const variant& right = stack.back();
+			if(left.is_int() && right.is_int()) {
+				left = variant::from_bool(left.as_int() > right.as_int());
+			} else {
+				left = variant::from_bool(left > right);
+			}
+			stack.pop_back();
+			break;
+		}
+
+		case OP_GTE_INT: {
+			variant& left = stack[stack.size()-2];
+			const variant& right = stack.back();
+			if(left.is_int() && right.is_int()) {
+				left = variant::from_bool(left.as_int() >= right.as_int());
+			} else {
+				left = variant::from_bool(left >= right);
+			}
+			stack.pop_back();
+			break;
+		}
+
+		case OP_EQ_INT: {
+			variant& left = stack[stack.size()-2];
+			const variant& right = stack.back();
+			if(left.is_int() && right.is_int()) {
+				left = variant::from_bool(left.as_int() == right.as_int());
+			} else {
+				left = variant::from_bool(left == right);
+			}
+			stack.pop_back();
+			break;
+		}
+
+		case OP_NEQ_INT: {
+			variant& left = stack[stack.size()-2];
+			const variant& right = stack.back();
+			if(left.is_int() && right.is_int()) {
+				left = variant::from_bool(left.as_int() != right.as_int());
+			} else {
+				left = variant::from_bool(left != right);
+			}
+			stack.pop_back();
+			break;
+		}
+
+		case OP_ADD_DECIMAL: {
+			variant& left = stack[stack.size()-2];
+			const variant& right = stack.back();
+			if(left.is_decimal() && right.is_decimal()) {
+				left = variant(left.as_decimal() + right.as_decimal());
+			} else {
+				left = left + right;
+			}
+			stack.pop_back();
+			break;
+		}
+
+		case OP_SUB_DECIMAL: {
+			variant& left = stack[stack.size()-2];
+			const variant& right = stack.back();
+			if(left.is_decimal() && right.is_decimal()) {
+				left = variant(left.as_decimal() - right.as_decimal());
+			} else {
+				left = left - right;
+			}
+			stack.pop_back();
+			break;
+		}
+
+		case OP_MUL_DECIMAL: {
+			variant& left = stack[stack.size()-2];
+			const variant& right = stack.back();
+			if(left.is_decimal() && right.is_decimal()) {
+				left = variant(left.as_decimal() * right.as_decimal());
+			} else {
+				left = left * right;
+			}
+			stack.pop_back();
+			break;
+		}
+
+		case OP_LT_DECIMAL: {
+			variant& left = stack[stack.size()-2];
+			const variant& right = stack.back();
+			if(left.is_decimal() && right.is_decimal()) {
+				left = variant::from_bool(left.as_decimal() < right.as_decimal());
+			} else {
+				left = variant::from_bool(left < right);
+			}
+			stack.pop_back();
+			break;
+		}
+
+		case OP_LTE_DECIMAL: {
+			variant& left = stack[stack.size()-2];
+			const variant& right = stack.back();
+			if(left.is_decimal() && right.is_decimal()) {
+				left = variant::from_bool(left.as_decimal() <= right.as_decimal());
+			} else {
+				left = variant::from_bool(left <= right);
+			}
+			stack.pop_back();
+			break;
+		}
+
+		case OP_GT_DECIMAL: {
+			variant& left = stack[stack.size()-2];
+			const variant& right = stack.back();
+			if(left.is_decimal() && right.is_decimal()) {
+				left = variant::from_bool(left.as_decimal() > right.as_decimal());
+			} else {
+				left = variant::from_bool(left > right);
+			}
+			stack.pop_back();
+			break;
+		}
+
+		case OP_GTE_DECIMAL: {
+			variant& left = stack[stack.size()-2];
+			const variant& right = stack.back();
+			if(left.is_decimal() && right.is_decimal()) {
+				left = variant::from_bool(left.as_decimal() >= right.as_decimal());
+			} else {
+				left = variant::from_bool(left >= right);
+			}
+			stack.pop_back();
+			break;
+		}
+
 		case OP_UNARY_NOT: {
 			stack.back() = stack.back().as_bool() ? variant::from_bool(false) : variant::from_bool(true);
 			break;
@@ -273,6 +471,16 @@ void VirtualMachine::executeInternal(const FormulaCallable& variables, std::vect
 			break;
 		}
 
+		case OP_INCREMENT_INT: {
+			variant& v = stack.back();
+			if(v.is_int()) {
+				++v.int_addr();
+			} else {
+				v = v + variant(1);
+			}
+			break;
+		}
+
 		case OP_LOOKUP: {
 			//std::cerr << "LOOKUP...\n"  << debugPinpointLocation(p, stack) << "\n";
 			const FormulaCallable& vars = variables_stack.empty() ? variables : *variables_stack.back();
@@ -288,6 +496,15 @@ void VirtualMachine::executeInternal(const FormulaCallable& variables, std::vect
 			break;
 		}
 
+		case OP_LOOKUP_STR_CONSTANT: {
+			const FormulaCallable& vars = variables_stack.empty() ? variables : *variables_stack.back();
+			++p;
+			const std::string& key = constants_[*p].as_string();
+			game_logic::LookupCache* cache = getLookupCache(*p);
+			stack.push_back(cache ? vars.queryValueCached(key, *cache) : vars.queryValue(key));
+			break;
+		}
+
 		case OP_INDEX: {
 			variant& left = stack[stack.size()-2];
 			variant& right = stack[stack.size()-1];
@@ -320,51 +537,25 @@ void VirtualMachine::executeInternal(const FormulaCallable& variables, std::vect
 
 		case OP_INDEX_STR: {
 			variant& left = stack[stack.size()-2];
-			variant& right = stack[stack.size()-1];
-
-			if(left.is_callable()) {
-				variant result = left.as_callable()->queryValue(right.as_string());
-				left = result;
-			} else if(left.is_map()) {
-				variant result = left[right];
-				left = result;
-			}
-			else if (left.is_list() && !right.is_string()) {
-				variant result = left[right];
-				left = result;
-			}
-			else if (left.is_list()) {
-				const std::string& s = right.as_string();
-				int index;
-				if (s == "x" || s == "r") {
-					index = 0;
-				}
-				else if (s == "y" || s == "g") {
-					index = 1;
-				}
-				else if (s == "z" || s == "b") {
-					index = 2;
-				}
-				else if (s == "a") {
-					index = 3;
-				}
-				else {
-					ASSERT_LOG(false, "Illegal string lookup on list: " << s << ": " << debugPinpointLocation(p, stack));
-				}
+			variant result = indexByString(left, stack.back(), p, stack);
+			left = result;
+			stack.pop_back();
+			break;
+		}
 
-				variant result = left[index];
-				left = result;
-			}
-			else if (left.is_string()) {
-				const std::string& s = left.as_string();
-				unsigned int index = right.as_int();
-				ASSERT_LOG(index < s.length(), "index outside bounds: " << s << "[" << index << "]'\n'"  << debugPinpointLocation(p, stack));
-				left = variant(s.substr(index, 1));
+		case OP_INDEX_STR_CONSTANT: {
+			++p;
+			variant& left = stack.back();
+			variant result = indexByString(left, constants_[*p], p, stack, getLookupCache(*p));
+			left = result;
+			break;
+		}
 
-			} else {
-				ASSERT_LOG(false, "Illegal lookup in bytecode: " << left.to_debug_string() << " indexed by " << right.to_debug_string() << " expected map or object");
-			}
-			stack.pop_back();
+		case OP_LOOKUP_INDEX_STR: {
+			const FormulaCallable& vars = variables_stack.empty() ? variables : *variables_stack.back();
+			const variant left = vars.queryValueBySlot(static_cast<int>(*(p+1)));
+			p += 2;
+			stack.push_back(indexByString(left, constants_[*p], p, stack, getLookupCache(*p)));
 			break;
 		}
 
@@ -402,9 +593,7 @@ void VirtualMachine::executeInternal(const FormulaCallable& variables, std::vect
 
 			std::map<variant,variant> res;
 			for(size_t n = stack.size() - nitems; n+1 < stack.size(); n += 2) {
-				variant key = stack[n];
-				variant value = stack[n+1];
-				res[key] = value;
+				res[std::move(stack[n])] = std::move(stack[n+1]);
 			}
 
 			variant result(&res);
@@ -987,6 +1176,17 @@ void VirtualMachine::executeInternal(const FormulaCallable& variables, std::vect
 			break;
 		}
 
+		case OP_POP_JMP_IF_BOOL:
+		case OP_POP_JMP_UNLESS_BOOL: {
+			if(stack.back().as_bool_unsafe() == (*p == OP_POP_JMP_IF_BOOL)) {
+				p += *(p+1);
+			} else {
+				++p;
+			}
+			stack.pop_back();
+			break;
+		}
+
 		case OP_JMP: {
 			p += *(p+1);
 			break;
@@ -1027,6 +1227,53 @@ void VirtualMachine::executeInternal(const FormulaCallable& variables, std::vect
 	}
 }
 
+variant VirtualMachine::indexByString(const variant& left, const variant& right, const InstructionType* p, const std::vector<variant>& stack, game_logic::LookupCache* cache) const
+{
+	if(left.is_callable()) {
+		if(cache) {
+			return left.as_callable()->queryValueCached(right.as_string(), *cache);
+		}
+		return left.as_callable()->queryValue(right.as_string());
+	} else if(left.is_map()) {
+		return left[right];
+	}
+	else if (left.is_list() && !right.is_string()) {
+		return left[right];
+	}
+	else if (left.is_list()) {
+		const std::string& s = right.as_string();
+		int index;
+		if (s == "x" || s == "r") {
+			index = 0;
+		}
+		else if (s == "y" || s == "g") {
+			index = 1;
+		}
+		else if (s == "z" || s == "b") {
+			index = 2;
+		}
+		else if (s == "a") {
+			index = 3;
+		}
+		else {
+			ASSERT_LOG(false, "Illegal string lookup on list: " << s << ": " << debugPinpointLocation(p, stack));
+		}
+
+		return left[index];
+	}
+	else if (left.is_string()) {
+		const std::string& s = left.as_string();
+		unsigned int index = right.as_int();
+		ASSERT_LOG(index < s.length(), "index outside bounds: " << s << "[" << index << "]'\n'"  << debugPinpointLocation(p, stack));
+		return variant(s.substr(index, 1));
+
+	} else {
+		ASSERT_LOG(false, "Illegal lookup in bytecode: " << left.to_debug_string() << " indexed by " << right.to_debug_string() << " expected map or object");
+	}
+
+	return variant();
+}
+
 void VirtualMachine::replaceInstructions(Iterator i1, Iterator i2, const std::vector<InstructionType>& new_instructions)
 {
 	const int diff = static_cast<int>(new_instructions.size()) - (static_cast<int>(i2.get_index()) - static_cast<int>(i1.get_index()));
@@ -1135,7 +1382,7 @@ void VirtualMachine::addJumpToPosition(InstructionType i, int pos)
 }
 
 namespace {
-	VirtualMachine::InstructionType g_arg_instructions[] = { OP_LOOKUP, OP_JMP_IF, OP_JMP, OP_JMP_UNLESS, OP_POP_JMP_IF, OP_POP_JMP_UNLESS, OP_CALL, OP_CALL_BUILTIN, OP_CALL_BUILTIN_DYNAMIC, OP_ALGO_MAP, OP_ALGO_FILTER, OP_ALGO_FIND, OP_ALGO_COMPREHENSION, OP_UNDER, OP_PUSH_INT, OP_LOOKUP_SYMBOL_STACK, OP_WHERE, OP_INLINE_FUNCTION, OP_CONSTANT };
+	VirtualMachine::InstructionType g_arg_instructions[] = { OP_LOOKUP, OP_JMP_IF, OP_JMP, OP_JMP_UNLESS, OP_POP_JMP_IF, OP_POP_JMP_UNLESS, OP_CALL, OP_CALL_BUILTIN, OP_CALL_BUILTIN_DYNAMIC, OP_ALGO_MAP, OP_ALGO_FILTER, OP_ALGO_FIND, OP_ALGO_COMPREHENSION, OP_UNDER, OP_PUSH_INT, OP_LOOKUP_SYMBOL_STACK, OP_WHERE, OP_INLINE_FUNCTION, OP_CONSTANT, OP_POP_JMP_IF_BOOL, OP_POP_JMP_UNLESS_BOOL, OP_INDEX_STR_CONSTANT, OP_LOOKUP_STR_CONSTANT };
 }
 
 void VirtualMachine::append(const VirtualMachine& other)
@@ -1163,28 +1410,23 @@ void VirtualMachine::append(const VirtualMachine& other)
 	}
 
 	for(size_t i = 0; i < other.instructions_.size(); ++i) {
-		instructions_.push_back(other.instructions_[i]);
-		if(instructions_.back() == OP_CONSTANT) {
-			++i;
+		const InstructionType op = other.instructions_[i];
+		instructions_.push_back(op);
 
-			auto mapping = map_constants.find(static_cast<int>(other.instructions_[i]));
-			if(mapping != map_constants.end()) {
-				instructions_.push_back(mapping->second);
-			} else {
-				instructions_.push_back(constants_.size() + other.instructions_[i]);
-			}
-		} else {
+		//the argument, if any, which refers to a constant.
+		const int constant_arg = op == OP_LOOKUP_INDEX_STR ? 1 : (op == OP_CONSTANT || op == OP_INDEX_STR_CONSTANT || op == OP_LOOKUP_STR_CONSTANT ? 0 : -1);
 
-			bool need_skip = false;
-			for(auto in : g_arg_instructions) {
-				if(in == instructions_.back()) {
-					need_skip = true;
-					break;
+		const int nargs = getNumArgs(op);
+		for(int n = 0; n != nargs; ++n) {
+			++i;
+			if(n == constant_arg) {
+				auto mapping = map_constants.find(static_cast<int>(other.instructions_[i]));
+				if(mapping != map_constants.end()) {
+					instructions_.push_back(mapping->second);
+				} else {
+					instructions_.push_back(constants_.size() + other.instructions_[i]);
 				}
-			}
-
-			if(need_skip) {
-				++i;
+			} else {
 				instructions_.push_back(other.instructions_[i]);
 			}
 		}
@@ -1205,6 +1447,484 @@ void VirtualMachine::append(Iterator i1, Iterator i2, const VirtualMachine& othe
 
 namespace {
 
+//an instruction decoded for the peephole optimizer. Jumps refer to the
+//instruction they go to by index so instructions can be removed without
+//fixing up offsets until the code is encoded again.
+struct PeepholeInstruction
+{
+	VirtualMachine::InstructionType op;
+	VirtualMachine::InstructionType args[2];
+	int nargs;
+
+	//for jumps and loops, the index of the instruction jumped to.
+	int target;
+
+	//position of the instruction in the original code.
+	int pos;
+
+	bool removed;
+};
+
+typedef std::vector<PeepholeInstruction> PeepholeCode;
+
+const int MaxPeepholePasses = 8;
+const int MaxJumpThreadingHops = 8;
+
+PeepholeInstruction make_instruction(VirtualMachine::InstructionType op, int pos)
+{
+	PeepholeInstruction result;
+	result.op = op;
+	result.args[0] = result.args[1] = 0;
+	result.nargs = VirtualMachine::getNumArgs(op);
+	result.target = -1;
+	result.pos = pos;
+	result.removed = false;
+	return result;
+}
+
+//drops removed instructions. Anything which jumped to a removed
+//instruction goes to the next remaining one instead.
+void compact_code(PeepholeCode& code)
+{
+	std::vector<int> new_index(code.size()+1);
+	int nremaining = 0;
+	for(size_t n = 0; n != code.size(); ++n) {
+		new_index[n] = nremaining;
+		if(!code[n].removed) {
+			++nremaining;
+		}
+	}
+
+	new_index.back() = nremaining;
+
+	PeepholeCode result;
+	result.reserve(nremaining);
+	for(const PeepholeInstruction& in : code) {
+		if(!in.removed) {
+			result.push_back(in);
+			if(in.target >= 0) {
+				result.back().target = new_index[in.target];
+			}
+		}
+	}
+
+	code.swap(result);
+}
+
+std::vector<int> count_jump_targets(const PeepholeCode& code)
+{
+	std::vector<int> result(code.size()+1);
+	for(const PeepholeInstruction& in : code) {
+		if(in.target >= 0) {
+			++result[in.target];
+		}
+	}
+
+	return result;
+}
+
+int next_remaining(const PeepholeCode& code, int n)
+{
+	do {
+		++n;
+	} while(n < static_cast<int>(code.size()) && code[n].removed);
+
+	return n;
+}
+
+bool get_constant(const PeepholeInstruction& in, const std::vector<variant>& constants, variant* result)
+{
+	switch(in.op) {
+	case OP_PUSH_NULL: *result = variant(); return true;
+	case OP_PUSH_0: *result = variant(0); return true;
+	case OP_PUSH_1: *result = variant(1); return true;
+	case OP_PUSH_INT: *result = variant(static_cast<int>(in.args[0])); return true;
+	case OP_CONSTANT: *result = constants[in.args[0]]; return true;
+	default: return false;
+	}
+}
+
+PeepholeInstruction load_constant(const variant& v, std::vector<variant>& constants, int pos)
+{
+	if(v.is_null()) {
+		return make_instruction(OP_PUSH_NULL, pos);
+	}
+
+	if(v.is_int()) {
+		if(v.as_int() == 0) {
+			return make_instruction(OP_PUSH_0, pos);
+		}
+
+		if(v.as_int() == 1) {
+			return make_instruction(OP_PUSH_1, pos);
+		}
+
+		if(v.as_int() <= std::numeric_limits<VirtualMachine::InstructionType>::max() && v.as_int() >= std::numeric_limits<VirtualMachine::InstructionType>::min()) {
+			PeepholeInstruction result = make_instruction(OP_PUSH_INT, pos);
+			result.args[0] = v.as_int();
+			return result;
+		}
+	}
+
+	auto itor = std::find(constants.begin(), constants.end(), v);
+	if(itor == constants.end()) {
+		constants.push_back(v);
+		itor = constants.end()-1;
+	}
+
+	PeepholeInstruction result = make_instruction(OP_CONSTANT, pos);
+	result.args[0] = static_cast<VirtualMachine::InstructionType>(itor - constants.begin());
+	return result;
+}
+
+//constants which can be used as a condition at compile time.
+bool is_simple_constant(const variant& v)
+{
+	return v.is_null() || v.is_bool() || v.is_int() || v.is_decimal();
+}
+
+bool is_bool_result(VirtualMachine::InstructionType op)
+{
+	switch(op) {
+	case OP_IN: case OP_NOT_IN: case OP_NEQ: case OP_LTE: case OP_GTE:
+	case OP_IS: case OP_IS_NOT: case OP_GT: case OP_LT: case OP_EQ:
+	case OP_UNARY_NOT:
+	case OP_LT_INT: case OP_LTE_INT: case OP_GT_INT: case OP_GTE_INT: case OP_EQ_INT: case OP_NEQ_INT:
+	case OP_LT_DECIMAL: case OP_LTE_DECIMAL: case OP_GT_DECIMAL: case OP_GTE_DECIMAL:
+		return true;
+	default:
+		return false;
+	}
+}
+
+bool is_pop_jmp(VirtualMachine::InstructionType op)
+{
+	return op == OP_POP_JMP_IF || op == OP_POP_JMP_UNLESS || op == OP_POP_JMP_IF_BOOL || op == OP_POP_JMP_UNLESS_BOOL;
+}
+
+bool is_pop_jmp_if(VirtualMachine::InstructionType op)
+{
+	return op == OP_POP_JMP_IF || op == OP_POP_JMP_IF_BOOL;
+}
+
+//evaluates a binary operator on numeric constants the way the VM would.
+bool fold_binary_op(VirtualMachine::InstructionType op, const variant& a, const variant& b, variant* result)
+{
+	switch(op) {
+	case OP_ADD: case OP_ADD_INT: case OP_ADD_DECIMAL: *result = a + b; return true;
+	case OP_SUB: case OP_SUB_INT: case OP_SUB_DECIMAL: *result = a - b; return true;
+	case OP_MUL: case OP_MUL_INT: case OP_MUL_DECIMAL: *result = a * b; return true;
+	case OP_LT: case OP_LT_INT: case OP_LT_DECIMAL: *result = variant::from_bool(a < b); return true;
+	case OP_LTE: case OP_LTE_INT: case OP_LTE_DECIMAL: *result = variant::from_bool(a <= b); return true;
+	case OP_GT: case OP_GT_INT: case OP_GT_DECIMAL: *result = variant::from_bool(a > b); return true;
+	case OP_GTE: case OP_GTE_INT: case OP_GTE_DECIMAL: *result = variant::from_bool(a >= b); return true;
+	case OP_EQ: case OP_EQ_INT: *result = variant::from_bool(a == b); return true;
+	case OP_NEQ: case OP_NEQ_INT: *result = variant::from_bool(a != b); return true;
+	default: return false;
+	}
+}
+
+bool fold_constants(PeepholeCode& code, std::vector<variant>& constants)
+{
+	const std::vector<int> targets = count_jump_targets(code);
+	const int ncode = static_cast<int>(code.size());
+
+	//whenever something is folded the same position is looked at again so
+	//that chains of constant operations fold in one pass.
+	bool changed = false;
+	for(int i = 0; i < ncode; ++i) {
+		variant a;
+		if(code[i].removed || !get_constant(code[i], constants, &a)) {
+			continue;
+		}
+
+		const int j = next_remaining(code, i);
+		if(j >= ncode || targets[j]) {
+			continue;
+		}
+
+		const VirtualMachine::InstructionType op = code[j].op;
+		if(op == OP_UNARY_SUB && a.is_numeric()) {
+			code[i] = load_constant(-a, constants, code[i].pos);
+			code[j].removed = true;
+			changed = true;
+			--i;
+			continue;
+		}
+
+		if(op == OP_UNARY_NOT && is_simple_constant(a)) {
+			code[i] = load_constant(variant::from_bool(!a.as_bool()), constants, code[i].pos);
+			code[j].removed = true;
+			changed = true;
+			--i;
+			continue;
+		}
+
+		if(is_pop_jmp(op) && is_simple_constant(a)) {
+			if(a.as_bool() == is_pop_jmp_if(op)) {
+				const int target = code[j].target;
+				code[i] = make_instruction(OP_JMP, code[i].pos);
+				code[i].target = target;
+			} else {
+				code[i].removed = true;
+			}
+
+			code[j].removed = true;
+			changed = true;
+			--i;
+			continue;
+		}
+
+		variant b;
+		const int k = next_remaining(code, j);
+		if(k >= ncode || targets[k] || !get_constant(code[j], constants, &b) || !a.is_numeric() || !b.is_numeric()) {
+			continue;
+		}
+
+		variant result;
+		if(fold_binary_op(code[k].op, a, b, &result)) {
+			code[i] = load_constant(result, constants, code[i].pos);
+			code[j].removed = true;
+			code[k].removed = true;
+			changed = true;
+
+			//the result may fold into what follows it.
+			--i;
+		}
+	}
+
+	return changed;
+}
+
+//replaces common sequences of instructions with single instructions.
+bool fuse_instructions(PeepholeCode& code, const std::vector<variant>& constants)
+{
+	std::vector<int> targets = count_jump_targets(code);
+	const int ncode = static_cast<int>(code.size());
+
+	bool changed = false;
+	for(int i = 0; i < ncode; ++i) {
+		PeepholeInstruction& in = code[i];
+		if(in.removed) {
+			continue;
+		}
+
+		const int j = next_remaining(code, i);
+		if(j >= ncode || targets[j]) {
+			continue;
+		}
+
+		const int k = next_remaining(code, j);
+
+		if(in.op == OP_LOOKUP && code[j].op == OP_CONSTANT && k < ncode && !targets[k] && code[k].op == OP_INDEX_STR) {
+			in.op = OP_LOOKUP_INDEX_STR;
+			in.nargs = 2;
+			in.args[1] = code[j].args[0];
+			code[j].removed = true;
+			code[k].removed = true;
+			changed = true;
+		} else if(in.op == OP_CONSTANT && code[j].op == OP_INDEX_STR) {
+			in.op = OP_INDEX_STR_CONSTANT;
+			code[j].removed = true;
+			changed = true;
+		} else if(in.op == OP_CONSTANT && code[j].op == OP_LOOKUP_STR && constants[in.args[0]].is_string()) {
+			in.op = OP_LOOKUP_STR_CONSTANT;
+			code[j].removed = true;
+			changed = true;
+		} else if(in.op == OP_PUSH_1 && (code[j].op == OP_ADD || code[j].op == OP_ADD_INT)) {
+			in.op = code[j].op == OP_ADD ? OP_INCREMENT : OP_INCREMENT_INT;
+			code[j].removed = true;
+			changed = true;
+		} else if(in.op == OP_UNARY_NOT && is_pop_jmp(code[j].op)) {
+			//anything jumping to the not now goes straight to the inverted
+			//jump, which sees the same value the not would have.
+			code[j].op = is_pop_jmp_if(code[j].op) ? OP_POP_JMP_UNLESS : OP_POP_JMP_IF;
+			in.removed = true;
+			changed = true;
+		} else if((in.op == OP_JMP_IF || in.op == OP_JMP_UNLESS) && code[j].op == OP_POP && in.target < ncode && code[in.target].op == OP_POP) {
+			//both ways the jump can go start by popping the condition, so
+			//do that as part of the jump.
+			in.op = in.op == OP_JMP_IF ? OP_POP_JMP_IF : OP_POP_JMP_UNLESS;
+			in.target = in.target + 1;
+			++targets[in.target];
+			code[j].removed = true;
+			changed = true;
+		} else if(is_bool_result(in.op) && (code[j].op == OP_POP_JMP_IF || code[j].op == OP_POP_JMP_UNLESS)) {
+			code[j].op = code[j].op == OP_POP_JMP_IF ? OP_POP_JMP_IF_BOOL : OP_POP_JMP_UNLESS_BOOL;
+			changed = true;
+		}
+	}
+
+	return changed;
+}
+
+//makes jumps which land on other jumps go straight to where they end up,
+//and removes jumps to the next instruction.
+bool thread_jumps(PeepholeCode& code)
+{
+	const int ncode = static_cast<int>(code.size());
+
+	//jumping to the end of a loop's body ends an iteration, so jumps must
+	//never be threaded past one.
+	std::vector<bool> loop_ends(ncode+1);
+	for(const PeepholeInstruction& in : code) {
+		if(VirtualMachine::isInstructionLoop(in.op)) {
+			loop_ends[in.target] = true;
+		}
+	}
+
+	bool changed = false;
+	for(int i = 0; i < ncode; ++i) {
+		PeepholeInstruction& in = code[i];
+		if(in.removed || in.target < 0 || VirtualMachine::isInstructionLoop(in.op)) {
+			continue;
+		}
+
+		for(int hops = 0; hops != MaxJumpThreadingHops; ++hops) {
+			const int t = in.target;
+			if(t >= ncode || t == i || loop_ends[t]) {
+				break;
+			}
+
+			const VirtualMachine::InstructionType target_op = code[t].op;
+			if(target_op == OP_JMP) {
+				in.target = code[t].target;
+			} else if((in.op == OP_JMP_IF || in.op == OP_JMP_UNLESS) && (target_op == OP_JMP_IF || target_op == OP_JMP_UNLESS)) {
+				//the condition is still on the stack, so we know which way
+				//the jump we land on will go.
+				in.target = target_op == in.op ? code[t].target : t + 1;
+			} else {
+				break;
+			}
+
+			changed = true;
+		}
+
+		if(in.target == i + 1 && (in.op == OP_JMP || in.op == OP_JMP_IF || in.op == OP_JMP_UNLESS)) {
+			in.removed = true;
+			changed = true;
+		}
+	}
+
+	return changed;
+}
+
+//removes instructions following an unconditional jump which nothing
+//jumps to.
+bool remove_unreachable(PeepholeCode& code)
+{
+	const std::vector<int> targets = count_jump_targets(code);
+
+	bool changed = false;
+	bool reachable = true;
+	for(size_t n = 0; n != code.size(); ++n) {
+		if(targets[n]) {
+			reachable = true;
+		}
+
+		if(!reachable) {
+			code[n].removed = true;
+			changed = true;
+		} else if(code[n].op == OP_JMP) {
+			reachable = false;
+		}
+	}
+
+	return changed;
+}
+
+}
+
+void VirtualMachine::optimize()
+{
+	PeepholeCode code;
+	std::vector<int> index_at_pos(instructions_.size()+1, -1);
+	for(Iterator i = begin_itor(); !i.at_end(); i.next()) {
+		PeepholeInstruction in = make_instruction(i.get(), static_cast<int>(i.get_index()));
+		if(in.pos + in.nargs >= static_cast<int>(instructions_.size())) {
+			return;
+		}
+
+		for(int n = 0; n != in.nargs; ++n) {
+			in.args[n] = instructions_[in.pos + 1 + n];
+		}
+
+		index_at_pos[in.pos] = static_cast<int>(code.size());
+		code.push_back(in);
+	}
+
+	index_at_pos.back() = static_cast<int>(code.size());
+
+	for(PeepholeInstruction& in : code) {
+		if(isInstructionJump(in.op)) {
+			const int dst = in.pos + in.args[0] + 1;
+			if(dst < 0 || dst >= static_cast<int>(index_at_pos.size()) || index_at_pos[dst] == -1) {
+				//doesn't land on an instruction, so leave the code alone.
+				return;
+			}
+
+			in.target = index_at_pos[dst];
+		}
+	}
+
+	for(int pass = 0; pass != MaxPeepholePasses; ++pass) {
+		bool changed = fold_constants(code, constants_);
+		compact_code(code);
+
+		if(fuse_instructions(code, constants_)) {
+			changed = true;
+		}
+		compact_code(code);
+
+		if(thread_jumps(code)) {
+			changed = true;
+		}
+		compact_code(code);
+
+		if(remove_unreachable(code)) {
+			changed = true;
+		}
+		compact_code(code);
+
+		if(!changed) {
+			break;
+		}
+	}
+
+	std::vector<int> new_pos(code.size()+1);
+	int pos = 0;
+	for(size_t n = 0; n != code.size(); ++n) {
+		new_pos[n] = pos;
+		pos += 1 + code[n].nargs;
+	}
+
+	new_pos.back() = pos;
+
+	std::vector<InstructionType> instructions;
+	instructions.reserve(pos);
+	for(size_t n = 0; n != code.size(); ++n) {
+		PeepholeInstruction& in = code[n];
+		if(in.target >= 0) {
+			in.args[0] = static_cast<InstructionType>(new_pos[in.target] - new_pos[n] - 1);
+		}
+
+		instructions.push_back(in.op);
+		instructions.insert(instructions.end(), in.args, in.args + in.nargs);
+	}
+
+	for(DebugInfo& info : debug_info_) {
+		//the first remaining instruction at or after where this was.
+		auto itor = std::lower_bound(code.begin(), code.end(), static_cast<int>(info.bytecode_pos), [](const PeepholeInstruction& in, int p) { return in.pos < p; });
+		info.bytecode_pos = new_pos[itor - code.begin()];
+	}
+
+	instructions_.swap(instructions);
+
+	lookup_caches_.assign(constants_.size(), game_logic::LookupCache());
+}
+
+namespace {
+
 const char* getOpName(VirtualMachine::InstructionType op) {
 #define DEF_OP(n) case n: return #n;
 
@@ -1300,6 +2020,21 @@ const char* getOpName(VirtualMachine::InstructionType op) {
 
 
 		  DEF_OP(OP_POW) DEF_OP(OP_DICE)
+
+		  DEF_OP(OP_ADD_INT) DEF_OP(OP_SUB_INT) DEF_OP(OP_MUL_INT)
+		  DEF_OP(OP_LT_INT) DEF_OP(OP_LTE_INT) DEF_OP(OP_GT_INT) DEF_OP(OP_GTE_INT) DEF_OP(OP_EQ_INT) DEF_OP(OP_NEQ_INT)
+		  DEF_OP(OP_ADD_DECIMAL) DEF_OP(OP_SUB_DECIMAL) DEF_OP(OP_MUL_DECIMAL)
+		  DEF_OP(OP_LT_DECIMAL) DEF_OP(OP_LTE_DECIMAL) DEF_OP(OP_GT_DECIMAL) DEF_OP(OP_GTE_DECIMAL)
+
+		  DEF_OP(OP_INCREMENT_INT)
+
+		  DEF_OP(OP_POP_JMP_IF_BOOL) DEF_OP(OP_POP_JMP_UNLESS_BOOL)
+
+		  DEF_OP(OP_INDEX_STR_CONSTANT)
+
+		  DEF_OP(OP_LOOKUP_INDEX_STR)
+
+		  DEF_OP(OP_LOOKUP_STR_CONSTANT)
 		  default:
 		  	return "UNKNOWN";
 	}
@@ -1308,6 +2043,93 @@ const char* getOpName(VirtualMachine::InstructionType op) {
 }
 }
 
+bool VirtualMachine::serialize(std::string* out) const
+{
+	using namespace formula_bytecode_cache;
+
+	std::string result;
+	write_int(static_cast<int>(constants_.size()), &result);
+	for(const variant& v : constants_) {
+		if(!write_plain_variant(v, &result)) {
+			return false;
+		}
+	}
+
+	write_int(static_cast<int>(instructions_.size()), &result);
+	result.append(reinterpret_cast<const char*>(instructions_.data()), instructions_.size()*sizeof(InstructionType));
+
+	write_int(static_cast<int>(debug_info_.size()), &result);
+	for(const DebugInfo& info : debug_info_) {
+		write_int(info.bytecode_pos, &result);
+		write_int(info.formula_pos, &result);
+	}
+
+	*out += result;
+	return true;
+}
+
+bool VirtualMachine::deserialize(const char*& p, const char* end, const variant& parent_formula)
+{
+	using namespace formula_bytecode_cache;
+
+	int nconstants = 0;
+	if(!read_int(p, end, &nconstants) || nconstants < 0) {
+		return false;
+	}
+
+	std::vector<variant> constants(nconstants);
+	for(variant& v : constants) {
+		if(!read_plain_variant(p, end, &v)) {
+			return false;
+		}
+	}
+
+	int ninstructions = 0;
+	if(!read_int(p, end, &ninstructions) || ninstructions < 0 || static_cast<size_t>(end - p) < ninstructions*sizeof(InstructionType)) {
+		return false;
+	}
+
+	std::vector<InstructionType> instructions(ninstructions);
+	memcpy(instructions.data(), p, ninstructions*sizeof(InstructionType));
+	p += ninstructions*sizeof(InstructionType);
+
+	int ndebug_info = 0;
+	if(!read_int(p, end, &ndebug_info) || ndebug_info < 0) {
+		return false;
+	}
+
+	std::vector<DebugInfo> debug_info(ndebug_info);
+	for(DebugInfo& info : debug_info) {
+		int bytecode_pos = 0, formula_pos = 0;
+		if(!read_int(p, end, &bytecode_pos) || !read_int(p, end, &formula_pos)) {
+			return false;
+		}
+
+		info.bytecode_pos = bytecode_pos;
+		info.formula_pos = formula_pos;
+	}
+
+	instructions_.swap(instructions);
+	constants_.swap(constants);
+	debug_info_.swap(debug_info);
+	parent_formula_ = parent_formula;
+	return true;
+}
+
+std::string VirtualMachine::getInstructionSetSignature()
+{
+	std::ostringstream s;
+	//instructions are well below this, leaving plenty of room for more.
+	for(int op = 0; op != 1024; ++op) {
+		const char* name = getOpName(op);
+		if(strcmp(name, "UNKNOWN") != 0) {
+			s << op << ":" << name << ":" << getNumArgs(op) << ";";
+		}
+	}
+
+	return s.str();
+}
+
 std::string VirtualMachine::debugOutput(const VirtualMachine::InstructionType* instruction_ptr) const
 {
 	std::ostringstream s;
@@ -1319,9 +2141,14 @@ std::string VirtualMachine::debugOutput(const VirtualMachine::InstructionType* i
 			s << "   " << n;
 		}
 
-		if(op == OP_CONSTANT) {
-			s << ": OP_CONSTANT ";
+		if(op == OP_CONSTANT || op == OP_INDEX_STR_CONSTANT || op == OP_LOOKUP_INDEX_STR || op == OP_LOOKUP_STR_CONSTANT) {
+			s << ": " << getOpName(op) << " ";
 			++n;
+			if(op == OP_LOOKUP_INDEX_STR) {
+				s << static_cast<int>(instructions_[n]) << " ";
+				++n;
+			}
+
 			if(instructions_[n] < constants_.size()) {
 				std::string j = constants_[instructions_[n]].write_json();
 				if(j.size() > 80) {
@@ -1368,6 +2195,14 @@ std::string VirtualMachine::debugOutput(const VirtualMachine::InstructionType* i
 			s << ": OP_POP_JMP_UNLESS ";
 			++n;
 			s << instructions_[n] << " ( -> " << (n + static_cast<int>(instructions_[n])) << ")\n";
+		} else if(op == OP_POP_JMP_IF_BOOL) {
+			s << ": OP_POP_JMP_IF_BOOL ";
+			++n;
+			s << instructions_[n] << " ( -> " << (n + static_cast<int>(instructions_[n])) << ")\n";
+		} else if(op == OP_POP_JMP_UNLESS_BOOL) {
+			s << ": OP_POP_JMP_UNLESS_BOOL ";
+			++n;
+			s << instructions_[n] << " ( -> " << (n + static_cast<int>(instructions_[n])) << ")\n";
 		} else if(op == OP_JMP) {
 			s << ": OP_JMP ";
 			++n;
@@ -1461,14 +2296,7 @@ VirtualMachine::InstructionType VirtualMachine::Iterator::get() const
 
 bool VirtualMachine::Iterator::has_arg() const
 {
-	auto cur = get();
-	for(auto in : g_arg_instructions) {
-		if(cur == in) {
-			return true;
-		}
-	}
-
-	return false;
+	return getNumArgs(get()) != 0;
 }
 
 VirtualMachine::InstructionType VirtualMachine::Iterator::arg() const
@@ -1483,11 +2311,7 @@ VirtualMachine::InstructionType& VirtualMachine::Iterator::arg_mutable()
 
 void VirtualMachine::Iterator::next()
 {
-	if(has_arg()) {
-		++index_;
-	}
-
-	++index_;
+	index_ += 1 + getNumArgs(get());
 }
 
 bool VirtualMachine::Iterator::at_end() const
@@ -1502,7 +2326,55 @@ bool VirtualMachine::isInstructionLoop(InstructionType i)
 
 bool VirtualMachine::isInstructionJump(InstructionType i)
 {
-	return isInstructionLoop(i) || (i >= OP_JMP_IF && i <= OP_JMP);
+	return isInstructionLoop(i) || (i >= OP_JMP_IF && i <= OP_JMP) || i == OP_POP_JMP_IF_BOOL || i == OP_POP_JMP_UNLESS_BOOL;
+}
+
+int VirtualMachine::getNumArgs(InstructionType i)
+{
+	if(i == OP_LOOKUP_INDEX_STR) {
+		return 2;
+	}
+
+	for(auto in : g_arg_instructions) {
+		if(i == in) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+OP VirtualMachine::specializeBinaryOp(OP op, variant::TYPE left, variant::TYPE right)
+{
+	if(left == variant::VARIANT_TYPE_INT && right == variant::VARIANT_TYPE_INT) {
+		switch(op) {
+		case OP_ADD: return OP_ADD_INT;
+		case OP_SUB: return OP_SUB_INT;
+		case OP_MUL: return OP_MUL_INT;
+		case OP_LT: return OP_LT_INT;
+		case OP_LTE: return OP_LTE_INT;
+		case OP_GT: return OP_GT_INT;
+		case OP_GTE: return OP_GTE_INT;
+		case OP_EQ: return OP_EQ_INT;
+		case OP_NEQ: return OP_NEQ_INT;
+		default: return op;
+		}
+	}
+
+	if(left == variant::VARIANT_TYPE_DECIMAL && right == variant::VARIANT_TYPE_DECIMAL) {
+		switch(op) {
+		case OP_ADD: return OP_ADD_DECIMAL;
+		case OP_SUB: return OP_SUB_DECIMAL;
+		case OP_MUL: return OP_MUL_DECIMAL;
+		case OP_LT: return OP_LT_DECIMAL;
+		case OP_LTE: return OP_LTE_DECIMAL;
+		case OP_GT: return OP_GT_DECIMAL;
+		case OP_GTE: return OP_GTE_DECIMAL;
+		default: return op;
+		}
+	}
+
+	return op;
 }
 
 UNIT_TEST(formula_vm) {
@@ -1575,4 +2447,133 @@ UNIT_TEST(formula_vm_or_1) {
 	}
 }
 
+namespace {
+int count_instructions(const VirtualMachine& vm)
+{
+	int result = 0;
+	for(VirtualMachine::Iterator i = vm.begin_itor(); !i.at_end(); i.next()) {
+		++result;
+	}
+
+	return result;
+}
+
+//if(x < condition, 10, 20) the way the if function emits it.
+VirtualMachine create_if_vm(const variant& condition)
+{
+	VirtualMachine vm;
+	vm.addLoadConstantInstruction(variant("x"));
+	vm.addInstruction(OP_LOOKUP_STR);
+	vm.addLoadConstantInstruction(condition);
+	vm.addInstruction(OP_LT_INT);
+	const int jump_source = vm.addJumpSource(OP_JMP_UNLESS);
+	vm.addInstruction(OP_POP);
+	vm.addLoadConstantInstruction(variant(10));
+	const int end_source = vm.addJumpSource(OP_JMP);
+	vm.jumpToEnd(jump_source);
+	vm.addInstruction(OP_POP);
+	vm.addLoadConstantInstruction(variant(20));
+	vm.jumpToEnd(end_source);
+	return vm;
+}
+}
+
+UNIT_TEST(formula_vm_optimize_constant_folding) {
+	MapFormulaCallable* callable = new MapFormulaCallable;
+	variant ref(callable);
+
+	VirtualMachine vm;
+	vm.addInstruction(OP_CONSTANT);
+	vm.addConstant(variant(5));
+	vm.addInstruction(OP_CONSTANT);
+	vm.addConstant(variant(8));
+	vm.addInstruction(OP_ADD);
+	vm.addLoadConstantInstruction(variant(3));
+	vm.addInstruction(OP_MUL_INT);
+	vm.addInstruction(OP_UNARY_SUB);
+	vm.optimize();
+
+	CHECK_EQ(count_instructions(vm), 1);
+	CHECK_EQ(vm.execute(*callable), variant(-39));
+}
+
+UNIT_TEST(formula_vm_optimize_branches) {
+	MapFormulaCallable* callable = new MapFormulaCallable;
+	variant ref(callable);
+
+	VirtualMachine vm = create_if_vm(variant(3));
+	VirtualMachine optimized = vm;
+	optimized.optimize();
+	CHECK(count_instructions(optimized) < count_instructions(vm), "if not optimized: " << optimized.debugOutput());
+
+	for(int x = 0; x != 6; ++x) {
+		callable->add("x", variant(x));
+		CHECK_EQ(optimized.execute(*callable), vm.execute(*callable));
+	}
+
+	//x isn't an int, so the specialized comparison has to fall back.
+	callable->add("x", variant(decimal::from_string("2.5")));
+	CHECK_EQ(optimized.execute(*callable), variant(10));
+}
+
+UNIT_TEST(formula_vm_optimize_constant_branch) {
+	MapFormulaCallable* callable = new MapFormulaCallable;
+	variant ref(callable);
+	callable->add("x", variant(7));
+
+	VirtualMachine vm;
+	vm.addInstruction(OP_PUSH_1);
+	vm.addLoadConstantInstruction(variant(2));
+	vm.addInstruction(OP_LT_INT);
+	const int jump_source = vm.addJumpSource(OP_JMP_UNLESS);
+	vm.addInstruction(OP_POP);
+	vm.addLoadConstantInstruction(variant("x"));
+	vm.addInstruction(OP_LOOKUP_STR);
+	const int end_source = vm.addJumpSource(OP_JMP);
+	vm.jumpToEnd(jump_source);
+	vm.addInstruction(OP_POP);
+	vm.addInstruction(OP_PUSH_NULL);
+	vm.jumpToEnd(end_source);
+	vm.optimize();
+
+	CHECK(count_instructions(vm) == 1, "constant branch not removed: " << vm.debugOutput());
+	CHECK_EQ(vm.execute(*callable), variant(7));
+}
+
+UNIT_TEST(formula_vm_specialized_ops_fall_back) {
+	MapFormulaCallable* callable = new MapFormulaCallable;
+	variant ref(callable);
+	callable->add("s", variant("abc"));
+
+	VirtualMachine vm;
+	vm.addLoadConstantInstruction(variant("s"));
+	vm.addInstruction(OP_LOOKUP_STR);
+	vm.addLoadConstantInstruction(variant("def"));
+	vm.addInstruction(OP_ADD_INT);
+	CHECK_EQ(vm.execute(*callable), variant("abcdef"));
+}
+
+UNIT_TEST(formula_vm_lookup_str_constant) {
+	MapFormulaCallable* callable = new MapFormulaCallable;
+	variant ref(callable);
+	callable->add("x", variant(4));
+
+	VirtualMachine vm;
+	vm.addLoadConstantInstruction(variant("x"));
+	vm.addInstruction(OP_LOOKUP_STR);
+	vm.addLoadConstantInstruction(variant("x"));
+	vm.addInstruction(OP_LOOKUP_STR);
+	vm.addInstruction(OP_MUL);
+	vm.optimize();
+
+	CHECK(count_instructions(vm) == 3, "lookups not fused: " << vm.debugOutput());
+
+	//the cache only speeds up finding the name, so values changing
+	//between runs are still seen.
+	for(int x = 0; x != 4; ++x) {
+		callable->add("x", variant(x));
+		CHECK_EQ(vm.execute(*callable), variant(x*x));
+	}
+}
+
 }
@@ -281,6 +281,48 @@ enum OP {
 
 		  OP_POW='^', OP_DICE='d',
 
+		  //Binary operators specialized for operands statically known to be
+		  //ints or decimals. If the operands turn out to be of other types
+		  //they fall back on the generic operator.
+		  // POP: 2
+		  // PUSH: 1
+		  // ARGS: NONE
+		  OP_ADD_INT, OP_SUB_INT, OP_MUL_INT,
+		  OP_LT_INT, OP_LTE_INT, OP_GT_INT, OP_GTE_INT, OP_EQ_INT, OP_NEQ_INT,
+		  OP_ADD_DECIMAL, OP_SUB_DECIMAL, OP_MUL_DECIMAL,
+		  OP_LT_DECIMAL, OP_LTE_DECIMAL, OP_GT_DECIMAL, OP_GTE_DECIMAL,
+
+		  //Increment the top item on the stack which is expected to be an int.
+		  OP_INCREMENT_INT,
+
+		  //Versions of OP_POP_JMP_IF and OP_POP_JMP_UNLESS for when the
+		  //item on the stack is known to be a bool.
+		  // POP: 1
+		  // PUSH: 0
+		  // ARGS: 1
+		  OP_POP_JMP_IF_BOOL, OP_POP_JMP_UNLESS_BOOL,
+
+		  //OP_CONSTANT followed by OP_INDEX_STR. Indexes the top item on the
+		  //stack by the constant given as an argument.
+		  // POP: 1
+		  // PUSH: 1
+		  // ARGS: 1
+		  OP_INDEX_STR_CONSTANT,
+
+		  //OP_LOOKUP followed by OP_INDEX_STR_CONSTANT. The first argument
+		  //is the slot to lookup, the second the constant to index it by.
+		  // POP: 0
+		  // PUSH: 1
+		  // ARGS: 2
+		  OP_LOOKUP_INDEX_STR,
+
+		  //OP_CONSTANT followed by OP_LOOKUP_STR. Looks up the constant
+		  //given as an argument in the current scope.
+		  // POP: 0
+		  // PUSH: 1
+		  // ARGS: 1
+		  OP_LOOKUP_STR_CONSTANT,
+
 		  };
 
 
@@ -293,6 +335,11 @@ public:
 
 	static bool isInstructionLoop(InstructionType instruction);
 	static bool isInstructionJump(InstructionType instruction);
+	static int getNumArgs(InstructionType instruction);
+
+	//gets the instruction to use for a binary operator given the static
+	//types of its operands, or op itself if there's no specialized version.
+	static OP specializeBinaryOp(OP op, variant::TYPE left, variant::TYPE right);
 
 	class Iterator {
 		const VirtualMachine* vm_;
@@ -345,15 +392,45 @@ public:
 
 	void append(Iterator i1, Iterator i2, const VirtualMachine& other);
 
+	//peephole optimizes the instructions: folds constants, combines common
+	//instruction sequences and threads jumps. Code which inspects VMs looks
+	//for the unoptimized instruction sequences, so this should only be done
+	//to a copy of a VM which will just be executed.
+	void optimize();
+
+	//writes the VM for the bytecode cache. Returns false if any of its
+	//constants aren't plain data which can be written out.
+	bool serialize(std::string* out) const;
+
+	//reads a VM written by serialize(), advancing p past it. parent_formula
+	//is the formula the VM's debug info refers to.
+	bool deserialize(const char*& p, const char* end, const variant& parent_formula);
+
+	//describes the instruction set, so bytecode written by a build with
+	//different instructions can be recognized.
+	static std::string getInstructionSetSignature();
+
 	std::string debugOutput(const InstructionType* p=nullptr) const;
 
 	void setDebugInfo(const variant& parent_formula, unsigned short begin, unsigned short end);
 private:
 	void executeInternal(const game_logic::FormulaCallable& variables, std::vector<game_logic::FormulaCallablePtr>& variables_stack, std::vector<variant>& stack, std::vector<variant>& symbol_stack, const InstructionType* p, const InstructionType* p2) const;
 	std::string debugPinpointLocation(const InstructionType* p, const std::vector<variant>& stack) const;
+	variant indexByString(const variant& left, const variant& right, const InstructionType* p, const std::vector<variant>& stack, game_logic::LookupCache* cache=nullptr) const;
+
+	//the cache for looking up the string constant with the given index,
+	//or nullptr if the VM hasn't been optimized and so doesn't have any.
+	game_logic::LookupCache* getLookupCache(InstructionType constant) const {
+		return static_cast<size_t>(constant) < lookup_caches_.size() ? &lookup_caches_[constant] : nullptr;
+	}
+
 	std::vector<InstructionType> instructions_;
 	std::vector<variant> constants_;
 
+	//inline caches for looking up names, one for each constant so that
+	//places in the code looking up the same name share one.
+	mutable std::vector<game_logic::LookupCache> lookup_caches_;
+
 	struct DebugInfo {
 		unsigned short bytecode_pos;
 		unsigned short formula_pos;
@@ -28,7 +28,11 @@
 
 #include <boost/lexical_cast.hpp>
 
+#include "BlendModeScope.hpp"
+#include "ColorScope.hpp"
 #include "DisplayDevice.hpp"
+#include "ModelMatrixScope.hpp"
+#include "RenderCommandBuffer.hpp"
 #include "TextureUtils.hpp"
 #include "WindowManager.hpp"
 
@@ -48,6 +52,7 @@
 #include "variant_utils.hpp"
 
 PREF_FLOAT(global_frame_scale, 2.0, "Sets the global frame scales for all frames in all animations");
+PREF_BOOL(auto_batch_sprites, true, "Draws consecutive object sprites which share a texture, shader and blend mode with a single draw call");
 
 namespace
 {
@@ -58,6 +63,43 @@ namespace
 
     uint64_t current_palette_mask = 0L;
 	const glm::vec3 z_axis(0, 0, 1.0f);
+
+	//Sprites queued by Frame::addToSpriteBatch(), along with the state
+	//they are to be drawn with. The vertices are kept between batches so
+	//their storage is reused.
+	struct SpriteBatch {
+		SpriteBatch() : frame(nullptr), model(1.0f) {}
+		const Frame* frame;
+		KRE::Color color;
+		KRE::BlendMode blend;
+		glm::mat4 model;
+		KRE::CameraPtr camera;
+		std::vector<KRE::vertex_texcoord> vertices;
+	};
+
+	SpriteBatch& get_sprite_batch() {
+		static SpriteBatch res;
+		return res;
+	}
+
+	Frame::SpriteBatchStats& get_sprite_batch_stats() {
+		static Frame::SpriteBatchStats res;
+		return res;
+	}
+
+	//Adds a quad to a triangle strip, joining it to the quads before it
+	//with degenerate triangles.
+	void add_strip_quad(std::vector<KRE::vertex_texcoord>& v, float x1, float y1, float x2, float y2, const rectf& uv) {
+		if(v.empty() == false) {
+			v.emplace_back(v.back());
+			v.emplace_back(glm::vec2(x1, y1), glm::vec2(uv.x1(), uv.y1()));
+		}
+
+		v.emplace_back(glm::vec2(x1, y1), glm::vec2(uv.x1(), uv.y1()));
+		v.emplace_back(glm::vec2(x2, y1), glm::vec2(uv.x2(), uv.y1()));
+		v.emplace_back(glm::vec2(x1, y2), glm::vec2(uv.x1(), uv.y2()));
+		v.emplace_back(glm::vec2(x2, y2), glm::vec2(uv.x2(), uv.y2()));
+	}
 }
 
 void Frame::buildPatterns(variant obj_variant)
@@ -351,6 +393,8 @@ Frame::Frame(variant node)
 		buildAlpha();
 	}
 
+	buildAlphaMasks();
+
 	for(const auto& value : node.as_map()) {
 		static const std::string PivotPrefix = "pivot_";
 		const std::string& attr = value.first.as_string();
@@ -666,6 +710,42 @@ void Frame::buildAlpha()
 	}
 }
 
+void Frame::buildAlphaMasks()
+{
+	if(alpha_.empty()) {
+		return;
+	}
+
+	bool needs_masks = false;
+	for(const CollisionArea& area : collision_areas_) {
+		if(area.no_alpha_check == false) {
+			needs_masks = true;
+		}
+	}
+
+	if(!needs_masks) {
+		return;
+	}
+
+	alpha_masks_.reserve(nframes_*2);
+	for(int n = 0; n < nframes_; ++n) {
+		PixelMask mask(width(), height());
+		for(int y = 0; y != height(); ++y) {
+			const int row = static_cast<int>(y / scale_)*img_rect_.w()*nframes_ + n*img_rect_.w();
+			for(int x = 0; x != width(); ++x) {
+				const int index = row + static_cast<int>(x / scale_);
+				ASSERT_INDEX_INTO_VECTOR(index, alpha_);
+				if(!alpha_[index]) {
+					mask.set(x, y);
+				}
+			}
+		}
+
+		alpha_masks_.emplace_back(mask.mirrored());
+		alpha_masks_.emplace_back(std::move(mask));
+	}
+}
+
 void Frame::setColorPalette(uint64_t palettes)
 {
     LOG_DEBUG("Frame::setColorPalette: " << palettes);
@@ -685,6 +765,15 @@ bool Frame::isAlpha(int x, int y, int time, bool face_right) const
 	}
 }
 
+const PixelMask* Frame::getAlphaMask(int time, bool face_right) const
+{
+	if(alpha_masks_.empty()) {
+		return nullptr;
+	}
+
+	return &alpha_masks_[frameNumber(time)*2 + (face_right ? 1 : 0)];
+}
+
 std::vector<bool>::const_iterator Frame::getAlphaItor(int x, int y, int time, bool face_right) const
 {
 	if(alpha_.empty()) {
@@ -745,6 +834,8 @@ void Frame::draw(graphics::AnuraShaderPtr shader, int x, int y, bool face_right,
 	blit_target_.setMirrorVert(!face_right);
 	blit_target_.preRender(wnd);
 	wnd->render(&blit_target_);
+	++get_sprite_batch_stats().sprites;
+	++get_sprite_batch_stats().draws;
 
 	blit_target_.getTexture()->setSourceRect(0, old_src_rect);
 }
@@ -785,6 +876,8 @@ void Frame::draw(graphics::AnuraShaderPtr shader, int x, int y, bool face_right,
 	blit_target_.setMirrorVert(!face_right);
 	blit_target_.preRender(wnd);
 	wnd->render(&blit_target_);
+	++get_sprite_batch_stats().sprites;
+	++get_sprite_batch_stats().draws;
 	blit_target_.setScale(1.0f, 1.0f);
 
 	blit_target_.getTexture()->setSourceRect(0, old_src_rect);
@@ -823,6 +916,8 @@ void Frame::draw(graphics::AnuraShaderPtr shader, int x, int y, const rect& area
 	blit_target_.setMirrorVert(!face_right);
 	blit_target_.preRender(wnd);
 	wnd->render(&blit_target_);
+	++get_sprite_batch_stats().sprites;
+	++get_sprite_batch_stats().draws;
 
 	blit_target_.getTexture()->setSourceRect(0, old_src_rect);
 }
@@ -840,7 +935,11 @@ void Frame::drawBatch(graphics::AnuraShaderPtr shader, const BatchDrawItem* i1,
 		frame->blit_target_.setShader(shader->getShader());
 	}
 
-	std::vector<KRE::vertex_texcoord> queue;
+	static std::vector<KRE::vertex_texcoord> queue;
+	queue.clear();
+
+	get_sprite_batch_stats().sprites += static_cast<int>(i2 - i1);
+	++get_sprite_batch_stats().draws;
 
 	while(i1 != i2) {
 		const FrameInfo* info = nullptr;
@@ -890,6 +989,107 @@ void Frame::drawBatch(graphics::AnuraShaderPtr shader, const BatchDrawItem* i1,
 	wnd->render(&frame->blit_target_);
 }
 
+bool Frame::addToSpriteBatch(int x, int y, bool face_right, bool upside_down, int time, float scale) const
+{
+	if(!g_auto_batch_sprites) {
+		return false;
+	}
+
+	SpriteBatch& batch = get_sprite_batch();
+	const KRE::Color& color = KRE::ColorScope::getCurrentColor();
+	const KRE::BlendMode& blend = KRE::BlendModeScope::getCurrentMode();
+	const glm::mat4& model = KRE::get_global_model_matrix();
+	const KRE::CameraPtr camera = KRE::DisplayDevice::getCurrent()->getDefaultCamera();
+
+	if(batch.frame != nullptr && (
+	   !(KRE::RenderStateKey(batch.frame->blit_target_) == KRE::RenderStateKey(blit_target_))
+	   || batch.color != color || batch.blend != blend || batch.model != model || batch.camera != camera)) {
+		flushSpriteBatch();
+	}
+
+	if(batch.frame == nullptr) {
+		batch.frame = this;
+		batch.color = color;
+		batch.blend = blend;
+		batch.model = model;
+		batch.camera = camera;
+	}
+
+	const rect old_src_rect = blit_target_.getTexture()->getSourceRect();
+	const FrameInfo* info = nullptr;
+	getRectInTexture(time, info);
+	blit_target_.getTexture()->setSourceRect(0, old_src_rect);
+
+	//The same placement draw() gives the sprite, which centres the
+	//blit target on it and scales it about its centre.
+	x += static_cast<int>((face_right ? info->x_adjust : info->x2_adjust) * scale_);
+	y += static_cast<int>(info->y_adjust * scale_);
+	const int w = static_cast<int>(info->area.w() * scale_);
+	const int h = static_cast<int>(info->area.h() * scale_);
+
+	const float cx = static_cast<float>(x + w/2);
+	const float cy = static_cast<float>(y + h/2);
+	float x1 = cx - w*scale/2.0f;
+	float x2 = cx + w*scale/2.0f;
+	float y1 = cy - h*scale/2.0f;
+	float y2 = cy + h*scale/2.0f;
+	if(!face_right) {
+		std::swap(x1, x2);
+	}
+	if(upside_down) {
+		std::swap(y1, y2);
+	}
+
+	add_strip_quad(batch.vertices, x1, y1, x2, y2, info->draw_rect);
+	++get_sprite_batch_stats().sprites;
+	return true;
+}
+
+void Frame::flushSpriteBatch()
+{
+	SpriteBatch& batch = get_sprite_batch();
+	if(batch.frame == nullptr) {
+		return;
+	}
+
+	const Frame* frame = batch.frame;
+	batch.frame = nullptr;
+
+	KRE::ColorScope color_scope(batch.color);
+	KRE::BlendModeScope blend_scope(batch.blend);
+	auto device = KRE::DisplayDevice::getCurrent();
+	const glm::mat4 model = KRE::get_global_model_matrix();
+	KRE::set_global_model_matrix(batch.model);
+	const KRE::CameraPtr camera = device->setDefaultCamera(batch.camera);
+
+	//The vertices are in level co-ordinates, so the blit target is drawn
+	//untransformed. draw() sets the draw rect, which makes the blit target
+	//rebuild its own vertices.
+	KRE::Blittable& target = frame->blit_target_;
+	target.setPosition(0, 0);
+	target.setRotation(0.0f, z_axis);
+	target.update(&batch.vertices);
+	KRE::WindowManager::getMainWindow()->render(&target);
+	++get_sprite_batch_stats().draws;
+
+	//The update swapped the blit target's old vertices into the batch.
+	batch.vertices.clear();
+	batch.camera.reset();
+
+	device->setDefaultCamera(camera);
+	KRE::set_global_model_matrix(model);
+}
+
+const Frame::SpriteBatchStats& Frame::getSpriteBatchStats()
+{
+	return get_sprite_batch_stats();
+}
+
+void Frame::resetSpriteBatchStats()
+{
+	get_sprite_batch_stats() = SpriteBatchStats();
+}
+
 void Frame::drawCustom(graphics::AnuraShaderPtr shader, int x, int y, const std::vector<CustomPoint>& points, const rect* area, bool face_right, bool upside_down, int time, float rotation) const
 {
 	KRE::Blittable blit;
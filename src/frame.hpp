@@ -30,6 +30,7 @@
 
 #include "anura_shader.hpp"
 #include "formula.hpp"
+#include "pixel_mask.hpp"
 #include "solid_map_fwd.hpp"
 #include "variant.hpp"
 #include <glm/glm.hpp>
@@ -73,6 +74,12 @@ public:
 	std::vector<bool>::const_iterator getAlphaItor(int x, int y, int time, bool face_right) const;
 	const std::vector<bool>& getAlphaBuf() const { return alpha_; }
 
+	//Gets which pixels of the frame are opaque, at the frame's scale and
+	//already mirrored if facing left, so that the mask lines up with the
+	//object's position. Only built for frames with collision areas which
+	//check alpha; returns nullptr if there is none.
+	const PixelMask* getAlphaMask(int time, bool face_right) const;
+
 	void draw(graphics::AnuraShaderPtr shader, int x, int y, bool face_right=true, bool upside_down=false, int time=0, float rotate=0) const;
 	void draw(graphics::AnuraShaderPtr shader, int x, int y, bool face_right, bool upside_down, int time, float rotate, float scale) const;
 	void draw(graphics::AnuraShaderPtr shader, int x, int y, const rect& area, bool face_right=true, bool upside_down=false, int time=0, float rotate=0) const;
@@ -98,6 +105,27 @@ public:
 
 	static void drawBatch(graphics::AnuraShaderPtr shader, const BatchDrawItem* i1, const BatchDrawItem* i2);
 
+	//Queues the frame to be drawn as a sprite along with the sprites queued
+	//before it, as long as they can all be drawn with the same texture,
+	//shader, blend mode, color, model matrix and camera. Otherwise the
+	//sprites queued so far are drawn first. Returns false, and queues
+	//nothing, if sprite batching is disabled. The caller must make sure
+	//nothing else is drawn while sprites are queued without first calling
+	//flushSpriteBatch().
+	bool addToSpriteBatch(int x, int y, bool face_right, bool upside_down, int time, float scale) const;
+	static void flushSpriteBatch();
+
+	//Counts of the sprites drawn by frames and the draw calls used for
+	//them, since the counts were last reset.
+	struct SpriteBatchStats {
+		SpriteBatchStats() : sprites(0), draws(0) {}
+		int sprites;
+		int draws;
+	};
+
+	static const SpriteBatchStats& getSpriteBatchStats();
+	static void resetSpriteBatchStats();
+
 	void setImageAsSolid();
 	ConstSolidInfoPtr solid() const { return solid_; }
 	ConstSolidInfoPtr platform() const { return platform_; }
@@ -166,6 +194,9 @@ public:
 private:
 	DECLARE_CALLABLE(Frame);
 
+	//gives a frame's blit target a different shader to check batching.
+	friend void UTILITY_test_sprite_batching(const std::vector<std::string>& args);
+
 	void getRectInTexture(int time, const FrameInfo*& info) const;
 	void getRectInFrameNumber(int nframe, const FrameInfo*& info) const;
 
@@ -215,7 +246,11 @@ private:
 
 	void buildAlphaFromFrameInfo();
 	void buildAlpha();
+	void buildAlphaMasks();
 	std::vector<bool> alpha_;
+
+	//facing right and facing left masks for each frame of the animation.
+	std::vector<PixelMask> alpha_masks_;
 	bool allow_wrapping_;
 	bool force_no_alpha_;
 
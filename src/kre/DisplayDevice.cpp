@@ -21,6 +21,7 @@
 	   distribution.
 */
 
+#include <algorithm>
 #include <map>
 
 #include "asserts.hpp"
@@ -30,6 +31,7 @@
 #include "ClipScope.hpp"
 #include "DisplayDevice.hpp"
 #include "Effects.hpp"
+#include "RenderCommandBuffer.hpp"
 #include "RenderTarget.hpp"
 #include "Scissor.hpp"
 #include "Shaders.hpp"
@@ -81,13 +83,31 @@ namespace KRE
 		setClearColor(r/255.0f, g/255.0f, b/255.0f, a/255.0f);
 	}
 
+	void DisplayDevice::render(const Renderable* r) const
+	{
+		auto buffer = RenderCommandBuffer::getCurrent();
+		if(buffer != nullptr) {
+			buffer->submit(r);
+			return;
+		}
+		if(r->isEnabled()) {
+			count_render_state(RenderStateKey(*r));
+		}
+		doRender(r);
+	}
+
 	DisplayDevicePtr DisplayDevice::factory(const std::string& type, WindowPtr parent)
 	{
 		ASSERT_LOG(!get_display_registry().empty(), "No display device drivers registered.");
 		auto it = get_display_registry().find(type);
 		if(it == get_display_registry().end()) {
-			LOG_WARN("Requested display driver '" << type << "' not found, using default: " << get_display_registry().begin()->first);
-			current_display_device() = get_display_registry().begin()->second(parent);
+			// The null driver draws nothing, so is only used when asked for.
+			it = std::find_if(get_display_registry().begin(), get_display_registry().end(), [](const DisplayDeviceRegistry::value_type& d) {
+				return d.first != "null";
+			});
+			ASSERT_LOG(it != get_display_registry().end(), "Requested display driver '" << type << "' not found.");
+			LOG_WARN("Requested display driver '" << type << "' not found, using default: " << it->first);
+			current_display_device() = it->second(parent);
 			return current_display_device();
 		}
 		current_display_device() = it->second(parent);
@@ -100,6 +120,13 @@ namespace KRE
 		return current_display_device();
 	}
 
+	DisplayDevicePtr DisplayDevice::setCurrent(const DisplayDevicePtr& device)
+	{
+		auto old_device = current_display_device();
+		current_display_device() = device;
+		return old_device;
+	}
+
 	void DisplayDevice::registerFactoryFunction(const std::string& type, std::function<DisplayDevicePtr(WindowPtr)> create_fn)
 	{
 		auto it = get_display_registry().find(type);
@@ -133,6 +160,11 @@ namespace KRE
 				return attrib;
 			}
 		}
+		return DisplayDevice::getCurrent()->handleCreateSoftwareAttribute(parent);
+	}
+
+	HardwareAttributePtr DisplayDevice::handleCreateSoftwareAttribute(AttributeBase* parent)
+	{
 		return std::make_shared<HardwareAttributeImpl>(parent);
 	}
 
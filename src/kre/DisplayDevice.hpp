@@ -104,6 +104,8 @@ namespace KRE
 			DISPLAY_DEVICE_SDL,
 			// Display device is Direct3D
 			DISPLAY_DEVICE_D3D,
+			// Display device draws nothing, for running without a GPU.
+			DISPLAY_DEVICE_NULL,
 		};
 
 		explicit DisplayDevice(WindowPtr wnd);
@@ -121,7 +123,8 @@ namespace KRE
 		virtual void init(int width, int height) = 0;
 		virtual void printDeviceInfo() = 0;
 
-		virtual void render(const Renderable* r) const = 0;
+		// Draws the renderable, or records it if a RenderCommandBuffer is current.
+		void render(const Renderable* r) const;
 
 		virtual void clearTextures() = 0;
 
@@ -190,6 +193,8 @@ namespace KRE
 		static DisplayDevicePtr factory(const std::string& type, WindowPtr wnd);
 
 		static DisplayDevicePtr getCurrent();
+		// Makes the given device current, returning the previous one.
+		static DisplayDevicePtr setCurrent(const DisplayDevicePtr& device);
 
 		static bool checkForFeature(DisplayDeviceCapabilities cap);
 
@@ -201,6 +206,8 @@ namespace KRE
 		DisplayDevice(const DisplayDevice&);
 		virtual AttributeSetPtr handleCreateAttributeSet(bool indexed, bool instanced) = 0;
 		virtual HardwareAttributePtr handleCreateAttribute(AttributeBase* parent) = 0;
+		// Creates the buffer for attributes which aren't hardware backed.
+		virtual HardwareAttributePtr handleCreateSoftwareAttribute(AttributeBase* parent);
 
 		virtual RenderTargetPtr handleCreateRenderTarget(int width, int height,
 			int color_plane_count,
@@ -224,6 +231,8 @@ namespace KRE
 
 		virtual bool doCheckForFeature(DisplayDeviceCapabilities cap) = 0;
 
+		virtual void doRender(const Renderable* r) const = 0;
+
 		virtual void doBlitTexture(const TexturePtr& tex, int dstx, int dsty, int dstw, int dsth, float rotation, int srcx, int srcy, int srcw, int srch) = 0;
 	};
 
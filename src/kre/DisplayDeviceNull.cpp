@@ -0,0 +1,1290 @@
+/*
+	Copyright (C) 2013-2014 by Kristina Simpson <sweet.kristas@gmail.com>
+
+	This software is provided 'as-is', without any express or implied
+	warranty. In no event will the authors be held liable for any damages
+	arising from the use of this software.
+
+	Permission is granted to anyone to use this software for any purpose,
+	including commercial applications, and to alter it and redistribute it
+	freely, subject to the following restrictions:
+
+	   1. The origin of this software must not be misrepresented; you must not
+	   claim that you wrote the original software. If you use this software
+	   in a product, an acknowledgement in the product documentation would be
+	   appreciated but is not required.
+
+	   2. Altered source versions must be plainly marked as such, and must not be
+	   misrepresented as being the original software.
+
+	   3. This notice may not be removed or altered from any source
+	   distribution.
+*/
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+
+#include <glm/gtc/type_ptr.hpp>
+
+#include "asserts.hpp"
+#include "AttributeSet.hpp"
+#include "Blend.hpp"
+#include "CameraObject.hpp"
+#include "Canvas.hpp"
+#include "ClipScope.hpp"
+#include "ColorScope.hpp"
+#include "DisplayDeviceNull.hpp"
+#include "Effects.hpp"
+#include "ModelMatrixScope.hpp"
+#include "RenderCommandBuffer.hpp"
+#include "RenderTarget.hpp"
+#include "Scissor.hpp"
+#include "StencilScope.hpp"
+#include "Surface.hpp"
+#include "Texture.hpp"
+#include "unit_test.hpp"
+
+namespace KRE
+{
+	namespace
+	{
+		static DisplayDeviceRegistrar<DisplayDeviceNull> null_register("null");
+
+		// The recording of the null display device that is recording, if any.
+		std::vector<RenderEvent>*& active_recording()
+		{
+			static std::vector<RenderEvent>* res = nullptr;
+			return res;
+		}
+
+		void record_event(RenderEvent::Type type, const void* object, int count)
+		{
+			auto recording = active_recording();
+			if(recording != nullptr) {
+				recording->emplace_back(type, object, count);
+			}
+		}
+
+		TexturePtr record_texture_creation(const TexturePtr& tex)
+		{
+			int texels = 0;
+			for(int n = 0; n != tex->getTextureCount(); ++n) {
+				texels += tex->actualWidth(n) * std::max(1, tex->actualHeight(n)) * std::max(1, tex->actualDepth(n));
+			}
+			record_event(RenderEvent::Type::TEXTURE_CREATE, tex.get(), texels);
+			return tex;
+		}
+
+		// Software attribute buffer which records the data uploaded to it.
+		class NullAttribute : public HardwareAttributeImpl
+		{
+		public:
+			explicit NullAttribute(AttributeBase* parent) : HardwareAttributeImpl(parent), parent_(parent) {}
+			void update(const void* value, ptrdiff_t offset, size_t size) override
+			{
+				record_event(RenderEvent::Type::ATTRIBUTE_UPLOAD, parent_, static_cast<int>(size));
+				HardwareAttributeImpl::update(value, offset, size);
+			}
+			HardwareAttributePtr create(AttributeBase* parent) override
+			{
+				return std::make_shared<NullAttribute>(parent);
+			}
+		private:
+			AttributeBase* parent_;
+		};
+
+		unsigned next_texture_id()
+		{
+			static unsigned res = 0;
+			return ++res;
+		}
+
+		class NullTexture : public Texture
+		{
+		public:
+			explicit NullTexture(const variant& node, const std::vector<SurfacePtr>& surfaces)
+				: Texture(node, surfaces), id_(next_texture_id()) {}
+			explicit NullTexture(const std::vector<SurfacePtr>& surfaces, TextureType type, int mipmap_levels)
+				: Texture(surfaces, type, mipmap_levels), id_(next_texture_id()) {}
+			explicit NullTexture(int count, int width, int height, int depth, PixelFormat::PF fmt, TextureType type)
+				: Texture(count, width, height, depth, fmt, type), id_(next_texture_id()) {}
+			NullTexture(const NullTexture& other)
+				: Texture(other), id_(next_texture_id()) {}
+
+			void init(int n) override {}
+			void bind(int binding_point) override {}
+			unsigned id(int n) const override { return id_; }
+
+			void update(int n, int x, int width, void* pixels) override
+			{
+				record_event(RenderEvent::Type::TEXTURE_UPDATE, this, width);
+			}
+			void update(int n, int x, int y, int width, int height, const void* pixels) override
+			{
+				record_event(RenderEvent::Type::TEXTURE_UPDATE, this, width * height);
+			}
+			void update2D(int n, int x, int y, int width, int height, int stride, const void* pixels) override
+			{
+				record_event(RenderEvent::Type::TEXTURE_UPDATE, this, width * height);
+			}
+			void updateYUV(int x, int y, int width, int height, const std::vector<int>& stride, const std::vector<void*>& pixels) override
+			{
+				record_event(RenderEvent::Type::TEXTURE_UPDATE, this, width * height);
+			}
+			void update(int n, int x, int y, int z, int width, int height, int depth, void* pixels) override
+			{
+				record_event(RenderEvent::Type::TEXTURE_UPDATE, this, width * height * depth);
+			}
+
+			SurfacePtr extractTextureToSurface(int n) const override
+			{
+				return getSurface(n);
+			}
+
+			const unsigned char* colorAt(int x, int y) const override
+			{
+				auto s = getFrontSurface();
+				if(s == nullptr) {
+					return nullptr;
+				}
+				const unsigned char* pixels = reinterpret_cast<const unsigned char*>(s->pixels());
+				return pixels + (y*s->width() + x)*s->getPixelFormat()->bytesPerPixel();
+			}
+
+			TexturePtr clone() override
+			{
+				return TexturePtr(new NullTexture(*this));
+			}
+		private:
+			void rebuild() override {}
+			void handleAddPalette(int index, const SurfacePtr& palette) override {}
+
+			unsigned id_;
+		};
+
+		class NullShaderProgram;
+
+		const NullShaderProgram*& current_null_shader()
+		{
+			static const NullShaderProgram* res = nullptr;
+			return res;
+		}
+
+		// A shader program which accepts any uniform or attribute, allocating
+		// locations for them as they are asked for. Writes of the matrix and
+		// color uniforms the device sets for every renderable are skipped when
+		// the value is unchanged, as the OpenGL shaders do.
+		class NullShaderProgram : public ShaderProgram
+		{
+		public:
+			explicit NullShaderProgram(const std::string& name, const variant& node)
+				: ShaderProgram(name, node)
+			{
+				u_mvp_ = getUniform("u_mvp_matrix");
+				u_color_ = getUniform("u_color");
+				getUniform("u_tex_map");
+				getUniform("u_discard");
+				getAttribute("a_position");
+				getAttribute("a_texcoord");
+			}
+
+			void makeActive() override
+			{
+				if(current_null_shader() != this) {
+					last_values_.clear();
+				}
+				current_null_shader() = this;
+			}
+
+			void applyAttribute(AttributeBasePtr attr) override {}
+			void cleanUpAfterDraw() override {}
+
+			int getAttributeOrDie(const std::string& attr) const override { return getAttribute(attr); }
+			int getUniformOrDie(const std::string& attr) const override { return getUniform(attr); }
+
+			int getAttribute(const std::string& attr) const override
+			{
+				auto it = attributes_.find(attr);
+				if(it == attributes_.end()) {
+					it = attributes_.emplace(attr, static_cast<int>(attributes_.size())).first;
+				}
+				return it->second;
+			}
+
+			int getUniform(const std::string& attr) const override
+			{
+				auto it = uniforms_.find(attr);
+				if(it == uniforms_.end()) {
+					it = uniforms_.emplace(attr, static_cast<int>(uniforms_.size())).first;
+				}
+				return it->second;
+			}
+
+			std::vector<std::string> getAllUniforms() const override
+			{
+				std::vector<std::string> res;
+				for(auto& u : uniforms_) {
+					res.emplace_back(u.first);
+				}
+				return res;
+			}
+
+			std::vector<std::string> getAllAttributes() const override
+			{
+				std::vector<std::string> res;
+				for(auto& a : attributes_) {
+					res.emplace_back(a.first);
+				}
+				return res;
+			}
+
+			void setUniformMapping(const std::vector<std::pair<std::string, std::string>>& mapping) override {}
+			void setAttributeMapping(const std::vector<std::pair<std::string, std::string>>& mapping) override {}
+
+			void setUniformValue(int uid, const int) const override { forgetValue(uid); }
+			void setUniformValue(int uid, const float) const override { forgetValue(uid); }
+			void setUniformValue(int uid, const int*) const override { forgetValue(uid); }
+			void setUniformValue(int uid, const void*) const override { forgetValue(uid); }
+			void setUniformFromVariant(int uid, const variant& value) const override { forgetValue(uid); }
+
+			void setUniformValue(int uid, const float* value) const override
+			{
+				auto& stats = get_render_stats();
+				++stats.uniform_writes;
+				const int count = uid == u_mvp_ ? 16 : uid == u_color_ ? 4 : 0;
+				if(count == 0 || current_null_shader() != this) {
+					last_values_.erase(uid);
+					return;
+				}
+				auto& last = last_values_[uid];
+				if(last.size() == static_cast<size_t>(count) && std::equal(value, value + count, last.begin())) {
+					++stats.uniform_writes_elided;
+					return;
+				}
+				last.assign(value, value + count);
+			}
+
+			void setAttributeValue(int aid, const int) const override {}
+			void setAttributeValue(int aid, const float) const override {}
+			void setAttributeValue(int aid, const float*) const override {}
+			void setAttributeValue(int aid, const int*) const override {}
+			void setAttributeValue(int aid, const void*) const override {}
+			void setAttributeValue(int aid, const unsigned char*) const override {}
+			void setAttributeFromVariant(int uid, const variant& value) const override {}
+
+			void configureActives(AttributeSetPtr attrset) override {}
+			void configureAttribute(AttributeBasePtr attr) override {}
+			void configureUniforms(UniformBufferBase& uniforms) override {}
+
+			int getColorUniform() const override { return u_color_; }
+			int getLineWidthUniform() const override { return findUniform("u_line_width"); }
+			int getMvUniform() const override { return findUniform("u_mv_matrix"); }
+			int getPUniform() const override { return findUniform("u_p_matrix"); }
+			int getPVUniform() const override { return findUniform("u_pv_matrix"); }
+			int getMvpUniform() const override { return u_mvp_; }
+			int getTexMapUniform() const override { return findUniform("u_tex_map"); }
+			int getDiscardUniform() const override { return findUniform("u_discard"); }
+
+			int getColorAttribute() const override { return findAttribute("a_color"); }
+			int getVertexAttribute() const override { return findAttribute("a_position"); }
+			int getTexcoordAttribute() const override { return findAttribute("a_texcoord"); }
+			int getNormalAttribute() const override { return findAttribute("a_normal"); }
+
+			void setUniformsForTexture(const TexturePtr& tex) const override {}
+
+			ShaderProgramPtr clone() override
+			{
+				return std::make_shared<NullShaderProgram>(*this);
+			}
+		private:
+			int findUniform(const std::string& name) const
+			{
+				auto it = uniforms_.find(name);
+				return it == uniforms_.end() ? INVALID_UNIFORM : it->second;
+			}
+
+			int findAttribute(const std::string& name) const
+			{
+				auto it = attributes_.find(name);
+				return it == attributes_.end() ? INVALID_ATTRIBUTE : it->second;
+			}
+
+			void forgetValue(int uid) const
+			{
+				++get_render_stats().uniform_writes;
+				last_values_.erase(uid);
+			}
+
+			mutable std::map<std::string, int> uniforms_;
+			mutable std::map<std::string, int> attributes_;
+			mutable std::map<int, std::vector<float>> last_values_;
+			int u_mvp_;
+			int u_color_;
+		};
+
+		class NullRenderTarget;
+
+		const NullRenderTarget*& applied_null_target()
+		{
+			static const NullRenderTarget* res = nullptr;
+			return res;
+		}
+
+		SurfacePtr create_raster_surface(int width, int height, const Color& color)
+		{
+			auto s = Surface::create(width, height, PixelFormat::PF::PIXELFORMAT_ABGR8888);
+			s->fillRect(rect(0, 0, width, height), color);
+			return s;
+		}
+
+		// The surface the software rasterizer draws into for a render target
+		// is only created once something is rasterized into it.
+		class NullRenderTarget : public RenderTarget
+		{
+		public:
+			explicit NullRenderTarget(int width, int height,
+				int color_plane_count,
+				bool depth,
+				bool stencil,
+				bool use_multi_sampling,
+				int multi_samples)
+				: RenderTarget(width, height, color_plane_count, depth, stencil, use_multi_sampling, multi_samples)
+			{
+				on_create();
+			}
+			explicit NullRenderTarget(const variant& node)
+				: RenderTarget(node)
+			{
+				on_create();
+			}
+
+			const SurfacePtr& getRasterSurface() const
+			{
+				if(surface_ == nullptr) {
+					surface_ = create_raster_surface(width(), height(), getClearColor());
+				}
+				return surface_;
+			}
+		private:
+			void handleCreate() override
+			{
+				auto tex = Texture::createTextureArray(std::max(1, getColorPlanes()), width(), height(), PixelFormat::PF::PIXELFORMAT_RGBA8888, TextureType::TEXTURE_2D);
+				tex->setSourceRect(-1, rect(0, 0, width(), height()));
+				setTexture(tex);
+				setDrawRect(rect(0, 0, width(), height()));
+			}
+			void handleApply(const rect& r) const override
+			{
+				previous_ = applied_null_target();
+				applied_null_target() = this;
+			}
+			void handleUnapply() const override
+			{
+				if(applied_null_target() == this) {
+					applied_null_target() = previous_;
+				}
+			}
+			void handleClear() const override
+			{
+				record_event(RenderEvent::Type::CLEAR, this, width() * height());
+				if(surface_ != nullptr) {
+					surface_->fillRect(rect(0, 0, width(), height()), getClearColor());
+				}
+			}
+			void handleSizeChange(int width, int height) override
+			{
+				surface_.reset();
+				handleCreate();
+			}
+			RenderTargetPtr handleClone() override
+			{
+				auto res = std::make_shared<NullRenderTarget>(*this);
+				res->surface_.reset();
+				res->previous_ = nullptr;
+				return res;
+			}
+			std::vector<uint8_t> handleReadPixels() const override
+			{
+				std::vector<uint8_t> res(width() * height() * 4);
+				if(surface_ != nullptr) {
+					for(int y = 0; y != height(); ++y) {
+						const uint8_t* row = static_cast<const uint8_t*>(surface_->pixels()) + y * surface_->rowPitch();
+						std::copy(row, row + width() * 4, res.begin() + y * width() * 4);
+					}
+				}
+				return res;
+			}
+			SurfacePtr handleReadToSurface(SurfacePtr s) const override
+			{
+				auto res = Surface::create(width(), height(), PixelFormat::PF::PIXELFORMAT_ABGR8888);
+				auto pixels = handleReadPixels();
+				for(int y = 0; y != height(); ++y) {
+					uint8_t* row = static_cast<uint8_t*>(res->pixelsWriteable()) + y * res->rowPitch();
+					std::copy(pixels.begin() + y * width() * 4, pixels.begin() + (y + 1) * width() * 4, row);
+				}
+				return res;
+			}
+
+			mutable SurfacePtr surface_;
+			mutable const NullRenderTarget* previous_ = nullptr;
+		};
+
+		template<typename T>
+		float read_component(const uint8_t* p, bool normalise)
+		{
+			T value;
+			std::memcpy(&value, p, sizeof(T));
+			if(normalise && std::numeric_limits<T>::is_integer) {
+				return static_cast<float>(value) / static_cast<float>(std::numeric_limits<T>::max());
+			}
+			return static_cast<float>(value);
+		}
+
+		// Reads up to four components of the given vertex from an attribute,
+		// returning the number read or zero if the format isn't supported.
+		int read_vertex(AttributeBase& attr, const AttributeDesc& desc, int index, float* out)
+		{
+			const intptr_t base = attr.getDeviceBufferData() ? attr.getDeviceBufferData()->value() : 0;
+			if(base == 0) {
+				return 0;
+			}
+
+			int size = 0;
+			switch(desc.getVarType()) {
+			case AttrFormat::BYTE:
+			case AttrFormat::UNSIGNED_BYTE:		size = 1; break;
+			case AttrFormat::SHORT:
+			case AttrFormat::UNSIGNED_SHORT:	size = 2; break;
+			case AttrFormat::FLOAT:
+			case AttrFormat::INT:
+			case AttrFormat::UNSIGNED_INT:		size = 4; break;
+			default: return 0;
+			}
+
+			const int count = std::min(4, static_cast<int>(desc.getNumElements()));
+			const ptrdiff_t stride = desc.getStride() != 0 ? desc.getStride() : desc.getNumElements() * size;
+			const uint8_t* p = reinterpret_cast<const uint8_t*>(base) + attr.getOffset() + desc.getOffset() + index * stride;
+			for(int n = 0; n != count; ++n, p += size) {
+				switch(desc.getVarType()) {
+				case AttrFormat::BYTE:				out[n] = read_component<int8_t>(p, desc.normalise()); break;
+				case AttrFormat::UNSIGNED_BYTE:		out[n] = read_component<uint8_t>(p, desc.normalise()); break;
+				case AttrFormat::SHORT:				out[n] = read_component<int16_t>(p, desc.normalise()); break;
+				case AttrFormat::UNSIGNED_SHORT:	out[n] = read_component<uint16_t>(p, desc.normalise()); break;
+				case AttrFormat::FLOAT:				out[n] = read_component<float>(p, false); break;
+				case AttrFormat::INT:				out[n] = read_component<int32_t>(p, desc.normalise()); break;
+				case AttrFormat::UNSIGNED_INT:		out[n] = read_component<uint32_t>(p, desc.normalise()); break;
+				default: break;
+				}
+			}
+			return count;
+		}
+
+		// Nearest texel lookups from the front surface of a texture, giving
+		// white if there is no texture or its surface can't be read.
+		class TextureSampler
+		{
+		public:
+			explicit TextureSampler(const TexturePtr& tex) : surface_(tex ? tex->getFrontSurface() : SurfacePtr()), format_()
+			{
+				if(surface_ != nullptr && (surface_->bytesPerPixel() != 4 || !surface_->hasData())) {
+					surface_.reset();
+				}
+				if(surface_ != nullptr) {
+					format_ = surface_->getPixelFormat();
+				}
+			}
+
+			glm::vec4 operator()(const glm::vec2& uv) const
+			{
+				if(surface_ == nullptr) {
+					return glm::vec4(1.0f);
+				}
+				const int x = std::min(std::max(static_cast<int>(uv.x * surface_->width()), 0), surface_->width() - 1);
+				const int y = std::min(std::max(static_cast<int>(uv.y * surface_->height()), 0), surface_->height() - 1);
+				uint32_t pixel;
+				std::memcpy(&pixel, static_cast<const uint8_t*>(surface_->pixels()) + y * surface_->rowPitch() + x * 4, sizeof(pixel));
+				int r, g, b, a;
+				format_->getRGBA(pixel, r, g, b, a);
+				return glm::vec4(r, g, b, a) / 255.0f;
+			}
+		private:
+			SurfacePtr surface_;
+			PixelFormatPtr format_;
+		};
+
+		struct RasterVertex
+		{
+			glm::vec2 pos;
+			glm::vec2 uv;
+		};
+
+		float edge_function(const glm::vec2& a, const glm::vec2& b, const glm::vec2& p)
+		{
+			return (b.x - a.x) * (p.y - a.y) - (b.y - a.y) * (p.x - a.x);
+		}
+
+		// Fills the pixels whose centres are inside the triangle, blending
+		// the color, modulated by the texture, over what is there.
+		void fill_triangle(Surface& s, const RasterVertex& v0, const RasterVertex& v1, const RasterVertex& v2, const glm::vec4& color, const TextureSampler& sampler)
+		{
+			const float area = edge_function(v0.pos, v1.pos, v2.pos);
+			if(std::abs(area) < 1e-6f) {
+				return;
+			}
+
+			const int x1 = std::max(0, static_cast<int>(std::floor(std::min({v0.pos.x, v1.pos.x, v2.pos.x}))));
+			const int y1 = std::max(0, static_cast<int>(std::floor(std::min({v0.pos.y, v1.pos.y, v2.pos.y}))));
+			const int x2 = std::min(s.width(), static_cast<int>(std::ceil(std::max({v0.pos.x, v1.pos.x, v2.pos.x}))));
+			const int y2 = std::min(s.height(), static_cast<int>(std::ceil(std::max({v0.pos.y, v1.pos.y, v2.pos.y}))));
+
+			for(int y = y1; y < y2; ++y) {
+				uint8_t* row = static_cast<uint8_t*>(s.pixelsWriteable()) + y * s.rowPitch();
+				for(int x = x1; x < x2; ++x) {
+					const glm::vec2 p(x + 0.5f, y + 0.5f);
+					const float b0 = edge_function(v1.pos, v2.pos, p) / area;
+					const float b1 = edge_function(v2.pos, v0.pos, p) / area;
+					const float b2 = edge_function(v0.pos, v1.pos, p) / area;
+					if(b0 < 0.0f || b1 < 0.0f || b2 < 0.0f) {
+						continue;
+					}
+
+					const glm::vec4 src = color * sampler(v0.uv * b0 + v1.uv * b1 + v2.uv * b2);
+					uint8_t* dst = row + x * 4;
+					for(int n = 0; n != 3; ++n) {
+						dst[n] = static_cast<uint8_t>(std::min(255.0f, src[n] * src.a * 255.0f + dst[n] * (1.0f - src.a)));
+					}
+					dst[3] = static_cast<uint8_t>(std::min(255.0f, src.a * 255.0f + dst[3] * (1.0f - src.a)));
+				}
+			}
+		}
+
+		class NullCanvas : public Canvas
+		{
+		public:
+			void blitTexture(const TexturePtr& tex, const rect& src, float rotation, const rect& dst, const Color& color, CanvasBlitFlags flags) const override {}
+			void blitTexture(const TexturePtr& tex, const std::vector<vertex_texcoord>& vtc, float rotation, const Color& color) override {}
+			void drawSolidRect(const rect& r, const Color& fill_color, const Color& stroke_color, float rotate) const override {}
+			void drawSolidRect(const rect& r, const Color& fill_color, float rotate) const override {}
+			void drawHollowRect(const rect& r, const Color& stroke_color, float rotate) const override {}
+			void drawLine(const point& p1, const point& p2, const Color& color) const override {}
+			void drawLines(const std::vector<glm::vec2>& varray, float line_width, const Color& color) const override {}
+			void drawLines(const std::vector<glm::vec2>& varray, float line_width, const std::vector<glm::u8vec4>& carray) const override {}
+			void drawLineStrip(const std::vector<glm::vec2>& points, float line_width, const Color& color) const override {}
+			void drawLineLoop(const std::vector<glm::vec2>& varray, float line_width, const Color& color) const override {}
+			void drawLine(const pointf& p1, const pointf& p2, const Color& color) const override {}
+			void drawPolygon(const std::vector<glm::vec2>& points, const Color& color) const override {}
+			void drawSolidCircle(const point& centre, float radius, const Color& color) const override {}
+			void drawSolidCircle(const point& centre, float radius, const std::vector<glm::u8vec4>& color) const override {}
+			void drawSolidCircle(const pointf& centre, float radius, const Color& color) const override {}
+			void drawSolidCircle(const pointf& centre, float radius, const std::vector<glm::u8vec4>& color) const override {}
+			void drawHollowCircle(const point& centre, float outer_radius, float inner_radius, const Color& color) const override {}
+			void drawHollowCircle(const pointf& centre, float outer_radius, float inner_radius, const Color& color) const override {}
+			void drawPoints(const std::vector<glm::vec2>& points, float radius, const Color& color) const override {}
+		private:
+			void handleDimensionsChanged() override {}
+		};
+
+		class NullClipScope : public ClipScope
+		{
+		public:
+			explicit NullClipScope(const rect& r) : ClipScope(r) {}
+			void apply(const CameraPtr& cam) const override {}
+			void clear() const override {}
+		};
+
+		class NullClipShapeScope : public ClipShapeScope
+		{
+		public:
+			explicit NullClipShapeScope(const RenderablePtr& r) : ClipShapeScope(r) {}
+			void apply(const CameraPtr& cam) const override {}
+			void clear() const override {}
+		};
+
+		class NullStencilScope : public StencilScope
+		{
+		public:
+			explicit NullStencilScope(const StencilSettings& settings) : StencilScope(settings) {}
+		private:
+			void handleUpdatedMask() override {}
+			void handleUpdatedSettings() override {}
+		};
+
+		class NullScissor : public Scissor
+		{
+		public:
+			explicit NullScissor(const rect& area) : Scissor(area) {}
+			void apply() override {}
+			void clear() override {}
+		};
+
+		class NullBlendEquationImpl : public BlendEquationImplBase
+		{
+		public:
+			void apply(const BlendEquation& eqn) const override {}
+			void clear(const BlendEquation& eqn) const override {}
+		};
+	}
+
+	const char* get_render_event_name(RenderEvent::Type type)
+	{
+		switch(type) {
+		case RenderEvent::Type::RENDER:				return "render";
+		case RenderEvent::Type::DRAW:				return "draw";
+		case RenderEvent::Type::ATTRIBUTE_UPLOAD:	return "attribute_upload";
+		case RenderEvent::Type::TEXTURE_CREATE:		return "texture_create";
+		case RenderEvent::Type::TEXTURE_UPDATE:		return "texture_update";
+		case RenderEvent::Type::TARGET_CHANGE:		return "target_change";
+		case RenderEvent::Type::SHADER_CHANGE:		return "shader_change";
+		case RenderEvent::Type::TEXTURE_CHANGE:		return "texture_change";
+		case RenderEvent::Type::BLEND_CHANGE:		return "blend_change";
+		case RenderEvent::Type::DEPTH_CHANGE:		return "depth_change";
+		case RenderEvent::Type::CLEAR:				return "clear";
+		case RenderEvent::Type::SWAP:				return "swap";
+		}
+		ASSERT_LOG(false, "Unknown render event type: " << static_cast<int>(type));
+		return "";
+	}
+
+	DisplayDeviceNull::DisplayDeviceNull(WindowPtr wnd)
+		: DisplayDevice(wnd),
+		  default_camera_(),
+		  viewport_(),
+		  shaders_(),
+		  recording_(),
+		  last_state_(),
+		  rasterize_(false),
+		  frame_(),
+		  clear_color_(0, 0, 0)
+	{
+	}
+
+	DisplayDeviceNull::~DisplayDeviceNull()
+	{
+		stopRecording();
+	}
+
+	void DisplayDeviceNull::startRecording()
+	{
+		active_recording() = &recording_;
+		last_state_.reset();
+	}
+
+	void DisplayDeviceNull::stopRecording()
+	{
+		if(isRecording()) {
+			active_recording() = nullptr;
+		}
+	}
+
+	bool DisplayDeviceNull::isRecording() const
+	{
+		return active_recording() == &recording_;
+	}
+
+	void DisplayDeviceNull::clearRecording()
+	{
+		recording_.clear();
+		last_state_.reset();
+	}
+
+	int DisplayDeviceNull::countEvents(RenderEvent::Type type) const
+	{
+		return static_cast<int>(std::count_if(recording_.begin(), recording_.end(), [type](const RenderEvent& e) {
+			return e.type == type;
+		}));
+	}
+
+	void DisplayDeviceNull::init(int width, int height)
+	{
+		viewport_ = rect(0, 0, width, height);
+		frame_.reset();
+	}
+
+	void DisplayDeviceNull::printDeviceInfo()
+	{
+		LOG_INFO("Null display device");
+	}
+
+	int DisplayDeviceNull::queryParameteri(DisplayDeviceParameters param)
+	{
+		switch(param) {
+		case DisplayDeviceParameters::MAX_TEXTURE_UNITS:	return 16;
+		default: break;
+		}
+		ASSERT_LOG(false, "Unknown value for DisplayDeviceParameters given.");
+		return -1;
+	}
+
+	void DisplayDeviceNull::clearTextures()
+	{
+	}
+
+	void DisplayDeviceNull::clear(ClearFlags clr)
+	{
+		record_event(RenderEvent::Type::CLEAR, this, viewport_.w() * viewport_.h());
+		if(frame_ != nullptr && (clr & ClearFlags::COLOR)) {
+			frame_->fillRect(rect(0, 0, frame_->width(), frame_->height()), clear_color_);
+		}
+	}
+
+	void DisplayDeviceNull::swap()
+	{
+		record_event(RenderEvent::Type::SWAP, this, 0);
+	}
+
+	void DisplayDeviceNull::setClearColor(float r, float g, float b, float a) const
+	{
+		clear_color_ = Color(r, g, b, a);
+	}
+
+	void DisplayDeviceNull::setClearColor(const Color& color) const
+	{
+		clear_color_ = color;
+	}
+
+	CameraPtr DisplayDeviceNull::setDefaultCamera(const CameraPtr& cam)
+	{
+		auto old_cam = default_camera_;
+		default_camera_ = cam;
+		return old_cam;
+	}
+
+	CameraPtr DisplayDeviceNull::getDefaultCamera() const
+	{
+		return default_camera_;
+	}
+
+	void DisplayDeviceNull::doRender(const Renderable* r) const
+	{
+		if(!r->isEnabled()) {
+			return;
+		}
+
+		if(r->hasClipSettings()) {
+			ModelManager2D mm(static_cast<int>(r->getPosition().x), static_cast<int>(r->getPosition().y));
+			render(r->getStencilMask().get());
+		}
+
+		if(active_recording() != nullptr) {
+			record_event(RenderEvent::Type::RENDER, r, 0);
+			recordStateChanges(r);
+		}
+
+		auto shader = r->getShader();
+		shader->makeActive();
+
+		glm::mat4 pmat(1.0f);
+		glm::mat4 vmat(1.0f);
+		if(r->getCamera()) {
+			pmat = r->getCamera()->getProjectionMat();
+			vmat = r->getCamera()->getViewMat();
+		} else if(default_camera_ != nullptr) {
+			pmat = default_camera_->getProjectionMat();
+			vmat = default_camera_->getViewMat();
+		}
+
+		if(r->getRenderTarget()) {
+			r->getRenderTarget()->apply();
+		}
+
+		const glm::mat4 model = is_global_model_matrix_valid() && !r->ignoreGlobalModelMatrix()
+			? get_global_model_matrix() * r->getModelMatrix()
+			: r->getModelMatrix();
+		const glm::mat4 mvp = pmat * vmat * model;
+		const Color color = r->isColorSet() ? r->getColor() : ColorScope::getCurrentColor();
+
+		if(shader->getPUniform() != ShaderProgram::INVALID_UNIFORM) {
+			shader->setUniformValue(shader->getPUniform(), glm::value_ptr(pmat));
+		}
+		if(shader->getMvUniform() != ShaderProgram::INVALID_UNIFORM) {
+			const glm::mat4 mvmat = vmat * model;
+			shader->setUniformValue(shader->getMvUniform(), glm::value_ptr(mvmat));
+		}
+		if(shader->getMvpUniform() != ShaderProgram::INVALID_UNIFORM) {
+			shader->setUniformValue(shader->getMvpUniform(), glm::value_ptr(mvp));
+		}
+		if(shader->getPVUniform() != ShaderProgram::INVALID_UNIFORM) {
+			const glm::mat4 pvmat = pmat * vmat;
+			shader->setUniformValue(shader->getPVUniform(), glm::value_ptr(pvmat));
+		}
+		if(shader->getColorUniform() != ShaderProgram::INVALID_UNIFORM) {
+			shader->setUniformValue(shader->getColorUniform(), color.asFloatVector());
+		}
+
+		shader->setUniformsForTexture(r->getTexture());
+
+		auto uniform_draw_fn = shader->getUniformDrawFunction();
+		if(uniform_draw_fn) {
+			uniform_draw_fn(shader);
+		}
+
+		for(auto as : r->getAttributeSet()) {
+			if(!as->isEnabled()) {
+				continue;
+			}
+			if((!as->isMultiDrawEnabled() && as->getCount() <= 0) || (as->isMultiDrawEnabled() && as->getMultiDrawCount() <= 0)) {
+				continue;
+			}
+			if(shader->getColorUniform() != ShaderProgram::INVALID_UNIFORM && as->isColorSet()) {
+				shader->setUniformValue(shader->getColorUniform(), as->getColor().asFloatVector());
+			}
+			for(auto& attr : as->getAttributes()) {
+				if(attr->isEnabled()) {
+					shader->applyAttribute(attr);
+				}
+			}
+			++get_render_stats().draw_calls;
+			record_event(RenderEvent::Type::DRAW, as.get(), static_cast<int>(as->getCount()));
+			if(rasterize_) {
+				rasterize(r, *as, mvp, as->isColorSet() ? as->getColor() : color);
+			}
+			shader->cleanUpAfterDraw();
+		}
+
+		if(r->getRenderTarget()) {
+			r->getRenderTarget()->unapply();
+		}
+	}
+
+	void DisplayDeviceNull::recordStateChanges(const Renderable* r) const
+	{
+		const RenderStateKey key(*r);
+		const RenderStateKey* last = last_state_.get();
+		if(last == nullptr || last->target != key.target) {
+			record_event(RenderEvent::Type::TARGET_CHANGE, r, 0);
+		}
+		if(last == nullptr || last->shader != key.shader) {
+			record_event(RenderEvent::Type::SHADER_CHANGE, r, 0);
+		}
+		if(last == nullptr || last->texture != key.texture) {
+			record_event(RenderEvent::Type::TEXTURE_CHANGE, r, 0);
+		}
+		if(last == nullptr || last->blend != key.blend) {
+			record_event(RenderEvent::Type::BLEND_CHANGE, r, 0);
+		}
+		if(last == nullptr || last->depth != key.depth) {
+			record_event(RenderEvent::Type::DEPTH_CHANGE, r, 0);
+		}
+
+		if(last_state_ == nullptr) {
+			last_state_.reset(new RenderStateKey(key));
+		} else {
+			*last_state_ = key;
+		}
+	}
+
+	void DisplayDeviceNull::rasterize(const Renderable* r, AttributeSet& as, const glm::mat4& mvp, const Color& color) const
+	{
+		SurfacePtr target;
+		if(applied_null_target() != nullptr) {
+			target = applied_null_target()->getRasterSurface();
+		} else if(viewport_.w() > 0 && viewport_.h() > 0) {
+			if(frame_ == nullptr) {
+				frame_ = create_raster_surface(viewport_.w(), viewport_.h(), clear_color_);
+			}
+			target = frame_;
+		}
+		if(target == nullptr) {
+			return;
+		}
+
+		AttributeBase* pos_attr = nullptr;
+		const AttributeDesc* pos_desc = nullptr;
+		AttributeBase* uv_attr = nullptr;
+		const AttributeDesc* uv_desc = nullptr;
+		for(auto& attr : as.getAttributes()) {
+			if(!attr->isEnabled()) {
+				continue;
+			}
+			for(auto& desc : attr->getAttrDesc()) {
+				if(desc.getAttrType() == AttrType::POSITION && pos_desc == nullptr) {
+					pos_attr = attr.get();
+					pos_desc = &desc;
+				} else if(desc.getAttrType() == AttrType::TEXTURE && uv_desc == nullptr) {
+					uv_attr = attr.get();
+					uv_desc = &desc;
+				}
+			}
+		}
+		if(pos_desc == nullptr) {
+			return;
+		}
+
+		// The vertices drawn, in order.
+		std::vector<int> indices;
+		if(as.isIndexed()) {
+			const void* index_array = as.getIndexArray();
+			for(size_t n = 0; n != as.getCount(); ++n) {
+				switch(as.getIndexType()) {
+				case IndexType::INDEX_UCHAR:	indices.emplace_back(static_cast<const uint8_t*>(index_array)[n]); break;
+				case IndexType::INDEX_USHORT:	indices.emplace_back(static_cast<const uint16_t*>(index_array)[n]); break;
+				case IndexType::INDEX_ULONG:	indices.emplace_back(static_cast<int>(static_cast<const uint32_t*>(index_array)[n])); break;
+				case IndexType::INDEX_NONE:		break;
+				}
+			}
+		} else {
+			for(size_t n = 0; n != as.getCount(); ++n) {
+				indices.emplace_back(static_cast<int>(as.getOffset() + n));
+			}
+		}
+
+		std::vector<RasterVertex> vertices;
+		std::vector<bool> visible;
+		for(int index : indices) {
+			float pos[4] = { 0.0f, 0.0f, 0.0f, 1.0f };
+			float uv[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+			read_vertex(*pos_attr, *pos_desc, index, pos);
+			if(uv_desc != nullptr) {
+				read_vertex(*uv_attr, *uv_desc, index, uv);
+			}
+			const glm::vec4 clip = mvp * glm::vec4(pos[0], pos[1], pos[2], pos[3]);
+			RasterVertex v;
+			v.pos = glm::vec2((clip.x / clip.w * 0.5f + 0.5f) * target->width(), (0.5f - clip.y / clip.w * 0.5f) * target->height());
+			v.uv = glm::vec2(uv[0], uv[1]);
+			vertices.emplace_back(v);
+			visible.emplace_back(clip.w > 0.0f);
+		}
+
+		const TextureSampler sampler(r->getTexture());
+		const glm::vec4 fill(color.r(), color.g(), color.b(), color.a());
+		auto draw = [&](size_t a, size_t b, size_t c) {
+			if(visible[a] && visible[b] && visible[c]) {
+				fill_triangle(*target, vertices[a], vertices[b], vertices[c], fill, sampler);
+			}
+		};
+
+		const size_t count = vertices.size();
+		switch(as.getDrawMode()) {
+		case DrawMode::TRIANGLES:
+			for(size_t n = 0; n + 2 < count; n += 3) {
+				draw(n, n + 1, n + 2);
+			}
+			break;
+		case DrawMode::TRIANGLE_STRIP:
+		case DrawMode::QUAD_STRIP:
+			for(size_t n = 0; n + 2 < count; ++n) {
+				draw(n, n + 1, n + 2);
+			}
+			break;
+		case DrawMode::TRIANGLE_FAN:
+		case DrawMode::POLYGON:
+			for(size_t n = 1; n + 1 < count; ++n) {
+				draw(0, n, n + 1);
+			}
+			break;
+		case DrawMode::QUADS:
+			for(size_t n = 0; n + 3 < count; n += 4) {
+				draw(n, n + 1, n + 2);
+				draw(n, n + 2, n + 3);
+			}
+			break;
+		default:
+			// Points and lines aren't rasterized.
+			break;
+		}
+	}
+
+	ScissorPtr DisplayDeviceNull::getScissor(const rect& r)
+	{
+		return std::make_shared<NullScissor>(r);
+	}
+
+	TexturePtr DisplayDeviceNull::handleCreateTexture(const SurfacePtr& surface, const variant& node)
+	{
+		std::vector<SurfacePtr> surfaces;
+		if(surface != nullptr) {
+			surfaces.emplace_back(surface);
+		}
+		return record_texture_creation(std::make_shared<NullTexture>(node, surfaces));
+	}
+
+	TexturePtr DisplayDeviceNull::handleCreateTexture(const SurfacePtr& surface, TextureType type, int mipmap_levels)
+	{
+		std::vector<SurfacePtr> surfaces(1, surface);
+		return record_texture_creation(std::make_shared<NullTexture>(surfaces, type, mipmap_levels));
+	}
+
+	TexturePtr DisplayDeviceNull::handleCreateTexture1D(int width, PixelFormat::PF fmt)
+	{
+		return record_texture_creation(std::make_shared<NullTexture>(1, width, 0, 0, fmt, TextureType::TEXTURE_1D));
+	}
+
+	TexturePtr DisplayDeviceNull::handleCreateTexture2D(int width, int height, PixelFormat::PF fmt)
+	{
+		const int count = fmt == PixelFormat::PF::PIXELFORMAT_YV12 ? 3 : 1;
+		return record_texture_creation(std::make_shared<NullTexture>(count, width, height, 0, fmt, TextureType::TEXTURE_2D));
+	}
+
+	TexturePtr DisplayDeviceNull::handleCreateTexture3D(int width, int height, int depth, PixelFormat::PF fmt)
+	{
+		return record_texture_creation(std::make_shared<NullTexture>(1, width, height, depth, fmt, TextureType::TEXTURE_3D));
+	}
+
+	TexturePtr DisplayDeviceNull::handleCreateTextureArray(int count, int width, int height, PixelFormat::PF fmt, TextureType type)
+	{
+		return record_texture_creation(std::make_shared<NullTexture>(count, width, height, 0, fmt, type));
+	}
+
+	TexturePtr DisplayDeviceNull::handleCreateTextureArray(const std::vector<SurfacePtr>& surfaces, const variant& node)
+	{
+		return record_texture_creation(std::make_shared<NullTexture>(node, surfaces));
+	}
+
+	RenderTargetPtr DisplayDeviceNull::handleCreateRenderTarget(int width, int height,
+			int color_plane_count,
+			bool depth,
+			bool stencil,
+			bool use_multi_sampling,
+			int multi_samples)
+	{
+		return std::make_shared<NullRenderTarget>(width, height, color_plane_count, depth, stencil, use_multi_sampling, multi_samples);
+	}
+
+	RenderTargetPtr DisplayDeviceNull::handleCreateRenderTarget(const variant& node)
+	{
+		return std::make_shared<NullRenderTarget>(node);
+	}
+
+	AttributeSetPtr DisplayDeviceNull::handleCreateAttributeSet(bool indexed, bool instanced)
+	{
+		// Use the software attribute sets.
+		return nullptr;
+	}
+
+	HardwareAttributePtr DisplayDeviceNull::handleCreateAttribute(AttributeBase* parent)
+	{
+		return nullptr;
+	}
+
+	HardwareAttributePtr DisplayDeviceNull::handleCreateSoftwareAttribute(AttributeBase* parent)
+	{
+		return std::make_shared<NullAttribute>(parent);
+	}
+
+	CanvasPtr DisplayDeviceNull::getCanvas()
+	{
+		static CanvasPtr res = std::make_shared<NullCanvas>();
+		return res;
+	}
+
+	ClipScopePtr DisplayDeviceNull::createClipScope(const rect& r)
+	{
+		return ClipScopePtr(new NullClipScope(r));
+	}
+
+	ClipShapeScopePtr DisplayDeviceNull::createClipShapeScope(const RenderablePtr& r)
+	{
+		return ClipShapeScopePtr(new NullClipShapeScope(r));
+	}
+
+	StencilScopePtr DisplayDeviceNull::createStencilScope(const StencilSettings& settings)
+	{
+		return StencilScopePtr(new NullStencilScope(settings));
+	}
+
+	BlendEquationImplBasePtr DisplayDeviceNull::getBlendEquationImpl()
+	{
+		return std::make_shared<NullBlendEquationImpl>();
+	}
+
+	void DisplayDeviceNull::setViewPort(int x, int y, int width, int height)
+	{
+		viewport_ = rect(x, y, width, height);
+	}
+
+	void DisplayDeviceNull::setViewPort(const rect& vp)
+	{
+		viewport_ = vp;
+	}
+
+	const rect& DisplayDeviceNull::getViewPort() const
+	{
+		return viewport_;
+	}
+
+	bool DisplayDeviceNull::doCheckForFeature(DisplayDeviceCapabilities cap)
+	{
+		switch(cap) {
+		case DisplayDeviceCapabilities::NPOT_TEXTURES:
+		case DisplayDeviceCapabilities::BLEND_EQUATION_SEPERATE:
+		case DisplayDeviceCapabilities::RENDER_TO_TEXTURE:
+		case DisplayDeviceCapabilities::SHADERS:
+			return true;
+		case DisplayDeviceCapabilities::UNIFORM_BUFFERS:
+			return false;
+		default:
+			ASSERT_LOG(false, "Unknown value for DisplayDeviceCapabilities given.");
+		}
+		return false;
+	}
+
+	void DisplayDeviceNull::loadShadersFromVariant(const variant& node)
+	{
+	}
+
+	ShaderProgramPtr DisplayDeviceNull::getShaderProgram(const std::string& name)
+	{
+		auto& shader = shaders_[name];
+		if(shader == nullptr) {
+			shader = std::make_shared<NullShaderProgram>(name, variant());
+		}
+		return shader;
+	}
+
+	ShaderProgramPtr DisplayDeviceNull::getShaderProgram(const variant& node)
+	{
+		ASSERT_LOG(node.has_key("name"), "Shader definitions must have a 'name' attribute: " << node.to_debug_string());
+		return getShaderProgram(node["name"].as_string());
+	}
+
+	ShaderProgramPtr DisplayDeviceNull::getDefaultShader()
+	{
+		return getShaderProgram("default");
+	}
+
+	ShaderProgramPtr DisplayDeviceNull::createShader(const std::string& name,
+		const std::vector<ShaderData>& shader_data,
+		const std::vector<ActiveMapping>& uniform_map,
+		const std::vector<ActiveMapping>& attribute_map)
+	{
+		return getShaderProgram(name);
+	}
+
+	ShaderProgramPtr DisplayDeviceNull::createGaussianShader(int radius)
+	{
+		return getShaderProgram("gaussian" + std::to_string(radius));
+	}
+
+	void DisplayDeviceNull::doBlitTexture(const TexturePtr& tex, int dstx, int dsty, int dstw, int dsth, float rotation, int srcx, int srcy, int srcw, int srch)
+	{
+		ASSERT_LOG(false, "DisplayDevice::doBlitTexture deprecated");
+	}
+
+	bool DisplayDeviceNull::handleReadPixels(int x, int y, unsigned width, unsigned height, ReadFormat fmt, AttrFormat type, void* data, int stride)
+	{
+		std::fill(static_cast<uint8_t*>(data), static_cast<uint8_t*>(data) + height * stride, 0);
+		return true;
+	}
+
+	EffectPtr DisplayDeviceNull::createEffect(const variant& node)
+	{
+		return EffectPtr();
+	}
+}
+
+namespace
+{
+	// A null display device made current for the lifetime of the object, with
+	// a renderable drawing a red quad over the whole viewport.
+	struct NullDeviceFixture
+	{
+		NullDeviceFixture()
+			: device(std::make_shared<KRE::DisplayDeviceNull>(KRE::WindowPtr())),
+			  previous(KRE::DisplayDevice::setCurrent(device)),
+			  quad(new KRE::Renderable())
+		{
+			device->init(8, 8);
+			device->startRecording();
+
+			quad->setShader(device->getShaderProgram("a"));
+			quad->setColor(KRE::Color(1.0f, 0.0f, 0.0f));
+			auto as = KRE::DisplayDevice::createAttributeSet(true, false, false);
+			as->setDrawMode(KRE::DrawMode::TRIANGLE_STRIP);
+			auto pos = std::make_shared<KRE::Attribute<glm::vec2>>(KRE::AccessFreqHint::DYNAMIC);
+			pos->addAttributeDesc(KRE::AttributeDesc(KRE::AttrType::POSITION, 2, KRE::AttrFormat::FLOAT, false));
+			as->addAttribute(pos);
+			quad->addAttributeSet(as);
+
+			std::vector<glm::vec2> vertices;
+			vertices.emplace_back(-1.0f, -1.0f);
+			vertices.emplace_back(1.0f, -1.0f);
+			vertices.emplace_back(-1.0f, 1.0f);
+			vertices.emplace_back(1.0f, 1.0f);
+			pos->update(vertices);
+		}
+
+		~NullDeviceFixture()
+		{
+			KRE::DisplayDevice::setCurrent(previous);
+		}
+
+		std::shared_ptr<KRE::DisplayDeviceNull> device;
+		KRE::DisplayDevicePtr previous;
+		KRE::RenderablePtr quad;
+	};
+}
+
+UNIT_TEST(null_display_device_records_events)
+{
+	NullDeviceFixture fixture;
+	auto& device = *fixture.device;
+	CHECK_EQ(device.countEvents(KRE::RenderEvent::Type::ATTRIBUTE_UPLOAD), 1);
+	CHECK_EQ(device.getRecording().back().count, static_cast<int>(4 * sizeof(glm::vec2)));
+
+	auto tex = KRE::DisplayDevice::createTexture2D(4, 2, KRE::PixelFormat::PF::PIXELFORMAT_RGBA8888);
+	CHECK_EQ(device.countEvents(KRE::RenderEvent::Type::TEXTURE_CREATE), 1);
+	CHECK_EQ(device.getRecording().back().count, 8);
+
+	device.clearRecording();
+	device.render(fixture.quad.get());
+	device.render(fixture.quad.get());
+	fixture.quad->setTexture(tex);
+	device.render(fixture.quad.get());
+	device.swap();
+
+	CHECK_EQ(device.countEvents(KRE::RenderEvent::Type::RENDER), 3);
+	CHECK_EQ(device.countEvents(KRE::RenderEvent::Type::DRAW), 3);
+	CHECK_EQ(device.countEvents(KRE::RenderEvent::Type::SHADER_CHANGE), 1);
+	CHECK_EQ(device.countEvents(KRE::RenderEvent::Type::TEXTURE_CHANGE), 2);
+	CHECK_EQ(device.countEvents(KRE::RenderEvent::Type::SWAP), 1);
+	CHECK_EQ(device.getRecording().back().type == KRE::RenderEvent::Type::SWAP, true);
+
+	device.stopRecording();
+	device.render(fixture.quad.get());
+	CHECK_EQ(device.countEvents(KRE::RenderEvent::Type::RENDER), 3);
+}
+
+UNIT_TEST(null_display_device_rasterizes)
+{
+	NullDeviceFixture fixture;
+	auto& device = *fixture.device;
+	device.setRasterizing(true);
+	device.setClearColor(KRE::Color(0, 0, 255));
+	device.render(fixture.quad.get());
+
+	auto frame = device.getFrameSurface();
+	CHECK_EQ(frame != nullptr, true);
+	CHECK_EQ(frame->width(), 8);
+	for(int y = 0; y != frame->height(); ++y) {
+		const uint8_t* row = static_cast<const uint8_t*>(frame->pixels()) + y * frame->rowPitch();
+		for(int x = 0; x != frame->width(); ++x) {
+			CHECK_EQ(static_cast<int>(row[x*4 + 0]), 255);
+			CHECK_EQ(static_cast<int>(row[x*4 + 2]), 0);
+			CHECK_EQ(static_cast<int>(row[x*4 + 3]), 255);
+		}
+	}
+
+	device.clear(KRE::ClearFlags::COLOR);
+	CHECK_EQ(static_cast<int>(static_cast<const uint8_t*>(frame->pixels())[2]), 255);
+}
+
+BENCHMARK(null_display_device_recording)
+{
+	NullDeviceFixture fixture;
+	BENCHMARK_LOOP {
+		fixture.device->clearRecording();
+		fixture.device->render(fixture.quad.get());
+	}
+}
+
+BENCHMARK(null_display_device_rasterizing)
+{
+	NullDeviceFixture fixture;
+	fixture.device->init(256, 256);
+	fixture.device->setRasterizing(true);
+	BENCHMARK_LOOP {
+		fixture.device->render(fixture.quad.get());
+	}
+}
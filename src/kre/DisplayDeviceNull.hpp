@@ -0,0 +1,185 @@
+/*
+	Copyright (C) 2013-2014 by Kristina Simpson <sweet.kristas@gmail.com>
+
+	This software is provided 'as-is', without any express or implied
+	warranty. In no event will the authors be held liable for any damages
+	arising from the use of this software.
+
+	Permission is granted to anyone to use this software for any purpose,
+	including commercial applications, and to alter it and redistribute it
+	freely, subject to the following restrictions:
+
+	   1. The origin of this software must not be misrepresented; you must not
+	   claim that you wrote the original software. If you use this software
+	   in a product, an acknowledgement in the product documentation would be
+	   appreciated but is not required.
+
+	   2. Altered source versions must be plainly marked as such, and must not be
+	   misrepresented as being the original software.
+
+	   3. This notice may not be removed or altered from any source
+	   distribution.
+*/
+
+#pragma once
+
+#include <map>
+#include <memory>
+#include <vector>
+
+#include "DisplayDevice.hpp"
+#include "RenderCommandBuffer.hpp"
+
+namespace KRE
+{
+	// Something the null display device was asked to do while recording.
+	struct RenderEvent
+	{
+		enum class Type {
+			// A renderable was drawn. object is the renderable.
+			RENDER,
+			// A draw call was made. object is the attribute set and count the
+			// number of vertices drawn.
+			DRAW,
+			// Attribute data was uploaded. object is the attribute and count
+			// the number of bytes.
+			ATTRIBUTE_UPLOAD,
+			// A texture was created or had pixels written to it. object is the
+			// texture and count the number of texels.
+			TEXTURE_CREATE,
+			TEXTURE_UPDATE,
+			// The state needed to draw a renderable differs from that of the
+			// last one drawn. object is the renderable.
+			TARGET_CHANGE,
+			SHADER_CHANGE,
+			TEXTURE_CHANGE,
+			BLEND_CHANGE,
+			DEPTH_CHANGE,
+			CLEAR,
+			SWAP,
+		};
+		RenderEvent(Type t, const void* obj, int n) : type(t), object(obj), count(n) {}
+		Type type;
+		const void* object;
+		int count;
+	};
+
+	const char* get_render_event_name(RenderEvent::Type type);
+
+	// A display device which draws nothing, for running the render path
+	// without a GPU. It goes through the same steps as the OpenGL device,
+	// writing the same uniforms and making one draw call per attribute set,
+	// so the render statistics it gathers match what OpenGL would see.
+	//
+	// While recording, what it is asked to do is appended to a list of
+	// events which can be inspected afterwards. When rasterizing, triangles
+	// are drawn in software into the surface of the applied render target, or
+	// into the frame surface if there is none. The rasterizer is only meant
+	// for checking what was drawn where: it does flat shading modulated by the
+	// texture, with alpha blending, and ignores anything shaders would do.
+	class DisplayDeviceNull : public DisplayDevice
+	{
+	public:
+		explicit DisplayDeviceNull(WindowPtr wnd);
+		~DisplayDeviceNull();
+
+		void startRecording();
+		void stopRecording();
+		bool isRecording() const;
+		const std::vector<RenderEvent>& getRecording() const { return recording_; }
+		void clearRecording();
+		// The number of events of the given type recorded.
+		int countEvents(RenderEvent::Type type) const;
+
+		void setRasterizing(bool rasterize) { rasterize_ = rasterize; }
+		bool isRasterizing() const { return rasterize_; }
+		const SurfacePtr& getFrameSurface() const { return frame_; }
+
+		DisplayDeviceId ID() const override { return DISPLAY_DEVICE_NULL; }
+
+		void swap() override;
+		void clear(ClearFlags clr) override;
+
+		void setClearColor(float r, float g, float b, float a) const override;
+		void setClearColor(const Color& color) const override;
+
+		CameraPtr setDefaultCamera(const CameraPtr& cam) override;
+		CameraPtr getDefaultCamera() const override;
+
+		CanvasPtr getCanvas() override;
+		ClipScopePtr createClipScope(const rect& r) override;
+		ClipShapeScopePtr createClipShapeScope(const RenderablePtr& r) override;
+		StencilScopePtr createStencilScope(const StencilSettings& settings) override;
+		ScissorPtr getScissor(const rect& r) override;
+
+		void clearTextures() override;
+
+		EffectPtr createEffect(const variant& node) override;
+
+		void loadShadersFromVariant(const variant& node) override;
+		ShaderProgramPtr getShaderProgram(const std::string& name) override;
+		ShaderProgramPtr getShaderProgram(const variant& node) override;
+		ShaderProgramPtr getDefaultShader() override;
+		ShaderProgramPtr createShader(const std::string& name,
+			const std::vector<ShaderData>& shader_data,
+			const std::vector<ActiveMapping>& uniform_map,
+			const std::vector<ActiveMapping>& attribute_map) override;
+		ShaderProgramPtr createGaussianShader(int radius) override;
+
+		BlendEquationImplBasePtr getBlendEquationImpl() override;
+
+		void init(int width, int height) override;
+		void printDeviceInfo() override;
+
+		int queryParameteri(DisplayDeviceParameters param) override;
+
+		void setViewPort(const rect& vp) override;
+		void setViewPort(int x, int y, int width, int height) override;
+		const rect& getViewPort() const override;
+	private:
+		DisplayDeviceNull();
+		DisplayDeviceNull(const DisplayDeviceNull&);
+
+		AttributeSetPtr handleCreateAttributeSet(bool indexed, bool instanced) override;
+		HardwareAttributePtr handleCreateAttribute(AttributeBase* parent) override;
+		HardwareAttributePtr handleCreateSoftwareAttribute(AttributeBase* parent) override;
+
+		RenderTargetPtr handleCreateRenderTarget(int width, int height,
+			int color_plane_count,
+			bool depth,
+			bool stencil,
+			bool use_multi_sampling,
+			int multi_samples) override;
+		RenderTargetPtr handleCreateRenderTarget(const variant& node) override;
+		void doBlitTexture(const TexturePtr& tex, int dstx, int dsty, int dstw, int dsth, float rotation, int srcx, int srcy, int srcw, int srch) override;
+
+		bool doCheckForFeature(DisplayDeviceCapabilities cap) override;
+
+		void doRender(const Renderable* r) const override;
+		void recordStateChanges(const Renderable* r) const;
+		void rasterize(const Renderable* r, AttributeSet& as, const glm::mat4& mvp, const Color& color) const;
+
+		TexturePtr handleCreateTexture(const SurfacePtr& surface, TextureType type, int mipmap_levels) override;
+		TexturePtr handleCreateTexture(const SurfacePtr& surface, const variant& node) override;
+
+		TexturePtr handleCreateTexture1D(int width, PixelFormat::PF fmt) override;
+		TexturePtr handleCreateTexture2D(int width, int height, PixelFormat::PF fmt) override;
+		TexturePtr handleCreateTexture3D(int width, int height, int depth, PixelFormat::PF fmt) override;
+
+		TexturePtr handleCreateTextureArray(int count, int width, int height, PixelFormat::PF fmt, TextureType type) override;
+		TexturePtr handleCreateTextureArray(const std::vector<SurfacePtr>& surfaces, const variant& node) override;
+
+		bool handleReadPixels(int x, int y, unsigned width, unsigned height, ReadFormat fmt, AttrFormat type, void* data, int stride) override;
+
+		CameraPtr default_camera_;
+		rect viewport_;
+		std::map<std::string, ShaderProgramPtr> shaders_;
+
+		std::vector<RenderEvent> recording_;
+		mutable std::unique_ptr<RenderStateKey> last_state_;
+
+		bool rasterize_;
+		mutable SurfacePtr frame_;
+		mutable Color clear_color_;
+	};
+}
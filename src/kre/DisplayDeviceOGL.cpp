@@ -37,6 +37,7 @@
 #include "FboOGL.hpp"
 #include "LightObject.hpp"
 #include "ModelMatrixScope.hpp"
+#include "RenderCommandBuffer.hpp"
 #include "ScissorOGL.hpp"
 #include "ShadersOGL.hpp"
 #include "StencilScopeOGL.hpp"
@@ -271,7 +272,7 @@ namespace KRE
 		return get_default_camera();
 	}
 
-	void DisplayDeviceOpenGL::render(const Renderable* r) const
+	void DisplayDeviceOpenGL::doRender(const Renderable* r) const
 	{
 		if(!r->isEnabled()) {
 			// Renderable item not enabled then early return.
@@ -430,6 +431,7 @@ namespace KRE
 				}
 			}
 
+			++get_render_stats().draw_calls;
 			if(as->isInstanced()) {
 				if(as->isIndexed()) {
 					as->bindIndex();
@@ -45,8 +45,6 @@ namespace KRE
 		void setClearColor(float r, float g, float b, float a) const override;
 		void setClearColor(const Color& color) const override;
 
-		void render(const Renderable* r) const override;
-
 		// Lets us set a default camera if nothing else is configured.
 		CameraPtr setDefaultCamera(const CameraPtr& cam) override;
 		CameraPtr getDefaultCamera() const override;
@@ -99,6 +97,8 @@ namespace KRE
 
 		bool doCheckForFeature(DisplayDeviceCapabilities cap) override;
 
+		void doRender(const Renderable* r) const override;
+
 		TexturePtr handleCreateTexture(const SurfacePtr& surface, TextureType type, int mipmap_levels) override;
 		TexturePtr handleCreateTexture(const SurfacePtr& surface, const variant& node) override;
 
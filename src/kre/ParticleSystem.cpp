@@ -35,7 +35,13 @@
 #include "WindowManager.hpp"
 #include "variant_utils.hpp"
 #include "profile_timer.hpp"
+#include "DisplayDeviceNull.hpp"
+#include "json_parser.hpp"
+#include "unit_test.hpp"
 #include "../preferences.hpp"
+#include "../task_scheduler.hpp"
+
+PREF_INT(particle_batch_size, 8192, "Particle systems with more than this many particles are updated in batches of at least this many on worker threads, 0 to always update them on one thread");
 
 namespace KRE
 {
@@ -56,6 +62,34 @@ namespace KRE
 			}
 		}
 
+		void for_each_particle_run(std::vector<Particle>& particles, const std::function<void(std::vector<Particle>::iterator, std::vector<Particle>::iterator)>& fn)
+		{
+			const size_t count = particles.size();
+			size_t njobs = 1;
+			if(g_particle_batch_size > 0) {
+				const size_t batch_size = static_cast<size_t>(g_particle_batch_size);
+				njobs = std::min<size_t>(static_cast<size_t>(task_scheduler::numWorkers() + 1), count/batch_size);
+			}
+			if(njobs <= 1) {
+				fn(particles.begin(), particles.end());
+				return;
+			}
+
+			std::vector<task_scheduler::TaskPtr> tasks;
+			const size_t per_job = (count + njobs - 1)/njobs;
+			for(size_t job = 1; job < njobs; ++job) {
+				const size_t begin = std::min(count, job*per_job);
+				const size_t end = std::min(count, begin + per_job);
+				tasks.push_back(task_scheduler::submit([&particles, &fn, begin, end]() {
+					fn(particles.begin() + begin, particles.begin() + end);
+				}, task_scheduler::PRIORITY::HIGH));
+			}
+
+			// this thread takes the first run, then waits for the others.
+			fn(particles.begin(), particles.begin() + std::min(count, per_job));
+			task_scheduler::wait(tasks);
+		}
+
 		void init_physics_parameters(PhysicsParameters& pp)
 		{
 			pp.position = glm::vec3(0.0f);
@@ -357,10 +391,23 @@ namespace KRE
 				a->emitProcess(dt);
 			}
 
-			// Decrement the ttl on particles
-			for(auto& p : active_particles_) {
-				p.current.time_to_live -= dt;
-			}
+			// Decrement the ttl on particles and update their positions in one
+			// pass over them.
+			const float* max_velocity = max_velocity_.get();
+			const float step = getScaleVelocity() * dt;
+			for_each_particle_run(active_particles_, [dt, max_velocity, step](std::vector<Particle>::iterator first, std::vector<Particle>::iterator last) {
+				for(auto it = first; it != last; ++it) {
+					auto& p = it->current;
+					p.time_to_live -= dt;
+					if(max_velocity != nullptr) {
+						const float len = glm::length(p.direction);
+						if(p.velocity*len > *max_velocity) {
+							p.direction *= *max_velocity / len;
+						}
+					}
+					p.position += p.direction * (p.velocity * step);
+				}
+			});
 
 			active_emitter_->current.time_to_live -= dt;
 
@@ -392,16 +439,6 @@ namespace KRE
 			//std::cerr << *a << std::endl;
 			}*/
 
-			// update particle positions
-			for(auto& p : active_particles_) {
-				if(max_velocity_ && p.current.velocity*glm::length(p.current.direction) > *max_velocity_) {
-					p.current.direction *= *max_velocity_ / glm::length(p.current.direction);
-				}
-
-				p.current.position += p.current.direction * p.current.velocity * getScaleVelocity() * dt;
-
-				//std::cerr << p << std::endl;
-			}
 			//if(active_particles_.size() > 0) {
 			//	std::cerr << active_particles_[0] << std::endl;
 			//}
@@ -751,3 +788,29 @@ namespace KRE
 		}
 	}
 }
+
+BENCHMARK(particle_system_100k)
+{
+	auto device = std::make_shared<KRE::DisplayDeviceNull>(KRE::WindowPtr());
+	auto previous = KRE::DisplayDevice::setCurrent(device);
+	{
+		auto sg = KRE::SceneGraph::create("particle_benchmark");
+		auto psc = KRE::Particles::ParticleSystemContainer::create(sg, json::parse(
+			"{particle_quota: 100000, max_velocity: 500,"
+			" emitter: {type: 'point', emission_rate: 100000, force_emission: true, time_to_live: 1000000, velocity: 50},"
+			" affector: ["
+			"  {type: 'gravity', gravity: 5, position: [0,100,0]},"
+			"  {type: 'linear_force', force: 2, direction: [0,-1,0]},"
+			"  {type: 'jet', acceleration: 0.01},"
+			"  {type: 'colour', time_colour: [{time: 0, colour: [1,1,1,1]}, {time: 1, colour: [1,0,0,0]}]},"
+			"  {type: 'scale', scale_xyz: {type: 'curved_linear', control_point: [[0,1],[1,4]]}}"
+			" ]}"));
+		auto& psystem = psc->getParticleSystem();
+		psystem->emitProcess(0.02f);
+		CHECK_EQ(psystem->getParticleCount(), 100000);
+		BENCHMARK_LOOP {
+			psystem->emitProcess(0.02f);
+		}
+	}
+	KRE::DisplayDevice::setCurrent(previous);
+}
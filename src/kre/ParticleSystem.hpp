@@ -23,6 +23,7 @@
 
 #pragma once
 
+#include <functional>
 #include <memory>
 #include <random>
 #include <sstream>
@@ -98,6 +99,12 @@ namespace KRE
 			bool init_pos;
 		};
 
+		// Calls fn with runs of particles which between them cover all of the
+		// particles. Large numbers of particles are split into several runs which
+		// are processed at the same time on worker threads, so fn must only
+		// change the particles it's given.
+		void for_each_particle_run(std::vector<Particle>& particles, const std::function<void(std::vector<Particle>::iterator, std::vector<Particle>::iterator)>& fn);
+
 		// General class for emitter objects which encapsulate and exposes physical parameters
 		// Used as a base class for everything that is not
 		class EmitObject : public Particle
@@ -172,8 +172,20 @@ namespace KRE
 			auto& psystem = getParentContainer()->getParticleSystem();
 			internalApply(*psystem->getEmitter(),t);
 
-			for(auto& p : psystem->getActiveParticles()) {
-				internalApply(p,t);
+			auto& particles = psystem->getActiveParticles();
+			if(canApplyConcurrently()) {
+				for_each_particle_run(particles, [this, t](std::vector<Particle>::iterator first, std::vector<Particle>::iterator last) {
+					internalApplyRange(first, last, t);
+				});
+			} else {
+				internalApplyRange(particles.begin(), particles.end(), t);
+			}
+		}
+
+		void Affector::internalApplyRange(std::vector<Particle>::iterator first, std::vector<Particle>::iterator last, float t)
+		{
+			for(auto it = first; it != last; ++it) {
+				internalApply(*it, t);
 			}
 		}
 
@@ -433,6 +445,20 @@ namespace KRE
 			}
 		}
 
+		void TimeColorAffector::internalApplyRange(std::vector<Particle>::iterator first, std::vector<Particle>::iterator last, float t)
+		{
+			if(tc_data_.empty()) {
+				return;
+			}
+			for(auto it = first; it != last; ++it) {
+				TimeColorAffector::internalApply(*it, t);
+			}
+		}
+
+		bool TimeColorAffector::canApplyConcurrently() const
+		{
+			return true;
+		}
 
 		void TimeColorAffector::handleWrite(variant_builder* build) const
 		{
@@ -494,6 +520,28 @@ namespace KRE
 			}
 		}
 
+		void JetAffector::internalApplyRange(std::vector<Particle>::iterator first, std::vector<Particle>::iterator last, float t)
+		{
+			if(acceleration_->getType() != ParameterType::FIXED) {
+				Affector::internalApplyRange(first, last, t);
+				return;
+			}
+			const float scale = t * acceleration_->getValue();
+			for(auto it = first; it != last; ++it) {
+				auto& p = *it;
+				if(p.current.direction.x == 0 && p.current.direction.y == 0 && p.current.direction.z == 0) {
+					p.current.direction += p.initial.direction * scale;
+				} else {
+					p.current.direction += p.current.direction * scale;
+				}
+			}
+		}
+
+		bool JetAffector::canApplyConcurrently() const
+		{
+			return acceleration_->getType() != ParameterType::RANDOM;
+		}
+
 		void JetAffector::handleWrite(variant_builder* build) const
 		{
 			if(acceleration_) {
@@ -580,6 +628,30 @@ namespace KRE
 			}
 		}
 
+		void GravityAffector::internalApplyRange(std::vector<Particle>::iterator first, std::vector<Particle>::iterator last, float t)
+		{
+			// Unless it's random the gravity is the same for every particle.
+			if(gravity_->getType() == ParameterType::RANDOM) {
+				Affector::internalApplyRange(first, last, t);
+				return;
+			}
+			const float gravity = gravity_->getValue(t) * getMass() * t;
+			const glm::vec3 position = getPosition();
+			for(auto it = first; it != last; ++it) {
+				auto& p = it->current;
+				const glm::vec3 d = position - p.position;
+				const float len = std::sqrt(glm::dot(d, d));
+				if(len > 0) {
+					p.direction += (gravity * p.mass / len) * d;
+				}
+			}
+		}
+
+		bool GravityAffector::canApplyConcurrently() const
+		{
+			return gravity_->getType() != ParameterType::RANDOM;
+		}
+
 		void GravityAffector::handleWrite(variant_builder* build) const
 		{
 			if(gravity_ && gravity_->getType() != ParameterType::FIXED && gravity_->getValue() != 1.0f) {
@@ -680,6 +752,23 @@ namespace KRE
 			}
 		}
 
+		void ScaleAffector::internalApplyRange(std::vector<Particle>::iterator first, std::vector<Particle>::iterator last, float t)
+		{
+			for(auto it = first; it != last; ++it) {
+				ScaleAffector::internalApply(*it, t);
+			}
+		}
+
+		bool ScaleAffector::canApplyConcurrently() const
+		{
+			for(auto& s : { scale_x_, scale_y_, scale_z_, scale_xyz_ }) {
+				if(s != nullptr && s->getType() == ParameterType::RANDOM) {
+					return false;
+				}
+			}
+			return true;
+		}
+
 		void ScaleAffector::handleWrite(variant_builder* build) const
 		{
 			if(since_system_start_) {
@@ -732,6 +821,23 @@ namespace KRE
 			p.current.direction += direction_*scale;
 		}
 
+		void LinearForceAffector::internalApplyRange(std::vector<Particle>::iterator first, std::vector<Particle>::iterator last, float t)
+		{
+			if(force_->getType() != ParameterType::FIXED) {
+				Affector::internalApplyRange(first, last, t);
+				return;
+			}
+			const glm::vec3 dv = direction_ * (t * force_->getValue());
+			for(auto it = first; it != last; ++it) {
+				it->current.direction += dv;
+			}
+		}
+
+		bool LinearForceAffector::canApplyConcurrently() const
+		{
+			return force_->getType() != ParameterType::RANDOM;
+		}
+
 		void LinearForceAffector::handleWrite(variant_builder* build) const
 		{
 			if(force_) {
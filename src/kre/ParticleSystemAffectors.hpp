@@ -79,6 +79,13 @@ namespace KRE
 			static AffectorPtr factory(std::weak_ptr<ParticleSystemContainer> parent, AffectorType type);
 		protected:
 			virtual void handleEmitProcess(float t) override;
+			// Applies the affector to each particle in [first, last). Affectors
+			// which can do this more efficiently than one particle at a time
+			// override it.
+			virtual void internalApplyRange(std::vector<Particle>::iterator first, std::vector<Particle>::iterator last, float t);
+			// Whether internalApplyRange may be called for different particles
+			// from different threads at once.
+			virtual bool canApplyConcurrently() const { return false; }
 		private:
 			virtual void init(const variant& node) = 0;
 			virtual void internalApply(Particle& p, float t) = 0;
@@ -120,6 +127,8 @@ namespace KRE
 			void setInterpolate(bool f) { interpolate_ = f; }
 		private:
 			void internalApply(Particle& p, float t) override;
+			void internalApplyRange(std::vector<Particle>::iterator first, std::vector<Particle>::iterator last, float t) override;
+			bool canApplyConcurrently() const override;
 			AffectorPtr clone() const override {
 				return std::make_shared<TimeColorAffector>(*this);
 			}
@@ -189,6 +198,8 @@ namespace KRE
 			const ParameterPtr& getAcceleration() const { return acceleration_; }
 		private:
 			void internalApply(Particle& p, float t) override;
+			void internalApplyRange(std::vector<Particle>::iterator first, std::vector<Particle>::iterator last, float t) override;
+			bool canApplyConcurrently() const override;
 			AffectorPtr clone() const override {
 				return std::make_shared<JetAffector>(*this);
 			}
@@ -211,6 +222,8 @@ namespace KRE
 			virtual bool showPositionUI() const override { return true; }
 		private:
 			void internalApply(Particle& p, float t) override;
+			void internalApplyRange(std::vector<Particle>::iterator first, std::vector<Particle>::iterator last, float t) override;
+			bool canApplyConcurrently() const override;
 			AffectorPtr clone() const override {
 				return std::make_shared<GravityAffector>(*this);
 			}
@@ -232,6 +245,8 @@ namespace KRE
 			void setDirection(const glm::vec3& d) { direction_ = d; }
 		private:
 			void internalApply(Particle& p, float t) override;
+			void internalApplyRange(std::vector<Particle>::iterator first, std::vector<Particle>::iterator last, float t) override;
+			bool canApplyConcurrently() const override;
 			AffectorPtr clone() const override {
 				return std::make_shared<LinearForceAffector>(*this);
 			}
@@ -259,6 +274,8 @@ namespace KRE
 			virtual bool showScaleUI() const override { return true; }
 		private:
 			void internalApply(Particle& p, float t) override;
+			void internalApplyRange(std::vector<Particle>::iterator first, std::vector<Particle>::iterator last, float t) override;
+			bool canApplyConcurrently() const override;
 			AffectorPtr clone() const override {
 				return std::make_shared<ScaleAffector>(*this);
 			}
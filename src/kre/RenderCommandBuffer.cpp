@@ -0,0 +1,368 @@
+/*
+	Copyright (C) 2013-2014 by Kristina Simpson <sweet.kristas@gmail.com>
+
+	This software is provided 'as-is', without any express or implied
+	warranty. In no event will the authors be held liable for any damages
+	arising from the use of this software.
+
+	Permission is granted to anyone to use this software for any purpose,
+	including commercial applications, and to alter it and redistribute it
+	freely, subject to the following restrictions:
+
+	   1. The origin of this software must not be misrepresented; you must not
+	   claim that you wrote the original software. If you use this software
+	   in a product, an acknowledgement in the product documentation would be
+	   appreciated but is not required.
+
+	   2. Altered source versions must be plainly marked as such, and must not be
+	   misrepresented as being the original software.
+
+	   3. This notice may not be removed or altered from any source
+	   distribution.
+*/
+
+#include <algorithm>
+#include <tuple>
+
+#include "AttributeSet.hpp"
+#include "ColorScope.hpp"
+#include "DisplayDevice.hpp"
+#include "DisplayDeviceNull.hpp"
+#include "ModelMatrixScope.hpp"
+#include "RenderCommandBuffer.hpp"
+#include "Renderable.hpp"
+#include "RenderTarget.hpp"
+#include "Shaders.hpp"
+#include "Texture.hpp"
+#include "unit_test.hpp"
+
+namespace KRE
+{
+	namespace
+	{
+		RenderCommandBuffer*& current_buffer()
+		{
+			static RenderCommandBuffer* res = nullptr;
+			return res;
+		}
+
+		// The state of the last renderable drawn.
+		struct LastRenderState
+		{
+			LastRenderState() : valid(false), target(nullptr), shader(nullptr), texture(nullptr), blend(0), depth(0) {}
+			bool valid;
+			const void* target;
+			const void* shader;
+			const void* texture;
+			int blend;
+			int depth;
+		};
+
+		LastRenderState& get_last_render_state()
+		{
+			static LastRenderState res;
+			return res;
+		}
+
+		// Makes no buffer current while renderables are drawn by one.
+		struct SuspendBuffer
+		{
+			SuspendBuffer() : buffer(current_buffer()) { current_buffer() = nullptr; }
+			~SuspendBuffer() { current_buffer() = buffer; }
+			RenderCommandBuffer* buffer;
+		};
+	}
+
+	RenderStats::RenderStats()
+		: renderables(0),
+		  draw_calls(0),
+		  target_changes(0),
+		  shader_changes(0),
+		  texture_changes(0),
+		  blend_changes(0),
+		  depth_changes(0),
+		  uniform_writes(0),
+		  uniform_writes_elided(0)
+	{
+	}
+
+	RenderStats& get_render_stats()
+	{
+		static RenderStats res;
+		return res;
+	}
+
+	void reset_render_stats()
+	{
+		get_render_stats() = RenderStats();
+		get_last_render_state() = LastRenderState();
+	}
+
+	RenderStateKey::RenderStateKey(const Renderable& r)
+		: target(r.getRenderTarget().get()),
+		  shader(r.getShader().get()),
+		  texture(r.getTexture().get()),
+		  blend(0),
+		  depth(0)
+	{
+		if(r.isBlendStateSet()) {
+			blend |= r.isBlendEnabled() ? 1 : 2;
+		}
+		if(r.isBlendModeSet()) {
+			blend |= (static_cast<int>(r.getBlendMode().src()) + 1) << 2;
+			blend |= (static_cast<int>(r.getBlendMode().dst()) + 1) << 10;
+		}
+		if(r.isBlendEquationSet()) {
+			blend |= (static_cast<int>(r.getBlendEquation().getRgbEquation()) + 1) << 18;
+			blend |= (static_cast<int>(r.getBlendEquation().getAlphaEquation()) + 1) << 24;
+		}
+
+		// Depth testing is assumed to be disabled if not specified.
+		if(r.isDepthEnableStateSet() && r.isDepthEnabled()) {
+			depth |= 1;
+		}
+		if(r.isDepthWriteStateSet()) {
+			depth |= r.isDepthWriteEnable() ? 2 : 4;
+		}
+	}
+
+	bool operator<(const RenderStateKey& a, const RenderStateKey& b)
+	{
+		return std::tie(a.target, a.shader, a.texture, a.blend, a.depth) < std::tie(b.target, b.shader, b.texture, b.blend, b.depth);
+	}
+
+	bool operator==(const RenderStateKey& a, const RenderStateKey& b)
+	{
+		return a.target == b.target && a.shader == b.shader && a.texture == b.texture && a.blend == b.blend && a.depth == b.depth;
+	}
+
+	void count_render_state(const RenderStateKey& key)
+	{
+		auto& stats = get_render_stats();
+		auto& last = get_last_render_state();
+		++stats.renderables;
+		if(!last.valid || last.target != key.target) {
+			++stats.target_changes;
+		}
+		if(!last.valid || last.shader != key.shader) {
+			++stats.shader_changes;
+		}
+		if(!last.valid || last.texture != key.texture) {
+			++stats.texture_changes;
+		}
+		if(!last.valid || last.blend != key.blend) {
+			++stats.blend_changes;
+		}
+		if(!last.valid || last.depth != key.depth) {
+			++stats.depth_changes;
+		}
+		last.valid = true;
+		last.target = key.target;
+		last.shader = key.shader;
+		last.texture = key.texture;
+		last.blend = key.blend;
+		last.depth = key.depth;
+	}
+
+	RenderCommandBuffer::Command::Command(const Renderable* renderable)
+		: key(*renderable),
+		  r(renderable),
+		  model(get_global_model_matrix()),
+		  color(ColorScope::getCurrentColor()),
+		  camera(DisplayDevice::getCurrent()->getDefaultCamera())
+	{
+	}
+
+	RenderCommandBuffer::RenderCommandBuffer(bool sort)
+		: sort_(sort),
+		  commands_()
+	{
+	}
+
+	RenderCommandBuffer* RenderCommandBuffer::getCurrent()
+	{
+		return current_buffer();
+	}
+
+	bool RenderCommandBuffer::isDeferrable(const Renderable& r)
+	{
+		if(r.hasClipSettings()) {
+			return false;
+		}
+		auto shader = r.getShader();
+		return shader != nullptr && !shader->getUniformDrawFunction();
+	}
+
+	void RenderCommandBuffer::submit(const Renderable* r)
+	{
+		if(!r->isEnabled()) {
+			return;
+		}
+
+		if(!isDeferrable(*r)) {
+			flush();
+			renderImmediate(r);
+			return;
+		}
+
+		commands_.emplace_back(r);
+	}
+
+	void RenderCommandBuffer::renderImmediate(const Renderable* r)
+	{
+		SuspendBuffer suspend;
+		DisplayDevice::getCurrent()->render(r);
+	}
+
+	void RenderCommandBuffer::flush()
+	{
+		if(commands_.empty()) {
+			return;
+		}
+
+		if(sort_) {
+			std::stable_sort(commands_.begin(), commands_.end(), [](const Command& a, const Command& b) {
+				return a.key < b.key;
+			});
+		}
+
+		SuspendBuffer suspend;
+		auto device = DisplayDevice::getCurrent();
+
+		// Reading the global model matrix brings it up to date with the model
+		// stacks, so setting it below isn't overridden by them.
+		const glm::mat4 model = get_global_model_matrix();
+		const CameraPtr camera = device->getDefaultCamera();
+
+		for(auto& cmd : commands_) {
+			set_global_model_matrix(cmd.model);
+			if(device->getDefaultCamera() != cmd.camera) {
+				device->setDefaultCamera(cmd.camera);
+			}
+			ColorScope color_scope(cmd.color);
+			device->render(cmd.r);
+		}
+
+		set_global_model_matrix(model);
+		device->setDefaultCamera(camera);
+		commands_.clear();
+	}
+
+	RenderCommandBuffer::Manager::Manager(bool sort)
+		: buffer_(sort),
+		  previous_(current_buffer())
+	{
+		current_buffer() = &buffer_;
+	}
+
+	RenderCommandBuffer::Manager::~Manager()
+	{
+		buffer_.flush();
+		current_buffer() = previous_;
+	}
+}
+
+namespace
+{
+	// Renderables drawn with the null display device, alternating between two
+	// shaders and, every other renderable, between two textures.
+	struct NullRenderFixture
+	{
+		explicit NullRenderFixture(int count)
+			: device(std::make_shared<KRE::DisplayDeviceNull>(KRE::WindowPtr())),
+			  previous(KRE::DisplayDevice::setCurrent(device))
+		{
+			KRE::ShaderProgramPtr shaders[] = { device->getShaderProgram("a"), device->getShaderProgram("b") };
+			KRE::TexturePtr textures[] = {
+				KRE::DisplayDevice::createTexture2D(4, 4, KRE::PixelFormat::PF::PIXELFORMAT_RGBA8888),
+				KRE::DisplayDevice::createTexture2D(4, 4, KRE::PixelFormat::PF::PIXELFORMAT_RGBA8888),
+			};
+			for(int n = 0; n != count; ++n) {
+				KRE::RenderablePtr r(new KRE::Renderable());
+				r->setShader(shaders[n%2]);
+				r->setTexture(textures[(n/2)%2]);
+				auto as = KRE::DisplayDevice::createAttributeSet();
+				as->setCount(4);
+				r->addAttributeSet(as);
+				renderables.emplace_back(r);
+			}
+		}
+
+		~NullRenderFixture()
+		{
+			KRE::DisplayDevice::setCurrent(previous);
+		}
+
+		void draw() const
+		{
+			for(auto& r : renderables) {
+				device->render(r.get());
+			}
+		}
+
+		KRE::DisplayDevicePtr device;
+		KRE::DisplayDevicePtr previous;
+		std::vector<KRE::RenderablePtr> renderables;
+	};
+}
+
+UNIT_TEST(render_command_buffer_sorts_by_state)
+{
+	NullRenderFixture fixture(16);
+
+	KRE::reset_render_stats();
+	fixture.draw();
+	CHECK_EQ(KRE::get_render_stats().renderables, 16);
+	CHECK_EQ(KRE::get_render_stats().draw_calls, 16);
+	CHECK_EQ(KRE::get_render_stats().shader_changes, 16);
+	CHECK_EQ(KRE::get_render_stats().texture_changes, 8);
+	CHECK_EQ(KRE::get_render_stats().uniform_writes_elided, 0);
+
+	KRE::reset_render_stats();
+	{
+		KRE::RenderCommandBuffer::Manager buffer(true);
+		fixture.draw();
+		CHECK_EQ(static_cast<int>(buffer.getBuffer().size()), 16);
+		CHECK_EQ(KRE::get_render_stats().renderables, 0);
+	}
+	CHECK_EQ(KRE::get_render_stats().renderables, 16);
+	CHECK_EQ(KRE::get_render_stats().draw_calls, 16);
+	CHECK_EQ(KRE::get_render_stats().shader_changes, 2);
+	CHECK_EQ(KRE::get_render_stats().texture_changes, 4);
+
+	// Within a shader every renderable after the first has the same matrix and
+	// color as the one before.
+	CHECK_EQ(KRE::get_render_stats().uniform_writes, 32);
+	CHECK_EQ(KRE::get_render_stats().uniform_writes_elided, 28);
+}
+
+UNIT_TEST(render_command_buffer_keeps_order_unless_sorting)
+{
+	NullRenderFixture fixture(16);
+
+	KRE::reset_render_stats();
+	{
+		KRE::RenderCommandBuffer::Manager buffer(false);
+		fixture.draw();
+	}
+	CHECK_EQ(KRE::get_render_stats().renderables, 16);
+	CHECK_EQ(KRE::get_render_stats().shader_changes, 16);
+	CHECK_EQ(KRE::get_render_stats().texture_changes, 8);
+}
+
+BENCHMARK(render_null_device_unsorted)
+{
+	NullRenderFixture fixture(1000);
+	BENCHMARK_LOOP {
+		fixture.draw();
+	}
+}
+
+BENCHMARK(render_null_device_sorted)
+{
+	NullRenderFixture fixture(1000);
+	BENCHMARK_LOOP {
+		KRE::RenderCommandBuffer::Manager buffer(true);
+		fixture.draw();
+	}
+}
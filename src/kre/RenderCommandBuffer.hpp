@@ -0,0 +1,140 @@
+/*
+	Copyright (C) 2013-2014 by Kristina Simpson <sweet.kristas@gmail.com>
+
+	This software is provided 'as-is', without any express or implied
+	warranty. In no event will the authors be held liable for any damages
+	arising from the use of this software.
+
+	Permission is granted to anyone to use this software for any purpose,
+	including commercial applications, and to alter it and redistribute it
+	freely, subject to the following restrictions:
+
+	   1. The origin of this software must not be misrepresented; you must not
+	   claim that you wrote the original software. If you use this software
+	   in a product, an acknowledgement in the product documentation would be
+	   appreciated but is not required.
+
+	   2. Altered source versions must be plainly marked as such, and must not be
+	   misrepresented as being the original software.
+
+	   3. This notice may not be removed or altered from any source
+	   distribution.
+*/
+
+#pragma once
+
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "Color.hpp"
+#include "DisplayDeviceFwd.hpp"
+#include "RenderFwd.hpp"
+#include "SceneFwd.hpp"
+#include "Util.hpp"
+
+namespace KRE
+{
+	// Counts of the work submitted to the display device, so that how well
+	// rendering is batched can be measured independently of the device.
+	struct RenderStats
+	{
+		RenderStats();
+		// Renderables drawn.
+		int renderables;
+		// Draw calls made, one per enabled attribute set.
+		int draw_calls;
+		// Changes of state between consecutive renderables.
+		int target_changes;
+		int shader_changes;
+		int texture_changes;
+		int blend_changes;
+		int depth_changes;
+		// Writes of uniform values, and the number of those skipped because
+		// the uniform already held the value.
+		int uniform_writes;
+		int uniform_writes_elided;
+	};
+
+	RenderStats& get_render_stats();
+	void reset_render_stats();
+
+	// The state a renderable needs the device to be in to be drawn. Renderables
+	// with equal keys can be drawn one after another without changing state.
+	struct RenderStateKey
+	{
+		explicit RenderStateKey(const Renderable& r);
+		const void* target;
+		const void* shader;
+		const void* texture;
+		int blend;
+		int depth;
+	};
+
+	bool operator<(const RenderStateKey& a, const RenderStateKey& b);
+	bool operator==(const RenderStateKey& a, const RenderStateKey& b);
+
+	// Updates the render statistics for a renderable about to be drawn.
+	void count_render_state(const RenderStateKey& key);
+
+	// Records the renderables passed to DisplayDevice::render while it is the
+	// current buffer, rather than drawing them straight away, and draws them
+	// when flushed. If created as sorting, renderables are drawn grouped by
+	// their state rather than in the order they were submitted, so it should
+	// only be used where the order doesn't matter, such as for renderables
+	// which don't overlap or which are depth tested.
+	//
+	// Renderables are recorded by pointer so must stay alive and unchanged
+	// until the buffer is flushed. The global model matrix, current color and
+	// default camera are captured at submission. Renderables which use a
+	// stencil mask or whose shader sets uniforms through a draw function
+	// depend on more state than that, so submitting one flushes the buffer
+	// and draws it immediately.
+	class RenderCommandBuffer
+	{
+	public:
+		explicit RenderCommandBuffer(bool sort);
+
+		void submit(const Renderable* r);
+		void flush();
+
+		bool isSorting() const { return sort_; }
+		size_t size() const { return commands_.size(); }
+
+		static RenderCommandBuffer* getCurrent();
+
+		class Manager;
+	private:
+		DISALLOW_COPY_ASSIGN_AND_DEFAULT(RenderCommandBuffer);
+
+		static bool isDeferrable(const Renderable& r);
+		void renderImmediate(const Renderable* r);
+
+		struct Command
+		{
+			explicit Command(const Renderable* renderable);
+			RenderStateKey key;
+			const Renderable* r;
+			glm::mat4 model;
+			Color color;
+			CameraPtr camera;
+		};
+
+		bool sort_;
+		std::vector<Command> commands_;
+	};
+
+	// Makes a buffer current for the lifetime of the object, flushing it when
+	// destroyed.
+	class RenderCommandBuffer::Manager
+	{
+	public:
+		explicit Manager(bool sort);
+		~Manager();
+		RenderCommandBuffer& getBuffer() { return buffer_; }
+	private:
+		DISALLOW_COPY_ASSIGN_AND_DEFAULT(Manager);
+		RenderCommandBuffer buffer_;
+		RenderCommandBuffer* previous_;
+	};
+}
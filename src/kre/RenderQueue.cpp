@@ -22,12 +22,19 @@
 */
 
 #include "asserts.hpp"
+#include "preferences.hpp"
+#include "RenderCommandBuffer.hpp"
 #include "Renderable.hpp"
 #include "RenderQueue.hpp"
 #include "WindowManager.hpp"
 
 namespace KRE
 {
+	namespace
+	{
+		PREF_BOOL(kre_sort_render_queues, false, "Draws the renderables in render queues grouped by their state rather than in order, to reduce state changes. Only correct if they don't overlap.");
+	}
+
 	RenderQueue::RenderQueue(const std::string& name)
 		: name_(name)
 	{
@@ -59,6 +66,10 @@ namespace KRE
 
 	void RenderQueue::render(const WindowPtr& wm) const
 	{
+		std::unique_ptr<RenderCommandBuffer::Manager> buffer;
+		if(g_kre_sort_render_queues) {
+			buffer.reset(new RenderCommandBuffer::Manager(true));
+		}
 		for(auto r : renderables_) {
 			wm->render(r.second.get());
 		}
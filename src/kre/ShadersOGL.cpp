@@ -21,6 +21,8 @@
 	   distribution.
 */
 
+#include <algorithm>
+
 #include <glm/glm.hpp>
 #include <glm/gtc/type_ptr.hpp>
 
@@ -28,6 +30,7 @@
 #include "variant_utils.hpp"
 #include "AttributeSet.hpp"
 #include "DisplayDevice.hpp"
+#include "RenderCommandBuffer.hpp"
 #include "ShadersOGL.hpp"
 #include "TextureOGL.hpp"
 #include "UniformBufferOGL.hpp"
@@ -811,6 +814,51 @@ namespace KRE
 				return res;
 			}
 
+			// The number of floats in a value of the given uniform type, or zero
+			// if it isn't a float type.
+			int uniform_float_count(GLenum type)
+			{
+				switch(type) {
+					case GL_FLOAT:			return 1;
+					case GL_FLOAT_VEC2:		return 2;
+					case GL_FLOAT_VEC3:		return 3;
+					case GL_FLOAT_VEC4:		return 4;
+					case GL_FLOAT_MAT2:		return 4;
+					case GL_FLOAT_MAT3:		return 9;
+					case GL_FLOAT_MAT4:		return 16;
+					default: break;
+				}
+				return 0;
+			}
+
+			// Returns true if the uniform already holds the value, so writing it
+			// can be skipped. Otherwise remembers the value as the one it holds.
+			// Values are only remembered while the program is active, as
+			// otherwise the write goes to whichever program is.
+			bool is_uniform_value_current(UniformValueCache& cache, const Actives& u, GLuint program, const GLfloat* value)
+			{
+				auto& stats = get_render_stats();
+				++stats.uniform_writes;
+				const int count = uniform_float_count(u.type) * u.num_elements;
+				if(count == 0 || get_current_active_shader() != program) {
+					cache.erase(u.location);
+					return false;
+				}
+				auto& last_value = cache[u.location];
+				if(static_cast<int>(last_value.size()) == count && std::equal(value, value + count, last_value.begin())) {
+					++stats.uniform_writes_elided;
+					return true;
+				}
+				last_value.assign(value, value + count);
+				return false;
+			}
+
+			void forget_uniform_value(UniformValueCache& cache, const Actives& u)
+			{
+				++get_render_stats().uniform_writes;
+				cache.erase(u.location);
+			}
+
 			GLenum get_shader_type(ProgramType type)
 			{
 				switch(type) {
@@ -910,6 +958,7 @@ namespace KRE
               v_attribs_(),
               uniform_alternate_name_map_(),
               attribute_alternate_name_map_(),
+              uniform_values_(std::make_shared<UniformValueCache>()),
 			  u_mvp_(-1),
 			  u_mv_(-1),
 			  u_p_(-1),
@@ -946,6 +995,7 @@ namespace KRE
               v_attribs_(),
               uniform_alternate_name_map_(),
               attribute_alternate_name_map_(),
+              uniform_values_(std::make_shared<UniformValueCache>()),
 			  u_mvp_(-1),
 			  u_mv_(-1),
 			  u_p_(-1),
@@ -1081,6 +1131,7 @@ namespace KRE
 			}
 			object_ = glCreateProgram();
 			ASSERT_LOG(object_ != 0, "Unable to create program object.");
+			uniform_values_ = std::make_shared<UniformValueCache>();
 
 			// Pre-link hook to configure any fixed bound locations.
 			// has to occur before glLinkProgram to have any effect.
@@ -1174,6 +1225,11 @@ namespace KRE
 			//if(get_current_active_shader() == object_) {
 			//	return;
 			//}
+			if(get_current_active_shader() != object_) {
+				// Uniforms may have been written directly while another
+				// program was made current, so don't trust the values we have.
+				uniform_values_->clear();
+			}
 			glUseProgram(object_);
 			get_current_active_shader() = object_;
 		}
@@ -1322,6 +1378,7 @@ namespace KRE
 			auto it = v_uniforms_.find(uid);
 			ASSERT_LOG(it != v_uniforms_.end(), "Couldn't find location " << uid << " on the uniform list.");
 			const Actives& u = it->second;
+			forget_uniform_value(*uniform_values_, u);
 			ASSERT_LOG(value != nullptr, "setUniformValue(): value is nullptr");
 			switch(u.type) {
 			case GL_INT:
@@ -1389,6 +1446,7 @@ namespace KRE
 			auto it = v_uniforms_.find(uid);
 			ASSERT_LOG(it != v_uniforms_.end(), "Couldn't find location " << uid << " on the uniform list.");
 			const Actives& u = it->second;
+			forget_uniform_value(*uniform_values_, u);
 			switch(u.type) {
 			case GL_INT:
 			case GL_BOOL:
@@ -1413,6 +1471,7 @@ namespace KRE
 			auto it = v_uniforms_.find(uid);
 			ASSERT_LOG(it != v_uniforms_.end(), "Couldn't find location " << uid << " on the uniform list.");
 			const Actives& u = it->second;
+			forget_uniform_value(*uniform_values_, u);
 			switch(u.type) {
 			case GL_FLOAT: {
 				glUniform1f(u.location, value);
@@ -1432,6 +1491,7 @@ namespace KRE
 			auto it = v_uniforms_.find(uid);
 			ASSERT_LOG(it != v_uniforms_.end(), "Couldn't find location " << uid << " on the uniform list.");
 			const Actives& u = it->second;
+			forget_uniform_value(*uniform_values_, u);
 			ASSERT_LOG(value != nullptr, "set_uniform(): value is nullptr");
 			switch(u.type) {
 			case GL_INT:
@@ -1470,6 +1530,9 @@ namespace KRE
 			ASSERT_LOG(it != v_uniforms_.end(), "Couldn't find location " << uid << " on the uniform list.");
 			const Actives& u = it->second;
 			ASSERT_LOG(value != nullptr, "setUniformValue(): value is nullptr");
+			if(is_uniform_value_current(*uniform_values_, u, object_, value)) {
+				return;
+			}
 			switch(u.type) {
 			case GL_FLOAT: {
 				if(u.num_elements > 1) {
@@ -1517,6 +1580,7 @@ namespace KRE
 			auto it = v_uniforms_.find(uid);
 			ASSERT_LOG(it != v_uniforms_.end(), "Couldn't find location " << uid << " on the uniform list.");
 			const Actives& u = it->second;
+			forget_uniform_value(*uniform_values_, u);
 			if(value.is_null()) {
 				ASSERT_LOG(false, "setUniformFromVariant(): value is null. shader='" << getName() << "', uid: " << uid << " : '" << u.name << "'");
 			}
@@ -66,6 +66,10 @@ namespace KRE
 			GLint location;
 		};
 
+		// For float uniforms, the value last written to a program while it was
+		// active, by location, so writing the same value again can be skipped.
+		typedef std::unordered_map<GLint, std::vector<float>> UniformValueCache;
+
 		typedef std::pair<std::string,std::string> ShaderDef;
 
 		typedef std::map<std::string, Actives> ActivesMap;
@@ -169,6 +173,8 @@ namespace KRE
 			std::unordered_map<int, Actives> v_attribs_;
 			std::map<std::string, std::string> uniform_alternate_name_map_;
 			std::map<std::string, std::string> attribute_alternate_name_map_;
+			// Clones share the GL program, and so share this too.
+			std::shared_ptr<UniformValueCache> uniform_values_;
 
 			// Store for common attributes and uniforms
 			int u_mvp_;
@@ -249,7 +249,9 @@ namespace KRE
 				break;
 			}
 			window_.reset(SDL_CreateWindow(getTitle().c_str(), x, y, w, h, wnd_flags), [&](SDL_Window* wnd){
-				ImGui_ImplSdlGL3_Shutdown();
+				if(usesOpenGL()) {
+					ImGui_ImplSdlGL3_Shutdown();
+				}
 
 				getDisplayDevice().reset();
 				if(context_) {
@@ -259,7 +261,10 @@ namespace KRE
 				SDL_DestroyWindow(wnd);
 			});
 
-			ImGui_ImplSdlGL3_Init(window_.get());
+			// The ImGui renderer draws with OpenGL, so is only used with an OpenGL device.
+			if(usesOpenGL()) {
+				ImGui_ImplSdlGL3_Init(window_.get());
+			}
 
 			ASSERT_LOG(window_.get() != nullptr, "Could not create window: " << x << ", " << y << ", " << w << ", " << h << " / wnd_flags = " << wnd_flags);
 
@@ -271,7 +276,7 @@ namespace KRE
 			}
 
 			ASSERT_LOG(window_ != nullptr, "Failed to create window: " << SDL_GetError());
-			if(getDisplayDevice()->ID() == DisplayDevice::DISPLAY_DEVICE_OPENGL ||getDisplayDevice()->ID() == DisplayDevice::DISPLAY_DEVICE_OPENGLES) {
+			if(usesOpenGL()) {
 				context_ = SDL_GL_CreateContext(window_.get());
 				ASSERT_LOG(context_ != nullptr, "Failed to GL Context: " << SDL_GetError());
 			}
@@ -303,7 +308,7 @@ namespace KRE
 			getDisplayDevice()->setClearColor(clear_color_);
 			getDisplayDevice()->clear(f);
 
-			if(new_frame_ == 0) {
+			if(new_frame_ == 0 && usesOpenGL()) {
 				ImGui_ImplSdlGL3_NewFrame(window_.get());
 				++new_frame_;
 			}
@@ -313,13 +318,15 @@ namespace KRE
 			// This is a little bit hacky -- ideally the display device should swap buffers.
 			// But SDL provides a device independent way of doing it which is really nice.
 			// So we use that.
-			ImGui::Render();
-			ImGui_ImplSdlGL3_RenderDrawLists(ImGui::GetDrawData());
+			if(usesOpenGL()) {
+				ImGui::Render();
+				ImGui_ImplSdlGL3_RenderDrawLists(ImGui::GetDrawData());
+			}
 			if(--new_frame_ < 0) {
 				new_frame_ = 0;
 			}
 
-			if(getDisplayDevice()->ID() == DisplayDevice::DISPLAY_DEVICE_OPENGL || getDisplayDevice()->ID() == DisplayDevice::DISPLAY_DEVICE_OPENGLES) {
+			if(usesOpenGL()) {
 				SDL_GL_SwapWindow(window_.get());
 			} else {
 				// default to delegating to the display device.
@@ -413,6 +420,10 @@ namespace KRE
 		}
 
 	private:
+		bool usesOpenGL() const {
+			return getDisplayDevice() != nullptr
+				&& (getDisplayDevice()->ID() == DisplayDevice::DISPLAY_DEVICE_OPENGL || getDisplayDevice()->ID() == DisplayDevice::DISPLAY_DEVICE_OPENGLES);
+		}
 		void handleSetClearColor() const override {
 			if(getDisplayDevice() != nullptr) {
 				getDisplayDevice()->setClearColor(clear_color_);
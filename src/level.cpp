@@ -24,8 +24,12 @@
 #include <GL/glew.h>
 
 #include <algorithm>
+#include <atomic>
 #include <iostream>
+#include <limits>
 #include <math.h>
+#include <thread>
+#include <unordered_map>
 
 #include "BlendModeScope.hpp"
 #include "CameraObject.hpp"
@@ -48,6 +52,7 @@
 #include "filesystem.hpp"
 #include "formatter.hpp"
 #include "formula_profiler.hpp"
+#include "frame.hpp"
 #include "json_parser.hpp"
 #include "hex.hpp"
 #include "level.hpp"
@@ -58,6 +63,7 @@
 #include "module.hpp"
 #include "multiplayer.hpp"
 #include "object_events.hpp"
+#include "pathfinding.hpp"
 #include "player_info.hpp"
 #include "playable_custom_object.hpp"
 #include "preferences.hpp"
@@ -70,9 +76,11 @@
 #include "stats.hpp"
 #include "string_utils.hpp"
 #include "surface_palette.hpp"
+#include "task_scheduler.hpp"
 #include "thread.hpp"
 #include "tile_map.hpp"
 #include "unit_test.hpp"
+#include "user_collision_grid.hpp"
 #include "variant_utils.hpp"
 #include "wml_formula_callable.hpp"
 
@@ -93,6 +101,10 @@ namespace
 	PREF_INT(debug_skip_draw_zorder_begin, INT_MIN, "Avoid drawing the given zorder");
 	PREF_INT(debug_skip_draw_zorder_end, INT_MIN, "Avoid drawing the given zorder");
 	PREF_BOOL(debug_shadows, false, "Show debug visualization of shadow drawing");
+	PREF_INT(tile_rebuild_threads, 0, "Number of threads used to rebuild tiles in the background. 0 uses every task scheduler worker plus the rebuilding thread.");
+	PREF_INT(tile_rebuild_rows_per_job, 32, "Number of rows of tiles each background tile rebuild job covers");
+	PREF_BOOL(isolated_object_processing, true, "Evaluate the process event handlers of objects whose type sets isolated_process on task scheduler workers");
+	PREF_INT(isolated_objects_per_job, 16, "Number of isolated objects each job evaluates the process event handlers of");
 
 	LevelPtr& get_current_level()
 	{
@@ -324,6 +336,9 @@ Level::Level(const std::string& level_cfg, variant node)
 	air_resistance_(0),
 	water_resistance_(7),
 	end_game_(false),
+	history_keyframes_(0),
+	history_trimming_suspended_(false),
+	history_memory_usage_(0),
 	editor_tile_updates_frozen_(0),
 	editor_dragging_objects_(false),
 	zoom_level_(1.0f),
@@ -1057,9 +1072,7 @@ namespace
 	struct level_tile_rebuild_info
 	{
 		level_tile_rebuild_info() : tile_rebuild_in_progress(false),
-									tile_rebuild_queued(false),
-									rebuild_tile_thread(nullptr),
-									tile_rebuild_complete(false)
+									tile_rebuild_queued(false)
 		{}
 
 		//record whether we are currently rebuilding tiles, and if we have had
@@ -1067,7 +1080,9 @@ namespace
 		bool tile_rebuild_in_progress;
 		bool tile_rebuild_queued;
 
-		threading::thread* rebuild_tile_thread;
+		//the task building the tiles, which is polled to see if tile
+		//rebuilding has been completed.
+		task_scheduler::TaskPtr rebuild_task;
 
 		//an unsynchronized buffer only accessed by the main thread with layers
 		//that will be rebuilt.
@@ -1077,37 +1092,70 @@ namespace
 		//be rebuilt.
 		std::vector<int> rebuild_tile_layers_worker_buffer;
 
-		//a locked flag which is polled to see if tile rebuilding has been completed.
-		bool tile_rebuild_complete;
+		//a band of one layer to rebuild, and where the tiles built for it
+		//are stored. Jobs for the same layer share one copy of its map.
+		struct job
+		{
+			std::shared_ptr<const TileMap> tile_map;
+			rect area;
+			std::vector<LevelTile> tiles;
+		};
 
-		threading::mutex tile_rebuild_complete_mutex;
+		std::vector<job> jobs;
 
-		//the tiles where the thread will store the new tiles.
-		std::vector<LevelTile> task_tiles;
+		//the copies of the maps the jobs build, which have their multi
+		//tile patterns matched before the jobs run.
+		std::vector<std::shared_ptr<TileMap>> tile_maps;
 	};
 
 	std::map<const Level*, level_tile_rebuild_info> tile_rebuild_map;
 
-	void build_tiles_thread_function(level_tile_rebuild_info* info, std::map<int, TileMap> tile_maps, threading::mutex& sync) {
-		std::lock_guard<std::mutex> lock(GarbageCollector::getGlobalMutex());
+	//calls fn(n) for each n in [0, count), spread over the task
+	//scheduler's workers with the calling thread also taking a share, and
+	//returns once they've all been done. The calls may create collectible
+	//objects, e.g. the callables tile patterns are matched with.
+	void run_in_parallel(size_t count, const std::function<void(size_t)>& fn) {
+		int nthreads = g_tile_rebuild_threads > 0 ? g_tile_rebuild_threads : task_scheduler::numWorkers() + 1;
+		nthreads = std::max(1, std::min(nthreads, static_cast<int>(count)));
+
+		std::atomic<size_t> next(0);
+		auto run = [count, &fn, &next]() {
+			for(size_t n = next++; n < count; n = next++) {
+				fn(n);
+			}
+		};
 
-		info->task_tiles.clear();
+		task_scheduler::TaskOptions options;
+		options.allocates_collectible_objects = true;
 
-		if(info->rebuild_tile_layers_worker_buffer.empty()) {
-			for(auto& i : tile_maps) {
-				i.second.buildTiles(&info->task_tiles);
-			}
-		} else {
-			for(int layer : info->rebuild_tile_layers_worker_buffer) {
-				auto itor = tile_maps.find(layer);
-				if(itor != tile_maps.end()) {
-					itor->second.buildTiles(&info->task_tiles);
-				}
-			}
+		std::vector<task_scheduler::TaskPtr> tasks;
+		for(int n = 1; n < nthreads; ++n) {
+			tasks.push_back(task_scheduler::submit(run, options));
 		}
 
-		threading::lock l(info->tile_rebuild_complete_mutex);
-		info->tile_rebuild_complete = true;
+		run();
+		task_scheduler::wait(tasks);
+	}
+
+	void run_tile_rebuild_jobs(level_tile_rebuild_info& info) {
+		//bands only build the same tiles as the whole layer would if
+		//they share the layer's multi tile pattern matches.
+		std::vector<std::shared_ptr<TileMap>>& tile_maps = info.tile_maps;
+		run_in_parallel(tile_maps.size(), [&tile_maps](size_t n) {
+			tile_maps[n]->prepareBuildBands();
+		});
+
+		std::vector<level_tile_rebuild_info::job>& jobs = info.jobs;
+		run_in_parallel(jobs.size(), [&jobs](size_t n) {
+			jobs[n].tile_map->buildTiles(&jobs[n].tiles, &jobs[n].area);
+		});
+	}
+
+	void build_tiles_thread_function(level_tile_rebuild_info* info) {
+		//the collector can't run while other threads are creating objects.
+		std::lock_guard<std::mutex> lock(GarbageCollector::getGlobalMutex());
+
+		run_tile_rebuild_jobs(*info);
 	}
 }
 
@@ -1131,20 +1179,39 @@ void Level::start_rebuild_tiles_in_background(const std::vector<int>& layers)
 	}
 
 	info.tile_rebuild_in_progress = true;
-	info.tile_rebuild_complete = false;
 
 	info.rebuild_tile_layers_worker_buffer = info.rebuild_tile_layers_buffer;
 	info.rebuild_tile_layers_buffer.clear();
 
-	std::map<int, TileMap> worker_tile_maps = tile_maps_;
-	for(auto& i : worker_tile_maps) {
-		//make the tile maps safe to go into a worker thread.
-		i.second.prepareForCopyToWorkerThread();
-	}
+	//only the layers being rebuilt are copied, and each is split into
+	//bands which can be built independently.
+	info.jobs.clear();
+	info.tile_maps.clear();
+	for(const auto& i : tile_maps_) {
+		if(info.rebuild_tile_layers_worker_buffer.empty() == false && std::binary_search(info.rebuild_tile_layers_worker_buffer.begin(), info.rebuild_tile_layers_worker_buffer.end(), i.first) == false) {
+			continue;
+		}
 
-	static threading::mutex* sync = new threading::mutex;
+		std::shared_ptr<TileMap> worker_tile_map(new TileMap(i.second));
 
-	info.rebuild_tile_thread = new threading::thread("rebuild_tiles", std::bind(build_tiles_thread_function, &info, worker_tile_maps, *sync), threading::THREAD_ALLOCATES_COLLECTIBLE_OBJECTS);
+		//make the tile map safe to go into worker threads.
+		worker_tile_map->prepareForCopyToWorkerThread();
+		info.tile_maps.push_back(worker_tile_map);
+
+		for(const rect& area : worker_tile_map->getBuildBands(std::max(1, g_tile_rebuild_rows_per_job))) {
+			level_tile_rebuild_info::job job;
+			job.tile_map = worker_tile_map;
+			job.area = area;
+			info.jobs.push_back(job);
+		}
+	}
+
+	//the task holds the collector's lock while it waits on the band jobs,
+	//so it gets its own thread rather than tying up a worker.
+	task_scheduler::TaskOptions options;
+	options.blocking = true;
+	options.allocates_collectible_objects = true;
+	info.rebuild_task = task_scheduler::submit(std::bind(build_tiles_thread_function, &info), options);
 }
 
 void Level::freeze_rebuild_tiles_in_background()
@@ -1156,7 +1223,7 @@ void Level::freeze_rebuild_tiles_in_background()
 void Level::unfreeze_rebuild_tiles_in_background()
 {
 	level_tile_rebuild_info& info = tile_rebuild_map[this];
-	if(info.rebuild_tile_thread != nullptr) {
+	if(info.rebuild_task) {
 		//a thread is actually in flight calculating tiles, so any requests
 		//would have been queued up anyway.
 		return;
@@ -1227,18 +1294,13 @@ bool Level::complete_rebuild_tiles_in_background()
 		return true;
 	}
 
-	{
-		threading::lock l(info.tile_rebuild_complete_mutex);
-		if(!info.tile_rebuild_complete) {
-			return false;
-		}
+	if(info.rebuild_task && !info.rebuild_task->done()) {
+		return false;
 	}
 
 	const int begin_time = profile::get_tick_time();
 
-//	ASSERT_LOG(rebuild_tile_thread, "REBUILD TILE THREAD IS nullptr");
-	delete info.rebuild_tile_thread;
-	info.rebuild_tile_thread = nullptr;
+	info.rebuild_task.reset();
 
 	TileBackupScope backup(tiles_);
 
@@ -1251,8 +1313,12 @@ bool Level::complete_rebuild_tiles_in_background()
 		}
 	}
 
-	tiles_.insert(tiles_.end(), info.task_tiles.begin(), info.task_tiles.end());
-	info.task_tiles.clear();
+	for(const level_tile_rebuild_info::job& job : info.jobs) {
+		tiles_.insert(tiles_.end(), job.tiles.begin(), job.tiles.end());
+	}
+
+	info.jobs.clear();
+	info.tile_maps.clear();
 
 	LOG_INFO("COMPLETE TILE REBUILD: " << (profile::get_tick_time() - begin_time));
 
@@ -2043,6 +2109,7 @@ namespace
 		KRE::ModelManager2D model_scope(diffx, diffy);
 		obj.draw(x, y);
 		if(editor) {
+			Frame::flushSpriteBatch();
 			obj.drawGroup();
 		}
 	}
@@ -2092,6 +2159,7 @@ void Level::draw(int x, int y, int w, int h) const
 		ASSERT_LOG(false, "apply shader_ here");
 	}
 	++draw_count;
+	Frame::resetSpriteBatchStats();
 
 	const int start_x = x;
 	const int start_y = y;
@@ -2756,6 +2824,66 @@ void Level::set_active_chars()
 	std::sort(active_chars_.begin(), active_chars_.end(), zorder_compare);
 }
 
+namespace
+{
+	//evaluates the process event handlers of the isolated objects among
+	//chars across the task scheduler's workers. Their commands are run
+	//as each object is processed in the usual order, and nothing done
+	//here depends on how the jobs are scheduled, so replays still match.
+	//Returns the objects which were prepared; they must be passed to
+	//discard_isolated_process() once chars have been processed.
+	std::vector<CustomObject*> prepare_isolated_process(const Level& lvl, const std::vector<EntityPtr>& chars)
+	{
+		std::vector<CustomObject*> objects;
+		if(!g_isolated_object_processing || lvl.in_editor()) {
+			return objects;
+		}
+
+		for(const EntityPtr& e : chars) {
+			CustomObject* obj = dynamic_cast<CustomObject*>(e.get());
+			if(obj != nullptr && !obj->destroyed() && obj->getType()->isolatedProcess()) {
+				objects.push_back(obj);
+			}
+		}
+
+		if(objects.empty()) {
+			return objects;
+		}
+
+		//built on demand, so build it now rather than in the jobs.
+		lvl.get_solid_chars();
+
+		const size_t per_job = static_cast<size_t>(std::max(1, g_isolated_objects_per_job));
+		const int cycle = lvl.cycle();
+
+		task_scheduler::TaskOptions options;
+		options.priority = task_scheduler::PRIORITY::HIGH;
+		options.allocates_collectible_objects = true;
+
+		std::vector<task_scheduler::TaskPtr> tasks;
+		for(size_t begin = 0; begin < objects.size(); begin += per_job) {
+			const size_t end = std::min(objects.size(), begin + per_job);
+			tasks.push_back(task_scheduler::submit([&objects, begin, end, cycle]() {
+				for(size_t n = begin; n != end; ++n) {
+					objects[n]->prepareIsolatedProcess(cycle);
+				}
+			}, options));
+		}
+
+		task_scheduler::wait(tasks);
+		return objects;
+	}
+
+	//objects which were destroyed or skipped never run the commands they
+	//prepared, so release them rather than holding them until next cycle.
+	void discard_isolated_process(const std::vector<CustomObject*>& objects)
+	{
+		for(CustomObject* obj : objects) {
+			obj->discardIsolatedProcess();
+		}
+	}
+}
+
 void Level::do_processing()
 {
 	if(cycle_ == 0) {
@@ -2798,6 +2926,7 @@ void Level::do_processing()
 	formula_profiler::Instrument instrumentation("CHARS_PROCESS");
 	while(!active_chars.empty()) {
 		new_chars_.clear();
+		const std::vector<CustomObject*> isolated_objects = prepare_isolated_process(*this, active_chars);
 		for(const EntityPtr& c : active_chars) {
 			if(!c->destroyed()) {
 				c->process(*this);
@@ -2812,6 +2941,8 @@ void Level::do_processing()
 			}
 		}
 
+		discard_isolated_process(isolated_objects);
+
 		active_chars = new_chars_;
 		active_chars_.insert(active_chars_.end(), new_chars_.begin(), new_chars_.end());
 	}
@@ -2824,6 +2955,28 @@ void Level::do_processing()
 	solid_chars_.clear();
 }
 
+UserCollisionGrid& Level::user_collision_grid()
+{
+	if(!user_collision_grid_) {
+		user_collision_grid_.reset(new UserCollisionGrid);
+	}
+
+	return *user_collision_grid_;
+}
+
+std::shared_ptr<pathfinding::SolidityGrid> Level::get_pathfinding_grid(int tile_size_x, int tile_size_y) const
+{
+	//the grids are built on demand, which can't be done in isolation.
+	game_logic::Formula::failIfIsolatedContext();
+
+	std::shared_ptr<pathfinding::SolidityGrid>& grid = pathfinding_grids_[std::pair<int, int>(tile_size_x, tile_size_y)];
+	if(!grid || grid->solidStateId() != solid_.version() || grid->area() != boundaries()) {
+		grid.reset(new pathfinding::SolidityGrid(*this, boundaries(), tile_size_x, tile_size_y, solid_.version()));
+	}
+
+	return grid;
+}
+
 void Level::erase_char(EntityPtr c)
 {
 	c->beingRemoved();
@@ -2843,6 +2996,18 @@ void Level::erase_char(EntityPtr c)
 
 bool Level::isSolid(const LevelSolidMap& map, const Entity& e, const std::vector<point>& points, const SurfaceInfo** surf_info) const
 {
+	if(surf_info == nullptr) {
+		const Frame& current_frame = e.getCurrentFrame();
+		for(const point& p : points) {
+			const int x = e.x() + (e.isFacingRight() ? p.x : (current_frame.width() - 1 - p.x));
+			if(map.isSolid(x, e.y() + p.y)) {
+				return true;
+			}
+		}
+
+		return false;
+	}
+
 	const TileSolidInfo* info = nullptr;
 	int prev_x = std::numeric_limits<int>::min(), prev_y = std::numeric_limits<int>::min();
 
@@ -2912,6 +3077,13 @@ bool Level::isSolid(const LevelSolidMap& map, const Entity& e, const std::vector
 
 bool Level::isSolid(const LevelSolidMap& map, int x, int y, const SurfaceInfo** surf_info) const
 {
+	if(!map.isSolid(x, y)) {
+		return false;
+	} else if(surf_info == nullptr) {
+		return true;
+	}
+
+	//find the tile to get its surface info.
 	tile_pos pos(x/TileSize, y/TileSize);
 	x = x%TileSize;
 	y = y%TileSize;
@@ -2952,6 +3124,13 @@ bool Level::isSolid(const LevelSolidMap& map, int x, int y, const SurfaceInfo**
 
 bool Level::standable(const rect& r, const SurfaceInfo** info) const
 {
+	if(!solid_.isSolidInRect(r) && !standable_.isSolidInRect(r)) {
+		return false;
+	} else if(info == nullptr) {
+		return true;
+	}
+
+	//find the first standable pixel to get its surface info.
 	const int ybegin = r.y();
 	const int yend = r.y2();
 	const int xbegin = r.x();
@@ -2999,6 +3178,12 @@ bool Level::solid(const Entity& e, const std::vector<point>& points, const Surfa
 
 bool Level::solid(int xbegin, int ybegin, int w, int h, const SurfaceInfo** info) const
 {
+	if(w <= 0 || h <= 0 || !solid_.isSolidInRect(rect(xbegin, ybegin, w, h))) {
+		return false;
+	} else if(info == nullptr) {
+		return true;
+	}
+
 	const int xend = xbegin + w;
 	const int yend = ybegin + h;
 
@@ -3015,7 +3200,13 @@ bool Level::solid(int xbegin, int ybegin, int w, int h, const SurfaceInfo** info
 
 bool Level::solid(const rect& r, const SurfaceInfo** info) const
 {
-	//TODO: consider optimizing this function.
+	if(!solid_.isSolidInRect(r)) {
+		return false;
+	} else if(info == nullptr) {
+		return true;
+	}
+
+	//find the first solid pixel to get its surface info.
 	const int ybegin = r.y();
 	const int yend = r.y2();
 	const int xbegin = r.x();
@@ -3034,33 +3225,7 @@ bool Level::solid(const rect& r, const SurfaceInfo** info) const
 
 bool Level::may_be_solid_in_rect(const rect& r) const
 {
-	int x = r.x();
-	int y = r.y();
-	tile_pos pos(x/TileSize, y/TileSize);
-	x = x%TileSize;
-	y = y%TileSize;
-	if(x < 0) {
-		pos.first--;
-		x += TileSize;
-	}
-
-	if(y < 0) {
-		pos.second--;
-		y += TileSize;
-	}
-
-	const int x2 = (x + r.w())/TileSize + ((x + r.w())%TileSize ? 1 : 0);
-	const int y2 = (y + r.h())/TileSize + ((y + r.h())%TileSize ? 1 : 0);
-
-	for(int ypos = 0; ypos < y2; ++ypos) {
-		for(int xpos = 0; xpos < x2; ++xpos) {
-			if(solid_.find(tile_pos(pos.first + xpos, pos.second + ypos))) {
-				return true;
-			}
-		}
-	}
-
-	return false;
+	return solid_.isSolidInRect(r);
 }
 
 void Level::set_solid_area(const rect& r, bool solid, bool platforms)
@@ -4012,6 +4177,7 @@ DEFINE_FIELD(editor_selection, "[custom_obj]")
 	return variant(&result);
 
 DEFINE_FIELD(frame_buffer_shaders, "[{begin_zorder: int, end_zorder: int, shader: object|null, shader_info: map|string, label: string|null}]")
+	game_logic::Formula::failIfIsolatedContext();
 	std::vector<variant> v;
 	for(const FrameBufferShaderEntry& e : obj.fb_shaders_) {
 		std::map<variant,variant> m;
@@ -4297,6 +4463,7 @@ void Level::getAllLabels(std::vector<std::string>& labels) const
 const std::vector<EntityPtr>& Level::get_solid_chars() const
 {
 	if(solid_chars_.empty()) {
+		game_logic::Formula::failIfIsolatedContext();
 		for(const EntityPtr& e : chars_) {
 			if(e->solid() || e->platform()) {
 				solid_chars_.push_back(e);
@@ -4332,13 +4499,15 @@ void Level::replay_from_cycle(int ncycle)
 		return;
 	}
 
-	int index = static_cast<int>(backups_.size()) - cycles_ago;
-	ASSERT_GE(index, 0);
+	if(backups_.empty() || backups_.front()->cycle > ncycle) {
+		//the controls have changed for cycles we no longer have history
+		//for, so the best we can do is carry on from where we are.
+		LOG_ERROR("Cannot replay from cycle " << ncycle << ": level history only goes back to cycle " << earliest_backup_cycle());
+		return;
+	}
 
 	const int cycle_to_play_until = cycle_;
-	restore_from_backup(*backups_[index]);
-	ASSERT_EQ(cycle_, ncycle);
-	backups_.erase(backups_.begin() + index, backups_.end());
+	restore_from_keyframe(ncycle);
 	while(cycle_ < cycle_to_play_until) {
 		backup();
 		do_processing();
@@ -4346,6 +4515,9 @@ void Level::replay_from_cycle(int ncycle)
 }
 
 PREF_BOOL(enable_history, true, "Allow editor history features");
+PREF_INT(history_rewind_window, 250, "Number of most recent cycles for which the level history keeps a snapshot of every cycle");
+PREF_INT(history_keyframe_interval, 10, "Number of cycles between the snapshots kept in the level history before the rewind window. Cycles in between are reconstructed by replaying from the previous snapshot");
+PREF_INT(history_memory_budget_mb, 128, "Approximate amount of memory the level history may use before the oldest snapshots are discarded");
 
 void Level::backup(bool force)
 {
@@ -4353,56 +4525,158 @@ void Level::backup(bool force)
 		return;
 	}
 
-	std::map<EntityPtr, EntityPtr> entity_map;
+	const backup_snapshot* prev = backups_.empty() ? nullptr : backups_.back().get();
+
+	//objects which haven't changed since the previous snapshot can share
+	//its copy. Usually the level has the same objects as last cycle, in
+	//which case each object is at the same index as in the previous
+	//snapshot. Otherwise we need to look them up.
+	const bool same_chars = prev != nullptr && prev->live == chars_;
+	std::unordered_map<Entity*, size_t> prev_index;
+	if(prev != nullptr && !same_chars) {
+		for(size_t n = 0; n != prev->live.size(); ++n) {
+			prev_index[prev->live[n].get()] = n;
+		}
+	}
+
+	if(!same_chars) {
+		history_live_map_.clear();
+	}
 
 	backup_snapshot_ptr snapshot(new backup_snapshot);
 	snapshot->rng_seed = rng::get_seed();
 	snapshot->cycle = cycle_;
+	snapshot->live = chars_;
 	snapshot->chars.reserve(chars_.size());
+	snapshot->generations.reserve(chars_.size());
 
+	for(size_t n = 0; n != chars_.size(); ++n) {
+		const EntityPtr& e = chars_[n];
 
-	for(const EntityPtr& e : chars_) {
-		snapshot->chars.push_back(e->backup());
-		entity_map[e] = snapshot->chars.back();
+		size_t index = n;
+		if(!same_chars) {
+			auto i = prev_index.find(e.get());
+			index = i == prev_index.end() ? std::numeric_limits<size_t>::max() : i->second;
+		}
+
+		if(prev != nullptr && index < prev->live.size() && prev->generations[index] == e->stateGeneration()) {
+			snapshot->chars.push_back(prev->chars[index]);
+		} else {
+			EntityPtr copy = e->backup();
+			if(copy != e) {
+				//the copy keeps referring to the live objects; references
+				//are only mapped when the snapshot is restored.
+				if(history_live_map_.empty()) {
+					for(const EntityPtr& c : chars_) {
+						history_live_map_[c] = c;
+					}
+				}
+
+				copy->mapEntities(history_live_map_);
+				history_memory_usage_ += copy->memoryUsage();
+			}
 
-		if(snapshot->chars.back()->isHuman()) {
-			snapshot->players.push_back(snapshot->chars.back());
+			snapshot->chars.push_back(copy);
+		}
+
+		snapshot->generations.push_back(e->stateGeneration());
+
+		if(e->isHuman()) {
+			snapshot->players.push_back(e);
 			if(e == player_) {
-				snapshot->player = snapshot->players.back();
+				snapshot->player = e;
 			}
 		}
 	}
 
-	for(entity_group& g : groups_) {
-		snapshot->groups.push_back(entity_group());
+	snapshot->groups = groups_;
+	snapshot->last_touched_player = last_touched_player_;
+
+	snapshot->memory_usage = sizeof(backup_snapshot) + (snapshot->live.capacity() + snapshot->chars.capacity() + snapshot->players.capacity())*sizeof(EntityPtr) + snapshot->generations.capacity()*sizeof(unsigned int);
+	for(const entity_group& g : snapshot->groups) {
+		snapshot->memory_usage += sizeof(entity_group) + g.capacity()*sizeof(EntityPtr);
+	}
 
-		for(EntityPtr e : g) {
-			std::map<EntityPtr, EntityPtr>::iterator i = entity_map.find(e);
-			if(i != entity_map.end()) {
-				snapshot->groups.back().push_back(i->second);
-			}
+	history_memory_usage_ += snapshot->memory_usage;
+	backups_.push_back(snapshot);
+
+	if(history_trimming_suspended_) {
+		return;
+	}
+
+	//every cycle in the rewind window is kept so it can be restored
+	//exactly. Once a snapshot falls out of the window only one every
+	//history_keyframe_interval cycles is kept, and the cycles between
+	//are recreated by replaying the recorded controls.
+	history_keyframes_ = std::min(history_keyframes_, backups_.size());
+	while(history_keyframes_ < backups_.size() && backups_[history_keyframes_]->cycle < cycle_ - std::max(1, g_history_rewind_window)) {
+		if(history_keyframes_ == 0 || backups_[history_keyframes_]->cycle - backups_[history_keyframes_-1]->cycle >= std::max(1, g_history_keyframe_interval)) {
+			++history_keyframes_;
+		} else {
+			erase_backup(history_keyframes_);
 		}
 	}
 
-	for(const EntityPtr& e : snapshot->chars) {
-		e->mapEntities(entity_map);
+	const size_t budget = static_cast<size_t>(std::max(0, g_history_memory_budget_mb))*1024*1024;
+	while(backups_.size() > 1 && history_memory_usage_ > budget) {
+		erase_backup(0);
+		if(history_keyframes_ > 0) {
+			--history_keyframes_;
+		}
 	}
+}
 
-	snapshot->last_touched_player = last_touched_player_;
+namespace
+{
+	bool snapshot_holds_copy(const std::vector<EntityPtr>& chars, size_t n, const EntityPtr& copy)
+	{
+		if(n < chars.size() && chars[n] == copy) {
+			return true;
+		}
 
-	backups_.push_back(snapshot);
-	if(backups_.size() > 250) {
-
-		for(std::deque<backup_snapshot_ptr>::iterator i = backups_.begin();
-		    i != backups_.begin() + 1; ++i) {
-			for(const EntityPtr& e : (*i)->chars) {
-				//kill off any references this entity holds, to workaround
-				//circular references causing things to stick around.
-				e->cleanup_references();
-			}
+		return std::find(chars.begin(), chars.end(), copy) != chars.end();
+	}
+}
+
+void Level::erase_backup(size_t index)
+{
+	ASSERT_LOG(index < backups_.size(), "Erasing level history snapshot which doesn't exist: " << index << "/" << backups_.size());
+
+	const backup_snapshot& snapshot = *backups_[index];
+	const backup_snapshot* prev = index > 0 ? backups_[index-1].get() : nullptr;
+	const backup_snapshot* next = index+1 < backups_.size() ? backups_[index+1].get() : nullptr;
+
+	size_t freed = snapshot.memory_usage;
+
+	for(size_t n = 0; n != snapshot.chars.size(); ++n) {
+		const EntityPtr& copy = snapshot.chars[n];
+		if(copy == snapshot.live[n]) {
+			continue;
+		}
+
+		//a copy is only ever shared by adjacent snapshots.
+		if((prev && snapshot_holds_copy(prev->chars, n, copy)) || (next && snapshot_holds_copy(next->chars, n, copy))) {
+			continue;
+		}
+
+		freed += copy->memoryUsage();
+
+		//kill off any references this entity holds, to workaround
+		//circular references causing things to stick around. Copies
+		//still held elsewhere, e.g. as ghosts returned by trace_past(),
+		//are left alone.
+		if(copy->refcount() == 1) {
+			copy->cleanup_references();
 		}
-		backups_.erase(backups_.begin(), backups_.begin() + 1);
 	}
+
+	history_memory_usage_ -= std::min(freed, history_memory_usage_);
+
+	if(index+1 == backups_.size()) {
+		history_live_map_.clear();
+	}
+
+	backups_.erase(backups_.begin() + index);
 }
 
 int Level::earliest_backup_cycle() const
@@ -4420,8 +4694,7 @@ void Level::reverse_one_cycle()
 		return;
 	}
 
-	restore_from_backup(*backups_.back());
-	backups_.pop_back();
+	reverse_to_cycle(std::max(cycle_ - 1, backups_.front()->cycle));
 }
 
 void Level::reverse_to_cycle(int ncycle)
@@ -4430,27 +4703,78 @@ void Level::reverse_to_cycle(int ncycle)
 		return;
 	}
 
+	//the oldest history may have been discarded, in which case go back
+	//as far as we can.
+	ncycle = std::max(ncycle, backups_.front()->cycle);
+
 	LOG_INFO("REVERSING FROM " << cycle_ << " TO " << ncycle << "...");
 
-	while(backups_.size() > 1 && backups_.back()->cycle > ncycle) {
-		LOG_INFO("REVERSING PAST " << backups_.back()->cycle << "...");
-		backups_.pop_back();
+	restore_from_keyframe(ncycle);
+
+	while(cycle_ < ncycle) {
+		backup();
+		do_processing();
 	}
 
-	LOG_INFO("GOT TO CYCLE: " << backups_.back()->cycle);
+	LOG_INFO("GOT TO CYCLE: " << cycle_);
+}
+
+void Level::restore_from_keyframe(int ncycle)
+{
+	ASSERT_LOG(backups_.empty() == false, "No level history to restore from");
+
+	while(backups_.size() > 1 && backups_.back()->cycle > ncycle) {
+		erase_backup(backups_.size()-1);
+	}
 
-	reverse_one_cycle();
+	restore_from_backup(*backups_.back());
 }
 
-void Level::restore_from_backup(backup_snapshot& snapshot)
+void Level::restore_from_backup(const backup_snapshot& snapshot)
 {
 	rng::set_seed(snapshot.rng_seed);
 	cycle_ = snapshot.cycle;
-	chars_ = snapshot.chars;
-	players_ = snapshot.players;
-	player_ = snapshot.player;
-	groups_ = snapshot.groups;
-	last_touched_player_ = snapshot.last_touched_player;
+
+	//the snapshot's copies are shared with other snapshots, so the level
+	//gets copies of them, and references to the objects the snapshot was
+	//taken from are pointed at their restored versions.
+	std::map<EntityPtr, EntityPtr> entity_map;
+	chars_.clear();
+	chars_.reserve(snapshot.chars.size());
+	for(size_t n = 0; n != snapshot.chars.size(); ++n) {
+		chars_.push_back(snapshot.chars[n]->backup());
+		entity_map[snapshot.live[n]] = chars_.back();
+	}
+
+	for(const EntityPtr& e : chars_) {
+		e->mapEntities(entity_map);
+	}
+
+	players_.clear();
+	for(const EntityPtr& e : snapshot.players) {
+		auto i = entity_map.find(e);
+		if(i != entity_map.end()) {
+			players_.push_back(i->second);
+		}
+	}
+
+	auto player_itor = entity_map.find(snapshot.player);
+	player_ = player_itor == entity_map.end() ? EntityPtr() : player_itor->second;
+
+	groups_.clear();
+	for(const entity_group& g : snapshot.groups) {
+		groups_.push_back(entity_group());
+		for(const EntityPtr& e : g) {
+			auto i = entity_map.find(e);
+			if(i != entity_map.end()) {
+				groups_.back().push_back(i->second);
+			}
+		}
+	}
+
+	auto last_touched_itor = entity_map.find(snapshot.last_touched_player);
+	last_touched_player_ = last_touched_itor == entity_map.end() ? snapshot.last_touched_player : last_touched_itor->second;
+
 	active_chars_.clear();
 
 	solid_chars_.clear();
@@ -4462,14 +4786,14 @@ void Level::restore_from_backup(backup_snapshot& snapshot)
 		}
 	}
 
-	for(const EntityPtr& ch : snapshot.chars) {
+	for(const EntityPtr& ch : chars_) {
 		ch->handleEvent(OBJECT_EVENT_LOAD);
 	}
 }
 
 std::vector<EntityPtr> Level::trace_past(EntityPtr e, int ncycle)
 {
-	backup();
+	backup(true);
 	int prev_cycle = -1;
 	std::vector<EntityPtr> result;
 	std::deque<backup_snapshot_ptr>::reverse_iterator i = backups_.rbegin();
@@ -4484,7 +4808,10 @@ std::vector<EntityPtr> Level::trace_past(EntityPtr e, int ncycle)
 
 		for(const EntityPtr& ghost : snapshot.chars) {
 			if(ghost->label() == e->label()) {
-				result.push_back(ghost);
+				//unchanged objects share their copy between snapshots.
+				if(result.empty() || result.back() != ghost) {
+					result.push_back(ghost);
+				}
 				break;
 			}
 		}
@@ -4499,10 +4826,7 @@ std::vector<EntityPtr> Level::predict_future(EntityPtr e, int ncycles)
 	disable_flashes_scope flashes_disabled_scope;
 	const controls::control_backup_scope ctrl_backup_scope;
 
-	backup();
-	backup_snapshot_ptr snapshot = backups_.back();
-	backups_.pop_back();
-
+	backup(true);
 	const size_t starting_backups = backups_.size();
 
 	int begin_time = profile::get_tick_time();
@@ -4510,6 +4834,10 @@ std::vector<EntityPtr> Level::predict_future(EntityPtr e, int ncycles)
 
 	const int controls_end = controls::local_controls_end();
 	LOG_INFO("PREDICT FUTURE: " << cycle_ << "/" << controls_end);
+
+	//the predicted cycles are all discarded afterwards, so they mustn't
+	//cause any of the real history to be thinned out or evicted.
+	history_trimming_suspended_ = true;
 	while(cycle_ < controls_end) {
 		try {
 			const assert_recover_scope safe_scope;
@@ -4521,6 +4849,7 @@ std::vector<EntityPtr> Level::predict_future(EntityPtr e, int ncycles)
 			break;
 		}
 	}
+	history_trimming_suspended_ = false;
 
 	LOG_INFO("TOOK " << (profile::get_tick_time() - begin_time) << "ms TO MOVE FORWARD " << nframes << " frames");
 
@@ -4530,8 +4859,11 @@ std::vector<EntityPtr> Level::predict_future(EntityPtr e, int ncycles)
 
 	LOG_INFO("TOOK " << (profile::get_tick_time() - begin_time) << "ms to TRACE PAST OF " << result.size() << " FRAMES");
 
-	backups_.resize(starting_backups);
-	restore_from_backup(*snapshot);
+	while(backups_.size() > starting_backups) {
+		erase_backup(backups_.size()-1);
+	}
+
+	restore_from_backup(*backups_.back());
 
 	return result;
 }
@@ -4540,7 +4872,6 @@ void Level::transfer_state_to(Level& lvl)
 {
 	backup(true);
 	lvl.restore_from_backup(*backups_.back());
-	backups_.pop_back();
 }
 
 void Level::get_tile_layers(std::set<int>* all_layers, std::set<int>* hidden_layers)
@@ -4888,6 +5219,7 @@ std::pair<std::vector<LevelTile>::const_iterator, std::vector<LevelTile>::const_
 	y = round_tile_size(y);
 
 	if(tiles_by_position_.size() != tiles_.size()) {
+		game_logic::Formula::failIfIsolatedContext();
 		tiles_by_position_ = tiles_;
 		std::sort(tiles_by_position_.begin(), tiles_by_position_.end(), level_tile_pos_comparer());
 	}
@@ -5113,6 +5445,70 @@ UTILITY(compile_levels)
 	LevelObject::writeCompiled();
 }
 */
+namespace
+{
+	std::string describe_level_objects(const Level& lvl)
+	{
+		std::ostringstream s;
+		s << lvl.cycle() << ":";
+		for(const EntityPtr& e : lvl.get_chars()) {
+			s << " " << e->label() << "@" << e->x() << "," << e->y() << "/" << e->getCurrentAnimationId() << "/" << e->getTimeInFrame() << (e->isFacingRight() ? "R" : "L");
+		}
+
+		return s.str();
+	}
+}
+
+UNIT_TEST(level_history_rewind_restores_state)
+{
+	//a small rewind window, so that the history contains cycles which
+	//are kept and cycles which have to be replayed from a keyframe.
+	const int old_window = g_history_rewind_window;
+	const int old_interval = g_history_keyframe_interval;
+	g_history_rewind_window = 10;
+	g_history_keyframe_interval = 4;
+
+	Level* lvl = new Level("test.cfg");
+	variant lvl_holder(lvl);
+	lvl->finishLoading();
+	lvl->setAsCurrentLevel();
+
+	lvl->add_character(new CustomObject("ant_black", 100, 0, true));
+	lvl->add_character(new CustomObject("ant_black", 200, 0, false));
+
+	//far away from the screen, so it isn't processed and shares its copy
+	//between snapshots.
+	lvl->add_character(new CustomObject("ant_black", 100000, 100000, true));
+
+	std::map<int, std::string> states;
+	for(int n = 0; n != 40; ++n) {
+		lvl->backup();
+		states[lvl->cycle()] = describe_level_objects(*lvl);
+		lvl->process();
+	}
+
+	lvl->backup();
+	const int end_cycle = lvl->cycle();
+	const std::string end_state = describe_level_objects(*lvl);
+
+	//replaying the whole history gets us back to where we were.
+	lvl->replay_from_cycle(lvl->earliest_backup_cycle());
+	CHECK_EQ(lvl->cycle(), end_cycle);
+	CHECK_EQ(describe_level_objects(*lvl), end_state);
+
+	//inside the rewind window, and then outside it, where the cycles
+	//between keyframes are replayed.
+	for(int cycles_ago : {1, 3, 10, 17, 30}) {
+		const int ncycle = end_cycle - cycles_ago;
+		lvl->reverse_to_cycle(ncycle);
+		CHECK_EQ(lvl->cycle(), ncycle);
+		CHECK_EQ(describe_level_objects(*lvl), states[ncycle]);
+	}
+
+	g_history_rewind_window = old_window;
+	g_history_keyframe_interval = old_interval;
+}
+
 BENCHMARK(level_solid)
 {
 	//benchmark which tells us how long Level::solid takes.
@@ -5122,6 +5518,63 @@ BENCHMARK(level_solid)
 	}
 }
 
+BENCHMARK(level_solid_info)
+{
+	//Level::solid when the surface info is wanted, which has to find the tile.
+	static Level* lvl = new Level("stairway-to-heaven.cfg");
+	const SurfaceInfo* info = nullptr;
+	BENCHMARK_LOOP {
+		lvl->solid(rng::generate()%1000, rng::generate()%1000, &info);
+	}
+}
+
+BENCHMARK(level_solid_rect)
+{
+	//rects about the size of an object's solid area.
+	static Level* lvl = new Level("stairway-to-heaven.cfg");
+	BENCHMARK_LOOP {
+		lvl->solid(rect(rng::generate()%1000, rng::generate()%1000, 32, 48));
+	}
+}
+
+BENCHMARK(level_solid_span)
+{
+	//a row of pixels, as tested when an object moves a pixel up or down.
+	static Level* lvl = new Level("stairway-to-heaven.cfg");
+	BENCHMARK_LOOP {
+		lvl->solid(rng::generate()%1000, rng::generate()%1000, 32, 1);
+	}
+}
+
+BENCHMARK(level_may_be_solid_in_rect)
+{
+	static Level* lvl = new Level("stairway-to-heaven.cfg");
+	BENCHMARK_LOOP {
+		lvl->may_be_solid_in_rect(rect(rng::generate()%1000, rng::generate()%1000, 64, 64));
+	}
+}
+
+BENCHMARK_ARG(level_rebuild_tiles, int nthreads)
+{
+	//how long rebuilding every tile layer in the background takes, for
+	//comparing against the number of cores used.
+	static Level* lvl = new Level("stairway-to-heaven.cfg");
+	const int old_threads = g_tile_rebuild_threads;
+	g_tile_rebuild_threads = nthreads;
+	BENCHMARK_LOOP {
+		lvl->start_rebuild_tiles_in_background(std::vector<int>());
+		while(lvl->complete_rebuild_tiles_in_background() == false) {
+		}
+	}
+
+	g_tile_rebuild_threads = old_threads;
+}
+
+BENCHMARK_ARG_CALL(level_rebuild_tiles, rebuild_threads_1, 1);
+BENCHMARK_ARG_CALL(level_rebuild_tiles, rebuild_threads_2, 2);
+BENCHMARK_ARG_CALL(level_rebuild_tiles, rebuild_threads_4, 4);
+BENCHMARK_ARG_CALL(level_rebuild_tiles, rebuild_threads_8, 8);
+
 BENCHMARK(load_nene)
 {
 	BENCHMARK_LOOP {
@@ -55,6 +55,13 @@
 class Level;
 typedef ffl::IntrusivePtr<Level> LevelPtr;
 
+class UserCollisionGrid;
+
+namespace pathfinding
+{
+	class SolidityGrid;
+}
+
 class CurrentLevelScope
 {
 	LevelPtr old_;
@@ -293,6 +300,13 @@ public:
 	void swap_chars(std::vector<EntityPtr>& v) { chars_.swap(v); solid_chars_.clear(); }
 	int num_active_chars() const { return static_cast<int>(active_chars_.size()); }
 
+	//broad-phase used by detect_user_collisions(), kept between cycles.
+	UserCollisionGrid& user_collision_grid();
+
+	//gets the coarse solidity map used for pathfinding with the given tile
+	//size. It is kept until the level's solid areas change.
+	std::shared_ptr<pathfinding::SolidityGrid> get_pathfinding_grid(int tile_size_x, int tile_size_y) const;
+
 	//function which, given the rect of the player's body will return true iff
 	//the player can currently "interact" with a portal or object. i.e. if
 	//pressing up will talk to someone or enter a door etc.
@@ -549,6 +563,10 @@ private:
 
 	std::vector<EntityPtr> chars_immune_from_time_freeze_;
 
+	std::shared_ptr<UserCollisionGrid> user_collision_grid_;
+
+	mutable std::map<std::pair<int, int>, std::shared_ptr<pathfinding::SolidityGrid> > pathfinding_grids_;
+
 	std::map<std::string, EntityPtr> chars_by_label_;
 	EntityPtr player_;
 	EntityPtr last_touched_player_;
@@ -627,21 +645,61 @@ private:
 
 	std::shared_ptr<point> lock_screen_;
 
+	//the level's objects as of a cycle. One is taken every cycle, but
+	//once they're older than history_rewind_window cycles only one every
+	//history_keyframe_interval cycles is kept; the cycles between are
+	//reached by restoring the previous snapshot and replaying.
+	//
+	//chars holds a copy of each of the live objects in 'live'. Objects
+	//which haven't changed since the previous snapshot share its copy,
+	//so a snapshot only copies the objects which changed that cycle.
+	//Since copies are shared, references the copies hold to other objects
+	//in the level point to the live objects, and are mapped to the
+	//restored objects when the snapshot is restored. The other members
+	//also refer to live objects.
 	struct backup_snapshot {
 		rng::Seed rng_seed;
 		int cycle;
+
+		//the memory used by the snapshot itself, not its copies.
+		size_t memory_usage;
+
+		std::vector<EntityPtr> live;
 		std::vector<EntityPtr> chars;
+		std::vector<unsigned int> generations;
 		std::vector<EntityPtr> players;
 		std::vector<entity_group> groups;
 		EntityPtr player, last_touched_player;
 	};
 
-	void restore_from_backup(backup_snapshot& snapshot);
-
 	typedef std::shared_ptr<backup_snapshot> backup_snapshot_ptr;
 
+	//restores the level to the snapshot, which is left unchanged.
+	void restore_from_backup(const backup_snapshot& snapshot);
+
+	//removes the snapshot at the given index from the history.
+	void erase_backup(size_t index);
+
+	//restores the latest snapshot at or before ncycle, discarding any
+	//history after it.
+	void restore_from_keyframe(int ncycle);
+
 	std::deque<backup_snapshot_ptr> backups_;
 
+	//the number of snapshots at the start of backups_ which are older
+	//than the rewind window and have been thinned out to keyframes.
+	size_t history_keyframes_;
+	bool history_trimming_suspended_;
+
+	//the approximate memory used by backups_ and the copies they hold.
+	size_t history_memory_usage_;
+
+	//maps each of the objects in the last snapshot to itself. Used to
+	//keep references to objects in the level pointing to the live
+	//objects when copying objects. Only rebuilt when the level's objects
+	//change.
+	std::map<EntityPtr, EntityPtr> history_live_map_;
+
 	int editor_tile_updates_frozen_;
 	bool editor_dragging_objects_;
 
@@ -33,7 +33,6 @@
 #include "ModelMatrixScope.hpp"
 #include "WindowManager.hpp"
 
-#include "background_task_pool.hpp"
 #include "base64.hpp"
 #include "clipboard.hpp"
 #include "collision_utils.hpp"
@@ -71,6 +70,7 @@
 #include "sound.hpp"
 #include "stats.hpp"
 #include "surface_cache.hpp"
+#include "task_scheduler.hpp"
 #include "tbs_internal_server.hpp"
 #include "theme_imgui.hpp"
 #include "user_voxel_object.hpp"
@@ -116,6 +116,7 @@ namespace
 
 	PREF_BOOL(editor_pause, false, "If true, the editor auto pauses when started");
 	PREF_INT(time_quota_async_work_items, 10, "Number of milliseconds allowed each frame for asynchronous/background work items to run");
+	PREF_INT(gc_incremental_budget_us, 0, "Microseconds of idle time each frame that may be spent on incremental garbage collection. 0 disables it.");
 
 	PREF_BOOL(allow_debug_console_clicking, true, "Allow clicking on objects in the debug console to select them");
 	PREF_BOOL(reload_modified_objects, false, "Reload object definitions when their file is modified on disk");
@@ -943,7 +944,7 @@ bool LevelRunner::play_cycle()
 		controls::mark_valid();
 	}
 
-	background_task_pool::pump();
+	task_scheduler::pump();
 
 	performance_data current_perf(current_max_,current_fps_,50,0,0,0,0,0,CustomObject::events_handled_per_second,"");
 
@@ -1555,9 +1556,10 @@ bool LevelRunner::play_cycle()
 					const std::string fname = KRE::WindowManager::getMainWindow()->saveFrameBuffer("screenshot.png");
 					if(!fname.empty()) {
 						std::shared_ptr<upload_screenshot_info> info(new upload_screenshot_info);
-						background_task_pool::submit(
-						  std::bind(upload_screenshot, fname, info),
-						  std::bind(done_upload_screenshot, info));
+						task_scheduler::TaskOptions options;
+						options.blocking = true;
+						options.on_complete = std::bind(done_upload_screenshot, info);
+						task_scheduler::submit(std::bind(upload_screenshot, fname, info), options);
 					}
 				} else if(key == SDLK_m && mod & KMOD_CTRL) {
 					sound::mute(!sound::muted()); //toggle sound
@@ -1920,6 +1922,11 @@ bool LevelRunner::play_cycle()
 		wait_time = std::max<int>(1, desired_end_time - profile::get_tick_time());
 	}
 
+	if(g_gc_incremental_budget_us > 0 && wait_time > 1) {
+		runIncrementalGarbageCollection(std::min<int>(g_gc_incremental_budget_us, (wait_time-1)*1000));
+		wait_time = std::max<int>(1, desired_end_time - profile::get_tick_time());
+	}
+
 	next_delay_ += wait_time;
 	current_perf.delay = wait_time;
 
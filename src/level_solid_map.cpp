@@ -22,11 +22,14 @@
 */
 
 
+#include <algorithm>
 #include <iostream>
 #include <set>
 
 #include "level_solid_map.hpp"
 #include "preferences.hpp"
+#include "random.hpp"
+#include "unit_test.hpp"
 
 namespace
 {
@@ -47,16 +50,17 @@ const std::string* SurfaceInfo::get_info_str(const std::string& key)
 	return &*info_set.insert(key).first;
 }
 
-LevelSolidMap::LevelSolidMap()
+LevelSolidMap::LevelSolidMap() : version_(0), chunk_x_(0), chunk_y_(0), chunk_w_(0), chunk_h_(0), dirty_(false)
 {
 }
 
-LevelSolidMap::LevelSolidMap(const LevelSolidMap& m)
+LevelSolidMap::LevelSolidMap(const LevelSolidMap& m) : version_(0), chunk_x_(0), chunk_y_(0), chunk_w_(0), chunk_h_(0), dirty_(false)
 {
 }
 
 LevelSolidMap& LevelSolidMap::operator=(const LevelSolidMap& m)
 {
+	++version_;
 	return *this;
 }
 
@@ -67,6 +71,9 @@ LevelSolidMap::~LevelSolidMap()
 
 TileSolidInfo& LevelSolidMap::insertOrFind(const tile_pos& pos)
 {
+	//the caller may modify the result, so assume it will.
+	++version_;
+	markDirty(pos);
 	TileSolidInfo** result = insertRaw(pos);
 	if(!*result) {
 		*result = new TileSolidInfo;
@@ -145,6 +152,8 @@ const TileSolidInfo* LevelSolidMap::find(const tile_pos& pos) const
 
 void LevelSolidMap::erase(const tile_pos& pos)
 {
+	++version_;
+	markDirty(pos);
 	TileSolidInfo** info = insertRaw(pos);
 	delete *info;
 	*info = nullptr;
@@ -152,6 +161,7 @@ void LevelSolidMap::erase(const tile_pos& pos)
 
 void LevelSolidMap::clear()
 {
+	++version_;
 	for(row& r : positive_rows_) {
 		for(TileSolidInfo* info : r.positive_cells) {
 			delete info;
@@ -174,10 +184,19 @@ void LevelSolidMap::clear()
 
 	positive_rows_.clear();
 	negative_rows_.clear();
+
+	threading::lock lck(chunk_mutex_);
+	chunk_grid_.clear();
+	chunk_x_ = chunk_y_ = chunk_w_ = chunk_h_ = 0;
+	chunks_.clear();
+	free_chunks_.clear();
+	dirty_tiles_.clear();
+	dirty_.store(false, std::memory_order_release);
 }
 
 void LevelSolidMap::merge(const LevelSolidMap& map, int xoffset, int yoffset)
 {
+	++version_;
 	for(int n = 0; n != map.negative_rows_.size(); ++n) {
 		for(int m = 0; m != map.negative_rows_[n].negative_cells.size(); ++m) {
 			const tile_pos pos(-m - 1 + xoffset, -n - 1 + yoffset);
@@ -243,3 +262,299 @@ void LevelSolidMap::merge(const LevelSolidMap& map, int xoffset, int yoffset)
 		}
 	}
 }
+
+void LevelSolidMap::markDirty(const tile_pos& pos)
+{
+	//tiles are usually changed a pixel at a time, so avoid recording the
+	//same tile over and over.
+	if(dirty_tiles_.empty() || dirty_tiles_.back() != pos) {
+		dirty_tiles_.push_back(pos);
+	}
+
+	dirty_.store(true, std::memory_order_release);
+}
+
+bool LevelSolidMap::isSolid(int x, int y) const
+{
+	syncChunks();
+
+	//shifting a negative number right rounds towards negative infinity,
+	//which is what we want for negative positions.
+	const int index = getChunk(x >> ChunkShift, y >> ChunkShift);
+	if(index == EmptyChunk) {
+		return false;
+	} else if(index == SolidChunk) {
+		return true;
+	}
+
+	return (chunks_[index].rows[y & (ChunkSize-1)] >> (x & (ChunkSize-1))) & 1;
+}
+
+bool LevelSolidMap::isSolidInRect(const rect& r) const
+{
+	if(r.w() <= 0 || r.h() <= 0) {
+		return false;
+	}
+
+	syncChunks();
+
+	const int x1 = r.x(), y1 = r.y(), x2 = r.x2() - 1, y2 = r.y2() - 1;
+
+	//only chunks within the grid can have anything solid in them.
+	const int cx1 = std::max(x1 >> ChunkShift, chunk_x_);
+	const int cy1 = std::max(y1 >> ChunkShift, chunk_y_);
+	const int cx2 = std::min(x2 >> ChunkShift, chunk_x_ + chunk_w_ - 1);
+	const int cy2 = std::min(y2 >> ChunkShift, chunk_y_ + chunk_h_ - 1);
+
+	for(int cy = cy1; cy <= cy2; ++cy) {
+		const int row1 = cy == (y1 >> ChunkShift) ? (y1 & (ChunkSize-1)) : 0;
+		const int row2 = cy == (y2 >> ChunkShift) ? (y2 & (ChunkSize-1)) : ChunkSize-1;
+		for(int cx = cx1; cx <= cx2; ++cx) {
+			const int index = chunk_grid_[(cy - chunk_y_)*chunk_w_ + cx - chunk_x_];
+			if(index == EmptyChunk) {
+				continue;
+			} else if(index == SolidChunk) {
+				return true;
+			}
+
+			const int col1 = cx == (x1 >> ChunkShift) ? (x1 & (ChunkSize-1)) : 0;
+			const int col2 = cx == (x2 >> ChunkShift) ? (x2 & (ChunkSize-1)) : ChunkSize-1;
+			const uint64_t mask = (~uint64_t(0) >> (ChunkSize - 1 - col2)) & (~uint64_t(0) << col1);
+
+			const Chunk& chunk = chunks_[index];
+			for(int row = row1; row <= row2; ++row) {
+				if(chunk.rows[row] & mask) {
+					return true;
+				}
+			}
+		}
+	}
+
+	return false;
+}
+
+int LevelSolidMap::getChunk(int cx, int cy) const
+{
+	const unsigned gx = static_cast<unsigned>(cx - chunk_x_);
+	const unsigned gy = static_cast<unsigned>(cy - chunk_y_);
+	if(gx >= static_cast<unsigned>(chunk_w_) || gy >= static_cast<unsigned>(chunk_h_)) {
+		return EmptyChunk;
+	}
+
+	return chunk_grid_[gy*chunk_w_ + gx];
+}
+
+void LevelSolidMap::syncChunks() const
+{
+	if(!dirty_.load(std::memory_order_acquire)) {
+		return;
+	}
+
+	threading::lock lck(chunk_mutex_);
+	if(!dirty_.load(std::memory_order_relaxed)) {
+		return;
+	}
+
+	std::sort(dirty_tiles_.begin(), dirty_tiles_.end());
+	dirty_tiles_.erase(std::unique(dirty_tiles_.begin(), dirty_tiles_.end()), dirty_tiles_.end());
+	for(const tile_pos& pos : dirty_tiles_) {
+		syncTile(pos);
+	}
+
+	dirty_tiles_.clear();
+	dirty_.store(false, std::memory_order_release);
+}
+
+void LevelSolidMap::syncTile(const tile_pos& pos) const
+{
+	const TileSolidInfo* info = find(pos);
+
+	const int words_per_row = (TileSize + 63)/64;
+	std::vector<uint64_t> rows(TileSize*words_per_row);
+	if(info && info->all_solid) {
+		for(int y = 0; y != TileSize; ++y) {
+			for(int x = 0; x < TileSize; x += 64) {
+				const int n = std::min(64, TileSize - x);
+				rows[y*words_per_row + x/64] = n == 64 ? ~uint64_t(0) : (uint64_t(1) << n) - 1;
+			}
+		}
+	} else if(info) {
+		for(size_t i = info->bitmap.find_first(); i != tile_bitmap::npos; i = info->bitmap.find_next(i)) {
+			const int y = static_cast<int>(i)/TileSize;
+			const int x = static_cast<int>(i)%TileSize;
+			rows[y*words_per_row + x/64] |= uint64_t(1) << (x%64);
+		}
+	}
+
+	const int xbase = pos.first*TileSize;
+	const int ybase = pos.second*TileSize;
+	for(int y = 0; y != TileSize; ++y) {
+		for(int x = 0; x < TileSize; x += 64) {
+			setChunkBits(xbase + x, ybase + y, std::min(64, TileSize - x), rows[y*words_per_row + x/64]);
+		}
+	}
+
+	//chunks which have become all empty or all solid needn't be stored.
+	for(int cy = ybase >> ChunkShift; cy <= (ybase + TileSize - 1) >> ChunkShift; ++cy) {
+		for(int cx = xbase >> ChunkShift; cx <= (xbase + TileSize - 1) >> ChunkShift; ++cx) {
+			const int index = getChunk(cx, cy);
+			if(index < 0) {
+				continue;
+			}
+
+			const uint64_t* begin = chunks_[index].rows;
+			const uint64_t* end = begin + ChunkSize;
+			int state = index;
+			if(std::all_of(begin, end, [](uint64_t row) { return row == 0; })) {
+				state = EmptyChunk;
+			} else if(std::all_of(begin, end, [](uint64_t row) { return row == ~uint64_t(0); })) {
+				state = SolidChunk;
+			}
+
+			if(state != index) {
+				chunk_grid_[(cy - chunk_y_)*chunk_w_ + cx - chunk_x_] = state;
+				free_chunks_.push_back(index);
+			}
+		}
+	}
+}
+
+void LevelSolidMap::setChunkBits(int x, int y, int n, uint64_t bits) const
+{
+	while(n > 0) {
+		const int cx = x >> ChunkShift;
+		const int cy = y >> ChunkShift;
+		const int offset = x & (ChunkSize-1);
+		const int count = std::min(n, ChunkSize - offset);
+		const uint64_t mask = (count == 64 ? ~uint64_t(0) : (uint64_t(1) << count) - 1) << offset;
+		const uint64_t value = (bits << offset) & mask;
+
+		int index = getChunk(cx, cy);
+		if((index == EmptyChunk && value == 0) || (index == SolidChunk && value == mask)) {
+			//already as it should be.
+		} else {
+			if(index < 0) {
+				const uint64_t fill = index == SolidChunk ? ~uint64_t(0) : 0;
+				growChunkGrid(cx, cy);
+				if(free_chunks_.empty()) {
+					index = static_cast<int>(chunks_.size());
+					chunks_.emplace_back();
+				} else {
+					index = free_chunks_.back();
+					free_chunks_.pop_back();
+				}
+
+				std::fill(chunks_[index].rows, chunks_[index].rows + ChunkSize, fill);
+				chunk_grid_[(cy - chunk_y_)*chunk_w_ + cx - chunk_x_] = index;
+			}
+
+			uint64_t& row = chunks_[index].rows[y & (ChunkSize-1)];
+			row = (row & ~mask) | value;
+		}
+
+		bits = count == 64 ? 0 : bits >> count;
+		x += count;
+		n -= count;
+	}
+}
+
+void LevelSolidMap::growChunkGrid(int cx, int cy) const
+{
+	if(cx >= chunk_x_ && cy >= chunk_y_ && cx < chunk_x_ + chunk_w_ && cy < chunk_y_ + chunk_h_) {
+		return;
+	}
+
+	//grow by a few chunks beyond what's needed, since tiles tend to be
+	//added next to each other.
+	const int Margin = 4;
+	int x1 = cx - Margin, y1 = cy - Margin, x2 = cx + Margin + 1, y2 = cy + Margin + 1;
+	if(chunk_w_ > 0) {
+		x1 = std::min(x1, chunk_x_);
+		y1 = std::min(y1, chunk_y_);
+		x2 = std::max(x2, chunk_x_ + chunk_w_);
+		y2 = std::max(y2, chunk_y_ + chunk_h_);
+	}
+
+	std::vector<int> grid((x2 - x1)*(y2 - y1), EmptyChunk);
+	for(int y = 0; y != chunk_h_; ++y) {
+		std::copy(chunk_grid_.begin() + y*chunk_w_, chunk_grid_.begin() + (y+1)*chunk_w_, grid.begin() + (chunk_y_ + y - y1)*(x2 - x1) + chunk_x_ - x1);
+	}
+
+	chunk_grid_.swap(grid);
+	chunk_x_ = x1;
+	chunk_y_ = y1;
+	chunk_w_ = x2 - x1;
+	chunk_h_ = y2 - y1;
+}
+
+namespace
+{
+	//whether the pixel is solid according to the map's tiles.
+	bool tile_pixel_solid(const LevelSolidMap& map, int x, int y)
+	{
+		tile_pos pos(x/TileSize, y/TileSize);
+		x = x%TileSize;
+		y = y%TileSize;
+		if(x < 0) {
+			pos.first--;
+			x += TileSize;
+		}
+
+		if(y < 0) {
+			pos.second--;
+			y += TileSize;
+		}
+
+		const TileSolidInfo* info = map.find(pos);
+		return info && (info->all_solid || info->bitmap.test(y*TileSize + x));
+	}
+}
+
+UNIT_TEST(level_solid_map_chunks_match_tiles)
+{
+	LevelSolidMap map;
+	const int Range = TileSize*12;
+
+	for(int pass = 0; pass != 4; ++pass) {
+		for(int n = 0; n != 400; ++n) {
+			const tile_pos pos(rng::generate()%12 - 6, rng::generate()%12 - 6);
+			const int op = rng::generate()%10;
+			if(op == 0) {
+				map.erase(pos);
+			} else if(op == 1) {
+				map.insertOrFind(pos).all_solid = true;
+			} else {
+				TileSolidInfo& info = map.insertOrFind(pos);
+				const int index = rng::generate()%(TileSize*TileSize);
+				if(info.all_solid) {
+					info.all_solid = false;
+					info.bitmap.set();
+					info.bitmap.reset(index);
+				} else {
+					info.bitmap.set(index, op != 2);
+				}
+			}
+		}
+
+		for(int y = -Range/2 - 10; y < Range/2 + 10; ++y) {
+			for(int x = -Range/2 - 10; x < Range/2 + 10; ++x) {
+				CHECK_EQ(map.isSolid(x, y), tile_pixel_solid(map, x, y));
+			}
+		}
+
+		for(int n = 0; n != 200; ++n) {
+			const rect r(rng::generate()%Range - Range/2, rng::generate()%Range - Range/2, rng::generate()%(TileSize*3), rng::generate()%(TileSize*3));
+			bool expected = false;
+			for(int y = r.y(); y < r.y2() && !expected; ++y) {
+				for(int x = r.x(); x < r.x2() && !expected; ++x) {
+					expected = tile_pixel_solid(map, x, y);
+				}
+			}
+
+			CHECK_EQ(map.isSolidInRect(r), expected);
+		}
+	}
+
+	map.clear();
+	CHECK_EQ(map.isSolidInRect(rect(-Range, -Range, Range*2, Range*2)), false);
+}
@@ -23,10 +23,15 @@
 
 #pragma once
 
+#include <atomic>
 #include <boost/dynamic_bitset.hpp>
+#include <cstdint>
 #include <map>
 #include <vector>
 
+#include "geometry.hpp"
+#include "thread.hpp"
+
 #ifndef MAX_TILE_SIZE
 #define MAX_TILE_SIZE 64
 #endif
@@ -70,13 +75,57 @@ public:
 	void clear();
 
 	void merge(const LevelSolidMap& m, int xoffset, int yoffset);
+
+	//whether the pixel, or any pixel in the rect, is solid. These use a
+	//copy of the map held as chunks of bits rather than tiles, which is
+	//brought up to date with tiles that have changed when next queried.
+	bool isSolid(int x, int y) const;
+	bool isSolidInRect(const rect& r) const;
+
+	//a counter which changes every time the map may have been modified,
+	//allowing caches derived from the map to be invalidated.
+	unsigned int version() const { return version_; }
 private:
 
 	TileSolidInfo** insertRaw(const tile_pos& pos);
+	void markDirty(const tile_pos& pos);
 
 	struct row {
 		std::vector<TileSolidInfo*> positive_cells, negative_cells;
 	};
 
 	std::vector<row> positive_rows_, negative_rows_;
+
+	unsigned int version_;
+
+	//The chunked copy of the map. Each chunk is ChunkSize pixels square with
+	//a word for each row, bit n being pixel n of the row. Chunks with no
+	//solid pixels or only solid pixels aren't stored.
+	enum { ChunkShift = 6, ChunkSize = 1 << ChunkShift };
+	enum { EmptyChunk = -1, SolidChunk = -2 };
+
+	struct Chunk {
+		uint64_t rows[ChunkSize];
+	};
+
+	//the index of chunk (cx, cy), or EmptyChunk if it's outside the grid.
+	int getChunk(int cx, int cy) const;
+
+	void syncChunks() const;
+	void syncTile(const tile_pos& pos) const;
+	void setChunkBits(int x, int y, int n, uint64_t bits) const;
+	void growChunkGrid(int cx, int cy) const;
+
+	//The grid of chunk indexes into chunks_, or EmptyChunk or SolidChunk,
+	//covering chunk_w_ by chunk_h_ chunks from chunk (chunk_x_, chunk_y_).
+	//These are updated from tiles marked as dirty, which might be done by
+	//any thread querying the map, so are guarded by chunk_mutex_.
+	mutable std::vector<int> chunk_grid_;
+	mutable int chunk_x_, chunk_y_, chunk_w_, chunk_h_;
+	mutable std::vector<Chunk> chunks_;
+	mutable std::vector<int> free_chunks_;
+
+	mutable std::vector<tile_pos> dirty_tiles_;
+	mutable std::atomic<bool> dirty_;
+	mutable threading::mutex chunk_mutex_;
 };
@@ -41,7 +41,6 @@
 
 #include "asserts.hpp"
 #include "auto_update_window.hpp"
-#include "background_task_pool.hpp"
 #include "checksum.hpp"
 #include "controls.hpp"
 #include "custom_object.hpp"
@@ -51,6 +50,7 @@
 #include "difficulty.hpp"
 #include "external_text_editor.hpp"
 #include "filesystem.hpp"
+#include "formula_bytecode_cache.hpp"
 #include "formula_callable_definition.hpp"
 #include "formula_object.hpp"
 #include "formula_profiler.hpp"
@@ -80,6 +80,7 @@
 #include "sound.hpp"
 #include "stats.hpp"
 #include "string_utils.hpp"
+#include "task_scheduler.hpp"
 #include "tbs_internal_server.hpp"
 #include "tile_map.hpp"
 #include "theme_imgui.hpp"
@@ -126,6 +127,7 @@ namespace
 
 	PREF_BOOL(desktop_fullscreen_force, false, "(Windows) forces desktop fullscreen to actually use fullscreen rather than a borderless window the size of the desktop");
 	PREF_BOOL(msaa, false, "Use msaa");
+	PREF_STRING(renderer, "opengl", "Display device to render with. 'null' draws nothing, for measuring the CPU cost of rendering without a GPU");
 
 
 #if defined(_MSC_VER)
@@ -686,7 +688,7 @@ int main(int argcount, char* argvec[])
 		}
 	}
 
-	background_task_pool::manager bg_task_pool_manager;
+	task_scheduler::manager task_scheduler_manager;
 
 	LOG_INFO("Preferences dir: " << preferences::user_data_path());
 
@@ -849,6 +851,8 @@ int main(int argcount, char* argvec[])
 
 	const stats::Manager stats_manager;
 
+	const formula_bytecode_cache::Manager bytecode_cache_manager;
+
 	const SharedMemoryPipeManager ipc_manager;
 
 	const tbs::internal_server_manager internal_server_manager_scope(preferences::internal_tbs_server());
@@ -893,7 +897,7 @@ int main(int argcount, char* argvec[])
 	WindowManager wm("SDL");
 
 	variant_builder hints;
-	hints.add("renderer", "opengl");
+	hints.add("renderer", g_renderer);
 	hints.add("use_vsync", g_vsync != 0 ? true : false);
 	hints.add("width", preferences::requested_window_width() > 0 ? preferences::requested_window_width() : 800);
 	hints.add("height", preferences::requested_window_height() > 0 ? preferences::requested_window_height() : 600);
@@ -21,11 +21,15 @@
 	   distribution.
 */
 
+#include <algorithm>
+#include <map>
 #include <queue>
+#include <thread>
 
 #include "math.h"
 #include "level.hpp"
 #include "pathfinding.hpp"
+#include "task_scheduler.hpp"
 #include "tile_map.hpp"
 #include "unit_test.hpp"
 
@@ -242,122 +246,415 @@ namespace pathfinding
 		if(pt.y > r.y2()) {pt.y = r.y2();}
 	}
 
+	namespace {
+		int floor_div(int n, int d) {
+			return n >= 0 ? n/d : -((-n + d - 1)/d);
+		}
+	}
+
+	SolidityGrid::SolidityGrid(const Level& lvl, const rect& area, int tile_size_x, int tile_size_y, unsigned int solid_state_id)
+		: lvl_(&lvl),
+		area_(area),
+		tile_size_x_(tile_size_x),
+		tile_size_y_(tile_size_y),
+		solid_state_id_(solid_state_id)
+	{
+		// Midpoints lie on the lattice k*tile_size + tile_size/2. Allow one
+		// tile of margin since start and end points can be clipped to the
+		// very edge of the level.
+		col_begin_ = floor_div(area.x() - tile_size_x, tile_size_x);
+		row_begin_ = floor_div(area.y() - tile_size_y, tile_size_y);
+		ncols_ = floor_div(area.x2() + tile_size_x, tile_size_x) - col_begin_ + 1;
+		nrows_ = floor_div(area.y2() + tile_size_y, tile_size_y) - row_begin_ + 1;
+
+		cells_.reset(new std::atomic<unsigned char>[numCells()]);
+		for(int n = 0; n != numCells(); ++n) {
+			cells_[n].store(CELL_UNKNOWN, std::memory_order_relaxed);
+		}
+	}
+
+	bool SolidityGrid::getCell(const point& midpoint, int* col, int* row) const
+	{
+		*col = floor_div(midpoint.x, tile_size_x_) - col_begin_;
+		*row = floor_div(midpoint.y, tile_size_y_) - row_begin_;
+		return *col >= 0 && *row >= 0 && *col < ncols_ && *row < nrows_;
+	}
+
+	point SolidityGrid::getMidpoint(int col, int row) const
+	{
+		return point((col + col_begin_)*tile_size_x_ + tile_size_x_/2, (row + row_begin_)*tile_size_y_ + tile_size_y_/2);
+	}
+
+	bool SolidityGrid::isSolid(int col, int row) const
+	{
+		std::atomic<unsigned char>& cell = cells_[row*ncols_ + col];
+		unsigned char value = cell.load(std::memory_order_relaxed);
+		if(value == CELL_UNKNOWN) {
+			// Several threads may race to fill in the same cell, but they
+			// will all calculate the same value.
+			const point p = getMidpoint(col, row);
+			value = lvl_->solid(p.x, p.y, tile_size_x_, tile_size_y_) ? CELL_SOLID : CELL_CLEAR;
+			cell.store(value, std::memory_order_relaxed);
+		}
+
+		return value == CELL_SOLID;
+	}
+
+	BuiltinHeuristic get_builtin_heuristic(const game_logic::ExpressionPtr& heuristic)
+	{
+		variant v;
+		if(!heuristic || !heuristic->isLiteral(v)) {
+			return BuiltinHeuristic::NONE;
+		}
+
+		if(v.is_string()) {
+			if(v.as_string() == "manhattan") {
+				return BuiltinHeuristic::MANHATTAN;
+			} else if(v.as_string() == "euclidean") {
+				return BuiltinHeuristic::EUCLIDEAN;
+			}
+
+			ASSERT_LOG(false, "Unknown pathfinding heuristic: '" << v.as_string() << "'. Use 'manhattan', 'euclidean' or an expression using a and b");
+		}
+
+		if(v.is_numeric() && v.as_decimal() == decimal::from_int(0)) {
+			return BuiltinHeuristic::ZERO;
+		}
+
+		return BuiltinHeuristic::NONE;
+	}
+
+	namespace {
+		struct PathNode {
+			double g;
+			int parent;
+			unsigned int visit;
+			bool closed;
+		};
+
+		// Per-thread storage for searches, reused between searches so a
+		// search doesn't allocate unless it needs a bigger grid than before.
+		// Nodes belong to the current search only if their visit matches.
+		struct PathNodePool {
+			PathNodePool() : visit(0), in_use(false) {}
+
+			void begin(int ncells) {
+				if(nodes.size() < static_cast<size_t>(ncells)) {
+					nodes.resize(ncells);
+				}
+
+				if(++visit == 0) {
+					for(PathNode& n : nodes) {
+						n.visit = 0;
+					}
+					visit = 1;
+				}
+
+				open.clear();
+			}
+
+			std::vector<PathNode> nodes;
+			unsigned int visit;
+
+			// (f, cell index) pairs, kept as a min-heap.
+			std::vector<std::pair<double, int>> open;
+
+			bool in_use;
+		};
+
+		thread_local PathNodePool g_node_pool;
+
+		// Claims the thread's pool for a search. A heuristic or weight
+		// formula may plot paths of its own while a search is using the
+		// pool, in which case the nested search gets a pool to itself.
+		class PathNodePoolScope {
+		public:
+			PathNodePoolScope() : pool_(&g_node_pool) {
+				if(pool_->in_use) {
+					nested_pool_.reset(new PathNodePool);
+					pool_ = nested_pool_.get();
+				}
+
+				pool_->in_use = true;
+			}
+
+			~PathNodePoolScope() {
+				pool_->in_use = false;
+			}
+
+			PathNodePoolScope(const PathNodePoolScope&) = delete;
+			void operator=(const PathNodePoolScope&) = delete;
+
+			PathNodePool& get() const { return *pool_; }
+		private:
+
+			std::unique_ptr<PathNodePool> nested_pool_;
+			PathNodePool* pool_;
+		};
+
+		struct OpenListMore {
+			bool operator()(const std::pair<double, int>& a, const std::pair<double, int>& b) const {
+				return a.first > b.first;
+			}
+		};
+
+		struct NativeHeuristic {
+			BuiltinHeuristic type;
+			double operator()(const point& a, const point& b) const {
+				switch(type) {
+				case BuiltinHeuristic::MANHATTAN:
+					return std::abs(a.x - b.x) + std::abs(a.y - b.y);
+				case BuiltinHeuristic::EUCLIDEAN:
+					return calc_weight(a, b);
+				default:
+					return 0.0;
+				}
+			}
+		};
+
+		struct NativeWeight {
+			double operator()(const point& a, const point& b) const {
+				return calc_weight(a, b);
+			}
+		};
+
+		struct FormulaHeuristic {
+			game_logic::ExpressionPtr expr;
+			game_logic::MapFormulaCallablePtr callable;
+			variant* a;
+			variant* b;
+			double operator()(const point& p1, const point& p2) const {
+				*a = point_as_variant_list(p1);
+				*b = point_as_variant_list(p2);
+				return expr->evaluate(*callable).as_decimal().as_float();
+			}
+		};
+
+		// Runs A* over the grid. On success fills path with the cells from
+		// src to dst, inclusive.
+		template<typename Heuristic, typename Weight>
+		bool grid_search(const SolidityGrid& grid, int src_col, int src_row, int dst_col, int dst_row, const Heuristic& heuristic, const Weight& weight, std::vector<point>* path)
+		{
+			const PathNodePoolScope pool_scope;
+			PathNodePool& pool = pool_scope.get();
+			pool.begin(grid.numCells());
+
+			const int ncols = grid.numCols();
+			const int tile_size_x = grid.tileSizeX();
+			const int tile_size_y = grid.tileSizeY();
+			const rect& b = grid.area();
+			const point dst = grid.getMidpoint(dst_col, dst_row);
+			const int dst_index = dst_row*ncols + dst_col;
+
+			const int src_index = src_row*ncols + src_col;
+			PathNode& src_node = pool.nodes[src_index];
+			src_node.g = 0.0;
+			src_node.parent = -1;
+			src_node.visit = pool.visit;
+			src_node.closed = false;
+			pool.open.emplace_back(heuristic(grid.getMidpoint(src_col, src_row), dst), src_index);
+
+			static const int Directions[][2] = { {-1,0}, {1,0}, {0,-1}, {0,1}, {-1,-1}, {1,-1}, {-1,1}, {1,1} };
+
+			while(!pool.open.empty()) {
+				std::pop_heap(pool.open.begin(), pool.open.end(), OpenListMore());
+				const int index = pool.open.back().second;
+				pool.open.pop_back();
+
+				PathNode& current = pool.nodes[index];
+				if(current.closed) {
+					// a stale entry superseded by a cheaper route.
+					continue;
+				}
+
+				if(index == dst_index) {
+					path->clear();
+					for(int n = index; n != -1; n = pool.nodes[n].parent) {
+						path->push_back(grid.getMidpoint(n%ncols, n/ncols));
+					}
+					std::reverse(path->begin(), path->end());
+					return true;
+				}
+
+				current.closed = true;
+
+				const int col = index%ncols;
+				const int row = index/ncols;
+				const point mid = grid.getMidpoint(col, row);
+
+				for(const auto& d : Directions) {
+					const point p(mid.x + d[0]*tile_size_x, mid.y + d[1]*tile_size_y);
+					if(p.x < b.x() || p.x >= b.x2() || p.y < b.y() || p.y >= b.y2()) {
+						continue;
+					}
+
+					const int ncol = col + d[0];
+					const int nrow = row + d[1];
+					if(grid.isSolid(ncol, nrow)) {
+						continue;
+					}
+
+					const int nindex = nrow*ncols + ncol;
+					PathNode& neighbour = pool.nodes[nindex];
+					const double g_cost = current.g + weight(mid, p);
+					if(neighbour.visit != pool.visit) {
+						neighbour.visit = pool.visit;
+						neighbour.closed = false;
+					} else if(neighbour.closed || g_cost >= neighbour.g) {
+						continue;
+					}
+
+					neighbour.g = g_cost;
+					neighbour.parent = index;
+					pool.open.emplace_back(g_cost + heuristic(p, dst), nindex);
+					std::push_heap(pool.open.begin(), pool.open.end(), OpenListMore());
+				}
+			}
+
+			return false;
+		}
+
+		template<typename Heuristic, typename Weight>
+		variant find_path_on_grid(const SolidityGrid& grid,
+			const point& src_pt1,
+			const point& dst_pt1,
+			const Heuristic& heuristic,
+			const Weight& weight)
+		{
+			std::vector<variant> path;
+			point src_pt(src_pt1), dst_pt(dst_pt1);
+			clip_pt_to_rect(src_pt, grid.area());
+			clip_pt_to_rect(dst_pt, grid.area());
+			point src(get_midpoint(src_pt, grid.tileSizeX(), grid.tileSizeY()));
+			point dst(get_midpoint(dst_pt, grid.tileSizeX(), grid.tileSizeY()));
+
+			if(src == dst) {
+				return variant(&path);
+			}
+
+			int src_col, src_row, dst_col, dst_row;
+			if(!grid.getCell(src, &src_col, &src_row) || !grid.getCell(dst, &dst_col, &dst_row) ||
+			   grid.isSolid(src_col, src_row) || grid.isSolid(dst_col, dst_row)) {
+				return variant(&path);
+			}
+
+			std::vector<point> points;
+			if(!grid_search(grid, src_col, src_row, dst_col, dst_row, heuristic, weight, &points)) {
+				LOG_ERROR("Open list was empty -- no path found.  (" << src.x << "," << src.y << ") : (" << dst_pt.x << "," << dst_pt.y << ")");
+				return variant(&path);
+			}
+
+			// The path is reported as starting and ending at the exact
+			// points asked for, rather than at the midpoints of their tiles.
+			points.front() = src_pt;
+			points.back() = dst_pt;
+			path.reserve(points.size());
+			for(const point& p : points) {
+				path.emplace_back(point_as_variant_list(p));
+			}
+
+			return variant(&path);
+		}
+	}
+
 	variant a_star_find_path(LevelPtr lvl,
-		const point& src_pt1,
-		const point& dst_pt1,
+		const point& src_pt,
+		const point& dst_pt,
 		game_logic::ExpressionPtr heuristic,
 		game_logic::ExpressionPtr weight_expr,
 		game_logic::MapFormulaCallablePtr callable,
 		const int tile_size_x,
 		const int tile_size_y)
 	{
-		typedef GraphNode<point, double>::GraphNodePtr gnp;
-		std::priority_queue<gnp, std::vector<gnp>, DerefPointerMore<gnp>> open_list;
-		std::vector<variant> path;
-		typedef std::map<point, gnp> graph_node_list;
-		graph_node_list node_list;
-		point src_pt(src_pt1), dst_pt(dst_pt1);
-		// Use some outside knowledge to grab the bounding rect for the level
-		const rect& b_rect = Level::current().boundaries();
-		clip_pt_to_rect(src_pt, b_rect);
-		clip_pt_to_rect(dst_pt, b_rect);
-		point src(get_midpoint(src_pt, tile_size_x, tile_size_y));
-		point dst(get_midpoint(dst_pt, tile_size_x, tile_size_y));
-		variant& a = callable->addDirectAccess("a");
-		variant& b = callable->addDirectAccess("b");
-
-		if(src == dst) {
-			return variant(&path);
+		const SolidityGridPtr grid = lvl->get_pathfinding_grid(tile_size_x, tile_size_y);
+
+		FormulaHeuristic formula_heuristic = { heuristic, callable, &callable->addDirectAccess("a"), &callable->addDirectAccess("b") };
+		const BuiltinHeuristic builtin = get_builtin_heuristic(heuristic);
+		if(weight_expr) {
+			FormulaHeuristic formula_weight = formula_heuristic;
+			formula_weight.expr = weight_expr;
+			if(builtin != BuiltinHeuristic::NONE) {
+				return find_path_on_grid(*grid, src_pt, dst_pt, NativeHeuristic{builtin}, formula_weight);
+			}
+
+			return find_path_on_grid(*grid, src_pt, dst_pt, formula_heuristic, formula_weight);
 		}
 
-		if(lvl->solid(src.x, src.y, tile_size_x, tile_size_y) || lvl->solid(dst.x, dst.y, tile_size_x, tile_size_y)) {
-			return variant(&path);
+		if(builtin != BuiltinHeuristic::NONE) {
+			return find_path_on_grid(*grid, src_pt, dst_pt, NativeHeuristic{builtin}, NativeWeight());
 		}
 
-		bool searching = true;
-		try {
-			a = point_as_variant_list(src);
-			b = point_as_variant_list(dst);
-			gnp current = std::make_shared<GraphNode<point,double>>(src);
-			current->setCost(0.0, heuristic->evaluate(*callable).as_decimal().as_float());
-			current->setOnOpenList(true);
-			open_list.push(current);
-			node_list[src] = current;
+		return find_path_on_grid(*grid, src_pt, dst_pt, formula_heuristic, NativeWeight());
+	}
 
-			while(searching) {
-				if(open_list.empty()) {
-					// open list is empty node not found.
-					PathfindingException<point> path_error = {
-						"Open list was empty -- no path found. ",
-						src,
-						dst
-					};
-					throw path_error;
+	std::vector<variant> a_star_find_paths(LevelPtr lvl,
+		const std::vector<PathQuery>& queries,
+		BuiltinHeuristic heuristic,
+		const int tile_size_x,
+		const int tile_size_y)
+	{
+		ASSERT_LOG(heuristic != BuiltinHeuristic::NONE, "Batched path finding requires a builtin heuristic");
+
+		const SolidityGridPtr grid = lvl->get_pathfinding_grid(tile_size_x, tile_size_y);
+		const NativeHeuristic native_heuristic = { heuristic };
+
+		std::vector<std::vector<point>> results(queries.size());
+		auto run_queries = [&](size_t begin, size_t end) {
+			for(size_t n = begin; n != end; ++n) {
+				// results are built as points here since variants can't be
+				// created safely off the main thread.
+				point src_pt(queries[n].src), dst_pt(queries[n].dst);
+				clip_pt_to_rect(src_pt, grid->area());
+				clip_pt_to_rect(dst_pt, grid->area());
+				const point src(get_midpoint(src_pt, tile_size_x, tile_size_y));
+				const point dst(get_midpoint(dst_pt, tile_size_x, tile_size_y));
+				int src_col, src_row, dst_col, dst_row;
+				if(src == dst || !grid->getCell(src, &src_col, &src_row) || !grid->getCell(dst, &dst_col, &dst_row) ||
+				   grid->isSolid(src_col, src_row) || grid->isSolid(dst_col, dst_row)) {
+					continue;
 				}
-				current = open_list.top(); open_list.pop();
-				current->setOnOpenList(false);
 
-				if(current->getNodeValue() == dst) {
-					// Found the path to our node.
-					searching = false;
-					auto p = current->getParent();
-					path.push_back(point_as_variant_list(dst_pt));
-					while(p != 0) {
-						point pt_to_add = p->getNodeValue();
-						if(pt_to_add == src) {
-							pt_to_add = src_pt;
-						}
-						path.insert(path.begin(), point_as_variant_list(pt_to_add));
-						p = p->getParent();
-					}
-				} else {
-					// Push lowest f node to the closed list so we don't consider it anymore.
-					current->setOnClosedList(true);
-					// Search through all the neighbour nodes connected to this one.
-					// XXX get_neighbours_from_rect should(?) implement a cache of the point to edges
-					for(const point& p : get_neighbours_from_rect(current->getNodeValue(), tile_size_x, tile_size_y, b_rect)) {
-						if(!lvl->solid(p.x, p.y, tile_size_x, tile_size_y)) {
-							graph_node_list::const_iterator neighbour_node = node_list.find(p);
-							double g_cost = current->G();
-							if(weight_expr) {
-								a = point_as_variant_list(current->getNodeValue());
-								b = point_as_variant_list(p);
-								g_cost += weight_expr->evaluate(*callable).as_decimal().as_float();
-							} else {
-								g_cost += calc_weight(p, current->getNodeValue());
-							}
-							if(neighbour_node == node_list.end()) {
-								// not on open or closed list (i.e. no mapping for it yet.
-								a = point_as_variant_list(p);
-								b = point_as_variant_list(dst);
-								gnp new_node = std::make_shared<GraphNode<point,double>>(p);
-								new_node->setParent(current);
-								new_node->setCost(g_cost, heuristic->evaluate(*callable).as_decimal().as_float());
-								new_node->setOnOpenList(true);
-								node_list[p] = new_node;
-								open_list.push(new_node);
-							} else if(neighbour_node->second->isOnClosedList() || neighbour_node->second->isOnOpenList()) {
-								// on closed list.
-								if(g_cost < neighbour_node->second->G()) {
-									neighbour_node->second->G(g_cost);
-									neighbour_node->second->setParent(current);
-								}
-							} else {
-								PathfindingException<point> path_error = {
-									"graph node on list, but not on open or closed lists. ",
-									p,
-									dst_pt
-								};
-								throw path_error;
-							}
-						}
-					}
+				if(grid_search(*grid, src_col, src_row, dst_col, dst_row, native_heuristic, NativeWeight(), &results[n])) {
+					results[n].front() = src_pt;
+					results[n].back() = dst_pt;
 				}
 			}
-		} catch (const PathfindingException<point>& e) {
-			LOG_ERROR(e.msg << " (" << e.src.x << "," << e.src.y << ") : (" << e.dest.x << "," << e.dest.y << ")");
+		};
+
+		// Small batches aren't worth the overhead of waking other threads.
+		const size_t QueriesPerJob = 8;
+		const size_t njobs = std::min<size_t>(static_cast<size_t>(task_scheduler::numWorkers() + 1), (queries.size() + QueriesPerJob - 1)/QueriesPerJob);
+		if(njobs <= 1) {
+			run_queries(0, queries.size());
+		} else {
+			std::vector<task_scheduler::TaskPtr> tasks;
+			const size_t per_job = (queries.size() + njobs - 1)/njobs;
+			for(size_t job = 1; job < njobs; ++job) {
+				const size_t begin = std::min(queries.size(), job*per_job);
+				const size_t end = std::min(queries.size(), begin + per_job);
+				tasks.push_back(task_scheduler::submit([&, begin, end]() {
+					run_queries(begin, end);
+				}, task_scheduler::PRIORITY::HIGH));
+			}
+
+			// this thread takes the first share of the work, then waits.
+			run_queries(0, std::min(queries.size(), per_job));
+			task_scheduler::wait(tasks);
 		}
-		return variant(&path);
+
+		std::vector<variant> paths;
+		paths.reserve(results.size());
+		for(const std::vector<point>& points : results) {
+			std::vector<variant> path;
+			path.reserve(points.size());
+			for(const point& p : points) {
+				path.emplace_back(point_as_variant_list(p));
+			}
+
+			paths.emplace_back(&path);
+		}
+
+		return paths;
 	}
 
 	// Find all the nodes reachable from src_node that have less than max_cost to get there.
@@ -419,6 +716,57 @@ namespace pathfinding
 	}
 }
 
+namespace {
+	// A fixed set of journeys across the level, so that each variation of
+	// the benchmark does the same work.
+	std::vector<pathfinding::PathQuery> get_benchmark_path_queries(const Level& lvl, int count)
+	{
+		const rect& b = lvl.boundaries();
+		std::vector<pathfinding::PathQuery> result;
+		for(int n = 0; n != count; ++n) {
+			const int a = (n*37)%100;
+			const int c = (n*61 + 50)%100;
+			pathfinding::PathQuery q = {
+				point(b.x() + (b.w()*a)/100, b.y() + (b.h()*c)/100),
+				point(b.x() + (b.w()*(99-c))/100, b.y() + (b.h()*(99-a))/100) };
+			result.push_back(q);
+		}
+
+		return result;
+	}
+}
+
+BENCHMARK_ARG(plot_path, const std::string& heuristic)
+{
+	static LevelPtr lvl(new Level("stairway-to-heaven.cfg"));
+	const std::vector<pathfinding::PathQuery> queries = get_benchmark_path_queries(*lvl, 16);
+
+	game_logic::MapFormulaCallablePtr callable(new game_logic::MapFormulaCallable);
+	callable->add("lvl", variant(lvl.get()));
+	const game_logic::Formula f(variant("plot_path(lvl, x1, y1, x2, y2, " + heuristic + ")"));
+	BENCHMARK_LOOP {
+		for(const pathfinding::PathQuery& q : queries) {
+			callable->add("x1", variant(q.src.x));
+			callable->add("y1", variant(q.src.y));
+			callable->add("x2", variant(q.dst.x));
+			callable->add("y2", variant(q.dst.y));
+			f.execute(*callable);
+		}
+	}
+}
+
+BENCHMARK_ARG_CALL(plot_path, ffl_heuristic, "abs(a[0]-b[0]) + abs(a[1]-b[1])");
+BENCHMARK_ARG_CALL(plot_path, builtin_manhattan, "'manhattan'");
+
+BENCHMARK(plot_paths_batched)
+{
+	static LevelPtr lvl(new Level("stairway-to-heaven.cfg"));
+	const std::vector<pathfinding::PathQuery> queries = get_benchmark_path_queries(*lvl, 16);
+	BENCHMARK_LOOP {
+		pathfinding::a_star_find_paths(lvl, queries, pathfinding::BuiltinHeuristic::MANHATTAN, TileSize, TileSize);
+	}
+}
+
 UNIT_TEST(directed_graph_function) {
 	CHECK_EQ(game_logic::Formula(variant("directed_graph(map(range(4), [value/2,value%2]), null).vertices")).execute(), game_logic::Formula(variant("[[0,0],[0,1],[1,0],[1,1]]")).execute());
 	CHECK_EQ(game_logic::Formula(variant("directed_graph(map(range(4), [value/2,value%2]), filter(links(v), inside_bounds(value))).edges where links = def(v) [[v[0]-1,v[1]], [v[0]+1,v[1]], [v[0],v[1]-1], [v[0],v[1]+1]], inside_bounds = def(v) v[0]>=0 and v[1]>=0 and v[0]<2 and v[1]<2")).execute(),
@@ -433,3 +781,137 @@ UNIT_TEST(cost_path_search_function) {
 	CHECK_EQ(game_logic::Formula(variant("sort(path_cost_search(weighted_graph(directed_graph(map(range(9), [value/3,value%3]), filter(links(v), inside_bounds(value))), def(any a, any b)->decimal sqrt((a[0]-b[0])^2+(a[1]-b[1])^2)), [1,1], 1)) where links = def(v) [[v[0]-1,v[1]], [v[0]+1,v[1]], [v[0],v[1]-1], [v[0],v[1]+1],[v[0]-1,v[1]-1],[v[0]-1,v[1]+1],[v[0]+1,v[1]-1],[v[0]+1,v[1]+1]], inside_bounds = def(v) v[0]>=0 and v[1]>=0 and v[0]<3 and v[1]<3")).execute(),
 		game_logic::Formula(variant("sort([[1,1], [1,0], [2,1], [1,2], [0,1]])")).execute());
 }
+
+namespace {
+	// The cost of the cheapest route between the tiles containing src and
+	// dst, found by a plain search of every tile, for checking the A*
+	// search against.
+	double reference_path_cost(const Level& lvl, const point& src, const point& dst, int tile_size)
+	{
+		const rect& b = lvl.boundaries();
+		const point start = pathfinding::get_midpoint(src, tile_size, tile_size);
+		const point goal = pathfinding::get_midpoint(dst, tile_size, tile_size);
+
+		std::map<point, double> best;
+		typedef std::pair<double, point> Entry;
+		auto more = [](const Entry& a, const Entry& c) { return a.first > c.first; };
+		std::priority_queue<Entry, std::vector<Entry>, decltype(more)> open(more);
+		best[start] = 0.0;
+		open.push(Entry(0.0, start));
+		while(!open.empty()) {
+			const Entry e = open.top();
+			open.pop();
+			if(e.second == goal) {
+				return e.first;
+			}
+
+			if(e.first > best[e.second]) {
+				continue;
+			}
+
+			for(int dx = -1; dx <= 1; ++dx) {
+				for(int dy = -1; dy <= 1; ++dy) {
+					const point p(e.second.x + dx*tile_size, e.second.y + dy*tile_size);
+					if((dx == 0 && dy == 0) || p.x < b.x() || p.x >= b.x2() || p.y < b.y() || p.y >= b.y2() || lvl.solid(p.x, p.y, tile_size, tile_size)) {
+						continue;
+					}
+
+					const double cost = e.first + pathfinding::calc_weight(e.second, p);
+					auto itor = best.find(p);
+					if(itor == best.end() || cost < itor->second) {
+						best[p] = cost;
+						open.push(Entry(cost, p));
+					}
+				}
+			}
+		}
+
+		return -1.0;
+	}
+
+	// The cost of a path returned by plot_path, measured between the
+	// midpoints of its tiles, and whether each step is to a clear,
+	// neighbouring tile.
+	double plotted_path_cost(const Level& lvl, const variant& path, int tile_size, bool* valid)
+	{
+		*valid = path.num_elements() > 0;
+		double cost = 0.0;
+		for(int n = 1; n < static_cast<int>(path.num_elements()); ++n) {
+			const point a = pathfinding::get_midpoint(point(path[n-1][0].as_int(), path[n-1][1].as_int()), tile_size, tile_size);
+			const point c = pathfinding::get_midpoint(point(path[n][0].as_int(), path[n][1].as_int()), tile_size, tile_size);
+			if(std::abs(a.x - c.x) > tile_size || std::abs(a.y - c.y) > tile_size || lvl.solid(c.x, c.y, tile_size, tile_size)) {
+				*valid = false;
+			}
+
+			cost += pathfinding::calc_weight(a, c);
+		}
+
+		return cost;
+	}
+}
+
+UNIT_TEST(plot_path_native_matches_formula_heuristic)
+{
+	const int TS = 32;
+	LevelPtr lvl(new Level("test.cfg"));
+	const rect& b = lvl->boundaries();
+
+	// A clear area of 14x10 tiles with two walls, each with a gap at
+	// opposite ends, so routes have to wind through it.
+	const point origin(b.x() + TS*2, b.y() + TS*2);
+	lvl->set_solid_area(rect(origin.x, origin.y, TS*14, TS*10), false);
+	lvl->set_solid_area(rect(origin.x + TS*4, origin.y, TS, TS*8), true);
+	lvl->set_solid_area(rect(origin.x + TS*9, origin.y + TS*2, TS, TS*8), true);
+
+	game_logic::MapFormulaCallablePtr callable(new game_logic::MapFormulaCallable);
+	callable->add("lvl", variant(lvl.get()));
+	callable->add("ts", variant(TS));
+
+	const point journeys[][2] = {
+		{ point(1, 1), point(12, 1) },
+		{ point(1, 8), point(12, 9) },
+		{ point(0, 0), point(13, 9) },
+		{ point(6, 4), point(2, 9) },
+	};
+
+	for(const auto& journey : journeys) {
+		const point src(origin.x + journey[0].x*TS + 5, origin.y + journey[0].y*TS + 7);
+		const point dst(origin.x + journey[1].x*TS + 3, origin.y + journey[1].y*TS + 11);
+		callable->add("x1", variant(src.x));
+		callable->add("y1", variant(src.y));
+		callable->add("x2", variant(dst.x));
+		callable->add("y2", variant(dst.y));
+
+		const double expected_cost = reference_path_cost(*lvl, src, dst, TS);
+		CHECK(expected_cost > 0.0, "No route in the test level");
+
+		// the same heuristic evaluated as a formula and natively searches
+		// the same way.
+		const variant ffl_path = game_logic::Formula(variant("plot_path(lvl, x1, y1, x2, y2, abs(a[0]-b[0]) + abs(a[1]-b[1]))")).execute(*callable);
+		const variant native_path = game_logic::Formula(variant("plot_path(lvl, x1, y1, x2, y2, 'manhattan')")).execute(*callable);
+		CHECK_EQ(native_path, ffl_path);
+		CHECK_EQ(native_path[0], game_logic::Formula(variant("[x1, y1]")).execute(*callable));
+		CHECK_EQ(native_path[native_path.num_elements()-1], game_logic::Formula(variant("[x2, y2]")).execute(*callable));
+
+		// with a heuristic which never overestimates, the path is as cheap
+		// as possible whichever way the heuristic is evaluated. The weight
+		// and tile size arguments come after the heuristic.
+		for(const char* formula : {
+			"plot_path(lvl, x1, y1, x2, y2, 'euclidean')",
+			"plot_path(lvl, x1, y1, x2, y2, sqrt((a[0]-b[0])^2 + (a[1]-b[1])^2))",
+			"plot_path(lvl, x1, y1, x2, y2, 0, sqrt((a[0]-b[0])^2 + (a[1]-b[1])^2), ts)",
+			"plot_path(lvl, x1, y1, x2, y2, 'euclidean', sqrt((a[0]-b[0])^2 + (a[1]-b[1])^2), ts, ts)",
+		}) {
+			const variant path = game_logic::Formula(variant(formula)).execute(*callable);
+			bool valid = false;
+			const double cost = plotted_path_cost(*lvl, path, TS, &valid);
+			CHECK(valid, "Invalid path from " << formula << ": " << path.write_json());
+			CHECK(std::abs(cost - expected_cost) < 0.01, "Path from " << formula << " costs " << cost << " rather than " << expected_cost);
+		}
+
+		// a heuristic which plots paths of its own doesn't disturb the
+		// search it's used in.
+		const variant nested_path = game_logic::Formula(variant("plot_path(lvl, x1, y1, x2, y2, abs(a[0]-b[0]) + abs(a[1]-b[1]) + 0*size(plot_path(lvl, a[0], a[1], b[0], b[1], 'manhattan')))")).execute(*callable);
+		CHECK_EQ(nested_path, ffl_path);
+	}
+}
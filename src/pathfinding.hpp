@@ -23,8 +23,10 @@
 
 #pragma once
 
+#include <atomic>
 #include <iostream>
 #include <map>
+#include <memory>
 #include <utility>
 #include <vector>
 
@@ -209,6 +211,66 @@ namespace pathfinding
 		const variant dst_node,
 		variant heuristic_fn);
 
+	// A coarse map of which tile sized cells of a level are solid, as used
+	// by a_star_find_path(). Cells are only tested against the level the
+	// first time they are needed. Level::get_pathfinding_grid() keeps these
+	// cached until the level's solid map changes. Lookups may be made from
+	// several threads at once as long as the level isn't being modified.
+	class SolidityGrid
+	{
+	public:
+		SolidityGrid(const Level& lvl, const rect& area, int tile_size_x, int tile_size_y, unsigned int solid_state_id);
+
+		const rect& area() const { return area_; }
+		int tileSizeX() const { return tile_size_x_; }
+		int tileSizeY() const { return tile_size_y_; }
+		unsigned int solidStateId() const { return solid_state_id_; }
+
+		int numCols() const { return ncols_; }
+		int numRows() const { return nrows_; }
+		int numCells() const { return ncols_*nrows_; }
+
+		// Cells are centered on the midpoints produced by get_midpoint().
+		bool getCell(const point& midpoint, int* col, int* row) const;
+		point getMidpoint(int col, int row) const;
+
+		bool isSolid(int col, int row) const;
+	private:
+		SolidityGrid(const SolidityGrid&);
+		void operator=(const SolidityGrid&);
+
+		enum { CELL_UNKNOWN, CELL_SOLID, CELL_CLEAR };
+
+		const Level* lvl_;
+		rect area_;
+		int tile_size_x_, tile_size_y_;
+		unsigned int solid_state_id_;
+		int col_begin_, row_begin_;
+		int ncols_, nrows_;
+		std::unique_ptr<std::atomic<unsigned char>[]> cells_;
+	};
+
+	typedef std::shared_ptr<SolidityGrid> SolidityGridPtr;
+
+	// Heuristics which a_star_find_path() can evaluate natively instead of
+	// running an FFL expression. They are selected by passing the name
+	// as a string literal, e.g. plot_path(level, x1, y1, x2, y2, 'manhattan')
+	enum class BuiltinHeuristic { NONE, MANHATTAN, EUCLIDEAN, ZERO };
+	BuiltinHeuristic get_builtin_heuristic(const game_logic::ExpressionPtr& heuristic);
+
+	struct PathQuery {
+		point src, dst;
+	};
+
+	// Resolves many path queries at once, splitting them between worker
+	// threads. Results are in the same format as a_star_find_path() and in
+	// the same order as the queries.
+	std::vector<variant> a_star_find_paths(LevelPtr lvl,
+		const std::vector<PathQuery>& queries,
+		BuiltinHeuristic heuristic,
+		const int tile_size_x,
+		const int tile_size_y);
+
 	variant a_star_find_path(LevelPtr lvl, const point& src,
 		const point& dst,
 		game_logic::ExpressionPtr heuristic,
@@ -0,0 +1,260 @@
+/*
+	Copyright (C) 2003-2014 by David White <davewx7@gmail.com>
+
+	This software is provided 'as-is', without any express or implied
+	warranty. In no event will the authors be held liable for any damages
+	arising from the use of this software.
+
+	Permission is granted to anyone to use this software for any purpose,
+	including commercial applications, and to alter it and redistribute it
+	freely, subject to the following restrictions:
+
+	   1. The origin of this software must not be misrepresented; you must not
+	   claim that you wrote the original software. If you use this software
+	   in a product, an acknowledgement in the product documentation would be
+	   appreciated but is not required.
+
+	   2. Altered source versions must be plainly marked as such, and must not be
+	   misrepresented as being the original software.
+
+	   3. This notice may not be removed or altered from any source
+	   distribution.
+*/
+
+#include <algorithm>
+
+#include "asserts.hpp"
+#include "pixel_mask.hpp"
+#include "random.hpp"
+#include "unit_test.hpp"
+
+PixelMask::PixelMask() : w_(0), h_(0), row_words_(0)
+{
+}
+
+PixelMask::PixelMask(int w, int h) : w_(w), h_(h), row_words_((w + 63)/64), words_(row_words_*h)
+{
+	ASSERT_LOG(w >= 0 && h >= 0, "Illegal pixel mask size: " << w << "x" << h);
+}
+
+bool PixelMask::get(int x, int y) const
+{
+	if(x < 0 || y < 0 || x >= w_ || y >= h_) {
+		return false;
+	}
+
+	return (words_[y*row_words_ + x/64] >> (x%64)) & 1;
+}
+
+void PixelMask::set(int x, int y, bool value)
+{
+	ASSERT_LOG(x >= 0 && y >= 0 && x < w_ && y < h_, "Pixel out of mask bounds: " << x << "," << y << " in " << w_ << "x" << h_);
+	const uint64_t bit = uint64_t(1) << (x%64);
+	if(value) {
+		words_[y*row_words_ + x/64] |= bit;
+	} else {
+		words_[y*row_words_ + x/64] &= ~bit;
+	}
+}
+
+uint64_t PixelMask::getBits(int x, int y) const
+{
+	const uint64_t* row = &words_[y*row_words_];
+	const int index = x/64;
+	const int shift = x%64;
+
+	uint64_t result = index < row_words_ ? row[index] >> shift : 0;
+	if(shift != 0 && index+1 < row_words_) {
+		result |= row[index+1] << (64 - shift);
+	}
+
+	return result;
+}
+
+PixelMask PixelMask::mirrored() const
+{
+	PixelMask result(w_, h_);
+	for(int y = 0; y != h_; ++y) {
+		for(int x = 0; x != w_; ++x) {
+			if(get(x, y)) {
+				result.set(w_ - x - 1, y);
+			}
+		}
+	}
+
+	return result;
+}
+
+bool PixelMask::overlaps(const PixelMask* a, int ax, int ay, const PixelMask* b, int bx, int by, const rect& area, int stride)
+{
+	ASSERT_LOG(stride == 1 || stride == 2, "Unsupported pixel mask stride: " << stride);
+
+	int x1 = area.x(), y1 = area.y(), x2 = area.x2(), y2 = area.y2();
+	if(a) {
+		x1 = std::max(x1, ax);
+		y1 = std::max(y1, ay);
+		x2 = std::min(x2, ax + a->w_);
+		y2 = std::min(y2, ay + a->h_);
+	}
+
+	if(b) {
+		x1 = std::max(x1, bx);
+		y1 = std::max(y1, by);
+		x2 = std::min(x2, bx + b->w_);
+		y2 = std::min(y2, by + b->h_);
+	}
+
+	//clipping mustn't change which columns and rows are sampled.
+	x1 += (x1 - area.x())%stride;
+	y1 += (y1 - area.y())%stride;
+
+	if(x1 >= x2 || y1 >= y2) {
+		return false;
+	}
+
+	//columns x1, x1+2, ... are the even bits of each word.
+	const uint64_t pattern = stride == 2 ? 0x5555555555555555ULL : ~uint64_t(0);
+
+	for(int y = y1; y < y2; y += stride) {
+		for(int x = x1; x < x2; x += 64) {
+			uint64_t bits = pattern;
+			if(x2 - x < 64) {
+				bits &= (uint64_t(1) << (x2 - x)) - 1;
+			}
+
+			if(a) {
+				bits &= a->getBits(x - ax, y - ay);
+			}
+
+			if(b) {
+				bits &= b->getBits(x - bx, y - by);
+			}
+
+			if(bits) {
+				return true;
+			}
+		}
+	}
+
+	return false;
+}
+
+namespace
+{
+	PixelMask generate_mask(int w, int h, int density)
+	{
+		PixelMask result(w, h);
+		for(int y = 0; y != h; ++y) {
+			for(int x = 0; x != w; ++x) {
+				if(rng::generate()%100 < density) {
+					result.set(x, y);
+				}
+			}
+		}
+
+		return result;
+	}
+
+	bool overlaps_per_pixel(const PixelMask* a, int ax, int ay, const PixelMask* b, int bx, int by, const rect& area, int stride)
+	{
+		for(int y = area.y(); y < area.y2(); y += stride) {
+			for(int x = area.x(); x < area.x2(); x += stride) {
+				if((!a || a->get(x - ax, y - ay)) && (!b || b->get(x - bx, y - by))) {
+					return true;
+				}
+			}
+		}
+
+		return false;
+	}
+
+	//a square mask whose middle columns are set, like a character
+	//standing in a frame with transparent space either side.
+	PixelMask generate_sprite_mask(int size)
+	{
+		PixelMask result(size, size);
+		for(int y = 0; y != size; ++y) {
+			for(int x = size/4 + size/16; x != size*3/4 - size/16; ++x) {
+				result.set(x, y);
+			}
+		}
+
+		return result;
+	}
+}
+
+UNIT_TEST(pixel_mask_overlaps_matches_per_pixel)
+{
+	for(int n = 0; n != 200; ++n) {
+		const PixelMask a = generate_mask(1 + rng::generate()%150, 1 + rng::generate()%40, 1 + rng::generate()%10);
+		const PixelMask b = generate_mask(1 + rng::generate()%150, 1 + rng::generate()%40, 1 + rng::generate()%10);
+		const int ax = rng::generate()%100 - 50, ay = rng::generate()%20 - 10;
+		const int bx = rng::generate()%100 - 50, by = rng::generate()%20 - 10;
+		const rect area(rng::generate()%100 - 60, rng::generate()%20 - 10, rng::generate()%200, rng::generate()%40);
+		const int stride = 1 + n%2;
+
+		CHECK_EQ(PixelMask::overlaps(&a, ax, ay, &b, bx, by, area, stride), overlaps_per_pixel(&a, ax, ay, &b, bx, by, area, stride));
+		CHECK_EQ(PixelMask::overlaps(&a, ax, ay, nullptr, 0, 0, area, stride), overlaps_per_pixel(&a, ax, ay, nullptr, 0, 0, area, stride));
+	}
+
+	const PixelMask m = generate_mask(100, 3, 50);
+	const PixelMask mirror = m.mirrored();
+	for(int y = 0; y != m.height(); ++y) {
+		for(int x = 0; x != m.width(); ++x) {
+			CHECK_EQ(m.get(x, y), mirror.get(m.width() - x - 1, y));
+		}
+	}
+}
+
+//two sprites whose rects intersect but whose pixels don't, so the whole
+//intersection has to be scanned. This is the common case for the narrow
+//phase of user collisions.
+BENCHMARK(pixel_mask_overlap_words)
+{
+	const PixelMask a = generate_sprite_mask(128), b = generate_sprite_mask(128);
+	bool result = false;
+	BENCHMARK_LOOP {
+		result = PixelMask::overlaps(&a, 0, 0, &b, 64, 0, rect(64, 0, 64, 128), 2) || result;
+		result = PixelMask::overlaps(&a, 0, 0, &b, 64, 64, rect(64, 64, 64, 64), 2) || result;
+	}
+	CHECK_EQ(result, false);
+}
+
+//the same test done a pixel at a time on std::vector<bool> alpha maps,
+//the way entity_user_collision used to.
+BENCHMARK(pixel_mask_overlap_per_pixel)
+{
+	const int size = 128;
+	const PixelMask mask = generate_sprite_mask(size);
+	std::vector<bool> alpha(size*size);
+	for(int y = 0; y != size; ++y) {
+		for(int x = 0; x != size; ++x) {
+			alpha[y*size + x] = !mask.get(x, y);
+		}
+	}
+
+	auto is_alpha = [&](int x, int y) {
+		if(x < 0 || y < 0 || x >= size || y >= size) {
+			return true;
+		}
+		return static_cast<bool>(alpha[y*size + x]);
+	};
+
+	auto collide = [&](int bx, int by, const rect& area) {
+		for(int y = area.y(); y < area.y2(); y += 2) {
+			for(int x = area.x(); x < area.x2(); x += 2) {
+				if(!is_alpha(x, y) && !is_alpha(x - bx, y - by)) {
+					return true;
+				}
+			}
+		}
+		return false;
+	};
+
+	bool result = false;
+	BENCHMARK_LOOP {
+		result = collide(64, 0, rect(64, 0, 64, 128)) || result;
+		result = collide(64, 64, rect(64, 64, 64, 64)) || result;
+	}
+	CHECK_EQ(result, false);
+}
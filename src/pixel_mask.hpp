@@ -0,0 +1,65 @@
+/*
+	Copyright (C) 2003-2014 by David White <davewx7@gmail.com>
+
+	This software is provided 'as-is', without any express or implied
+	warranty. In no event will the authors be held liable for any damages
+	arising from the use of this software.
+
+	Permission is granted to anyone to use this software for any purpose,
+	including commercial applications, and to alter it and redistribute it
+	freely, subject to the following restrictions:
+
+	   1. The origin of this software must not be misrepresented; you must not
+	   claim that you wrote the original software. If you use this software
+	   in a product, an acknowledgement in the product documentation would be
+	   appreciated but is not required.
+
+	   2. Altered source versions must be plainly marked as such, and must not be
+	   misrepresented as being the original software.
+
+	   3. This notice may not be removed or altered from any source
+	   distribution.
+*/
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "geometry.hpp"
+
+//A bitmap of which pixels of an image are set, such as which are opaque or
+//solid. Each row is packed into 64-bit words and starts on a word boundary,
+//so testing whether two masks overlap can compare 64 pixels at a time.
+class PixelMask
+{
+public:
+	PixelMask();
+	PixelMask(int w, int h);
+
+	int width() const { return w_; }
+	int height() const { return h_; }
+
+	bool get(int x, int y) const;
+	void set(int x, int y, bool value=true);
+
+	//Gets the 64 pixels starting at (x, y) with pixel x in the lowest bit.
+	//Pixels past the end of the row are clear. x must not be negative.
+	uint64_t getBits(int x, int y) const;
+
+	//Gets the mask flipped horizontally.
+	PixelMask mirrored() const;
+
+	size_t memoryUsage() const { return words_.size()*sizeof(uint64_t); }
+
+	//Whether any pixel within 'area' is set in both masks, with each mask's
+	//top left corner placed at the given position. Pixels outside a mask
+	//are clear, while a null mask has every pixel set. With a stride of 2
+	//only every other column and row is tested, starting from the top left
+	//of 'area'.
+	static bool overlaps(const PixelMask* a, int ax, int ay, const PixelMask* b, int bx, int by, const rect& area, int stride=1);
+private:
+	int w_, h_;
+	int row_words_;
+	std::vector<uint64_t> words_;
+};
@@ -34,6 +34,7 @@
 #include "level_runner.hpp"
 #include "playable_custom_object.hpp"
 #include "string_utils.hpp"
+#include "unit_test.hpp"
 #include "variant_utils.hpp"
 #include "widget.hpp"
 
@@ -252,6 +253,18 @@ variant PlayableCustomObject::getValue(const std::string& key) const
 	return CustomObject::getValue(key);
 }
 
+variant PlayableCustomObject::getValueCached(const std::string& key, game_logic::LookupCache& cache) const
+{
+	//the player's own keys such as ctrl_left aren't known to the object
+	//type, so they resolve as dynamic and are looked up by name.
+	const int resolution = getCachedResolution(key, cache);
+	if(resolution == CustomObjectType::LOOKUP_DYNAMIC) {
+		return getValue(key);
+	}
+
+	return getResolvedValue(key, resolution);
+}
+
 variant PlayableCustomObject::getPlayerValueBySlot(int slot) const
 {
 	switch(slot) {
@@ -415,6 +428,8 @@ variant PlayableCustomObject::getPlayerValueBySlot(int slot) const
 
 void PlayableCustomObject::setPlayerValueBySlot(int slot, const variant& value)
 {
+	markStateChanged();
+
 	switch(slot) {
 	case CUSTOM_OBJECT_PLAYER_DIFFICULTY:
 		difficulty_ = value.as_int();
@@ -462,6 +477,8 @@ void PlayableCustomObject::setPlayerValueBySlot(int slot, const variant& value)
 
 void PlayableCustomObject::setValue(const std::string& key, const variant& value)
 {
+	markStateChanged();
+
 	if(key == "difficulty") {
 		setPlayerValueBySlot(CUSTOM_OBJECT_PLAYER_DIFFICULTY, value);
 	} else if(key == "can_interact") {
@@ -540,3 +557,21 @@ variant PlayableCustomObject::getCtrlKeys() const
 	}
 	return variant(&result);
 }
+
+UNIT_TEST(playable_custom_object_cached_control_lookup)
+{
+	ffl::IntrusivePtr<PlayableCustomObject> obj(new PlayableCustomObject("ant_black", 0, 0, false));
+	obj->setControlStatus(controls::CONTROL_LEFT, true);
+
+	game_logic::LookupCache cache;
+	CHECK_EQ(obj->queryValueCached("ctrl_left", cache).as_bool(), true);
+	CHECK_EQ(obj->queryValueCached("ctrl_left", cache).as_bool(), true);
+
+	game_logic::LookupCache right_cache;
+	CHECK_EQ(obj->queryValueCached("ctrl_right", right_cache).as_bool(), false);
+
+	//formulas look identifiers up through an inline cache too.
+	const game_logic::Formula f(variant("if(ctrl_left, 1, 0)"));
+	CHECK_EQ(f.execute(*obj), variant(1));
+	CHECK_EQ(f.execute(*obj), variant(1));
+}
@@ -71,6 +71,7 @@ private:
 
 	virtual void process(Level& lvl) override;
 	variant getValue(const std::string& key) const override;
+	variant getValueCached(const std::string& key, game_logic::LookupCache& cache) const override;
 	void setValue(const std::string& key, const variant& value) override;
 
 	variant getPlayerValueBySlot(int slot) const override;
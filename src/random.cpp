@@ -34,10 +34,16 @@ namespace rng
 		boost::random::mt19937 state;
 		boost::random::uniform_int_distribution<> generator(0,0xFFFFFF);
 		bool rng_init = false;
+
+		thread_local int t_disallowed = 0;
 	}
 
 	int generate()
 	{
+		if(t_disallowed) {
+			throw Disallowed();
+		}
+
 		if(!rng_init) {
 			// using std::time to initialise a mersienne twister is a really pitiful and inadequate idea.
 			seed_from_int(static_cast<unsigned int>(std::time(nullptr)));
@@ -60,4 +66,14 @@ namespace rng
 	{
 		return state;
 	}
+
+	DisallowScope::DisallowScope()
+	{
+		++t_disallowed;
+	}
+
+	DisallowScope::~DisallowScope()
+	{
+		--t_disallowed;
+	}
 }
@@ -31,6 +31,22 @@ namespace rng
 
 	int generate();
 	void seed_from_int(unsigned int seed);
+
+	//thrown by generate() on a thread which isn't allowed random numbers.
+	struct Disallowed {};
+
+	//while one exists generate() throws Disallowed on this thread. For
+	//code running alongside other threads, where the order numbers were
+	//drawn in would depend on scheduling and break replays.
+	class DisallowScope
+	{
+	public:
+		DisallowScope();
+		~DisallowScope();
+
+		DisallowScope(const DisallowScope&) = delete;
+		void operator=(const DisallowScope&) = delete;
+	};
 	void set_seed(const Seed& seed);
 	Seed get_seed();
 }
@@ -314,6 +314,17 @@ ConstSolidInfoPtr SolidInfo::createFromSolidMaps(const std::vector<ConstSolidMap
 
 		result->area_ = rect::from_coordinates(x1, y1, x2-1, y2-1);
 		result->solid_= solid;
+
+		result->mask_ = PixelMask(result->area_.w(), result->area_.h());
+		for(int y = 0; y != result->area_.h(); ++y) {
+			for(int x = 0; x != result->area_.w(); ++x) {
+				if(result->isSolidAt(result->area_.x() + x, result->area_.y() + y)) {
+					result->mask_.set(x, y);
+				}
+			}
+		}
+
+		result->mirrored_mask_ = result->mask_.mirrored();
 		return ConstSolidInfoPtr(result);
 	}
 }
@@ -26,6 +26,7 @@
 #include <vector>
 
 #include "geometry.hpp"
+#include "pixel_mask.hpp"
 #include "Texture.hpp"
 
 #include "solid_map_fwd.hpp"
@@ -81,9 +82,15 @@ public:
 	const std::vector<ConstSolidMapPtr>& solid() const { return solid_; }
 	const rect& area() const { return area_; }
 	bool isSolidAt(int x, int y, const std::string** area_id=nullptr) const;
+
+	//Which pixels of area() are solid in any of the solid maps, and the
+	//same flipped horizontally.
+	const PixelMask& mask() const { return mask_; }
+	const PixelMask& mirroredMask() const { return mirrored_mask_; }
 private:
 	static ConstSolidInfoPtr createFromSolidMaps(const std::vector<ConstSolidMapPtr>& v);
 
 	std::vector<ConstSolidMapPtr> solid_;
 	rect area_;
+	PixelMask mask_, mirrored_mask_;
 };
@@ -23,6 +23,7 @@
 
 #include <assert.h>
 
+#include <atomic>
 #include <iostream>
 #include <map>
 #include <cmath>
@@ -41,6 +42,7 @@
 #include "module.hpp"
 #include "preferences.hpp"
 #include "sound.hpp"
+#include "sound_mix.hpp"
 #include "thread.hpp"
 #include "unit_test.hpp"
 #include "utils.hpp"
@@ -53,6 +55,7 @@
 
 PREF_INT(mixer_looped_sounds_fade_time_ms, 100, "Number of milliseconds looped sounds should fade for");
 PREF_INT(audio_cache_size_mb, 30, "Audio data cache size in megabytes");
+PREF_INT(audio_stream_threshold_kb, 1024, "Ogg sound effects which decode to more than this many kilobytes are streamed from disk rather than cached");
 
 PREF_BOOL(debug_visualize_audio, false, "Show a graph of audio data");
 
@@ -367,15 +370,12 @@ namespace sound
 
 				if(numChannels() == 2) {
 					assert(nsamples <= out_nsamples);
-					for(int n = 0; n != nsamples; ++n) {
-						*out++ += volume_*static_cast<float>(data[n])/SHRT_MAX;
-					}
+					mix_pcm16(out, data, 2, nsamples/2, volume_, volume_);
+					out += nsamples;
 				} else {
 					assert(nsamples*2 <= out_nsamples);
-					for(int n = 0; n != nsamples; ++n) {
-						*out++ += volume_*static_cast<float>(data[n])/SHRT_MAX;
-						*out++ += volume_*static_cast<float>(data[n])/SHRT_MAX;
-					}
+					mix_pcm16(out, data, 1, nsamples, volume_, volume_);
+					out += nsamples*2;
 				}
 
 			}
@@ -464,12 +464,15 @@ namespace sound
 
 	//Ring buffer which music is mixed into by the music thread. The mixer thread consumes
 	//this for the mix.
-	//Access to g_music_buf_read and g_music_buf_nsamples is controlled by g_music_thread_mutex.
-	//g_music_buf_write is only used by the music thread so doesn't need to be synchronized.
+	//g_music_buf_write is only used by the music thread and g_music_buf_read only by the
+	//mixer thread. g_music_buf_nsamples is the number of samples written and not yet read;
+	//the music thread only ever adds to it and the mixer only ever subtracts from it, so
+	//neither thread needs to wait for the other.
 	float g_music_buf[8192];
-	float* g_music_buf_read = g_music_buf;
-	float* g_music_buf_write = g_music_buf;
-	int g_music_buf_nsamples = 0;
+	const int MusicBufSize = sizeof(g_music_buf)/sizeof(*g_music_buf);
+	int g_music_buf_read = 0;
+	int g_music_buf_write = 0;
+	std::atomic<int> g_music_buf_nsamples(0);
 
 	//The music thread. The purpose of this thread is to fill the music ring buffer with music
 	//mixed from the g_music_players music tracks.
@@ -478,10 +481,6 @@ namespace sound
 		for(;;) {
 			std::vector<MusicPlayer*> players;
 
-			float* buf_read;
-
-			int nspace_available = 0;
-
 			{
 				threading::lock lck(g_music_thread_mutex);
 				if(g_music_thread_exit) {
@@ -493,24 +492,21 @@ namespace sound
 						players.push_back(p.get());
 					}
 				}
-
-				buf_read = g_music_buf_read;
-
-				nspace_available = sizeof(g_music_buf)/sizeof(*g_music_buf) - g_music_buf_nsamples;
 			}
 
-			float* end_music_buf = g_music_buf + sizeof(g_music_buf)/sizeof(*g_music_buf);
+			const int nspace_available = MusicBufSize - g_music_buf_nsamples.load(std::memory_order_acquire);
 
 			int nwrite = 0;
 			while(nwrite < nspace_available) {
-				int nspace = (g_music_buf_write < buf_read ? buf_read : end_music_buf) - g_music_buf_write;
+				const int nspace = std::min<int>(nspace_available - nwrite, MusicBufSize - g_music_buf_write);
+				float* buf_write = g_music_buf + g_music_buf_write;
 				for(int n = 0; n != nspace; ++n) {
-					g_music_buf_write[n] = 0.0f;
+					buf_write[n] = 0.0f;
 				}
 
 				for(auto player : players) {
 					int nwant = nspace;
-					float* pwrite = g_music_buf_write;
+					float* pwrite = buf_write;
 
 					while(nwant > 0) {
 						int ngot = player->read(pwrite, nwant);
@@ -525,15 +521,12 @@ namespace sound
 
 				g_music_buf_write += nspace;
 				nwrite += nspace;
-				if(g_music_buf_write == end_music_buf) {
-					g_music_buf_write = g_music_buf;
+				if(g_music_buf_write == MusicBufSize) {
+					g_music_buf_write = 0;
 				}
 			}
 
-			{
-				threading::lock lck(g_music_thread_mutex);
-				g_music_buf_nsamples += nwrite;
-			}
+			g_music_buf_nsamples.fetch_add(nwrite, std::memory_order_release);
 
 			SDL_Delay(20);
 		}
@@ -626,7 +619,7 @@ namespace sound
 
 	//Function to load an ogg vorbis file into a buffer. Fills 'spec' with the
 	//specs of the format loaded.
-	bool loadVorbis(const char* file, SDL_AudioSpec* spec, std::vector<char>& buf)
+	bool loadVorbis(const char* file, SDL_AudioSpec* spec, std::vector<short>& buf)
 	{
 		OggVorbis_File ogg_file;
 
@@ -642,18 +635,25 @@ namespace sound
 		spec->format = AUDIO_S16;
 		spec->silence = 0;
 
+		//Decode straight into a buffer of the full size where the length is known.
+		const ogg_int64_t nframes = vorbis().ov_pcm_total(&ogg_file, -1);
+		if(nframes > 0) {
+			buf.reserve(static_cast<size_t>(nframes)*info->channels);
+		}
+
 		int bit_stream = 0;
 
 		long nbytes = 1;
 		while(nbytes > 0) {
-			const int buf_len = 4096;
-			buf.resize(buf.size() + buf_len);
-			nbytes = vorbis().ov_read(&ogg_file, &buf[0] + buf.size() - buf_len, buf_len, 0, 2, 1, &bit_stream);
-			buf.resize(buf.size() - 4096 + nbytes);
+			const int buf_len = 2048;
+			const size_t old_size = buf.size();
+			buf.resize(old_size + buf_len);
+			nbytes = vorbis().ov_read(&ogg_file, reinterpret_cast<char*>(&buf[old_size]), buf_len*sizeof(short), 0, 2, 1, &bit_stream);
+			buf.resize(old_size + std::max<long>(nbytes, 0)/sizeof(short));
 		}
 
-		spec->samples = buf.size()/4;
-		spec->size = buf.size();
+		spec->samples = buf.size()/2;
+		spec->size = buf.size()*sizeof(short);
 		spec->callback = nullptr;
 		spec->userdata = nullptr;
 
@@ -662,6 +662,24 @@ namespace sound
 		return true;
 	}
 
+	//Finds the size of an ogg vorbis file once decoded without decoding it.
+	//Returns false if the file can't be opened.
+	bool getVorbisInfo(const char* file, int* rate, int* nchannels, ogg_int64_t* nframes)
+	{
+		OggVorbis_File ogg_file;
+		if(vorbis().ov_fopen(file, &ogg_file) != 0) {
+			return false;
+		}
+
+		vorbis_info* info = vorbis().ov_info(&ogg_file, -1);
+		*rate = info->rate;
+		*nchannels = info->channels;
+		*nframes = vorbis().ov_pcm_total(&ogg_file, -1);
+
+		vorbis().ov_clear(&ogg_file);
+		return true;
+	}
+
 	//function to map a sound filename to a physical path.
 	std::string map_filename(const std::string& fname)
 	{
@@ -672,20 +690,188 @@ namespace sound
 	const int BUFFER_NUM_SAMPLES = 1024;
 
 	//In memory represenation of a wave file. We always use 32-bit floats in stereo
+	//
+	//Sounds too long to keep in memory are streamed, in which case there is no
+	//data here, and each voice playing the sound decodes it from disk with its
+	//own SoundStream.
 	struct WaveData {
-		WaveData(const std::string& filename, std::vector<short>* buf, int nchan) : fname(filename), buffer(new short [buf->size()]), buffer_size(buf->size()), nchannels(nchan) {
-			memcpy(buffer, &(*buf)[0], buffer_size*sizeof(short));
+		//Takes the contents of buf.
+		WaveData(const std::string& filename, std::vector<short>* buf, int nchan) : fname(filename), nchannels(nchan), nframes(buf->size()/nchan), streamed(false) {
+			buffer.swap(*buf);
 		}
-		~WaveData() {
-			delete [] buffer;
+		WaveData(const std::string& filename, int nchan, size_t frames) : fname(filename), nchannels(nchan), nframes(frames), streamed(true) {
 		}
 		std::string fname;
-		short* buffer;
-		size_t buffer_size;
+		std::vector<short> buffer;
 		int nchannels;
-		size_t nsamples() const { return buffer_size/nchannels; }
+		size_t nframes;
+		bool streamed;
+		size_t nsamples() const { return nframes; }
 
-		size_t memoryUsage() const { return buffer_size*sizeof(short); }
+		size_t memoryUsage() const { return buffer.size()*sizeof(short); }
+	};
+
+	//Decodes a streamed sound from disk as one voice plays it. The loader
+	//thread decodes into a ring buffer which the mixer plays from, neither
+	//waiting for the other. If the mixer catches up with the decoder it plays
+	//silence rather than waiting.
+	class SoundStream
+	{
+	public:
+		SoundStream(std::shared_ptr<WaveData> wave, int start_frame, bool looped, int loop_point, int loop_from)
+		  : wave_(wave), open_(false), start_frame_(start_frame), decode_pos_(0), bit_stream_(0),
+		    looped_(looped), loop_point_(loop_point), loop_from_(loop_from),
+		    capacity_(SampleRate), write_pos_(0), read_pos_(0), nframes_(0), eof_(false), nunderruns_(0)
+		{
+			ring_.resize(capacity_*wave_->nchannels);
+		}
+
+		~SoundStream()
+		{
+			if(open_) {
+				vorbis().ov_clear(&file_);
+			}
+		}
+
+		//Called from the game thread.
+		void setLooping(bool looped, int loop_point, int loop_from)
+		{
+			loop_point_ = loop_point;
+			loop_from_ = loop_from;
+			looped_ = looped;
+		}
+
+		//Decodes until the ring buffer is full or the sound ends. Called
+		//from the loader thread.
+		void fill()
+		{
+			if(eof_) {
+				return;
+			}
+
+			const int nchannels = wave_->nchannels;
+
+			if(!open_) {
+				if(vorbis().ov_fopen(wave_->fname.c_str(), &file_) != 0) {
+					LOG_ERROR("Could not open sound to stream: " << wave_->fname);
+					eof_.store(true, std::memory_order_release);
+					return;
+				}
+
+				open_ = true;
+				if(start_frame_ > 0 && !seek(start_frame_)) {
+					return;
+				}
+			}
+
+			int nspace = capacity_ - nframes_.load(std::memory_order_acquire);
+			bool just_seeked = false;
+			while(nspace > 0) {
+				const bool looped = looped_;
+				const int loop_from = looped ? loop_from_.load() : 0;
+				if(loop_from > 0 && decode_pos_ >= loop_from) {
+					if(!seek(loop_point_)) {
+						break;
+					}
+					continue;
+				}
+
+				int nwant = std::min<int>(nspace, capacity_ - write_pos_);
+				if(loop_from > 0) {
+					nwant = std::min<int>(nwant, loop_from - decode_pos_);
+				}
+
+				const long nbytes = vorbis().ov_read(&file_, reinterpret_cast<char*>(&ring_[write_pos_*nchannels]), nwant*nchannels*sizeof(short), 0, 2, 1, &bit_stream_);
+				if(nbytes == 0 && looped && !just_seeked) {
+					if(!seek(loop_point_)) {
+						break;
+					}
+					just_seeked = true;
+					continue;
+				}
+
+				if(nbytes <= 0) {
+					eof_.store(true, std::memory_order_release);
+					break;
+				}
+
+				just_seeked = false;
+
+				const int ngot = static_cast<int>(nbytes/(nchannels*sizeof(short)));
+				decode_pos_ += ngot;
+				write_pos_ = (write_pos_ + ngot)%capacity_;
+				nspace -= ngot;
+				nframes_.fetch_add(ngot, std::memory_order_release);
+			}
+		}
+
+		//Gives the decoded frames which are contiguous in the ring buffer.
+		//Called from the mixer thread, as are consume() and finished().
+		const short* readPointer(int* nframes) const
+		{
+			*nframes = std::min<int>(nframes_.load(std::memory_order_acquire), capacity_ - read_pos_);
+			return &ring_[read_pos_*wave_->nchannels];
+		}
+
+		void consume(int nframes)
+		{
+			read_pos_ = (read_pos_ + nframes)%capacity_;
+			nframes_.fetch_sub(nframes, std::memory_order_release);
+		}
+
+		//Whether everything has been decoded and played.
+		bool finished() const
+		{
+			return eof_.load(std::memory_order_acquire) && nframes_.load(std::memory_order_acquire) == 0;
+		}
+
+		//Records that the mixer wanted more than had been decoded.
+		void addUnderrun() { ++nunderruns_; }
+		int numUnderruns() const { return nunderruns_; }
+
+		int nchannels() const { return wave_->nchannels; }
+
+		size_t memoryUsage() const { return ring_.size()*sizeof(short); }
+	private:
+		//This runs on the loader thread, so a sound that can't be seeked is
+		//ended rather than taking down the game. The voice finishes once
+		//what has been decoded has played.
+		bool seek(int frame)
+		{
+			const int res = vorbis().ov_time_seek(&file_, frame/SampleRateDouble);
+			if(res != 0) {
+				LOG_ERROR("Failed to seek streamed sound: " << wave_->fname << ": " << res);
+				eof_.store(true, std::memory_order_release);
+				return false;
+			}
+
+			decode_pos_ = frame;
+			return true;
+		}
+
+		std::shared_ptr<WaveData> wave_;
+
+		//Only used by the loader thread.
+		OggVorbis_File file_;
+		bool open_;
+		int start_frame_;
+		int decode_pos_;
+		int bit_stream_;
+
+		std::atomic<bool> looped_;
+		std::atomic<int> loop_point_, loop_from_;
+
+		//The ring buffer and its size in frames. write_pos_ is only used by the
+		//loader thread and read_pos_ only by the mixer. nframes_ is the number of
+		//frames decoded and not yet played.
+		std::vector<short> ring_;
+		const int capacity_;
+		int write_pos_;
+		int read_pos_;
+		std::atomic<int> nframes_;
+
+		std::atomic<bool> eof_;
+		std::atomic<int> nunderruns_;
 	};
 
 	//set of files that are loading or loaded along with a mutex to control
@@ -725,6 +911,51 @@ namespace sound
 
 	float g_sfx_volume = 1.0f, g_user_music_volume = 1.0f, g_engine_music_volume = 1.0f;
 
+	//Places a loaded sound effect into our audio cache, evicting the least
+	//recently used effects which aren't playing if the cache is full.
+	void add_cached_wave(const std::string& fname, std::shared_ptr<WaveData> data)
+	{
+		threading::lock lck(g_wave_cache_mutex);
+		g_wave_cache_lru.push_front(data);
+		g_wave_cache[fname] = g_wave_cache_lru.begin();
+		g_wave_cache_size += data->memoryUsage();
+
+		int nlive = 0;
+		int nactive = 0;
+		for(auto& p : g_wave_cache_lru) {
+			if(p.unique() == false) {
+				nlive += p->memoryUsage();
+				++nactive;
+			}
+		}
+
+		LOG_VERBOSE("Added wave: " << fname << " Have " << g_wave_cache_lru.size() << " items in cache, size " << (g_wave_cache_size/(1024*1024)) << "MB, " << nactive << " items live, " << (nlive/(1024*1024)) << "MB\n");
+
+		while(g_wave_cache_size >= static_cast<size_t>(g_audio_cache_size_mb*1024*1024)) {
+			assert(!g_wave_cache_lru.empty());
+
+			for(int n = 0; n < int(g_wave_cache_lru.size()) && g_wave_cache_lru.back().unique() == false; ++n) {
+				g_wave_cache_lru.splice(g_wave_cache_lru.begin(), g_wave_cache_lru, std::prev(g_wave_cache_lru.end()));
+			}
+
+			if(g_wave_cache_lru.back().unique() == false) {
+				LOG_ERROR("Audio cache size exceeded but all " << g_wave_cache_lru.size() << " items in use cannot evict");
+				break;
+			}
+
+			g_wave_cache_size -= g_wave_cache_lru.back()->memoryUsage();
+
+			{
+				threading::lock lck(g_files_loading_mutex);
+				g_files_loading.erase(g_wave_cache_lru.back()->fname);
+			}
+
+			g_wave_cache.erase(g_wave_cache_lru.back()->fname);
+			g_wave_cache_lru.erase(std::prev(g_wave_cache_lru.end()));
+
+		}
+	}
+
 	//Function which loads a sound effect (can be in wave or ogg format). Blocks while loading,
 	//and places the effect into our audio cache.
 	void LoadWaveBlocking(const std::string& fname)
@@ -744,14 +975,25 @@ namespace sound
 		SDL_AudioSpec spec_buf;
 		SDL_AudioSpec* res_spec = &spec_buf;
 
-		std::vector<char> ogg_buf;
+		std::vector<short> ogg_buf;
+
+		const bool is_ogg = fname.size() > 4 && std::equal(fname.end()-4,fname.end(), ".ogg");
+		if(is_ogg) {
+			//Long sounds are streamed as they play rather than decoded into the cache,
+			//as long as they need no conversion.
+			int rate = 0, nchannels = 0;
+			ogg_int64_t nframes = 0;
+			if(getVorbisInfo(fname.c_str(), &rate, &nchannels, &nframes) && rate == SampleRate && nchannels >= 1 && nchannels <= 2 &&
+			   nframes*nchannels*static_cast<ogg_int64_t>(sizeof(short)) > static_cast<ogg_int64_t>(g_audio_stream_threshold_kb)*1024) {
+				add_cached_wave(fname, std::shared_ptr<WaveData>(new WaveData(fname, nchannels, static_cast<size_t>(nframes))));
+				return;
+			}
 
-		if(fname.size() > 4 && std::equal(fname.end()-4,fname.end(), ".ogg")) {
 			bool res = loadVorbis(fname.c_str(), res_spec, ogg_buf);
 			ASSERT_LOG(res, "Could not load ogg: " << fname);
 			ASSERT_LOG(ogg_buf.size() > 0, "No ogg data: " << fname);
 			buf = reinterpret_cast<Uint8*>(&ogg_buf[0]);
-			len = ogg_buf.size();
+			len = ogg_buf.size()*sizeof(short);
 		} else {
 			res_spec = SDL_LoadWAV(fname.c_str(), &in_spec, &buf, &len);
 		}
@@ -770,7 +1012,9 @@ namespace sound
 
 			std::vector<short> out_buf;
 
-			if(res == 0) {
+			if(res == 0 && is_ogg) {
+				out_buf.swap(ogg_buf);
+			} else if(res == 0) {
 				out_buf.resize(len/sizeof(short));
 				if(!out_buf.empty()) {
 					memcpy(&out_buf[0], buf, out_buf.size()*sizeof(short));
@@ -793,53 +1037,13 @@ namespace sound
 				memcpy(&out_buf[0], cvt.buf, cvt.len_cvt);
 			}
 
-			if(ogg_buf.empty()) {
+			if(!is_ogg) {
 				SDL_FreeWAV(buf);
 			}
 
 			std::shared_ptr<WaveData> data(new WaveData(fname, &out_buf, spec.channels));
-
-			threading::lock lck(g_wave_cache_mutex);
-			g_wave_cache_lru.push_front(data);
-			g_wave_cache[fname] = g_wave_cache_lru.begin();
-			g_wave_cache_size += data->memoryUsage();
-
-			int nlive = 0;
-			int nactive = 0;
-			for(auto& p : g_wave_cache_lru) {
-				if(p.unique() == false) {
-					nlive += p->memoryUsage();
-					++nactive;
-				}
-			}
-
-			LOG_VERBOSE("Added wave: " << fname << " Have " << g_wave_cache_lru.size() << " items in cache, size " << (g_wave_cache_size/(1024*1024)) << "MB, " << nactive << " items live, " << (nlive/(1024*1024)) << "MB\n");
-
-			while(g_wave_cache_size >= static_cast<size_t>(g_audio_cache_size_mb*1024*1024)) {
-				assert(!g_wave_cache_lru.empty());
-
-				for(int n = 0; n < int(g_wave_cache_lru.size()) && g_wave_cache_lru.back().unique() == false; ++n) {
-					g_wave_cache_lru.splice(g_wave_cache_lru.begin(), g_wave_cache_lru, std::prev(g_wave_cache_lru.end()));
-				}
-
-				if(g_wave_cache_lru.back().unique() == false) {
-					LOG_ERROR("Audio cache size exceeded but all " << g_wave_cache_lru.size() << " items in use cannot evict");
-					break;
-				}
-
-				g_wave_cache_size -= g_wave_cache_lru.back()->memoryUsage();
-
-				{
-					threading::lock lck(g_files_loading_mutex);
-					g_files_loading.erase(g_wave_cache_lru.back()->fname);
-				}
-
-				g_wave_cache.erase(g_wave_cache_lru.back()->fname);
-				g_wave_cache_lru.erase(std::prev(g_wave_cache_lru.end()));
-
-			}
+			add_cached_wave(fname, data);
 		}
-
 	}
 
 	//The loader thread is responsible for loading sound effects and
@@ -855,10 +1059,26 @@ namespace sound
 	//to push duplicate items onto this queue.
 	std::vector<std::string> g_loader_thread_queue;
 
+	//Streams the loader thread keeps filled. They belong to the voices playing
+	//them, and are dropped from here once those are gone.
+	std::vector<std::weak_ptr<SoundStream>> g_loader_thread_streams;
+
+	//How often the loader thread tops up streams, in milliseconds. Streams
+	//hold a second of audio so this leaves plenty of room.
+	const int StreamFillInterval = 50;
+
+	void add_sound_stream(std::shared_ptr<SoundStream> stream)
+	{
+		threading::lock lck(g_loader_thread_mutex);
+		g_loader_thread_streams.push_back(stream);
+		g_loader_thread_cond.notify_one();
+	}
+
 	void LoaderThread()
 	{
 		for(;;) {
 			std::vector<std::string> items;
+			std::vector<std::shared_ptr<SoundStream>> streams;
 			{
 				threading::lock lck(g_loader_thread_mutex);
 				if(g_loader_thread_exit) {
@@ -867,9 +1087,25 @@ namespace sound
 
 				if(g_loader_thread_queue.empty() == false) {
 					items.swap(g_loader_thread_queue);
-				} else {
+				} else if(g_loader_thread_streams.empty()) {
 					g_loader_thread_cond.wait(g_loader_thread_mutex);
+				} else {
+					g_loader_thread_cond.wait_timeout(g_loader_thread_mutex, StreamFillInterval);
 				}
+
+				for(auto& s : g_loader_thread_streams) {
+					std::shared_ptr<SoundStream> stream = s.lock();
+					if(stream) {
+						streams.push_back(stream);
+					}
+				}
+
+				g_loader_thread_streams.erase(std::remove_if(g_loader_thread_streams.begin(), g_loader_thread_streams.end(), [](const std::weak_ptr<SoundStream>& s) { return s.expired(); }), g_loader_thread_streams.end());
+			}
+
+			//Keep streams topped up before loading anything which might take a while.
+			for(auto& stream : streams) {
+				stream->fill();
 			}
 
 			for(const std::string& item : items) {
@@ -953,6 +1189,9 @@ namespace sound
 		void setBiquad(BiquadFilterType type, float Fc, float Q, float peakGain);
 		float process(int nchannel, float in);
 
+		//Filters stereo input, adding the result to output.
+		void mix(float* output, const float* in, int nframes);
+
 	protected:
 		void calcBiquad(void);
 
@@ -970,6 +1209,11 @@ namespace sound
 		return out;
 	}
 
+	void Biquad::mix(float* output, const float* in, int nframes) {
+		const BiquadCoefficients c = { a0, a1, a2, b1, b2 };
+		mix_biquad(output, in, nframes, c, z1_, z2_);
+	}
+
 	Biquad::Biquad(BiquadFilterType t, variant node) {
 		setBiquad(t, node["fc"].as_double(4000.0)/SampleRate, node["q"].as_double(0.707), node["peak_gain"].as_double(1.0));
 		for(int n = 0; n != NumChannels; ++n) {
@@ -1117,18 +1361,10 @@ namespace sound
 		{
 			threading::lock lck(mutex_);
 
-			std::vector<float> input;
-			input.resize(nsamples*NumChannels);
-			GetData(&input[0], nsamples);
+			input_.assign(nsamples*NumChannels, 0.0f);
+			GetData(&input_[0], nsamples);
 
-			const float* in = &input[0];
-
-			for(int n = 0; n < nsamples; ++n) {
-				float left = filter_.process(0, *in++);
-				float right = filter_.process(1, *in++);
-				*output++ += left;
-				*output++ += right;
-			}
+			filter_.mix(output, &input_[0], nsamples);
 		}
 
 		SoundEffectFilter* clone() const override { return new BiQuadSoundEffectFilter(*this); }
@@ -1137,6 +1373,7 @@ namespace sound
 	private:
 		threading::mutex mutex_;
 		Biquad filter_;
+		std::vector<float> input_;
 		DECLARE_CALLABLE(BiQuadSoundEffectFilter);
 	};
 
@@ -1158,18 +1395,9 @@ namespace sound
 				return;
 			}
 
-			std::vector<float> buf;
-			buf.resize(source_nsamples*NumChannels);
-			GetData(&buf[0], source_nsamples);
-			for(int n = 0; n != nsamples; ++n) {
-				const float point = n*speed_;
-				const int a = util::clamp<int>(static_cast<int>(floor(point)), 0, source_nsamples - 1);
-				const int b = util::clamp<int>(static_cast<int>(ceil(point)), 0, source_nsamples - 1);
-				const float ratio = n*speed_ - floor(point);
-
-				output[n*2] += util::mix<float>(buf[a*2], buf[b*2], ratio);
-				output[n*2+1] += util::mix<float>(buf[a*2+1], buf[b*2+1], ratio);
-			}
+			buf_.assign(source_nsamples*NumChannels, 0.0f);
+			GetData(&buf_[0], source_nsamples);
+			mix_resample_linear(output, nsamples, &buf_[0], source_nsamples, speed_);
 		}
 
 		SoundEffectFilter* clone() const override { return new SpeedSoundEffectFilter(*this); }
@@ -1178,6 +1406,7 @@ namespace sound
 	private:
 		threading::mutex mutex_;
 		float speed_;
+		std::vector<float> buf_;
 		DECLARE_CALLABLE(SpeedSoundEffectFilter);
 	};
 
@@ -1206,15 +1435,14 @@ namespace sound
 		{
 			threading::lock lck(mutex_);
 
-			std::vector<float> buffer;
-			buffer.resize(nsamples*NumChannels);
-			GetData(&buffer[0], nsamples);
+			input_.assign(nsamples*NumChannels, 0.0f);
+			GetData(&input_[0], nsamples);
 
 			const bool left_channel = delay_ < 0.0f;
 
 			//output the unaffected channel
 			{
-				float* in = &buffer[0];
+				float* in = &input_[0];
 				float* out = output;
 				if(left_channel) {
 					++out;
@@ -1233,7 +1461,7 @@ namespace sound
 
 			//The delayed channel
 			{
-				float* in = &buffer[0];
+				float* in = &input_[0];
 				float* out = output;
 				float* end_out = output + nsamples*NumChannels;
 				if(!left_channel) {
@@ -1271,6 +1499,7 @@ namespace sound
 		threading::mutex mutex_;
 		float delay_;
 		std::vector<float> buf_;
+		std::vector<float> input_;
 		DECLARE_CALLABLE(BinauralDelaySoundEffectFilter);
 	};
 
@@ -1279,15 +1508,107 @@ namespace sound
 		return variant(obj.delay_);
 	END_DEFINE_CALLABLE(BinauralDelaySoundEffectFilter)
 
+	//Fixed capacity queue which one thread pushes to and one other thread pops
+	//from. Neither push() nor pop() ever waits for the other thread.
+	template<typename T, unsigned Capacity>
+	class SpscQueue
+	{
+	public:
+		static_assert((Capacity & (Capacity-1)) == 0, "SpscQueue capacity must be a power of two");
+
+		SpscQueue() : head_(0), tail_(0) {}
+
+		//Returns false if the queue is full. Only called from the producer.
+		bool push(const T& item) {
+			const unsigned head = head_.load(std::memory_order_relaxed);
+			if(head - tail_.load(std::memory_order_acquire) == Capacity) {
+				return false;
+			}
+
+			items_[head%Capacity] = item;
+			head_.store(head+1, std::memory_order_release);
+			return true;
+		}
+
+		//Copies out the oldest item without removing it, so its slot can't be
+		//reused and anything the producer keeps alive for it stays alive
+		//until pop() is called. Returns false if the queue is empty. Only
+		//called from the consumer.
+		bool front(T* item) const {
+			const unsigned tail = tail_.load(std::memory_order_relaxed);
+			if(tail == head_.load(std::memory_order_acquire)) {
+				return false;
+			}
+
+			*item = items_[tail%Capacity];
+			return true;
+		}
+
+		//Removes the item returned by front(). Only called from the consumer.
+		void pop() {
+			tail_.store(tail_.load(std::memory_order_relaxed)+1, std::memory_order_release);
+		}
+
+		//The number of items ever pushed and ever popped. These wrap around, so
+		//compare them by subtracting.
+		unsigned numPushed() const { return head_.load(std::memory_order_relaxed); }
+		unsigned numPopped() const { return tail_.load(std::memory_order_acquire); }
+	private:
+		T items_[Capacity];
+		std::atomic<unsigned> head_, tail_;
+	};
+
+	class PlayingSound;
+
+	//A change to the sounds being mixed, sent from the game thread to the mixer.
+	//The mixer owns the list of voices it mixes and the state of the sounds in
+	//it, so once a sound has been added all changes to it are made this way.
+	struct MixerCommand
+	{
+		enum TYPE { ADD_VOICE, REMOVE_VOICE, SET_VOLUME, SET_PANNING, STOP_PLAYING,
+		            SET_LOOPED, SET_LOOP_POINT, SET_LOOP_FROM, SET_WAVE, SET_STREAM, SET_FILTERS };
+		MixerCommand(TYPE t, PlayingSound* v, float a1=0.0f, float a2=0.0f, int num=0, void* p=nullptr)
+		  : type(t), voice(v), arg1(a1), arg2(a2), n(num), ptr(p)
+		{}
+		MixerCommand() : type(ADD_VOICE), voice(nullptr), arg1(0.0f), arg2(0.0f), n(0), ptr(nullptr) {}
+		TYPE type;
+		PlayingSound* voice;
+		float arg1, arg2;
+		int n;
+		//The WaveData for SET_WAVE, the SoundStream for SET_STREAM or the
+		//SoundSource to mix from for SET_FILTERS.
+		void* ptr;
+	};
+
+	SpscQueue<MixerCommand, 4096> g_mixer_commands;
+
+	//The ID of our audio device.
+	SDL_AudioDeviceID g_audio_device;
+
+	//The voices being mixed. Only accessed from the mixer thread.
+	std::vector<PlayingSound*> g_mixer_voices;
+
+	//Set while an OfflineMixer exists, in which case the game thread is also the
+	//mixer thread.
+	bool g_offline_mixer = false;
+
+	void post_mixer_command(const MixerCommand& cmd);
+	void apply_mixer_command(const MixerCommand& cmd);
+
+	//Keeps an object the mixer may still be using alive until the mixer has
+	//taken all the commands posted so far. Only called from the game thread.
+	void retain_for_mixer(ffl::IntrusivePtr<SoundSource> obj, std::shared_ptr<void> data=std::shared_ptr<void>());
+
 	class RawPlayingSound : public SoundSource
 	{
 	public:
-		RawPlayingSound(const std::string& fname, float volume, float fade_in) : fname_(fname), pos_(0), volume_(volume), volume_target_(0.0), volume_target_time_(-1.0), fade_in_(fade_in), looped_(false), loop_point_(0), loop_from_(0), fade_out_(-1.0f), fade_out_current_(0.0f), left_pan_(1.0f), right_pan_(1.0f)
+		RawPlayingSound(const std::string& fname, float volume, float fade_in) : fname_(fname), pos_(0), volume_(volume), volume_target_(0.0), volume_target_time_(-1.0), fade_in_(fade_in), looped_(false), loop_point_(0), loop_from_(0), fade_out_(-1.0f), fade_out_current_(0.0f), left_pan_(1.0f), right_pan_(1.0f), mix_data_(nullptr), mix_stream_(nullptr)
 		{
 			init();
+			mix_data_ = data_.get();
 		}
 
-		RawPlayingSound(const std::string& fname, variant options) : fname_(fname), pos_(int(options["pos"].as_double(0.0)*SampleRate)), volume_(options["volume"].as_float(1.0f)), volume_target_(0.0), volume_target_time_(-1.0), fade_in_(options["fade_in"].as_float(0.0f)), looped_(options["loop"].as_bool(false)), loop_point_(int(options["loop_point"].as_float(0.0f)*SampleRate)), loop_from_(int(options["loop_from"].as_float(0.0f)*SampleRate)), fade_out_(-1.0f), fade_out_current_(0.0f), left_pan_(1.0f), right_pan_(1.0f)
+		RawPlayingSound(const std::string& fname, variant options) : fname_(fname), pos_(int(options["pos"].as_double(0.0)*SampleRate)), volume_(options["volume"].as_float(1.0f)), volume_target_(0.0), volume_target_time_(-1.0), fade_in_(options["fade_in"].as_float(0.0f)), looped_(options["loop"].as_bool(false)), loop_point_(int(options["loop_point"].as_float(0.0f)*SampleRate)), loop_from_(int(options["loop_from"].as_float(0.0f)*SampleRate)), fade_out_(-1.0f), fade_out_current_(0.0f), left_pan_(1.0f), right_pan_(1.0f), mix_data_(nullptr), mix_stream_(nullptr)
 		{
 			variant panning = options["pan"];
 			if(panning.is_list()) {
@@ -1296,6 +1617,7 @@ namespace sound
 			}
 
 			init();
+			mix_data_ = data_.get();
 		}
 
 		virtual ~RawPlayingSound() {}
@@ -1318,11 +1640,22 @@ namespace sound
 			right_pan_ = right;
 		}
 
+		//Whether the game thread has loaded the data for this sound.
 		bool loaded() const
 		{
 			return data_.get() != nullptr;
 		}
 
+		//The data the mixer plays, which lags behind data() until the mixer
+		//takes the command setting it.
+		bool mixLoaded() const
+		{
+			return mix_data_ != nullptr;
+		}
+
+		void setMixData(const WaveData* data) { mix_data_ = data; }
+		void setMixStream(SoundStream* stream) { mix_stream_ = stream; }
+
 		void init()
 		{
 			if(data_) {
@@ -1355,7 +1688,15 @@ namespace sound
 		//Once finished(), the game thread may remove this from the list of playing sounds.
 		bool finished() const override
 		{
-			return (data_.get() != nullptr && !looped_ && pos_ >= int(data_->nsamples())) || (fade_out_ >= 0.0f && fade_out_current_ >= fade_out_);
+			if(fade_out_ >= 0.0f && fade_out_current_ >= fade_out_) {
+				return true;
+			}
+
+			if(mix_data_ != nullptr && mix_data_->streamed) {
+				return mix_stream_ != nullptr && mix_stream_->finished();
+			}
+
+			return mix_data_ != nullptr && !looped_ && pos_ >= int(mix_data_->nsamples());
 		}
 
 		void setVolume(float volume, float nseconds=0.0)
@@ -1377,17 +1718,24 @@ namespace sound
 		//Mix data into the output buffer. Can be safely called from the mixing thread.
 		virtual void MixData(float* output, int nsamples) override
 		{
-			if(!data_ || nsamples <= 0 || (!looped_ && pos_ >= int(data_->nsamples())) || (fade_out_ >= 0.0f && fade_out_current_ >= fade_out_)) {
+			if(mix_data_ != nullptr && mix_data_->streamed) {
+				if(mix_stream_ != nullptr) {
+					mixStream(output, nsamples);
+				}
+				return;
+			}
+
+			if(!mix_data_ || nsamples <= 0 || (!looped_ && pos_ >= int(mix_data_->nsamples())) || (fade_out_ >= 0.0f && fade_out_current_ >= fade_out_)) {
 				return;
 			}
 			int pos = pos_;
 			pos_ += nsamples;
-			std::shared_ptr<WaveData> data = data_;
+			const WaveData* data = mix_data_;
 
 			float fade_out = fade_out_;
 			float fade_out_current = fade_out_current_;
 
-			int endpoint = !looped_ || loop_from_ <= 0 || loop_from_ > static_cast<int>(data_->nsamples()) ? data_->nsamples() : loop_from_;
+			int endpoint = !looped_ || loop_from_ <= 0 || loop_from_ > static_cast<int>(data->nsamples()) ? data->nsamples() : loop_from_;
 
 			if(fade_out_ >= 0.0f) {
 				fade_out_current_ += float(std::min<int>(nsamples, endpoint - pos))/float(SampleRate);
@@ -1418,12 +1766,29 @@ namespace sound
 
 			const short* p = &data->buffer[pos*data->nchannels];
 
+			mixFrames(output, p, data->nchannels, pos, nsamples, fade_out, fade_out_current);
+			output += nsamples*2;
+
+			if(looped && nmissed > 0 && endpoint > 0) {
+				MixData(output, nmissed);
+			}
+		}
+
+		int pos() const { return pos_; }
+
+		std::shared_ptr<WaveData> data() const { return data_; }
+
+	private:
+		//Mixes nsamples frames of the sound, the first being frame pos, applying
+		//the fades, volume and panning.
+		void mixFrames(float* output, const short* p, int nchannels, int pos, int nsamples, float fade_out, float fade_out_current)
+		{
 			float volume = volume_ * g_sfx_volume;
 
 			if(pos < fade_in_*SampleRate || fade_out >= 0.0f) {
 				for(int n = 0; n != nsamples; ++n) {
 					*output++ += (float(*p)/SHRT_MAX) * volume * std::min<float>(1.0f, ((pos+n*2) / (SampleRate*fade_in_))) * (1.0f - (fade_out_current + (n*0.5f)/SampleRate)/fade_out);
-					if(data->nchannels > 1) {
+					if(nchannels > 1) {
 						++p;
 					}
 					*output++ += (float(*p)/SHRT_MAX) * volume * std::min<float>(1.0f, ((pos+n*2) / (SampleRate*fade_in_))) * (1.0f - (fade_out_current + (n*0.5f)/SampleRate)/fade_out);
@@ -1440,15 +1805,7 @@ namespace sound
 
 				float end_volume = (1.0-ratio)*begin_volume + volume_target_*ratio*g_sfx_volume;
 
-				for(int n = 0; n != nsamples; ++n) {
-					float r = float(n)/float(nsamples);
-					float volume = (begin_volume*(1.0-r) + end_volume*r);
-					*output++ += (float(*p)/SHRT_MAX) * volume * left_pan_;
-					if(data->nchannels > 1) {
-						++p;
-					}
-					*output++ += (float(*p++)/SHRT_MAX) * volume * right_pan_;
-				}
+				mix_pcm16_ramp(output, p, nchannels, nsamples, begin_volume*left_pan_, begin_volume*right_pan_, end_volume*left_pan_, end_volume*right_pan_);
 
 				volume_target_time_ -= ntime;
 				volume_ = (1.0-ratio)*volume_ + volume_target_*ratio;
@@ -1456,36 +1813,45 @@ namespace sound
 					volume_target_time_ = 0.0f;
 					volume_ = volume_target_;
 				}
-			} else if(left_pan_ != 1.0f || right_pan_ != 1.0f) {
-				for(int n = 0; n != nsamples; ++n) {
-					*output++ += (float(*p)/SHRT_MAX) * volume * left_pan_;
-					if(data->nchannels > 1) {
-						++p;
-					}
-					*output++ += (float(*p++)/SHRT_MAX) * volume * right_pan_;
-				}
-			} else if(data->nchannels == 1) {
-				for(int n = 0; n != nsamples; ++n) {
-					*output++ += (float(*p)/SHRT_MAX) * volume;
-					*output++ += (float(*p)/SHRT_MAX) * volume;
-					++p;
-				}
 			} else {
-				for(int n = 0; n != nsamples*2; ++n) {
-					*output++ += (float(*p++)/SHRT_MAX) * volume;
-				}
+				mix_pcm16(output, p, nchannels, nsamples, volume*left_pan_, volume*right_pan_);
 			}
+		}
 
-			if(looped && nmissed > 0 && endpoint > 0) {
-				MixData(output, nmissed);
+		//Mixes what the stream has decoded. If that isn't enough the rest is
+		//left silent, and the sound carries on from where it got to next time.
+		void mixStream(float* output, int nsamples)
+		{
+			if(nsamples <= 0 || (fade_out_ >= 0.0f && fade_out_current_ >= fade_out_)) {
+				return;
 			}
-		}
 
-		int pos() const { return pos_; }
+			const float fade_out = fade_out_;
+			const float fade_out_current = fade_out_current_;
 
-		std::shared_ptr<WaveData> data() const { return data_; }
+			int nmixed = 0;
+			while(nmixed < nsamples) {
+				int nframes = 0;
+				const short* p = mix_stream_->readPointer(&nframes);
+				nframes = std::min<int>(nframes, nsamples - nmixed);
+				if(nframes <= 0) {
+					break;
+				}
 
-	private:
+				mixFrames(output + nmixed*2, p, mix_stream_->nchannels(), pos_, nframes, fade_out, fade_out_current + float(nmixed)/SampleRate);
+				mix_stream_->consume(nframes);
+				pos_ += nframes;
+				nmixed += nframes;
+			}
+
+			if(nmixed < nsamples && !mix_stream_->finished()) {
+				mix_stream_->addUnderrun();
+			}
+
+			if(fade_out_ >= 0.0f) {
+				fade_out_current_ += float(nmixed)/float(SampleRate);
+			}
+		}
 
 		std::string fname_;
 
@@ -1501,11 +1867,16 @@ namespace sound
 		int loop_point_, loop_from_;
 
 		float left_pan_, right_pan_;
+
+		const WaveData* mix_data_;
+		SoundStream* mix_stream_;
 	};
 
 	//Representation of a sound currently playing. A new instance will be created every time
 	//a sound effect starts playing, so is reasonably lightweight.
-	//Instances are created by the game thread but accessed from the mixing thread.
+	//Instances are created by the game thread. Once the sound has been given to the mixer
+	//its source and filters belong to the mixing thread, and the game thread changes them
+	//by posting commands, keeping its own copy of the settings it reads back.
 	//
 	//If the underlying data isn't available when this object is created it will wait, polling
 	//every frame to see if the cache has been populated every frame, and then play as soon
@@ -1513,14 +1884,18 @@ namespace sound
 	class PlayingSound : public SoundSource
 	{
 	public:
-		PlayingSound(const std::string& fname, const void* obj, float volume, float fade_in) : obj_(obj), source_(new RawPlayingSound(fname, volume, fade_in)), actual_volume_(-1.0f)
+		PlayingSound(const std::string& fname, const void* obj, float volume, float fade_in) : obj_(obj), source_(new RawPlayingSound(fname, volume, fade_in)), mixing_(false), finished_(false), actual_volume_(-1.0f)
 		{
-			first_filter_ = source_;
+			mix_source_ = source_.get();
+			readSourceSettings();
+			startStream();
 		}
 
-		PlayingSound(const std::string& fname, const void* obj, variant options) : obj_(obj), source_(new RawPlayingSound(fname, options)), userdata_(options["userdata"]), actual_volume_(-1.0f)
+		PlayingSound(const std::string& fname, const void* obj, variant options) : obj_(obj), source_(new RawPlayingSound(fname, options)), userdata_(options["userdata"]), mixing_(false), finished_(false), actual_volume_(-1.0f)
 		{
-			first_filter_ = source_;
+			mix_source_ = source_.get();
+			readSourceSettings();
+			startStream();
 
 			variant f = options["filters"];
 			if(f.is_list()) {
@@ -1538,77 +1913,107 @@ namespace sound
 		virtual ~PlayingSound() {}
 
 		void setFilename(const std::string& f) {
-			threading::lock lck(mutex_);
+			if(f == source_->fname()) {
+				return;
+			}
+
+			if(mixing_) {
+				retain_for_mixer(ffl::IntrusivePtr<SoundSource>(), source_->data());
+				retain_for_mixer(ffl::IntrusivePtr<SoundSource>(), stream_);
+			}
+
+			//A streamed sound starts the new file from its beginning.
+			start_pos_ = 0;
 			source_->setFilename(f);
+			startStream();
+			sendCommand(MixerCommand(MixerCommand::SET_WAVE, this, 0.0f, 0.0f, 0, source_->data().get()));
 		}
 
 		void setObj(const void* obj) { obj_ = obj; }
 
-		void setLooped(bool value) { source_->setLooped(value); }
-		bool looped() const { return source_->looped(); }
+		void setLooped(bool value) {
+			looped_ = value;
+			updateStreamLooping();
+			sendCommand(MixerCommand(MixerCommand::SET_LOOPED, this, 0.0f, 0.0f, value ? 1 : 0));
+		}
+		bool looped() const { return looped_; }
 
-		int loopPoint() const { return source_->loopPoint(); }
+		int loopPoint() const { return loop_point_; }
 		void setLoopPoint(int value) {
-			threading::lock lck(mutex_);
-			source_->setLoopPoint(value);
+			loop_point_ = value;
+			updateStreamLooping();
+			sendCommand(MixerCommand(MixerCommand::SET_LOOP_POINT, this, 0.0f, 0.0f, value));
 		}
 
-		int loopFrom() const { return source_->loopFrom(); }
+		int loopFrom() const { return loop_from_; }
 		void setLoopFrom(int value) {
-			threading::lock lck(mutex_);
-			source_->setLoopFrom(value);
+			loop_from_ = value;
+			updateStreamLooping();
+			sendCommand(MixerCommand(MixerCommand::SET_LOOP_FROM, this, 0.0f, 0.0f, value));
 		}
 
-		float leftPan() const { return source_->leftPan(); }
-		float rightPan() const { return source_->rightPan(); }
+		float leftPan() const { return left_pan_; }
+		float rightPan() const { return right_pan_; }
 		void setPanning(float left, float right)
 		{
-			threading::lock lck(mutex_);
-			source_->setPanning(left, right);
+			left_pan_ = left;
+			right_pan_ = right;
+			sendCommand(MixerCommand(MixerCommand::SET_PANNING, this, left, right));
 		}
 
+		//Called by the game thread to see if the data for the sound has been loaded.
 		void init()
 		{
-			threading::lock lck(mutex_);
+			if(source_->loaded()) {
+				return;
+			}
+
 			source_->init();
+			if(source_->loaded()) {
+				startStream();
+				sendCommand(MixerCommand(MixerCommand::SET_WAVE, this, 0.0f, 0.0f, 0, source_->data().get()));
+			}
 		}
 
 		void stopPlaying(float fade_time) {
-			threading::lock lck(mutex_);
-			source_->stopPlaying(fade_time);
+			sendCommand(MixerCommand(MixerCommand::STOP_PLAYING, this, fade_time));
 		}
 
 		//Once finished(), the game thread may remove this from the list of playing sounds.
 		bool finished() const override
 		{
-			threading::lock lck(mutex_);
-			return first_filter_->finished();
+			if(mixing_) {
+				return finished_.load(std::memory_order_acquire);
+			}
+
+			return mix_source_->finished();
 		}
 
 		void setVolume(float volume, float nseconds=0.0)
 		{
-			threading::lock lck(mutex_);
-			source_->setVolume(volume, nseconds);
+			volume_ = volume;
+			sendCommand(MixerCommand(MixerCommand::SET_VOLUME, this, volume, nseconds));
 		}
 
-		float getVolume()
+		float getVolume() const
 		{
-			if(actual_volume_ >= 0.0f) {
-				return actual_volume_;
+			const float actual_volume = actual_volume_.load(std::memory_order_relaxed);
+			if(actual_volume >= 0.0f) {
+				return actual_volume;
 			}
 
-			threading::lock lck(mutex_);
-			return source_->getVolume();
+			return volume_;
 		}
 
-		//Mix data into the output buffer. Can be safely called from the mixing thread.
+		//Mix data into the output buffer. Called from the mixing thread.
 		virtual void MixData(float* output, int nsamples) override
 		{
-			threading::lock lck(mutex_);
-			if(source_->loaded()) {
-				actual_volume_ = source_->getVolume();
-				first_filter_->MixData(output, nsamples);
+			if(source_->mixLoaded()) {
+				actual_volume_.store(source_->getVolume(), std::memory_order_relaxed);
+				mix_source_->MixData(output, nsamples);
 			}
+
+			finished_.store(mix_source_->finished(), std::memory_order_release);
 		}
 
 		const void* obj() const { return obj_; }
@@ -1619,7 +2024,13 @@ namespace sound
 		}
 
 		void setFilters(std::vector<ffl::IntrusivePtr<SoundEffectFilter> > filters) {
-			threading::lock lck(mutex_);
+			if(mixing_) {
+				//The mixer may be part way through mixing the old filters.
+				for(auto f : filters_) {
+					retain_for_mixer(f);
+				}
+			}
+
 			filters_.clear();
 			for(auto f : filters) {
 				filters_.push_back(ffl::IntrusivePtr<SoundEffectFilter>(f->clone()));
@@ -1632,37 +2043,246 @@ namespace sound
 				}
 			}
 
-			if(filters_.empty()) {
-				first_filter_ = source_;
-			} else {
-				first_filter_ = filters_.back();
-			}
+			SoundSource* first_filter = filters_.empty() ? static_cast<SoundSource*>(source_.get()) : filters_.back().get();
+			sendCommand(MixerCommand(MixerCommand::SET_FILTERS, this, 0.0f, 0.0f, 0, first_filter));
 		}
 
 		ffl::IntrusivePtr<RawPlayingSound> src() const { return source_; }
 
+		bool streamed() const { return stream_.get() != nullptr; }
+		int numUnderruns() const { return stream_ ? stream_->numUnderruns() : 0; }
+
+		//The memory used by the sound's data, if it is loaded, and stream.
+		size_t memoryUsage() const
+		{
+			size_t res = 0;
+			if(source_->data()) {
+				res += source_->data()->memoryUsage();
+			}
+
+			if(stream_) {
+				res += stream_->memoryUsage();
+			}
+
+			return res;
+		}
+
+		size_t streamMemoryUsage() const { return stream_ ? stream_->memoryUsage() : 0; }
+
+		//Hands the sound to the mixer. From now on changes to it are posted
+		//to the mixer rather than made directly.
+		void startMixing() { mixing_ = true; }
+
+		//Makes a change to the sound. Called from the mixing thread once the
+		//sound has been given to the mixer.
+		void applyCommand(const MixerCommand& cmd)
+		{
+			switch(cmd.type) {
+			case MixerCommand::SET_VOLUME:
+				source_->setVolume(cmd.arg1, cmd.arg2);
+				break;
+			case MixerCommand::SET_PANNING:
+				source_->setPanning(cmd.arg1, cmd.arg2);
+				break;
+			case MixerCommand::STOP_PLAYING:
+				source_->stopPlaying(cmd.arg1);
+				break;
+			case MixerCommand::SET_LOOPED:
+				source_->setLooped(cmd.n != 0);
+				break;
+			case MixerCommand::SET_LOOP_POINT:
+				source_->setLoopPoint(cmd.n);
+				break;
+			case MixerCommand::SET_LOOP_FROM:
+				source_->setLoopFrom(cmd.n);
+				break;
+			case MixerCommand::SET_WAVE:
+				source_->setMixData(static_cast<const WaveData*>(cmd.ptr));
+				break;
+			case MixerCommand::SET_STREAM:
+				source_->setMixStream(static_cast<SoundStream*>(cmd.ptr));
+				break;
+			case MixerCommand::SET_FILTERS:
+				mix_source_ = static_cast<SoundSource*>(cmd.ptr);
+				break;
+			default:
+				break;
+			}
+		}
+
 	private:
 		DECLARE_CALLABLE(PlayingSound);
 
-		threading::mutex mutex_;
+		void readSourceSettings()
+		{
+			start_pos_ = std::max(0, source_->pos());
+			looped_ = source_->looped();
+			loop_point_ = source_->loopPoint();
+			loop_from_ = source_->loopFrom();
+			left_pan_ = source_->leftPan();
+			right_pan_ = source_->rightPan();
+			volume_ = source_->getVolume();
+		}
+
+		//If the sound's data is loaded and is to be streamed, starts decoding it.
+		void startStream()
+		{
+			std::shared_ptr<WaveData> data = source_->data();
+			if(!data || !data->streamed) {
+				if(stream_) {
+					stream_.reset();
+					sendCommand(MixerCommand(MixerCommand::SET_STREAM, this));
+				}
+				return;
+			}
+
+			stream_ = std::make_shared<SoundStream>(data, start_pos_, looped_, loop_point_, loop_from_);
+			add_sound_stream(stream_);
+			sendCommand(MixerCommand(MixerCommand::SET_STREAM, this, 0.0f, 0.0f, 0, stream_.get()));
+		}
+
+		void updateStreamLooping()
+		{
+			if(stream_) {
+				stream_->setLooping(looped_, loop_point_, loop_from_);
+			}
+		}
+
+		void sendCommand(const MixerCommand& cmd)
+		{
+			if(mixing_) {
+				post_mixer_command(cmd);
+			} else {
+				applyCommand(cmd);
+			}
+		}
 
 		const void* obj_;
 
 		ffl::IntrusivePtr<RawPlayingSound> source_;
 
-		ffl::IntrusivePtr<SoundSource> first_filter_;
-
 		std::vector<ffl::IntrusivePtr<SoundEffectFilter> > filters_;
 
 		variant userdata_;
 
-		float actual_volume_;
+		//The game thread's copy of the sound's settings.
+		bool looped_;
+		int loop_point_, loop_from_;
+		float left_pan_, right_pan_;
+		float volume_;
+		int start_pos_;
+
+		//The stream the sound plays from, if it is streamed.
+		std::shared_ptr<SoundStream> stream_;
+
+		bool mixing_;
+
+		//Mixer thread state: what to mix from, which is the last filter or the
+		//source if there are no filters, and whether the sound has finished.
+		SoundSource* mix_source_;
+		std::atomic<bool> finished_;
+
+		std::atomic<float> actual_volume_;
 	};
 
-	//List of currently playing sounds. Only the game thread can modify this,
-	//the mixing thread will read it.
+	//List of currently playing sounds. Only accessed from the game thread; the
+	//mixer keeps its own list, g_mixer_voices, which is kept in step by commands.
 	std::vector<ffl::IntrusivePtr<PlayingSound> > g_playing_sounds;
-	threading::mutex g_playing_sounds_mutex;
+
+	//Objects kept alive by retain_for_mixer(), along with how many commands had
+	//been posted when they were retained.
+	struct RetainedForMixer
+	{
+		unsigned ncommand;
+		ffl::IntrusivePtr<SoundSource> obj;
+		std::shared_ptr<void> data;
+	};
+
+	std::vector<RetainedForMixer> g_retained_for_mixer;
+
+	void retain_for_mixer(ffl::IntrusivePtr<SoundSource> obj, std::shared_ptr<void> data)
+	{
+		RetainedForMixer item;
+		item.ncommand = g_mixer_commands.numPushed();
+		item.obj = obj;
+		item.data = data;
+		g_retained_for_mixer.push_back(item);
+	}
+
+	//Releases the objects retained for commands the mixer has taken.
+	void release_retained_for_mixer()
+	{
+		const unsigned npopped = g_mixer_commands.numPopped();
+		auto itor = g_retained_for_mixer.begin();
+		while(itor != g_retained_for_mixer.end() && static_cast<int>(npopped - itor->ncommand) > 0) {
+			++itor;
+		}
+
+		g_retained_for_mixer.erase(g_retained_for_mixer.begin(), itor);
+	}
+
+	void apply_mixer_command(const MixerCommand& cmd)
+	{
+		switch(cmd.type) {
+		case MixerCommand::ADD_VOICE:
+			if(std::find(g_mixer_voices.begin(), g_mixer_voices.end(), cmd.voice) == g_mixer_voices.end()) {
+				g_mixer_voices.push_back(cmd.voice);
+			}
+			break;
+		case MixerCommand::REMOVE_VOICE:
+			g_mixer_voices.erase(std::remove(g_mixer_voices.begin(), g_mixer_voices.end(), cmd.voice), g_mixer_voices.end());
+			break;
+		default:
+			cmd.voice->applyCommand(cmd);
+			break;
+		}
+	}
+
+	//Takes the commands the game thread has posted. Called from the mixing thread.
+	void process_mixer_commands()
+	{
+		//A command is only popped once it has been applied, since popping it
+		//lets the game thread release what it retained for the command.
+		MixerCommand cmd;
+		while(g_mixer_commands.front(&cmd)) {
+			apply_mixer_command(cmd);
+			g_mixer_commands.pop();
+		}
+	}
+
+	void post_mixer_command(const MixerCommand& cmd)
+	{
+		if(g_audio_device == 0 && !g_offline_mixer) {
+			//Nothing is mixing, so the command can be applied now.
+			apply_mixer_command(cmd);
+			return;
+		}
+
+		//The voice must outlive the command even if the game drops it.
+		retain_for_mixer(cmd.voice);
+
+		while(!g_mixer_commands.push(cmd)) {
+			//The mixer empties the queue every time it is called, so the game
+			//thread has to have posted a huge burst of commands to get here.
+			if(g_offline_mixer) {
+				process_mixer_commands();
+			} else {
+				SDL_Delay(1);
+			}
+		}
+	}
+
+	//Starts mixing a sound, unless it is already playing.
+	void add_playing_sound(const ffl::IntrusivePtr<PlayingSound>& s)
+	{
+		if(std::find(g_playing_sounds.begin(), g_playing_sounds.end(), s) != g_playing_sounds.end()) {
+			return;
+		}
+
+		g_playing_sounds.push_back(s);
+		s->startMixing();
+		post_mixer_command(MixerCommand(MixerCommand::ADD_VOICE, s.get()));
+	}
 
 	BEGIN_DEFINE_CALLABLE(PlayingSound, SoundSource)
 	DEFINE_FIELD(filename, "string")
@@ -1679,10 +2299,13 @@ namespace sound
 		}
 
 		return variant();
+	DEFINE_FIELD(memory_usage, "int")
+		return variant(static_cast<int>(obj.memoryUsage()));
+	DEFINE_FIELD(streamed, "bool")
+		return variant::from_bool(obj.streamed());
 	DEFINE_FIELD(loop, "bool")
 		return variant::from_bool(obj.looped());
 	DEFINE_SET_FIELD
-		threading::lock lck(obj.mutex_);
 		obj.setLooped(value.as_bool());
 
 	DEFINE_FIELD(loop_point, "decimal|null")
@@ -1705,7 +2328,6 @@ namespace sound
 			return variant(float(obj.loopFrom()) / float(SampleRate));
 		}
 	DEFINE_SET_FIELD
-		threading::lock lck(obj.mutex_);
 		if(value.is_null()) {
 			obj.setLoopFrom(0);
 		} else {
@@ -1713,7 +2335,7 @@ namespace sound
 		}
 
 	DEFINE_FIELD(volume, "decimal")
-		return variant(obj.source_->getVolume());
+		return variant(obj.getVolume());
 
 	BEGIN_DEFINE_FN(set_volume, "(decimal,decimal)->commands")
 		float vol = FN_ARG(0).as_float();
@@ -1731,7 +2353,6 @@ namespace sound
 		return variant(&v);
 
 	DEFINE_SET_FIELD
-		threading::lock lck(obj.mutex_);
 		std::vector<decimal> d = value.as_list_decimal();
 		ASSERT_LOG(d.size() == 2, "Incorrect pan arg");
 		obj.setPanning(d[0].as_float32(), d[1].as_float32());
@@ -1758,12 +2379,7 @@ namespace sound
 	BEGIN_DEFINE_FN(play, "()->commands")
 		ffl::IntrusivePtr<PlayingSound> ptr(const_cast<PlayingSound*>(&obj));
 		return variant(new game_logic::FnCommandCallable("sound::play", [=]() {
-			threading::lock lck(g_playing_sounds_mutex);
-			if(std::find(g_playing_sounds.begin(), g_playing_sounds.end(), ptr) != g_playing_sounds.end()) {
-				return;
-			} else {
-				g_playing_sounds.push_back(ptr);
-			}
+			add_playing_sound(ptr);
 		}));
 	END_DEFINE_FN
 
@@ -1783,6 +2399,37 @@ namespace sound
 	std::vector<Uint8> g_debug_audio_stream;
 	threading::mutex g_debug_audio_stream_mutex;
 
+	//Mixes the sound effects and music into buf, which holds nsamples samples
+	//and has been zeroed. Called from the mixing thread.
+	void mix_audio(float* buf, int nsamples)
+	{
+		//Mix all the sound effects.
+		for(PlayingSound* s : g_mixer_voices) {
+			s->MixData(buf, nsamples/2);
+		}
+
+		//Now mix the music from the music ring buffer.
+		const float music_volume = g_engine_music_volume*g_user_music_volume;
+
+		const int nmix = std::min<int>(g_music_buf_nsamples.load(std::memory_order_acquire), nsamples);
+
+		float* music_write_buf = buf;
+		int nremaining = nmix;
+		while(nremaining > 0) {
+			const int nchunk = std::min<int>(nremaining, MusicBufSize - g_music_buf_read);
+			mix_float(music_write_buf, g_music_buf + g_music_buf_read, nchunk, music_volume);
+			music_write_buf += nchunk;
+
+			nremaining -= nchunk;
+			g_music_buf_read += nchunk;
+			if(g_music_buf_read == MusicBufSize) {
+				g_music_buf_read = 0;
+			}
+		}
+
+		g_music_buf_nsamples.fetch_sub(nmix, std::memory_order_release);
+	}
+
 	int g_audio_callback_done_fade_out = 0;
 	bool g_audio_callback_fade_out = false;
 
@@ -1794,76 +2441,22 @@ namespace sound
 			++g_audio_callback_done_fade_out;
 		}
 
-		float sfx_volume = g_sfx_volume;
-
 		float* buf = reinterpret_cast<float*>(stream);
 		const int nsamples = len / sizeof(float);
 
 		//Set the buffer to zeroes so we can start mixing.
-		for(int n = 0; n < nsamples; ++n) {
-			buf[n] = 0.0f;
-		}
+		std::fill(buf, buf + nsamples, 0.0f);
+
+		process_mixer_commands();
 
 		if(g_muted || g_audio_callback_done_fade_out > 1) {
 			return;
 		}
 
-		//Mix all the sound effects.
-		{
-			threading::lock lck(g_playing_sounds_mutex);
-			for(const ffl::IntrusivePtr<PlayingSound>& s : g_playing_sounds) {
-				s->MixData(buf, nsamples/2);
-			}
-		}
-
-		//Now mix the music from the music ring buffer.
-		const float music_volume = g_engine_music_volume*g_user_music_volume;
-
-		float*	music_read = nullptr;
-		int music_nsamples = 0;
-		float* end_music_buf = g_music_buf + sizeof(g_music_buf)/sizeof(*g_music_buf);
-		{
-			threading::lock lck(g_music_thread_mutex);
-			music_read = g_music_buf_read;
-			music_nsamples = g_music_buf_nsamples;
-		}
-
-		int music_starting_samples = music_nsamples;
-
-		int navail = std::min<int>(music_nsamples, end_music_buf - music_read);
-		int nmix = std::min<int>(navail, nsamples);
-
-		float* music_write_buf = buf;
-
-		for(int n = 0; n < nmix; ++n) {
-			*music_write_buf++ += *music_read++ * music_volume;
-		}
-
-		music_nsamples -= nmix;
-
-		if(music_read == end_music_buf) {
-			music_read = g_music_buf;
-			nmix = std::min<int>(music_nsamples, nsamples - nmix);
-			for(int n = 0; n < nmix; ++n) {
-				*music_write_buf++ += *music_read++ * music_volume;
-			}
-
-			music_nsamples -= nmix;
-		}
-
-		{
-			threading::lock lck(g_music_thread_mutex);
-			g_music_buf_read = music_read;
-			g_music_buf_nsamples -= music_starting_samples - music_nsamples;
-		}
+		mix_audio(buf, nsamples);
 
 		if(g_audio_callback_fade_out) {
-			float* buf = reinterpret_cast<float*>(stream);
-			const int nsamples = len / sizeof(float);
-			for(int n = 0; n != nsamples; ++n) {
-				float ratio = 1.0 - float(n)/float(nsamples);
-				buf[n] *= ratio;
-			}
+			apply_gain_ramp(buf, nsamples, 1.0f, 0.0f);
 		}
 
 		if(g_debug_visualize_audio) {
@@ -1878,9 +2471,6 @@ namespace sound
 			memcpy(&g_debug_audio_stream[0] + g_debug_audio_stream.size() - len, stream, len);
 		}
 	}
-
-	//The ID of our audio device.
-	SDL_AudioDeviceID g_audio_device;
 }
 
 Manager::Manager()
@@ -1902,6 +2492,9 @@ Manager::Manager()
 	g_loader_thread.reset(new threading::thread("sound_loader", LoaderThread));
 	g_music_thread.reset(new threading::thread("music_mixer", MusicThread));
 
+	//Adding voices shouldn't need to allocate in the mixing thread.
+	g_mixer_voices.reserve(256);
+
 	SDL_AudioSpec spec;
 
 	spec.freq = SampleRate;
@@ -1958,12 +2551,54 @@ Manager::~Manager()
 
 		SDL_CloseAudioDevice(g_audio_device);
 		g_audio_device = 0;
+
+		//With the device closed this thread can take the mixer's place.
+		process_mixer_commands();
+		release_retained_for_mixer();
 	}
 }
 
 bool ok()
 {
-	return g_audio_device != 0;
+	return g_audio_device != 0 || g_offline_mixer;
+}
+
+OfflineMixer::OfflineMixer()
+{
+	ASSERT_LOG(g_audio_device == 0 && !g_offline_mixer, "Offline mixing can't be done while the audio device or another offline mixer is in use");
+	g_offline_mixer = true;
+}
+
+OfflineMixer::~OfflineMixer()
+{
+	process_mixer_commands();
+	g_offline_mixer = false;
+	release_retained_for_mixer();
+}
+
+void OfflineMixer::render(float* buf, int nframes)
+{
+	const int nsamples = nframes*NumChannels;
+	std::fill(buf, buf + nsamples, 0.0f);
+
+	process_mixer_commands();
+
+	if(!g_muted) {
+		mix_audio(buf, nsamples);
+	}
+}
+
+std::vector<float> OfflineMixer::renderSeconds(float nseconds)
+{
+	std::vector<float> res(static_cast<int>(nseconds*SampleRate)*NumChannels);
+
+	//Mix as much at a time as the audio device would ask for.
+	const int BlockSize = BUFFER_NUM_SAMPLES*NumChannels;
+	for(int pos = 0; pos < static_cast<int>(res.size()); pos += BlockSize) {
+		render(&res[pos], std::min<int>(BlockSize, static_cast<int>(res.size()) - pos)/NumChannels);
+	}
+
+	return res;
 }
 
 bool muted()
@@ -1981,16 +2616,18 @@ void process()
 {
 	//Go through the playing sounds list and remove any that are finished.
 	{
-		threading::lock lck(g_playing_sounds_mutex);
 		for(ffl::IntrusivePtr<PlayingSound>& s : g_playing_sounds) {
 			s->init();
 
 			if(s->finished()) {
+				post_mixer_command(MixerCommand(MixerCommand::REMOVE_VOICE, s.get()));
 				s.reset();
 			}
 		}
 
 		g_playing_sounds.erase(std::remove(g_playing_sounds.begin(), g_playing_sounds.end(), ffl::IntrusivePtr<PlayingSound>()), g_playing_sounds.end());
+
+		release_retained_for_mixer();
 	}
 
 	//Go through the music players and removed any that are finished.
@@ -2117,8 +2754,7 @@ void play(const std::string& file, const void* object, float volume, float fade_
 	ffl::IntrusivePtr<PlayingSound> s(new PlayingSound(file, object, volume, fade_in_time));
 	s->setPanning(g_pan_left, g_pan_right);
 
-	threading::lock lck(g_playing_sounds_mutex);
-	g_playing_sounds.push_back(s);
+	add_playing_sound(s);
 }
 
 
@@ -2158,8 +2794,7 @@ int play_looped(const std::string& file, const void* object, float volume, float
 	s->setLooped(true);
 	s->setPanning(g_pan_left, g_pan_right);
 
-	threading::lock lck(g_playing_sounds_mutex);
-	g_playing_sounds.push_back(s);
+	add_playing_sound(s);
 	return -1;
 }
 
@@ -2233,16 +2868,19 @@ BEGIN_DEFINE_CALLABLE_NOBASE(AudioEngine)
 		}
 
 		{
-			threading::lock lck(g_playing_sounds_mutex);
 			s << g_playing_sounds.size() << " sounds playing\n";
 
 			for(auto p : g_playing_sounds) {
-				s << "  " << p->fname() << ": " << (p->src()->loaded() == false ? "loading" : (p->finished() ? "finished" : "")) << " vol: " << p->getVolume() << " (stereo pan: " << p->src()->leftPan() << "/" << p->src()->rightPan() << ")";
-				if(p->src()->looped()) {
+				s << "  " << p->fname() << ": " << (p->src()->loaded() == false ? "loading" : (p->finished() ? "finished" : "")) << " vol: " << p->getVolume() << " (stereo pan: " << p->leftPan() << "/" << p->rightPan() << ")";
+				if(p->looped()) {
 					s << " (looped)";
 				}
 				if(p->src()->data()) {
 					s << " " << p->src()->pos()/44100.0f << "/" << p->src()->data()->nsamples()/44100.0f;
+					s << " " << (p->memoryUsage()/1024) << "KB";
+				}
+				if(p->streamed()) {
+					s << " (streamed, " << p->numUnderruns() << " underruns)";
 				}
 
 				if(p->getFilters().empty() == false) {
@@ -2302,8 +2940,6 @@ BEGIN_DEFINE_CALLABLE_NOBASE(AudioEngine)
 	DEFINE_FIELD(current_sounds, "[builtin playing_sound]")
 		std::vector<variant> res;
 
-		threading::lock lck(g_playing_sounds_mutex);
-
 		for(auto p : g_playing_sounds) {
 			res.emplace_back(p.get());
 		}
@@ -2363,6 +2999,15 @@ MemoryUsageInfo get_memory_usage_info()
 	info.cache_usage = g_wave_cache_size;
 	info.max_cache_usage = g_audio_cache_size_mb*1024*1024;
 	info.nsounds_cached = static_cast<int>(g_wave_cache_lru.size());
+
+	info.nsounds_streaming = 0;
+	info.stream_usage = 0;
+	for(auto p : g_playing_sounds) {
+		if(p->streamed()) {
+			++info.nsounds_streaming;
+			info.stream_usage += static_cast<int>(p->streamMemoryUsage());
+		}
+	}
 	return info;
 }
 
@@ -2377,6 +3022,114 @@ void get_debug_audio_stream(std::vector<float>& res)
 
 }
 
+namespace
+{
+	//Puts a stereo sound effect holding the given sample value straight into
+	//the audio cache.
+	void add_test_wave(const std::string& name, int nsamples, short value)
+	{
+		std::vector<short> buf(nsamples*2, value);
+		std::shared_ptr<sound::WaveData> data(new sound::WaveData(name, &buf, 2));
+		sound::add_cached_wave(sound::map_filename(name), data);
+	}
+}
+
+UNIT_TEST(offline_mixer_applies_commands)
+{
+	add_test_wave("offline_mixer_test.wav", 44100, 10000);
+
+	sound::OfflineMixer mixer;
+	const int object = 0;
+	sound::play("offline_mixer_test.wav", &object, 0.5f);
+
+	std::vector<float> buf = mixer.renderSeconds(0.1f);
+	CHECK_EQ(static_cast<int>(buf.size()), 4410*2);
+	CHECK_EQ(std::abs(buf.front() - 0.5f*10000/SHRT_MAX) < 0.0001f, true);
+	CHECK_EQ(std::abs(buf.back() - 0.5f*10000/SHRT_MAX) < 0.0001f, true);
+
+	sound::stop_sound("offline_mixer_test.wav", &object);
+	buf = mixer.renderSeconds(0.1f);
+	CHECK_EQ(static_cast<int>(std::count(buf.begin(), buf.end(), 0.0f)), static_cast<int>(buf.size()));
+
+	sound::process();
+}
+
+//A looped sound mixed in blocks should have no gaps where blocks or loops join.
+UNIT_TEST(offline_mixer_looped_sound_is_continuous)
+{
+	add_test_wave("offline_mixer_loop_test.wav", 1000, 10000);
+
+	sound::OfflineMixer mixer;
+	const int object = 0;
+	sound::play_looped("offline_mixer_loop_test.wav", &object);
+
+	const float expected = 10000.0f/SHRT_MAX;
+	std::vector<float> buf = mixer.renderSeconds(1.0f);
+	int nwrong = 0;
+	for(float f : buf) {
+		if(std::abs(f - expected) > 0.0001f) {
+			++nwrong;
+		}
+	}
+
+	CHECK_EQ(nwrong, 0);
+
+	sound::stop_sound("offline_mixer_loop_test.wav", &object);
+	mixer.renderSeconds(0.01f);
+	sound::process();
+}
+
+BENCHMARK(offline_mixer_64_voices)
+{
+	add_test_wave("offline_mixer_bench.wav", 44100, 1000);
+
+	sound::OfflineMixer mixer;
+	const int object = 0;
+	for(int n = 0; n != 64; ++n) {
+		sound::play_looped("offline_mixer_bench.wav", &object, 0.5f);
+	}
+
+	std::vector<float> buf(sound::BUFFER_NUM_SAMPLES*sound::NumChannels);
+	BENCHMARK_LOOP {
+		mixer.render(&buf[0], sound::BUFFER_NUM_SAMPLES);
+	}
+
+	sound::stop_sound("offline_mixer_bench.wav", &object);
+	mixer.render(&buf[0], sound::BUFFER_NUM_SAMPLES);
+	sound::process();
+}
+
+BENCHMARK(offline_mixer_64_voices_filtered)
+{
+	add_test_wave("offline_mixer_bench.wav", 44100, 1000);
+
+	std::map<variant,variant> lowpass_options, speed_options, options;
+	speed_options[variant("speed")] = variant(0.8);
+
+	std::vector<variant> filters;
+	filters.emplace_back(new sound::BiQuadSoundEffectFilter(sound::bq_type_lowpass, variant(&lowpass_options)));
+	filters.emplace_back(new sound::SpeedSoundEffectFilter(variant(&speed_options)));
+
+	options[variant("loop")] = variant::from_bool(true);
+	options[variant("volume")] = variant(0.5);
+	options[variant("filters")] = variant(&filters);
+
+	sound::OfflineMixer mixer;
+	const int object = 0;
+	for(int n = 0; n != 64; ++n) {
+		sound::add_playing_sound(ffl::IntrusivePtr<sound::PlayingSound>(new sound::PlayingSound("offline_mixer_bench.wav", &object, variant(&options))));
+	}
+
+	std::vector<float> buf(sound::BUFFER_NUM_SAMPLES*sound::NumChannels);
+	BENCHMARK_LOOP {
+		mixer.render(&buf[0], sound::BUFFER_NUM_SAMPLES);
+	}
+
+	sound::stop_sound("offline_mixer_bench.wav", &object);
+	mixer.render(&buf[0], sound::BUFFER_NUM_SAMPLES);
+	sound::process();
+}
+
 //Outputs names of any wave files it fails to load.
 COMMAND_LINE_UTILITY(validate_waves)
 {
@@ -29,6 +29,7 @@
 #include "variant.hpp"
 
 #include <string>
+#include <vector>
 
 namespace sound
 {
@@ -38,6 +39,26 @@ namespace sound
 		~Manager();
 	};
 
+	//Mixes audio into a buffer rather than playing it, so the mixer can be run
+	//and measured without an audio device. While one exists sounds play as if
+	//the device was open, with render() standing in for the device asking for
+	//more audio. It can't be used while the device is open.
+	class OfflineMixer
+	{
+	public:
+		OfflineMixer();
+		~OfflineMixer();
+
+		//Mixes the next nframes stereo frames into buf.
+		void render(float* buf, int nframes);
+
+		//Mixes the next nseconds of audio, in blocks the size the device uses.
+		std::vector<float> renderSeconds(float nseconds);
+
+		OfflineMixer(const OfflineMixer&) = delete;
+		void operator=(const OfflineMixer&) = delete;
+	};
+
 	void init_music(variant node);
 
 	bool ok();
@@ -101,6 +122,10 @@ namespace sound
 		int nsounds_cached;
 		int cache_usage;
 		int max_cache_usage;
+		//Sounds playing from a stream rather than the cache, and the memory
+		//their stream buffers use.
+		int nsounds_streaming;
+		int stream_usage;
 	};
 
 	MemoryUsageInfo get_memory_usage_info();
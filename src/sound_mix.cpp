@@ -0,0 +1,370 @@
+/*
+	Copyright (C) 2003-2014 by David White <davewx7@gmail.com>
+
+	This software is provided 'as-is', without any express or implied
+	warranty. In no event will the authors be held liable for any damages
+	arising from the use of this software.
+
+	Permission is granted to anyone to use this software for any purpose,
+	including commercial applications, and to alter it and redistribute it
+	freely, subject to the following restrictions:
+
+	   1. The origin of this software must not be misrepresented; you must not
+	   claim that you wrote the original software. If you use this software
+	   in a product, an acknowledgement in the product documentation would be
+	   appreciated but is not required.
+
+	   2. Altered source versions must be plainly marked as such, and must not be
+	   misrepresented as being the original software.
+
+	   3. This notice may not be removed or altered from any source
+	   distribution.
+*/
+
+
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <cstdlib>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define SOUND_MIX_SSE2 1
+#include <emmintrin.h>
+#endif
+
+#include "sound_mix.hpp"
+#include "unit_test.hpp"
+
+namespace sound
+{
+	namespace
+	{
+		const float Pcm16Scale = 1.0f/SHRT_MAX;
+
+		//The plain versions of the mixing functions, used where there is no
+		//SSE2 and to finish off the frames left over from the SSE2 versions.
+		namespace scalar
+		{
+			void mix_pcm16(float* out, const short* in, int in_channels, int nframes, float left_gain, float right_gain)
+			{
+				left_gain *= Pcm16Scale;
+				right_gain *= Pcm16Scale;
+				if(in_channels == 1) {
+					for(int n = 0; n < nframes; ++n) {
+						out[n*2] += in[n]*left_gain;
+						out[n*2+1] += in[n]*right_gain;
+					}
+				} else {
+					for(int n = 0; n < nframes; ++n) {
+						out[n*2] += in[n*2]*left_gain;
+						out[n*2+1] += in[n*2+1]*right_gain;
+					}
+				}
+			}
+
+			void mix_pcm16_ramp(float* out, const short* in, int in_channels, int nframes, float left_begin, float right_begin, float left_end, float right_end)
+			{
+				if(nframes <= 0) {
+					return;
+				}
+
+				const float left_delta = (left_end - left_begin)*Pcm16Scale/nframes;
+				const float right_delta = (right_end - right_begin)*Pcm16Scale/nframes;
+				left_begin *= Pcm16Scale;
+				right_begin *= Pcm16Scale;
+				for(int n = 0; n < nframes; ++n) {
+					const short* frame = in_channels == 1 ? in + n : in + n*2;
+					out[n*2] += frame[0]*(left_begin + left_delta*n);
+					out[n*2+1] += frame[in_channels-1]*(right_begin + right_delta*n);
+				}
+			}
+
+			void mix_float(float* out, const float* in, int nsamples, float gain)
+			{
+				for(int n = 0; n < nsamples; ++n) {
+					out[n] += in[n]*gain;
+				}
+			}
+
+			void apply_gain_ramp(float* buf, int nsamples, float begin, float end)
+			{
+				const float delta = (end - begin)/nsamples;
+				for(int n = 0; n < nsamples; ++n) {
+					buf[n] *= begin + delta*n;
+				}
+			}
+
+			void mix_resample_linear(float* out, int nframes, const float* in, int nin, float step)
+			{
+				for(int n = 0; n < nframes; ++n) {
+					const float point = n*step;
+					const int a = std::min<int>(static_cast<int>(point), nin - 1);
+					const int b = std::min<int>(a + 1, nin - 1);
+					const float ratio = point - std::floor(point);
+					out[n*2] += in[a*2] + (in[b*2] - in[a*2])*ratio;
+					out[n*2+1] += in[a*2+1] + (in[b*2+1] - in[a*2+1])*ratio;
+				}
+			}
+
+			void mix_biquad(float* out, const float* in, int nframes, const BiquadCoefficients& c, float* z1, float* z2)
+			{
+				float z1_left = z1[0], z1_right = z1[1];
+				float z2_left = z2[0], z2_right = z2[1];
+				for(int n = 0; n < nframes; ++n) {
+					const float left = in[n*2];
+					const float right = in[n*2+1];
+					const float left_out = left*c.a0 + z1_left;
+					const float right_out = right*c.a0 + z1_right;
+					z1_left = left*c.a1 + z2_left - c.b1*left_out;
+					z1_right = right*c.a1 + z2_right - c.b1*right_out;
+					z2_left = left*c.a2 - c.b2*left_out;
+					z2_right = right*c.a2 - c.b2*right_out;
+					out[n*2] += left_out;
+					out[n*2+1] += right_out;
+				}
+
+				z1[0] = z1_left;
+				z1[1] = z1_right;
+				z2[0] = z2_left;
+				z2[1] = z2_right;
+			}
+		}
+
+#ifdef SOUND_MIX_SSE2
+		//Loads and stores one stereo frame in the low half of a register.
+		inline __m128 load_frame(const float* p)
+		{
+			return _mm_loadl_pi(_mm_setzero_ps(), reinterpret_cast<const __m64*>(p));
+		}
+
+		inline void store_frame(float* p, __m128 v)
+		{
+			_mm_storel_pi(reinterpret_cast<__m64*>(p), v);
+		}
+
+		//Mixes four frames of 16-bit samples with gains for the first two and
+		//last two frames.
+		inline void mix_pcm16_4frames(float* out, const short* in, int in_channels, __m128 gains_lo, __m128 gains_hi)
+		{
+			__m128 lo, hi;
+			if(in_channels == 1) {
+				const __m128i s = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(in));
+				const __m128 v = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(s, s), 16));
+				lo = _mm_unpacklo_ps(v, v);
+				hi = _mm_unpackhi_ps(v, v);
+			} else {
+				const __m128i s = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in));
+				lo = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(s, s), 16));
+				hi = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(s, s), 16));
+			}
+
+			_mm_storeu_ps(out, _mm_add_ps(_mm_loadu_ps(out), _mm_mul_ps(lo, gains_lo)));
+			_mm_storeu_ps(out + 4, _mm_add_ps(_mm_loadu_ps(out + 4), _mm_mul_ps(hi, gains_hi)));
+		}
+#endif
+	}
+
+	void mix_pcm16(float* out, const short* in, int in_channels, int nframes, float left_gain, float right_gain)
+	{
+		int n = 0;
+#ifdef SOUND_MIX_SSE2
+		const __m128 gains = _mm_setr_ps(left_gain*Pcm16Scale, right_gain*Pcm16Scale, left_gain*Pcm16Scale, right_gain*Pcm16Scale);
+		for(; n + 4 <= nframes; n += 4) {
+			mix_pcm16_4frames(out + n*2, in + n*in_channels, in_channels, gains, gains);
+		}
+#endif
+		scalar::mix_pcm16(out + n*2, in + n*in_channels, in_channels, nframes - n, left_gain, right_gain);
+	}
+
+	void mix_pcm16_ramp(float* out, const short* in, int in_channels, int nframes, float left_begin, float right_begin, float left_end, float right_end)
+	{
+		if(nframes <= 0) {
+			return;
+		}
+
+		const float left_delta = (left_end - left_begin)/nframes;
+		const float right_delta = (right_end - right_begin)/nframes;
+
+		int n = 0;
+#ifdef SOUND_MIX_SSE2
+		const __m128 begin = _mm_mul_ps(_mm_setr_ps(left_begin, right_begin, left_begin, right_begin), _mm_set1_ps(Pcm16Scale));
+		const __m128 delta = _mm_mul_ps(_mm_setr_ps(left_delta, right_delta, left_delta, right_delta), _mm_set1_ps(Pcm16Scale));
+		const __m128 four = _mm_set1_ps(4.0f);
+		__m128 frames_lo = _mm_setr_ps(0.0f, 0.0f, 1.0f, 1.0f);
+		__m128 frames_hi = _mm_setr_ps(2.0f, 2.0f, 3.0f, 3.0f);
+		for(; n + 4 <= nframes; n += 4) {
+			const __m128 gains_lo = _mm_add_ps(begin, _mm_mul_ps(delta, frames_lo));
+			const __m128 gains_hi = _mm_add_ps(begin, _mm_mul_ps(delta, frames_hi));
+			mix_pcm16_4frames(out + n*2, in + n*in_channels, in_channels, gains_lo, gains_hi);
+			frames_lo = _mm_add_ps(frames_lo, four);
+			frames_hi = _mm_add_ps(frames_hi, four);
+		}
+#endif
+		scalar::mix_pcm16_ramp(out + n*2, in + n*in_channels, in_channels, nframes - n, left_begin + left_delta*n, right_begin + right_delta*n, left_end, right_end);
+	}
+
+	void mix_float(float* out, const float* in, int nsamples, float gain)
+	{
+		int n = 0;
+#ifdef SOUND_MIX_SSE2
+		const __m128 g = _mm_set1_ps(gain);
+		for(; n + 4 <= nsamples; n += 4) {
+			_mm_storeu_ps(out + n, _mm_add_ps(_mm_loadu_ps(out + n), _mm_mul_ps(_mm_loadu_ps(in + n), g)));
+		}
+#endif
+		scalar::mix_float(out + n, in + n, nsamples - n, gain);
+	}
+
+	void apply_gain_ramp(float* buf, int nsamples, float begin, float end)
+	{
+		if(nsamples <= 0) {
+			return;
+		}
+
+		const float delta = (end - begin)/nsamples;
+
+		int n = 0;
+#ifdef SOUND_MIX_SSE2
+		const __m128 b = _mm_set1_ps(begin);
+		const __m128 d = _mm_set1_ps(delta);
+		const __m128 four = _mm_set1_ps(4.0f);
+		__m128 index = _mm_setr_ps(0.0f, 1.0f, 2.0f, 3.0f);
+		for(; n + 4 <= nsamples; n += 4) {
+			const __m128 gain = _mm_add_ps(b, _mm_mul_ps(d, index));
+			_mm_storeu_ps(buf + n, _mm_mul_ps(_mm_loadu_ps(buf + n), gain));
+			index = _mm_add_ps(index, four);
+		}
+#endif
+		scalar::apply_gain_ramp(buf + n, nsamples - n, begin + delta*n, end);
+	}
+
+	void mix_resample_linear(float* out, int nframes, const float* in, int nin, float step)
+	{
+		if(nin <= 0) {
+			return;
+		}
+
+#ifdef SOUND_MIX_SSE2
+		for(int n = 0; n < nframes; ++n) {
+			const float point = n*step;
+			const int a = std::min<int>(static_cast<int>(point), nin - 1);
+			const int b = std::min<int>(a + 1, nin - 1);
+			const __m128 ratio = _mm_set1_ps(point - std::floor(point));
+			const __m128 from = load_frame(in + a*2);
+			const __m128 to = load_frame(in + b*2);
+			const __m128 v = _mm_add_ps(from, _mm_mul_ps(_mm_sub_ps(to, from), ratio));
+			store_frame(out + n*2, _mm_add_ps(load_frame(out + n*2), v));
+		}
+#else
+		scalar::mix_resample_linear(out, nframes, in, nin, step);
+#endif
+	}
+
+	void mix_biquad(float* out, const float* in, int nframes, const BiquadCoefficients& c, float* z1, float* z2)
+	{
+#ifdef SOUND_MIX_SSE2
+		//The two channels are filtered side by side in one register.
+		const __m128 a0 = _mm_set1_ps(c.a0);
+		const __m128 a1 = _mm_set1_ps(c.a1);
+		const __m128 a2 = _mm_set1_ps(c.a2);
+		const __m128 b1 = _mm_set1_ps(c.b1);
+		const __m128 b2 = _mm_set1_ps(c.b2);
+		__m128 state1 = load_frame(z1);
+		__m128 state2 = load_frame(z2);
+		for(int n = 0; n < nframes; ++n) {
+			const __m128 x = load_frame(in + n*2);
+			const __m128 y = _mm_add_ps(_mm_mul_ps(x, a0), state1);
+			state1 = _mm_sub_ps(_mm_add_ps(_mm_mul_ps(x, a1), state2), _mm_mul_ps(b1, y));
+			state2 = _mm_sub_ps(_mm_mul_ps(x, a2), _mm_mul_ps(b2, y));
+			store_frame(out + n*2, _mm_add_ps(load_frame(out + n*2), y));
+		}
+
+		store_frame(z1, state1);
+		store_frame(z2, state2);
+#else
+		scalar::mix_biquad(out, in, nframes, c, z1, z2);
+#endif
+	}
+}
+
+namespace
+{
+	std::vector<short> random_pcm16(int n)
+	{
+		std::vector<short> res(n);
+		for(short& s : res) {
+			s = static_cast<short>(rand()%65536 - 32768);
+		}
+		return res;
+	}
+
+	std::vector<float> random_floats(int n)
+	{
+		std::vector<float> res(n);
+		for(float& f : res) {
+			f = (rand()%2001 - 1000)/1000.0f;
+		}
+		return res;
+	}
+
+	bool nearly_equal(const std::vector<float>& a, const std::vector<float>& b)
+	{
+		if(a.size() != b.size()) {
+			return false;
+		}
+
+		for(size_t n = 0; n != a.size(); ++n) {
+			if(std::abs(a[n] - b[n]) > 0.0001f) {
+				return false;
+			}
+		}
+		return true;
+	}
+}
+
+//The vectorized functions should agree with the plain ones, including on the
+//frames left over at the end.
+UNIT_TEST(sound_mix_matches_scalar)
+{
+	const int NumFrames = 1023;
+	const std::vector<short> pcm = random_pcm16(NumFrames*2);
+	const std::vector<float> input = random_floats(NumFrames*2);
+	const std::vector<float> start = random_floats(NumFrames*2);
+
+	for(int channels = 1; channels <= 2; ++channels) {
+		std::vector<float> a = start, b = start;
+		sound::mix_pcm16(&a[0], &pcm[0], channels, NumFrames, 0.5f, 0.25f);
+		sound::scalar::mix_pcm16(&b[0], &pcm[0], channels, NumFrames, 0.5f, 0.25f);
+		CHECK_EQ(nearly_equal(a, b), true);
+
+		a = b = start;
+		sound::mix_pcm16_ramp(&a[0], &pcm[0], channels, NumFrames, 1.0f, 0.5f, 0.0f, 0.75f);
+		sound::scalar::mix_pcm16_ramp(&b[0], &pcm[0], channels, NumFrames, 1.0f, 0.5f, 0.0f, 0.75f);
+		CHECK_EQ(nearly_equal(a, b), true);
+	}
+
+	std::vector<float> a = start, b = start;
+	sound::mix_float(&a[0], &input[0], NumFrames*2, 0.3f);
+	sound::scalar::mix_float(&b[0], &input[0], NumFrames*2, 0.3f);
+	CHECK_EQ(nearly_equal(a, b), true);
+
+	a = b = start;
+	sound::apply_gain_ramp(&a[0], NumFrames*2, 1.0f, 0.0f);
+	sound::scalar::apply_gain_ramp(&b[0], NumFrames*2, 1.0f, 0.0f);
+	CHECK_EQ(nearly_equal(a, b), true);
+
+	a = b = start;
+	sound::mix_resample_linear(&a[0], NumFrames, &input[0], NumFrames*2/3, 0.66f);
+	sound::scalar::mix_resample_linear(&b[0], NumFrames, &input[0], NumFrames*2/3, 0.66f);
+	CHECK_EQ(nearly_equal(a, b), true);
+
+	const sound::BiquadCoefficients c = { 0.2f, 0.4f, 0.2f, -0.6f, 0.2f };
+	float z1_a[2] = { 0.1f, -0.1f }, z2_a[2] = { 0.05f, 0.0f };
+	float z1_b[2] = { 0.1f, -0.1f }, z2_b[2] = { 0.05f, 0.0f };
+	a = b = start;
+	sound::mix_biquad(&a[0], &input[0], NumFrames, c, z1_a, z2_a);
+	sound::scalar::mix_biquad(&b[0], &input[0], NumFrames, c, z1_b, z2_b);
+	CHECK_EQ(nearly_equal(a, b), true);
+	CHECK_EQ(std::abs(z1_a[1] - z1_b[1]) < 0.0001f, true);
+}
@@ -0,0 +1,64 @@
+/*
+	Copyright (C) 2003-2014 by David White <davewx7@gmail.com>
+
+	This software is provided 'as-is', without any express or implied
+	warranty. In no event will the authors be held liable for any damages
+	arising from the use of this software.
+
+	Permission is granted to anyone to use this software for any purpose,
+	including commercial applications, and to alter it and redistribute it
+	freely, subject to the following restrictions:
+
+	   1. The origin of this software must not be misrepresented; you must not
+	   claim that you wrote the original software. If you use this software
+	   in a product, an acknowledgement in the product documentation would be
+	   appreciated but is not required.
+
+	   2. Altered source versions must be plainly marked as such, and must not be
+	   misrepresented as being the original software.
+
+	   3. This notice may not be removed or altered from any source
+	   distribution.
+*/
+
+
+#pragma once
+
+//The inner loops of the sound mixer. Buffers of floats are interleaved
+//stereo, and lengths are in frames, a frame being one sample for each
+//channel, unless they say otherwise. Mixing adds to what is already in the
+//output buffer.
+//
+//Where SSE2 is available these work on several samples at once, otherwise
+//they fall back to plain loops, which give the same results up to float
+//rounding.
+namespace sound
+{
+	//Mixes 16-bit samples with in_channels channels, 1 or 2, scaling the left
+	//and right channels by the given gains. Mono input goes to both channels.
+	void mix_pcm16(float* out, const short* in, int in_channels, int nframes, float left_gain, float right_gain);
+
+	//Like mix_pcm16 but the gains change linearly from the begin gains on the
+	//first frame towards the end gains, which would be reached on the frame
+	//after the last.
+	void mix_pcm16_ramp(float* out, const short* in, int in_channels, int nframes, float left_begin, float right_begin, float left_end, float right_end);
+
+	//Mixes nsamples floats scaled by gain.
+	void mix_float(float* out, const float* in, int nsamples, float gain);
+
+	//Scales nsamples floats by a gain changing linearly from begin towards end.
+	void apply_gain_ramp(float* buf, int nsamples, float begin, float end);
+
+	//Mixes in resampled by linear interpolation, so output frame n is taken
+	//from position n*step in the input, which has nin frames.
+	void mix_resample_linear(float* out, int nframes, const float* in, int nin, float step);
+
+	struct BiquadCoefficients
+	{
+		float a0, a1, a2, b1, b2;
+	};
+
+	//Mixes in after running it through a biquad filter. z1 and z2 are the
+	//filter's state for each of the two channels and are updated.
+	void mix_biquad(float* out, const float* in, int nframes, const BiquadCoefficients& c, float* z1, float* z2);
+}
@@ -40,10 +40,17 @@ namespace graphics
 			int64_t mod_time;
 		};
 
+		PREF_INT(surface_cache_max_mb, 0, "Megabytes of surfaces to keep cached before evicting the least recently used. 0 means no limit.");
+
+		size_t surface_bytes(const std::string& key, const CacheEntry& entry)
+		{
+			return entry.surf ? static_cast<size_t>(entry.surf->rowPitch())*entry.surf->height() : 0;
+		}
+
 		typedef ConcurrentCache<std::string,CacheEntry> SurfaceMap;
 		SurfaceMap& cache()
 		{
-			static SurfaceMap res;
+			static SurfaceMap res("surfaces", static_cast<size_t>(g_surface_cache_max_mb)*1024*1024, surface_bytes);
 			return res;
 		}
 
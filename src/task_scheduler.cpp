@@ -0,0 +1,683 @@
+/*
+	Copyright (C) 2003-2014 by David White <davewx7@gmail.com>
+
+	This software is provided 'as-is', without any express or implied
+	warranty. In no event will the authors be held liable for any damages
+	arising from the use of this software.
+
+	Permission is granted to anyone to use this software for any purpose,
+	including commercial applications, and to alter it and redistribute it
+	freely, subject to the following restrictions:
+
+	   1. The origin of this software must not be misrepresented; you must not
+	   claim that you wrote the original software. If you use this software
+	   in a product, an acknowledgement in the product documentation would be
+	   appreciated but is not required.
+
+	   2. Altered source versions must be plainly marked as such, and must not be
+	   misrepresented as being the original software.
+
+	   3. This notice may not be removed or altered from any source
+	   distribution.
+*/
+
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <thread>
+
+#include "asserts.hpp"
+#include "formula_garbage_collector.hpp"
+#include "preferences.hpp"
+#include "task_scheduler.hpp"
+#include "thread.hpp"
+#include "unit_test.hpp"
+#include "variant.hpp"
+
+PREF_INT(task_scheduler_threads, 0, "Number of worker threads the task scheduler uses. 0 uses one fewer than the number of cores.");
+
+namespace task_scheduler
+{
+	namespace
+	{
+		const int NumPriorities = 3;
+
+		//index of the worker the current thread is, or -1.
+		thread_local int t_worker_index = -1;
+
+		uint64_t get_time_ns()
+		{
+			return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+		}
+
+		//keeps the formula state of a thread which runs tasks for as long
+		//as the thread runs them.
+		struct VariantThreadRegistration
+		{
+			VariantThreadRegistration() { variant::registerThread(); }
+			~VariantThreadRegistration() { variant::unregisterThread(); }
+		};
+	}
+
+	class Scheduler
+	{
+	public:
+		static Scheduler& get();
+
+		Scheduler();
+
+		TaskPtr submit(std::function<void()> job, const TaskOptions& options);
+		void wait(const TaskPtr& task);
+		bool cancel(const TaskPtr& task);
+
+		void runOnMainThread(std::function<void()> fn);
+		void pump();
+
+		int numWorkers() const { return static_cast<int>(workers_.size()); }
+		std::vector<WorkerStats> getWorkerStats() const;
+
+		void shutdown();
+
+	private:
+		struct Worker
+		{
+			Worker() : busy_ns(0), tasks_run(0), tasks_stolen(0) {}
+			std::mutex mutex;
+			std::deque<TaskPtr> queues[NumPriorities];
+			std::atomic<uint64_t> busy_ns, tasks_run, tasks_stolen;
+			std::unique_ptr<threading::thread> thread;
+		};
+
+		struct BlockingThread
+		{
+			TaskPtr task;
+			std::shared_ptr<threading::thread> thread;
+		};
+
+		void workerLoop(int index);
+
+		//called when all of a task's dependencies are done.
+		void makeReady(const TaskPtr& task);
+		void enqueue(const TaskPtr& task);
+		bool findTask(int index, TaskPtr* result, bool* stolen);
+		//removes the given task from whichever queue it's in.
+		bool takeTask(const TaskPtr& task);
+		void runTask(const TaskPtr& task, int index, bool stolen);
+		void finish(const TaskPtr& task, Task::STATE state);
+
+		std::vector<std::unique_ptr<Worker>> workers_;
+
+		std::mutex shared_mutex_;
+		std::deque<TaskPtr> shared_queues_[NumPriorities];
+
+		//number of tasks in all queues. Workers sleep when it's zero.
+		std::atomic<int> queued_;
+		std::mutex idle_mutex_;
+		std::condition_variable idle_cond_;
+
+		//signalled whenever a task finishes.
+		std::mutex finished_mutex_;
+		std::condition_variable finished_cond_;
+
+		//tasks submitted and not yet done.
+		std::atomic<int> outstanding_;
+
+		std::mutex main_thread_mutex_;
+		std::vector<std::function<void()>> main_thread_queue_;
+
+		std::mutex blocking_mutex_;
+		std::vector<BlockingThread> blocking_threads_;
+
+		std::atomic<bool> quit_;
+	};
+
+	TaskOptions::TaskOptions() : priority(PRIORITY::NORMAL), blocking(false), allocates_collectible_objects(false)
+	{
+	}
+
+	Task::Task(std::function<void()> job, const TaskOptions& options)
+	  : job_(job), on_complete_(options.on_complete), priority_(options.priority),
+	    blocking_(options.blocking), allocates_collectible_objects_(options.allocates_collectible_objects),
+	    state_(static_cast<int>(STATE::WAITING)), dependencies_remaining_(0)
+	{
+	}
+
+	bool Task::cancel()
+	{
+		return Scheduler::get().cancel(shared_from_this());
+	}
+
+	Scheduler& Scheduler::get()
+	{
+		//never destroyed, so tasks may still be finishing during exit.
+		static Scheduler* instance = new Scheduler;
+		return *instance;
+	}
+
+	Scheduler::Scheduler() : queued_(0), outstanding_(0), quit_(false)
+	{
+		int nworkers = g_task_scheduler_threads;
+		if(nworkers <= 0) {
+			nworkers = std::max<int>(1, static_cast<int>(std::thread::hardware_concurrency()) - 1);
+		}
+
+		for(int n = 0; n != nworkers; ++n) {
+			workers_.emplace_back(new Worker);
+		}
+
+		for(int n = 0; n != nworkers; ++n) {
+			workers_[n]->thread.reset(new threading::thread("task_worker", std::bind(&Scheduler::workerLoop, this, n)));
+		}
+	}
+
+	TaskPtr Scheduler::submit(std::function<void()> job, const TaskOptions& options)
+	{
+		TaskPtr task(new Task(job, options));
+		++outstanding_;
+
+		if(task->allocates_collectible_objects_) {
+			GarbageCollectible::incrementWorkerThreads();
+		}
+
+		//hold an extra count while registering with the dependencies, so
+		//they can't make the task ready until we're done.
+		task->dependencies_remaining_ = 1;
+		bool dependency_cancelled = false;
+		for(const TaskPtr& dep : options.dependencies) {
+			std::lock_guard<std::mutex> lock(dep->mutex_);
+			if(dep->done()) {
+				dependency_cancelled = dependency_cancelled || dep->state() == Task::STATE::CANCELLED;
+				continue;
+			}
+
+			++task->dependencies_remaining_;
+			dep->dependents_.push_back(task);
+		}
+
+		if(dependency_cancelled) {
+			cancel(task);
+		}
+
+		if(--task->dependencies_remaining_ == 0) {
+			makeReady(task);
+		}
+
+		return task;
+	}
+
+	void Scheduler::makeReady(const TaskPtr& task)
+	{
+		int expected = static_cast<int>(Task::STATE::WAITING);
+		if(task->state_.compare_exchange_strong(expected, static_cast<int>(Task::STATE::QUEUED)) == false) {
+			//it was cancelled.
+			return;
+		}
+
+		if(task->blocking_) {
+			std::function<void()> fn = [this, task]() {
+				VariantThreadRegistration registration;
+				runTask(task, -1, false);
+			};
+			BlockingThread blocking = { task, std::make_shared<threading::thread>("blocking_task", fn) };
+			std::lock_guard<std::mutex> lock(blocking_mutex_);
+			blocking_threads_.push_back(blocking);
+			return;
+		}
+
+		enqueue(task);
+	}
+
+	void Scheduler::enqueue(const TaskPtr& task)
+	{
+		const int priority = static_cast<int>(task->priority_);
+		const int index = t_worker_index;
+		if(index >= 0 && index < numWorkers()) {
+			Worker& worker = *workers_[index];
+			std::lock_guard<std::mutex> lock(worker.mutex);
+			worker.queues[priority].push_back(task);
+		} else {
+			std::lock_guard<std::mutex> lock(shared_mutex_);
+			shared_queues_[priority].push_back(task);
+		}
+
+		++queued_;
+
+		{
+			std::lock_guard<std::mutex> lock(idle_mutex_);
+		}
+
+		idle_cond_.notify_one();
+	}
+
+	bool Scheduler::findTask(int index, TaskPtr* result, bool* stolen)
+	{
+		if(queued_ <= 0) {
+			return false;
+		}
+
+		const int nworkers = numWorkers();
+		for(int priority = 0; priority != NumPriorities; ++priority) {
+			*stolen = false;
+
+			//our own newest task, whose data is most likely still in cache.
+			if(index >= 0) {
+				Worker& worker = *workers_[index];
+				std::lock_guard<std::mutex> lock(worker.mutex);
+				std::deque<TaskPtr>& q = worker.queues[priority];
+				if(q.empty() == false) {
+					*result = q.back();
+					q.pop_back();
+					--queued_;
+					return true;
+				}
+			}
+
+			{
+				std::lock_guard<std::mutex> lock(shared_mutex_);
+				std::deque<TaskPtr>& q = shared_queues_[priority];
+				if(q.empty() == false) {
+					*result = q.front();
+					q.pop_front();
+					--queued_;
+					return true;
+				}
+			}
+
+			//steal the oldest task from another worker.
+			*stolen = true;
+			for(int n = 1; n <= nworkers; ++n) {
+				const int victim = (std::max(index, 0) + n)%nworkers;
+				if(victim == index) {
+					continue;
+				}
+
+				Worker& worker = *workers_[victim];
+				std::lock_guard<std::mutex> lock(worker.mutex);
+				std::deque<TaskPtr>& q = worker.queues[priority];
+				if(q.empty() == false) {
+					*result = q.front();
+					q.pop_front();
+					--queued_;
+					return true;
+				}
+			}
+		}
+
+		return false;
+	}
+
+	bool Scheduler::takeTask(const TaskPtr& task)
+	{
+		if(task->state() != Task::STATE::QUEUED || task->blocking_) {
+			return false;
+		}
+
+		auto take = [this, &task](std::deque<TaskPtr>& q) {
+			auto itor = std::find(q.begin(), q.end(), task);
+			if(itor == q.end()) {
+				return false;
+			}
+
+			q.erase(itor);
+			--queued_;
+			return true;
+		};
+
+		const int priority = static_cast<int>(task->priority_);
+		{
+			std::lock_guard<std::mutex> lock(shared_mutex_);
+			if(take(shared_queues_[priority])) {
+				return true;
+			}
+		}
+
+		for(auto& worker : workers_) {
+			std::lock_guard<std::mutex> lock(worker->mutex);
+			if(take(worker->queues[priority])) {
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+	void Scheduler::runTask(const TaskPtr& task, int index, bool stolen)
+	{
+		int expected = static_cast<int>(Task::STATE::QUEUED);
+		if(task->state_.compare_exchange_strong(expected, static_cast<int>(Task::STATE::RUNNING)) == false) {
+			//cancelled while it was queued; cancel() has already finished it.
+			return;
+		}
+
+		const uint64_t begin = get_time_ns();
+		task->job_();
+
+		if(index >= 0) {
+			Worker& worker = *workers_[index];
+			worker.busy_ns += get_time_ns() - begin;
+			worker.tasks_run++;
+			if(stolen) {
+				worker.tasks_stolen++;
+			}
+		}
+
+		finish(task, Task::STATE::FINISHED);
+	}
+
+	bool Scheduler::cancel(const TaskPtr& task)
+	{
+		int expected = static_cast<int>(Task::STATE::WAITING);
+		if(task->state_.compare_exchange_strong(expected, static_cast<int>(Task::STATE::CANCELLED)) == false) {
+			expected = static_cast<int>(Task::STATE::QUEUED);
+			if(task->state_.compare_exchange_strong(expected, static_cast<int>(Task::STATE::CANCELLED)) == false) {
+				return false;
+			}
+		}
+
+		finish(task, Task::STATE::CANCELLED);
+		return true;
+	}
+
+	void Scheduler::finish(const TaskPtr& task, Task::STATE state)
+	{
+		std::vector<TaskPtr> dependents;
+		{
+			std::lock_guard<std::mutex> lock(task->mutex_);
+			task->state_ = static_cast<int>(state);
+			dependents.swap(task->dependents_);
+		}
+
+		for(const TaskPtr& dependent : dependents) {
+			if(state == Task::STATE::CANCELLED) {
+				cancel(dependent);
+			}
+
+			if(--dependent->dependencies_remaining_ == 0) {
+				makeReady(dependent);
+			}
+		}
+
+		if(state == Task::STATE::FINISHED && task->on_complete_) {
+			runOnMainThread(task->on_complete_);
+		}
+
+		if(task->allocates_collectible_objects_) {
+			runOnMainThread(GarbageCollectible::decrementWorkerThreads);
+		}
+
+		task->job_ = std::function<void()>();
+
+		--outstanding_;
+
+		{
+			std::lock_guard<std::mutex> lock(finished_mutex_);
+		}
+
+		finished_cond_.notify_all();
+	}
+
+	void Scheduler::wait(const TaskPtr& task)
+	{
+		const int index = t_worker_index;
+		while(task->done() == false) {
+			if(index < 0) {
+				//the main thread only runs the task it's waiting for, so it
+				//can't be held up by, or run into, unrelated work.
+				if(takeTask(task)) {
+					runTask(task, index, false);
+					continue;
+				}
+			} else {
+				TaskPtr other;
+				bool stolen = false;
+				if(findTask(index, &other, &stolen)) {
+					runTask(other, index, stolen);
+					continue;
+				}
+			}
+
+			std::unique_lock<std::mutex> lock(finished_mutex_);
+			finished_cond_.wait_for(lock, std::chrono::milliseconds(1), [&task]() { return task->done(); });
+		}
+	}
+
+	void Scheduler::workerLoop(int index)
+	{
+		t_worker_index = index;
+
+		//tasks may evaluate formulas, which keep per-thread state.
+		VariantThreadRegistration registration;
+
+		while(!quit_) {
+			TaskPtr task;
+			bool stolen = false;
+			if(findTask(index, &task, &stolen)) {
+				runTask(task, index, stolen);
+				continue;
+			}
+
+			std::unique_lock<std::mutex> lock(idle_mutex_);
+			idle_cond_.wait_for(lock, std::chrono::milliseconds(50), [this]() { return quit_ || queued_ > 0; });
+		}
+	}
+
+	void Scheduler::runOnMainThread(std::function<void()> fn)
+	{
+		std::lock_guard<std::mutex> lock(main_thread_mutex_);
+		main_thread_queue_.push_back(fn);
+	}
+
+	void Scheduler::pump()
+	{
+		std::vector<std::function<void()>> fns;
+		{
+			std::lock_guard<std::mutex> lock(main_thread_mutex_);
+			fns.swap(main_thread_queue_);
+		}
+
+		for(const std::function<void()>& fn : fns) {
+			fn();
+		}
+
+		//join the threads of blocking tasks which are done, outside the lock.
+		std::vector<BlockingThread> finished;
+		{
+			std::lock_guard<std::mutex> lock(blocking_mutex_);
+			auto itor = std::partition(blocking_threads_.begin(), blocking_threads_.end(), [](const BlockingThread& t) { return !t.task->done(); });
+			finished.assign(itor, blocking_threads_.end());
+			blocking_threads_.erase(itor, blocking_threads_.end());
+		}
+	}
+
+	std::vector<WorkerStats> Scheduler::getWorkerStats() const
+	{
+		std::vector<WorkerStats> result;
+		for(const auto& worker : workers_) {
+			WorkerStats stats = { worker->busy_ns, worker->tasks_run, worker->tasks_stolen };
+			result.push_back(stats);
+		}
+
+		return result;
+	}
+
+	void Scheduler::shutdown()
+	{
+		while(outstanding_ > 0) {
+			pump();
+			std::unique_lock<std::mutex> lock(finished_mutex_);
+			finished_cond_.wait_for(lock, std::chrono::milliseconds(1));
+		}
+
+		pump();
+
+		quit_ = true;
+		{
+			std::lock_guard<std::mutex> lock(idle_mutex_);
+		}
+
+		idle_cond_.notify_all();
+		for(auto& worker : workers_) {
+			worker->thread.reset();
+		}
+	}
+
+	TaskPtr submit(std::function<void()> job, PRIORITY priority)
+	{
+		TaskOptions options;
+		options.priority = priority;
+		return Scheduler::get().submit(job, options);
+	}
+
+	TaskPtr submit(std::function<void()> job, const TaskOptions& options)
+	{
+		return Scheduler::get().submit(job, options);
+	}
+
+	void wait(const TaskPtr& task)
+	{
+		Scheduler::get().wait(task);
+	}
+
+	void wait(const std::vector<TaskPtr>& tasks)
+	{
+		for(const TaskPtr& task : tasks) {
+			Scheduler::get().wait(task);
+		}
+	}
+
+	void runOnMainThread(std::function<void()> fn)
+	{
+		Scheduler::get().runOnMainThread(fn);
+	}
+
+	void pump()
+	{
+		Scheduler::get().pump();
+	}
+
+	int numWorkers()
+	{
+		return Scheduler::get().numWorkers();
+	}
+
+	std::vector<WorkerStats> getWorkerStats()
+	{
+		return Scheduler::get().getWorkerStats();
+	}
+
+	manager::manager()
+	{
+		Scheduler::get();
+	}
+
+	manager::~manager()
+	{
+		Scheduler::get().shutdown();
+	}
+}
+
+UNIT_TEST(task_scheduler_dependencies)
+{
+	using namespace task_scheduler;
+
+	std::atomic<int> counter(0);
+	std::vector<TaskPtr> first;
+	for(int n = 0; n != 16; ++n) {
+		first.push_back(submit([&counter]() { ++counter; }));
+	}
+
+	//runs only once all the first tasks are done.
+	int seen = -1;
+	TaskOptions options;
+	options.dependencies = first;
+	TaskPtr last = submit([&counter, &seen]() { seen = counter; }, options);
+
+	wait(last);
+	CHECK_EQ(seen, 16);
+	CHECK(last->state() == Task::STATE::FINISHED, "task didn't finish");
+}
+
+UNIT_TEST(task_scheduler_cancel)
+{
+	using namespace task_scheduler;
+
+	std::mutex mutex;
+	mutex.lock();
+
+	//holds up the dependent tasks until we've cancelled them.
+	TaskPtr blocker = submit([&mutex]() { std::lock_guard<std::mutex> lock(mutex); });
+
+	bool ran = false;
+	TaskOptions options;
+	options.dependencies.push_back(blocker);
+	TaskPtr cancelled = submit([&ran]() { ran = true; }, options);
+
+	options.dependencies.clear();
+	options.dependencies.push_back(cancelled);
+	TaskPtr dependent = submit([&ran]() { ran = true; }, options);
+
+	CHECK(cancelled->cancel(), "could not cancel a waiting task");
+	mutex.unlock();
+
+	wait(blocker);
+	wait(dependent);
+	CHECK(!ran, "a cancelled task ran");
+	CHECK(dependent->state() == Task::STATE::CANCELLED, "dependent of a cancelled task wasn't cancelled");
+	CHECK(!blocker->cancel(), "cancelled a finished task");
+}
+
+UNIT_TEST(task_scheduler_main_thread_continuation)
+{
+	using namespace task_scheduler;
+
+	bool completed = false;
+	TaskOptions options;
+	options.on_complete = [&completed]() { completed = true; };
+	TaskPtr task = submit([]() {}, options);
+	wait(task);
+
+	pump();
+	CHECK(completed, "on_complete wasn't called from pump()");
+}
+
+UNIT_TEST(task_scheduler_nested_wait)
+{
+	using namespace task_scheduler;
+
+	//tasks waiting on the tasks they spawn mustn't deadlock, even with
+	//more of them than there are workers.
+	std::atomic<int> counter(0);
+	std::vector<TaskPtr> outer;
+	for(int n = 0; n != numWorkers()*4; ++n) {
+		outer.push_back(submit([&counter]() {
+			std::vector<TaskPtr> inner;
+			for(int m = 0; m != 8; ++m) {
+				inner.push_back(submit([&counter]() { ++counter; }));
+			}
+
+			wait(inner);
+		}));
+	}
+
+	wait(outer);
+	CHECK_EQ(counter.load(), numWorkers()*4*8);
+}
+
+BENCHMARK_ARG(task_scheduler_fan_out, int ntasks)
+{
+	std::atomic<int> counter(0);
+	BENCHMARK_LOOP {
+		std::vector<task_scheduler::TaskPtr> tasks;
+		tasks.reserve(ntasks);
+		for(int n = 0; n != ntasks; ++n) {
+			tasks.push_back(task_scheduler::submit([&counter]() { ++counter; }));
+		}
+
+		task_scheduler::wait(tasks);
+	}
+}
+
+BENCHMARK_ARG_CALL(task_scheduler_fan_out, fan_out_100, 100);
+BENCHMARK_ARG_CALL(task_scheduler_fan_out, fan_out_10000, 10000);
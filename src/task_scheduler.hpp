@@ -0,0 +1,139 @@
+/*
+	Copyright (C) 2003-2014 by David White <davewx7@gmail.com>
+
+	This software is provided 'as-is', without any express or implied
+	warranty. In no event will the authors be held liable for any damages
+	arising from the use of this software.
+
+	Permission is granted to anyone to use this software for any purpose,
+	including commercial applications, and to alter it and redistribute it
+	freely, subject to the following restrictions:
+
+	   1. The origin of this software must not be misrepresented; you must not
+	   claim that you wrote the original software. If you use this software
+	   in a product, an acknowledgement in the product documentation would be
+	   appreciated but is not required.
+
+	   2. Altered source versions must be plainly marked as such, and must not be
+	   misrepresented as being the original software.
+
+	   3. This notice may not be removed or altered from any source
+	   distribution.
+*/
+
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+//An engine-wide pool of worker threads which run tasks.
+//
+//Each worker has its own queues which it takes tasks from newest first,
+//and when they're empty it takes the oldest tasks from other workers'
+//queues. Tasks submitted from threads which aren't workers go in a shared
+//queue. Higher priority tasks are always taken first.
+namespace task_scheduler
+{
+	enum class PRIORITY { HIGH, NORMAL, LOW };
+
+	class Task;
+	typedef std::shared_ptr<Task> TaskPtr;
+
+	struct TaskOptions
+	{
+		TaskOptions();
+
+		PRIORITY priority;
+
+		//the task won't start until all of these have finished. If any of
+		//them is cancelled then so is this task.
+		std::vector<TaskPtr> dependencies;
+
+		//called from pump() on the main thread once the task has finished.
+		//It's not called if the task is cancelled.
+		std::function<void()> on_complete;
+
+		//the task may block for a long time, e.g. waiting on a process or
+		//the network, so it gets its own thread rather than a worker.
+		bool blocking;
+
+		//the task creates GarbageCollectible objects. Such tasks must be
+		//submitted from the main thread, or from another task which
+		//creates GarbageCollectible objects.
+		bool allocates_collectible_objects;
+	};
+
+	class Task : public std::enable_shared_from_this<Task>
+	{
+	public:
+		enum class STATE { WAITING, QUEUED, RUNNING, FINISHED, CANCELLED };
+
+		STATE state() const { return static_cast<STATE>(state_.load()); }
+
+		//true once the task has run or been cancelled.
+		bool done() const { const STATE s = state(); return s == STATE::FINISHED || s == STATE::CANCELLED; }
+
+		//stops the task, and any tasks which depend on it, from running if
+		//it hasn't started yet. Returns true if it was cancelled.
+		bool cancel();
+
+	private:
+		friend class Scheduler;
+
+		Task(std::function<void()> job, const TaskOptions& options);
+		Task(const Task&);
+		void operator=(const Task&);
+
+		std::function<void()> job_;
+		std::function<void()> on_complete_;
+		PRIORITY priority_;
+		bool blocking_;
+		bool allocates_collectible_objects_;
+
+		std::atomic<int> state_;
+		std::atomic<int> dependencies_remaining_;
+
+		//guards dependents_.
+		std::mutex mutex_;
+		std::vector<TaskPtr> dependents_;
+	};
+
+	TaskPtr submit(std::function<void()> job, PRIORITY priority=PRIORITY::NORMAL);
+	TaskPtr submit(std::function<void()> job, const TaskOptions& options);
+
+	//blocks until the task is done. While waiting, a worker thread runs
+	//other queued tasks, but any other thread only runs the awaited tasks
+	//themselves, if no worker has started them yet.
+	void wait(const TaskPtr& task);
+	void wait(const std::vector<TaskPtr>& tasks);
+
+	//queues fn to be called from pump().
+	void runOnMainThread(std::function<void()> fn);
+
+	//should be called regularly from the main thread.
+	void pump();
+
+	int numWorkers();
+
+	struct WorkerStats
+	{
+		uint64_t busy_ns;
+		uint64_t tasks_run;
+		uint64_t tasks_stolen;
+	};
+
+	//totals for each worker since it started.
+	std::vector<WorkerStats> getWorkerStats();
+
+	//waits for outstanding tasks and stops the workers when destroyed.
+	struct manager
+	{
+		manager();
+		~manager();
+	};
+}
@@ -33,13 +33,13 @@
 #endif
 
 #include "asserts.hpp"
-#include "background_task_pool.hpp"
 #include "formatter.hpp"
 #include "json_parser.hpp"
 #include "module.hpp"
 #include "preferences.hpp"
 #include "shared_memory_pipe.hpp"
 #include "string_utils.hpp"
+#include "task_scheduler.hpp"
 #include "tbs_internal_server.hpp"
 #include "uuid.hpp"
 #include "variant_utils.hpp"
@@ -247,7 +247,15 @@ void terminate_utility_process(bool* complete=nullptr)
 	std::string named_semaphore = g_termination_semaphore_name;
 	boost::interprocess::named_semaphore* sem = g_termination_semaphore;
 
-	background_task_pool::submit([=]() {
+	task_scheduler::TaskOptions options;
+	options.blocking = true;
+	options.on_complete = [=]() {
+		if(complete != nullptr) {
+			*complete = true;
+		}
+	};
+
+	task_scheduler::submit([=]() {
 		WaitForSingleObject(local_child_process, INFINITE);
 		CloseHandle(local_child_process);
 		CloseHandle(local_child_thread);
@@ -259,13 +267,7 @@ void terminate_utility_process(bool* complete=nullptr)
 
 		boost::interprocess::named_semaphore::remove(named_semaphore.c_str());
 		delete sem;
-	},
-
-	[=]() {
-		if(complete != nullptr) {
-			*complete = true;
-		}
-	});
+	}, options);
 
 #else
 	if(!g_child_pid) {
@@ -279,7 +281,15 @@ void terminate_utility_process(bool* complete=nullptr)
 	std::string named_semaphore = g_termination_semaphore_name;
 	boost::interprocess::named_semaphore* sem = g_termination_semaphore;
 
-	background_task_pool::submit([=]() {
+	task_scheduler::TaskOptions options;
+	options.blocking = true;
+	options.on_complete = [=]() {
+		if(complete != nullptr) {
+			*complete = true;
+		}
+	};
+
+	task_scheduler::submit([=]() {
 		int status;
 		if(waitpid(child_pid, &status, 0) != child_pid) {
 			std::cerr << "Error waiting for child process to finish: " << errno << std::endl;
@@ -289,13 +299,7 @@ void terminate_utility_process(bool* complete=nullptr)
 
 		boost::interprocess::named_semaphore::remove(named_semaphore.c_str());
 		delete sem;
-	},
-
-	[=]() {
-		if(complete != nullptr) {
-			*complete = true;
-		}
-	});
+	}, options);
 
 	g_child_pid = 0;
 #endif
@@ -438,7 +442,7 @@ void terminate_utility_process(bool* complete=nullptr)
 			bool complete = false;
 			terminate_utility_process(&complete);
 			while(!complete) {
-				background_task_pool::pump();
+				task_scheduler::pump();
 				SDL_Delay(1);
 			}
 		}
@@ -25,8 +25,10 @@
 #include <cmath>
 #include <iostream>
 #include <limits>
+#include <random>
 #include <sstream>
 #include <set>
+#include <tuple>
 
 #include "asserts.hpp"
 #include "formatter.hpp"
@@ -44,6 +46,7 @@
 #include "string_utils.hpp"
 #include "thread.hpp"
 #include "tile_map.hpp"
+#include "unit_test.hpp"
 #include "variant_utils.hpp"
 
 namespace
@@ -430,7 +433,6 @@ TileMap::TileMap() : xpos_(0), ypos_(0), x_speed_(100), y_speed_(100), zorder_(0
 
 	//make an entry for the empty string.
 	pattern_index_.push_back(PatternIndexEntry());
-	pattern_index_.back().matching_patterns.push_back(&get_regex_from_pool(""));
 }
 
 TileMap::TileMap(variant node)
@@ -460,7 +462,6 @@ TileMap::TileMap(variant node)
 
 	//make an entry for the empty string.
 	pattern_index_.push_back(PatternIndexEntry());
-	pattern_index_.back().matching_patterns.push_back(&get_regex_from_pool(""));
 
 	{
 	const std::string& tiles_str = node["tiles"].as_string();
@@ -544,14 +545,12 @@ TileMap::~TileMap()
 
 void TileMap::buildPatterns()
 {
-	std::vector<const boost::regex*> all_regexes;
-
 	patterns_version_ = current_patterns_version;
-	const unsigned begin_time = profile::get_tick_time();
+	multi_pattern_matches_.reset();
 	patterns_.clear();
+	multi_patterns_.clear();
 	for(const TilePattern& p : patterns) {
 		std::vector<const boost::regex*> re;
-		std::vector<const boost::regex*> accepted_re;
 		if(!p.current_tile_pattern->empty()) {
 			re.push_back(p.current_tile_pattern);
 		}
@@ -564,7 +563,6 @@ void TileMap::buildPatterns()
 		for(PatternIndexEntry& e : pattern_index_) {
 			for(const boost::regex*& regex : re) {
 				if(regex && match_regex(e.str, regex)) {
-					accepted_re.push_back(regex);
 					regex = nullptr;
 					++matches;
 					if(matches == re.size()) {
@@ -579,14 +577,12 @@ void TileMap::buildPatterns()
 		}
 
 		if(matches == re.size()) {
-			all_regexes.insert(all_regexes.end(), accepted_re.begin(), accepted_re.end());
 			patterns_.push_back(&p);
 		}
 	}
 
 	for(const MultiTilePattern& p : MultiTilePattern::getAll()) {
 		std::vector<const boost::regex*> re;
-		std::vector<const boost::regex*> accepted_re;
 
 		re.reserve(p.width()*p.height());
 		for(int x = 0; x < p.width(); ++x) {
@@ -599,7 +595,6 @@ void TileMap::buildPatterns()
 		for(PatternIndexEntry& e : pattern_index_) {
 			for(const boost::regex*& regex : re) {
 				if(regex && match_regex(e.str, regex)) {
-					accepted_re.push_back(regex);
 					regex = nullptr;
 					++matches;
 					if(matches == re.size()) {
@@ -614,27 +609,59 @@ void TileMap::buildPatterns()
 		}
 
 		if(matches == re.size()) {
-			all_regexes.insert(all_regexes.end(), accepted_re.begin(), accepted_re.end());
 			multi_patterns_.push_back(&p);
 		}
 	}
 
-	std::sort(all_regexes.begin(), all_regexes.end());
-	all_regexes.erase(std::unique(all_regexes.begin(), all_regexes.end()), all_regexes.end());
+	//give each regex the accepted patterns use a dense id, and replace
+	//the regexes in the patterns with them.
+	std::map<const boost::regex*, int> regex_ids;
+	auto get_regex_id = [&regex_ids](const boost::regex* re) {
+		return regex_ids.insert(std::pair<const boost::regex*, int>(re, static_cast<int>(regex_ids.size()))).first->second;
+	};
 
-	for(PatternIndexEntry& e : pattern_index_) {
-		e.matching_patterns.clear();
+	compiled_patterns_.clear();
+	for(const TilePattern* p : patterns_) {
+		CompiledPattern compiled;
+		compiled.pattern = p;
+		for(const TilePattern::SurroundingTile& t : p->surrounding_tiles) {
+			CompiledNeighbour neighbour = { t.xoffset, t.yoffset, get_regex_id(t.pattern) };
+			compiled.neighbours.push_back(neighbour);
+		}
 
-		for(const boost::regex* re : all_regexes) {
-			if(match_regex(e.str, re)) {
-				e.matching_patterns.push_back(re);
+		compiled_patterns_.push_back(compiled);
+	}
+
+	multi_pattern_re_ids_.clear();
+	for(const MultiTilePattern* p : multi_patterns_) {
+		std::vector<int> ids(p->width()*p->height());
+		for(int x = 0; x < p->width(); ++x) {
+			for(int y = 0; y < p->height(); ++y) {
+				ids[y*p->width() + x] = get_regex_id(p->getTileAt(x, y).re);
 			}
 		}
+
+		multi_pattern_re_ids_.push_back(ids);
 	}
 
-	const unsigned end_time = profile::get_tick_time();
-	static unsigned total_time = 0;
-	total_time += (end_time - begin_time);
+	//then evaluate every regex once against each string in the map.
+	const size_t nwords = (regex_ids.size() + 63)/64;
+	for(PatternIndexEntry& e : pattern_index_) {
+		e.match_bits.assign(std::max<size_t>(1, nwords), 0);
+		for(const auto& re : regex_ids) {
+			if(match_regex(e.str, re.first)) {
+				e.match_bits[re.second >> 6] |= uint64_t(1) << (re.second&63);
+			}
+		}
+
+		e.candidates.clear();
+		for(int n = 0; n != static_cast<int>(compiled_patterns_.size()); ++n) {
+			const boost::regex* re = compiled_patterns_[n].pattern->current_tile_pattern;
+			if(re->empty() || match_regex(e.str, re)) {
+				e.candidates.push_back(n);
+			}
+		}
+	}
 }
 
 const std::vector<const TilePattern*>& TileMap::getPatterns() const
@@ -747,29 +774,14 @@ const TileMap::PatternIndexEntry& TileMap::getTileEntry(int y, int x) const
 	return pattern_index_[map_[y][x]];
 }
 
-namespace
-{
-	struct cstr_less
-	{
-		bool operator()(const char* a, const char* b) const {
-			return strcmp(a, b) < 0;
-		}
-	};
-
-	typedef std::map<const char*, std::vector<const TilePattern*>, cstr_less> TilePatternCacheMap;
-	struct TilePatternCache
-	{
-		TilePatternCacheMap cache;
-	};
-}
-
 int TileMap::getVariations(int x, int y) const
 {
+	getPatterns();
+
 	x -= xpos_/TileSize;
 	y -= ypos_/TileSize;
-	TilePatternCache cache;
 	bool face_right = false;
-	const TilePattern* p = getMatchingPattern(x, y, cache, &face_right);
+	const TilePattern* p = getMatchingPattern(x, y, &face_right);
 	if(p == nullptr) {
 		return 0;
 	}
@@ -822,6 +834,30 @@ void TileMap::prepareForCopyToWorkerThread()
 #ifndef NO_EDITOR
 	node_ = variant();
 #endif
+
+	//compile the patterns now so threads sharing this map only read it.
+	getPatterns();
+}
+
+std::vector<rect> TileMap::getBuildBands(int rows_per_band) const
+{
+	std::vector<rect> result;
+
+	//wide enough to cover every column buildTiles() visits.
+	const int x = xpos_ - (1 << 24);
+	const int w = 1 << 25;
+
+	const int begin = -g_tile_pattern_search_border;
+	const int end = static_cast<int>(map_.size()) + g_tile_pattern_search_border;
+	for(int y = begin; y < end; y += rows_per_band) {
+		const int nrows = std::min(rows_per_band, end - y);
+
+		//buildTiles() includes tiles on the bottom edge, so stop a pixel
+		//short of the next band.
+		result.emplace_back(x, ypos_ + y*TileSize, w, nrows*TileSize - 1);
+	}
+
+	return result;
 }
 
 namespace
@@ -833,6 +869,12 @@ namespace
 	//i.e. any change in the input results in a completely different output.
 	//
 	//The function returns a number in the range [0,99].
+	//rounds n/TileSize towards negative infinity.
+	int tile_floor_div(int n)
+	{
+		return n >= 0 ? n/TileSize : -((-n + TileSize - 1)/TileSize);
+	}
+
 	int random_hash(int x, int y, int z, int n)
 	{
 		//The implementation is simply four arrays of hard coded random numbers.
@@ -854,7 +896,7 @@ namespace
 }
 
 void TileMap::applyMatchingMultiPattern(int& x, int y,
-	const MultiTilePattern& pattern,
+	const MultiTilePattern& pattern, const std::vector<int>& re_ids,
 	point_map<LevelObject*>& mapping,
 	std::map<point_zorder, LevelObject*>& different_zorder_mapping) const
 {
@@ -868,8 +910,7 @@ void TileMap::applyMatchingMultiPattern(int& x, int y,
 		const int xpos = pattern.tryOrder()[n].loc.x;
 		const int ypos = pattern.tryOrder()[n].loc.y;
 
-		const PatternIndexEntry& entry = getTileEntry(y + ypos, x + xpos);
-		if(std::find(entry.matching_patterns.begin(), entry.matching_patterns.end(), pattern.getTileAt(xpos, ypos).re) == entry.matching_patterns.end()) {
+		if(!getTileEntry(y + ypos, x + xpos).matches(re_ids[ypos*pattern.width() + xpos])) {
 			//the regex doesn't match
 			match = false;
 
@@ -907,6 +948,42 @@ void TileMap::applyMatchingMultiPattern(int& x, int y,
 	}
 }
 
+void TileMap::matchMultiPatterns(int width, bool partial, int rx1, int ry1, int rx2, int ry2, MultiPatternMatches* matches) const
+{
+	for(int n = 0; n != static_cast<int>(multi_patterns_.size()); ++n) {
+		const MultiTilePattern* p = multi_patterns_[n];
+
+		//patterns starting above or to the left of the area may still
+		//cover it, and whether they match depends on those before them,
+		//so look a little further back. This gives the same tiles inside
+		//the area as matching everything unless a long chain of patterns
+		//overlap.
+		const int y1 = std::max(-p->height(), partial ? ry1 - p->height()*2 : ry1);
+		const int y2 = std::min(static_cast<int>(map_.size()) + p->height(), ry2);
+		const int x1 = std::max(-p->width(), partial ? rx1 - p->width()*2 : rx1);
+		const int x2 = std::min(width + p->width(), rx2);
+		for(int y = y1; y < y2; ++y) {
+			for(int x = x1; x < x2; ++x) {
+				applyMatchingMultiPattern(x, y, *p, multi_pattern_re_ids_[n], matches->mapping, matches->different_zorder_mapping);
+			}
+		}
+	}
+}
+
+void TileMap::prepareBuildBands()
+{
+	getPatterns();
+
+	int width = 0;
+	for(const auto& row : map_) {
+		width = std::max(width, static_cast<int>(row.size()));
+	}
+
+	std::shared_ptr<MultiPatternMatches> matches(new MultiPatternMatches);
+	matchMultiPatterns(width, false, std::numeric_limits<int>::min(), std::numeric_limits<int>::min(), std::numeric_limits<int>::max(), std::numeric_limits<int>::max(), matches.get());
+	multi_pattern_matches_ = matches;
+}
+
 void TileMap::buildTiles(std::vector<LevelTile>* tiles, const rect* r) const
 {
 	const int begin_time = profile::get_tick_time();
@@ -918,28 +995,34 @@ void TileMap::buildTiles(std::vector<LevelTile>* tiles, const rect* r) const
 		}
 	}
 
-	point_map<LevelObject*> multi_pattern_matches;
-	std::map<point_zorder, LevelObject*> different_zorder_multi_pattern_matches;
-
-	for(const MultiTilePattern* p : multi_patterns_) {
-		for(int y = -p->height(); y < static_cast<int>(map_.size()) + p->height(); ++y) {
-			const int ypos = ypos_ + y*TileSize;
-
-			if((r && ypos < r->y()) || (r && ypos > r->y2())) {
-				continue;
-			}
+	getPatterns();
+
+	//the range of tiles with a position inside r, so that rebuilding a
+	//small area only visits the tiles in it.
+	int rx1 = std::numeric_limits<int>::min(), ry1 = std::numeric_limits<int>::min();
+	int rx2 = std::numeric_limits<int>::max(), ry2 = std::numeric_limits<int>::max();
+	if(r) {
+		rx1 = tile_floor_div(r->x() - xpos_ + TileSize - 1);
+		ry1 = tile_floor_div(r->y() - ypos_ + TileSize - 1);
+		rx2 = tile_floor_div(r->x2() - xpos_) + 1;
+		ry2 = tile_floor_div(r->y2() - ypos_) + 1;
+	}
 
-			for(int x = -p->width(); x < width + p->width(); ++x) {
-				applyMatchingMultiPattern(x, y, *p, multi_pattern_matches, different_zorder_multi_pattern_matches);
-			}
-		}
+	MultiPatternMatches local_matches;
+	const MultiPatternMatches* matches = multi_pattern_matches_.get();
+	if(matches == nullptr) {
+		matchMultiPatterns(width, r != nullptr, rx1, ry1, rx2, ry2, &local_matches);
+		matches = &local_matches;
 	}
 
 	//add all tiles in different zorders to our own.
-	for(auto& i : different_zorder_multi_pattern_matches) {
+	for(auto& i : matches->different_zorder_mapping) {
 		const LevelObject* obj = i.second;
 		const int x = i.first.first.x;
 		const int y = i.first.first.y;
+		if(x < rx1 || x >= rx2 || y < ry1 || y >= ry2) {
+			continue;
+		}
 
 		const int xpos = xpos_ + x*TileSize;
 		const int ypos = ypos_ + y*TileSize;
@@ -955,20 +1038,18 @@ void TileMap::buildTiles(std::vector<LevelTile>* tiles, const rect* r) const
 	}
 
 
-	TilePatternCache cache;
-
 	int ntiles = 0;
-	for(int y = -g_tile_pattern_search_border; y < static_cast<int>(map_.size()) + g_tile_pattern_search_border; ++y) {
+	const int y1 = std::max(-g_tile_pattern_search_border, ry1);
+	const int y2 = std::min(static_cast<int>(map_.size()) + g_tile_pattern_search_border, ry2);
+	const int x1 = std::max(-g_tile_pattern_search_border, rx1);
+	const int x2 = std::min(width + g_tile_pattern_search_border, rx2);
+	for(int y = y1; y < y2; ++y) {
 		const int ypos = ypos_ + y*TileSize;
 
-		if((r && ypos < r->y()) || (r && ypos > r->y2())) {
-			continue;
-		}
-
-		for(int x = -g_tile_pattern_search_border; x < width + g_tile_pattern_search_border; ++x) {
+		for(int x = x1; x < x2; ++x) {
 			const int xpos = xpos_ + x*TileSize;
 
-			const LevelObject* obj = multi_pattern_matches.get(point(x, y));
+			const LevelObject* obj = matches->mapping.get(point(x, y));
 			if(obj) {
 				LevelTile t;
 				t.x = xpos;
@@ -982,16 +1063,11 @@ void TileMap::buildTiles(std::vector<LevelTile>* tiles, const rect* r) const
 			}
 
 			bool face_right = true;
-			const TilePattern* p = getMatchingPattern(x, y, cache, &face_right);
+			const TilePattern* p = getMatchingPattern(x, y, &face_right);
 			if(p == nullptr) {
 				continue;
 			}
 
-
-			if((r && xpos < r->x()) || (r && xpos > r->x2())) {
-				continue;
-			}
-
 			++ntiles;
 
 			LevelTile t;
@@ -1034,10 +1110,10 @@ void TileMap::buildTiles(std::vector<LevelTile>* tiles, const rect* r) const
 	LOG_DEBUG("done build tiles: " << ntiles << " " << (profile::get_tick_time() - begin_time));
 }
 
-const TilePattern* TileMap::getMatchingPattern(int x, int y, TilePatternCache& cache, bool* face_right) const
+const TilePattern* TileMap::getMatchingPattern(int x, int y, bool* face_right) const
 {
-
-	if (!*getTile(y, x) &&
+	const PatternIndexEntry& current = getTileEntry(y, x);
+	if (!current.str[0] &&
 	    !*getTile(y-1, x) &&
 		!*getTile(y+1, x) &&
 		!*getTile(y, x-1) &&
@@ -1045,39 +1121,25 @@ const TilePattern* TileMap::getMatchingPattern(int x, int y, TilePatternCache& c
 		return nullptr;
 	}
 
-	const int xpos = xpos_ + x*TileSize;
-
-	ffl::IntrusivePtr<FilterCallable> callable_ptr(new FilterCallable(*this, x, y));
-	FilterCallable& callable = *callable_ptr;
+	//only made if a pattern has a filter.
+	ffl::IntrusivePtr<FilterCallable> callable;
 
-	const char* current_tile = getTile(y,x);
+	for(int index : current.candidates) {
+		const CompiledPattern& compiled = compiled_patterns_[index];
+		const TilePattern& p = *compiled.pattern;
+		if(p.filter_formula) {
+			if(!callable) {
+				callable.reset(new FilterCallable(*this, x, y));
+			}
 
-	//we build a cache of all of the patterns which have some chance of
-	//matching the current tile.
-	TilePatternCacheMap::iterator itor = cache.cache.find(current_tile);
-	if(itor == cache.cache.end()) {
-		itor = cache.cache.emplace(current_tile, std::vector<const TilePattern*>()).first;
-		for(const TilePattern* p : getPatterns()) {
-			if(!p->current_tile_pattern->empty() && !boost::regex_match(current_tile, current_tile + strlen(current_tile), *p->current_tile_pattern)) {
+			if(p.filter_formula->execute(*callable).as_bool() == false) {
 				continue;
 			}
-
-			itor->second.push_back(&*p);
-		}
-	}
-
-	const std::vector<const TilePattern*>& matching_patterns = itor->second;
-
-	for(const TilePattern* ptr : matching_patterns) {
-		const TilePattern& p = *ptr;
-		if(p.filter_formula && p.filter_formula->execute(callable).as_bool() == false) {
-			continue;
 		}
 
 		bool match = true;
-		for(const TilePattern::SurroundingTile& t : p.surrounding_tiles) {
-			const PatternIndexEntry& entry = getTileEntry(y + t.yoffset, x + t.xoffset);
-			if(std::find(entry.matching_patterns.begin(), entry.matching_patterns.end(), t.pattern) == entry.matching_patterns.end()) {
+		for(const CompiledNeighbour& t : compiled.neighbours) {
+			if(!getTileEntry(y + t.yoffset, x + t.xoffset).matches(t.re_id)) {
 				match = false;
 				break;
 			}
@@ -1095,9 +1157,8 @@ const TilePattern* TileMap::getMatchingPattern(int x, int y, TilePatternCache& c
 		if(p.reverse) {
 			match = true;
 
-			for(const TilePattern::SurroundingTile& t : p.surrounding_tiles) {
-				const PatternIndexEntry& entry = getTileEntry(y + t.yoffset, x - t.xoffset);
-				if(std::find(entry.matching_patterns.begin(), entry.matching_patterns.end(), t.pattern) == entry.matching_patterns.end()) {
+			for(const CompiledNeighbour& t : compiled.neighbours) {
+				if(!getTileEntry(y + t.yoffset, x - t.xoffset).matches(t.re_id)) {
 					match = false;
 					break;
 				}
@@ -1123,6 +1184,8 @@ bool TileMap::setTile(int xpos, int ypos, const std::string& str)
 		return false;
 	}
 
+	multi_pattern_matches_.reset();
+
 	tile_string empty_tile;
 	std::fill(empty_tile.begin(), empty_tile.end(), '\0');
 	if(xpos < xpos_) {
@@ -1192,3 +1255,149 @@ int TileMap::getPatternIndexEntry(const tile_string& str) {
 	buildPatterns();
 	return index;
 }
+
+namespace
+{
+	//a map of random tiles from those the module has, with some cells
+	//left empty, so that tiles are surrounded by every combination of
+	//neighbours.
+	variant random_tile_map_node(int width, int height, unsigned int seed)
+	{
+		std::vector<std::string> tile_ids(1, "");
+		for(const auto& i : files_index) {
+			if(i.first.size() <= 3) {
+				tile_ids.push_back(i.first);
+			}
+		}
+
+		std::mt19937 gen(seed);
+		std::ostringstream tiles;
+		for(int y = 0; y != height; ++y) {
+			if(y) {
+				tiles << "\n";
+			}
+
+			for(int x = 0; x != width; ++x) {
+				if(x) {
+					tiles << ",";
+				}
+
+				tiles << tile_ids[gen()%tile_ids.size()];
+			}
+		}
+
+		std::vector<std::string> unique_tiles(tile_ids.begin()+1, tile_ids.end());
+
+		variant_builder node;
+		node.add("x", 0);
+		node.add("y", 0);
+		node.add("zorder", 0);
+		node.add("tiles", tiles.str());
+		node.add("unique_tiles", util::join(unique_tiles));
+		return node.build();
+	}
+
+	bool level_tile_less(const LevelTile& a, const LevelTile& b)
+	{
+		return std::tie(a.zorder, a.y, a.x, a.object, a.face_right) < std::tie(b.zorder, b.y, b.x, b.object, b.face_right);
+	}
+
+	bool level_tile_equal(const LevelTile& a, const LevelTile& b)
+	{
+		return std::tie(a.zorder, a.y, a.x, a.object, a.face_right) == std::tie(b.zorder, b.y, b.x, b.object, b.face_right);
+	}
+}
+
+UNIT_TEST(tile_map_build_bands_match_full_build)
+{
+	for(unsigned int seed = 1; seed <= 4; ++seed) {
+		TileMap full_map(random_tile_map_node(40, 50, seed));
+		std::vector<LevelTile> full;
+		full_map.buildTiles(&full);
+
+		TileMap banded_map(full_map);
+		banded_map.prepareBuildBands();
+
+		//bands a few rows high, so that multi tile patterns straddle them.
+		std::vector<LevelTile> banded;
+		for(const rect& area : banded_map.getBuildBands(3)) {
+			banded_map.buildTiles(&banded, &area);
+		}
+
+		std::sort(full.begin(), full.end(), level_tile_less);
+		std::sort(banded.begin(), banded.end(), level_tile_less);
+		CHECK_EQ(banded.size(), full.size());
+		CHECK(std::equal(full.begin(), full.end(), banded.begin(), banded.end(), level_tile_equal), "Building a tile map in bands gives different tiles to building it whole");
+	}
+}
+
+UNIT_TEST(tile_map_compiled_patterns_match_regex)
+{
+	//the first pattern matching each tile, found by matching the tile and
+	//its neighbours against each pattern's regexes in turn.
+	auto regex_matching_pattern = [](const TileMap& m, int x, int y, bool* face_right) -> const TilePattern* {
+		auto tile_str = [&m](int y, int x) {
+			std::array<char, 4> str;
+			std::fill(str.begin(), str.end(), '\0');
+			const char* tile = m.getTile(y, x);
+			std::copy(tile, tile + strlen(tile), str.begin());
+			return str;
+		};
+
+		const char* current_tile = m.getTile(y, x);
+		if(!*current_tile && !*m.getTile(y-1, x) && !*m.getTile(y+1, x) && !*m.getTile(y, x-1) && !*m.getTile(y, x+1)) {
+			return nullptr;
+		}
+
+		for(const TilePattern* p : m.getPatterns()) {
+			if(!p->current_tile_pattern->empty() && !boost::regex_match(current_tile, current_tile + strlen(current_tile), *p->current_tile_pattern)) {
+				continue;
+			}
+
+			if(p->filter_formula) {
+				ffl::IntrusivePtr<FilterCallable> callable(new FilterCallable(m, x, y));
+				if(p->filter_formula->execute(*callable).as_bool() == false) {
+					continue;
+				}
+			}
+
+			for(int dir = 1; dir >= (p->reverse ? -1 : 1); dir -= 2) {
+				bool match = true;
+				for(const TilePattern::SurroundingTile& t : p->surrounding_tiles) {
+					if(!match_regex(tile_str(y + t.yoffset, x + dir*t.xoffset), t.pattern)) {
+						match = false;
+						break;
+					}
+				}
+
+				if(match) {
+					*face_right = dir < 0;
+					return p->empty ? nullptr : p;
+				}
+			}
+		}
+
+		return nullptr;
+	};
+
+	//random tiles put every kind of tile next to every other, so
+	//overlapping patterns and patterns with wildcards compete.
+	int nmatched = 0;
+	for(unsigned int seed = 1; seed <= 4; ++seed) {
+		const TileMap m(random_tile_map_node(30, 30, seed));
+		for(int y = -1; y <= 30; ++y) {
+			for(int x = -1; x <= 30; ++x) {
+				bool face_right = false, expected_face_right = false;
+				const TilePattern* p = m.getMatchingPattern(x, y, &face_right);
+				const TilePattern* expected = regex_matching_pattern(m, x, y, &expected_face_right);
+				CHECK(p == expected, "Compiled tile patterns matched " << (p ? p->pattern_str : "nothing") << " at " << x << "," << y << " instead of " << (expected ? expected->pattern_str : "nothing"));
+				if(p) {
+					CHECK_EQ(face_right, expected_face_right);
+					++nmatched;
+				}
+			}
+		}
+	}
+
+	CHECK(nmatched > 0 || patterns.empty(), "No tiles matched any pattern");
+}
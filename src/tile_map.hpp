@@ -26,7 +26,9 @@
 #include <array>
 #include <boost/regex.hpp>
 
+#include <cstdint>
 #include <map>
+#include <memory>
 #include <string>
 
 #include "geometry.hpp"
@@ -44,11 +46,6 @@ int get_named_zorder(const std::string& key, int default_value=0);
 struct TilePattern;
 class MultiTilePattern;
 
-namespace
-{
-	struct TilePatternCache;
-}
-
 class TileMap
 {
 public:
@@ -79,6 +76,16 @@ public:
 	//info to prepare the tile map to be placed into a worker thread.
 	void prepareForCopyToWorkerThread();
 
+	//matches the multi tile patterns against the whole map, so that
+	//buildTiles() uses the same matches whichever area it builds. Until
+	//the map or the patterns change, building each band from
+	//getBuildBands() then gives the same tiles as building the whole map.
+	void prepareBuildBands();
+
+	//splits the area buildTiles() covers into bands of at most
+	//rows_per_band rows, to be built after prepareBuildBands().
+	std::vector<rect> getBuildBands(int rows_per_band) const;
+
 #ifndef NO_EDITOR
 	//Functions for rebuilding all live tile maps when there is a change
 	//to tile map data. prepareRebuildAll() should be called before
@@ -88,11 +95,14 @@ public:
 #endif
 
 private:
+	//checks getMatchingPattern() against matching each pattern's regexes.
+	friend void TEST_tile_map_compiled_patterns_match_regex();
+
 	void buildPatterns();
 	const std::vector<const TilePattern*>& getPatterns() const;
 
 	int variation(int x, int y) const;
-	const TilePattern* getMatchingPattern(int x, int y, TilePatternCache& cache, bool* face_right) const;
+	const TilePattern* getMatchingPattern(int x, int y, bool* face_right) const;
 	variant getValue(const std::string& key) const { return variant(); }
 	int xpos_, ypos_;
 	int x_speed_, y_speed_;
@@ -109,7 +119,15 @@ private:
 	{
 		PatternIndexEntry() { for(int n = 0; n != str.size(); ++n) { str[n] = 0; } }
 		tile_string str;
-		mutable std::vector<const boost::regex*> matching_patterns;
+
+		//bit n is set if this string matches the regex with id n.
+		std::vector<uint64_t> match_bits;
+
+		//indexes into compiled_patterns_ of the patterns whose main tile
+		//matches this string, in priority order.
+		std::vector<int> candidates;
+
+		bool matches(int re_id) const { return (match_bits[re_id >> 6] >> (re_id&63))&1; }
 	};
 
 	const PatternIndexEntry& getTileEntry(int y, int x) const;
@@ -121,19 +139,52 @@ private:
 	//the subset of all multi tile patterns which might be valid for this map.
 	std::vector<const MultiTilePattern*> multi_patterns_;
 
+	//for each of multi_patterns_, the regex id of each tile, at
+	//y*width + x.
+	std::vector<std::vector<int>> multi_pattern_re_ids_;
+
 	typedef std::pair<point, int> point_zorder;
 	//function to apply the first found matching multi pattern.
 	//mapping represents all the tiles added in our zorder.
 	//different_zorder_mapping represents the mappings in different zorders
 	//to this tile_map.
 	void applyMatchingMultiPattern(int& x, int y,
-		const MultiTilePattern& pattern,
+		const MultiTilePattern& pattern, const std::vector<int>& re_ids,
 		point_map<LevelObject*>& mapping,
 		std::map<point_zorder, LevelObject*>& different_zorder_mapping) const;
 
+	struct MultiPatternMatches
+	{
+		point_map<LevelObject*> mapping;
+		std::map<point_zorder, LevelObject*> different_zorder_mapping;
+	};
+
+	//applies the multi tile patterns to the tiles in [x1,x2) x [y1,y2).
+	//If partial is set, patterns starting a little outside that range
+	//which may cover it are tried as well.
+	void matchMultiPatterns(int width, bool partial, int x1, int y1, int x2, int y2, MultiPatternMatches* matches) const;
+
+	//the matches over the whole map found by prepareBuildBands(), if any.
+	std::shared_ptr<const MultiPatternMatches> multi_pattern_matches_;
+
 	//the subset of all global patterns which might be valid for this map.
 	std::vector<const TilePattern*> patterns_;
 
+	//patterns_ with the regex of each surrounding tile replaced by its id,
+	//so matching a pattern only needs bit tests on the neighbours'
+	//PatternIndexEntry.
+	struct CompiledNeighbour {
+		int xoffset, yoffset;
+		int re_id;
+	};
+
+	struct CompiledPattern {
+		const TilePattern* pattern;
+		std::vector<CompiledNeighbour> neighbours;
+	};
+
+	std::vector<CompiledPattern> compiled_patterns_;
+
 	//when we generate patterns_ we check the underlying vector's version.
 	//when it is updated it will get a new version and so we'll have to
 	//update our view into it.
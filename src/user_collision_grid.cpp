@@ -0,0 +1,336 @@
+/*
+	Copyright (C) 2003-2014 by David White <davewx7@gmail.com>
+
+	This software is provided 'as-is', without any express or implied
+	warranty. In no event will the authors be held liable for any damages
+	arising from the use of this software.
+
+	Permission is granted to anyone to use this software for any purpose,
+	including commercial applications, and to alter it and redistribute it
+	freely, subject to the following restrictions:
+
+	   1. The origin of this software must not be misrepresented; you must not
+	   claim that you wrote the original software. If you use this software
+	   in a product, an acknowledgement in the product documentation would be
+	   appreciated but is not required.
+
+	   2. Altered source versions must be plainly marked as such, and must not be
+	   misrepresented as being the original software.
+
+	   3. This notice may not be removed or altered from any source
+	   distribution.
+*/
+
+#include <algorithm>
+
+#include "asserts.hpp"
+#include "random.hpp"
+#include "unit_test.hpp"
+#include "user_collision_grid.hpp"
+
+namespace
+{
+	//entries covering more than this many cells go in the oversized list.
+	const int MaxCellsPerEntry = 64;
+
+	int floor_div(int n, int d)
+	{
+		return n >= 0 ? n/d : -((-n + d - 1)/d);
+	}
+}
+
+UserCollisionGrid::UserCollisionGrid(int cell_size)
+	: cell_size_(cell_size), stamp_(0)
+{
+	ASSERT_LOG(cell_size_ > 0, "Illegal user collision grid cell size: " << cell_size_);
+}
+
+void UserCollisionGrid::beginUpdate()
+{
+	++stamp_;
+}
+
+void UserCollisionGrid::update(const void* key, int index, const rect& area)
+{
+	//rects are treated inclusively of x2/y2 to match the pixel loops used
+	//by the narrow phase.
+	const int x1 = floor_div(area.x(), cell_size_);
+	const int y1 = floor_div(area.y(), cell_size_);
+	const int x2 = floor_div(area.x2(), cell_size_);
+	const int y2 = floor_div(area.y2(), cell_size_);
+
+	auto itor = slots_.find(key);
+	if(itor != slots_.end()) {
+		Record& r = records_[itor->second];
+		r.index = index;
+		r.stamp = stamp_;
+		if(r.x1 == x1 && r.y1 == y1 && r.x2 == x2 && r.y2 == y2) {
+			return;
+		}
+
+		eraseRecord(itor->second);
+		r.x1 = x1;
+		r.y1 = y1;
+		r.x2 = x2;
+		r.y2 = y2;
+		insertRecord(itor->second);
+		return;
+	}
+
+	int slot;
+	if(free_records_.empty()) {
+		slot = static_cast<int>(records_.size());
+		records_.emplace_back();
+	} else {
+		slot = free_records_.back();
+		free_records_.pop_back();
+	}
+
+	Record& r = records_[slot];
+	r.key = key;
+	r.index = index;
+	r.x1 = x1;
+	r.y1 = y1;
+	r.x2 = x2;
+	r.y2 = y2;
+	r.stamp = stamp_;
+	r.oversized = false;
+
+	slots_[key] = slot;
+	insertRecord(slot);
+}
+
+void UserCollisionGrid::endUpdate()
+{
+	for(auto itor = slots_.begin(); itor != slots_.end(); ) {
+		if(records_[itor->second].stamp != stamp_) {
+			eraseRecord(itor->second);
+			free_records_.push_back(itor->second);
+			itor = slots_.erase(itor);
+		} else {
+			++itor;
+		}
+	}
+}
+
+void UserCollisionGrid::insertRecord(int slot)
+{
+	Record& r = records_[slot];
+	const int ncells = (r.x2 - r.x1 + 1)*(r.y2 - r.y1 + 1);
+	r.oversized = ncells > MaxCellsPerEntry;
+	if(r.oversized) {
+		oversized_.push_back(slot);
+		return;
+	}
+
+	for(int y = r.y1; y <= r.y2; ++y) {
+		for(int x = r.x1; x <= r.x2; ++x) {
+			cells_[cellKey(x, y)].push_back(slot);
+		}
+	}
+}
+
+void UserCollisionGrid::eraseRecord(int slot)
+{
+	const Record& r = records_[slot];
+	if(r.oversized) {
+		oversized_.erase(std::remove(oversized_.begin(), oversized_.end(), slot), oversized_.end());
+		return;
+	}
+
+	for(int y = r.y1; y <= r.y2; ++y) {
+		for(int x = r.x1; x <= r.x2; ++x) {
+			auto itor = cells_.find(cellKey(x, y));
+			if(itor == cells_.end()) {
+				continue;
+			}
+
+			std::vector<int>& v = itor->second;
+			v.erase(std::remove(v.begin(), v.end(), slot), v.end());
+			if(v.empty()) {
+				cells_.erase(itor);
+			}
+		}
+	}
+}
+
+void UserCollisionGrid::getCandidatePairs(std::vector<std::pair<int, int>>* pairs) const
+{
+	pairs->clear();
+
+	for(const auto& cell : cells_) {
+		const std::vector<int>& v = cell.second;
+		if(v.size() < 2) {
+			continue;
+		}
+
+		const int cx = static_cast<int>(static_cast<uint32_t>(cell.first >> 32));
+		const int cy = static_cast<int>(static_cast<uint32_t>(cell.first));
+
+		for(auto i = v.begin(); i != v.end(); ++i) {
+			const Record& a = records_[*i];
+			for(auto j = i + 1; j != v.end(); ++j) {
+				const Record& b = records_[*j];
+
+				//a pair sharing several cells is only reported from the
+				//top-left cell of their overlap.
+				if(cx != std::max(a.x1, b.x1) || cy != std::max(a.y1, b.y1)) {
+					continue;
+				}
+
+				pairs->emplace_back(std::min(a.index, b.index), std::max(a.index, b.index));
+			}
+		}
+	}
+
+	for(auto i = oversized_.begin(); i != oversized_.end(); ++i) {
+		const Record& a = records_[*i];
+		for(const auto& s : slots_) {
+			const Record& b = records_[s.second];
+			if(&a == &b || (b.oversized && s.second < *i)) {
+				//oversized pairs are reported once, from the lower slot.
+				continue;
+			}
+
+			if(a.x2 < b.x1 || b.x2 < a.x1 || a.y2 < b.y1 || b.y2 < a.y1) {
+				continue;
+			}
+
+			pairs->emplace_back(std::min(a.index, b.index), std::max(a.index, b.index));
+		}
+	}
+
+	std::sort(pairs->begin(), pairs->end());
+}
+
+void UserCollisionGrid::clear()
+{
+	records_.clear();
+	free_records_.clear();
+	slots_.clear();
+	cells_.clear();
+	oversized_.clear();
+}
+
+namespace
+{
+	std::vector<rect> generate_rects(int count, int world_size)
+	{
+		std::vector<rect> result;
+		result.reserve(count);
+		for(int n = 0; n != count; ++n) {
+			result.emplace_back(rng::generate()%world_size - world_size/2, rng::generate()%world_size - world_size/2, 4 + rng::generate()%48, 4 + rng::generate()%48);
+		}
+
+		return result;
+	}
+
+	bool inclusive_rects_overlap(const rect& a, const rect& b)
+	{
+		return a.x() <= b.x2() && b.x() <= a.x2() && a.y() <= b.y2() && b.y() <= a.y2();
+	}
+}
+
+UNIT_TEST(user_collision_grid_finds_all_overlaps)
+{
+	UserCollisionGrid grid(64);
+
+	std::vector<rect> rects = generate_rects(300, 2000);
+	rects.emplace_back(-1000, -1000, 2000, 2000); //oversized
+	rects.emplace_back(-500, -500, 1200, 1200); //oversized
+
+	for(int cycle = 0; cycle != 3; ++cycle) {
+		grid.beginUpdate();
+		for(int n = 0; n != static_cast<int>(rects.size()); ++n) {
+			grid.update(&rects[n], n, rects[n]);
+		}
+		grid.endUpdate();
+
+		std::vector<std::pair<int, int>> pairs;
+		grid.getCandidatePairs(&pairs);
+
+		CHECK(std::adjacent_find(pairs.begin(), pairs.end()) == pairs.end(), "duplicate candidate pair");
+
+		for(int i = 0; i != static_cast<int>(rects.size()); ++i) {
+			for(int j = i+1; j != static_cast<int>(rects.size()); ++j) {
+				if(inclusive_rects_overlap(rects[i], rects[j])) {
+					CHECK(std::binary_search(pairs.begin(), pairs.end(), std::pair<int, int>(i, j)), "missing candidate pair " << i << ", " << j);
+				}
+			}
+		}
+
+		//move some of the rects so the next cycle exercises rebucketing.
+		for(int n = 0; n < static_cast<int>(rects.size()); n += 3) {
+			rects[n] = rect(rects[n].x() + 70, rects[n].y() - 130, rects[n].w(), rects[n].h());
+		}
+	}
+
+	//entries which aren't updated are dropped.
+	grid.beginUpdate();
+	grid.update(&rects[0], 0, rects[0]);
+	grid.update(&rects[1], 1, rects[0]);
+	grid.endUpdate();
+	CHECK_EQ(grid.size(), 2);
+
+	std::vector<std::pair<int, int>> pairs;
+	grid.getCandidatePairs(&pairs);
+	CHECK_EQ(static_cast<int>(pairs.size()), 1);
+}
+
+BENCHMARK_ARG(user_collision_broad_phase, int nobjects)
+{
+	//objects spread out so that roughly the same density is maintained as
+	//the object count scales.
+	int world_size = 64;
+	while(world_size*world_size < nobjects*4096) {
+		world_size *= 2;
+	}
+
+	std::vector<rect> rects = generate_rects(nobjects, world_size);
+	UserCollisionGrid grid;
+	std::vector<std::pair<int, int>> pairs;
+	BENCHMARK_LOOP {
+		for(rect& r : rects) {
+			r = rect(r.x() + rng::generate()%5 - 2, r.y() + rng::generate()%5 - 2, r.w(), r.h());
+		}
+
+		grid.beginUpdate();
+		for(int n = 0; n != nobjects; ++n) {
+			grid.update(&rects[n], n, rects[n]);
+		}
+		grid.endUpdate();
+		grid.getCandidatePairs(&pairs);
+	}
+}
+
+BENCHMARK_ARG_CALL(user_collision_broad_phase, grid_100, 100);
+BENCHMARK_ARG_CALL(user_collision_broad_phase, grid_500, 500);
+BENCHMARK_ARG_CALL(user_collision_broad_phase, grid_1000, 1000);
+BENCHMARK_ARG_CALL(user_collision_broad_phase, grid_5000, 5000);
+
+BENCHMARK_ARG(user_collision_all_pairs, int nobjects)
+{
+	//the O(n^2) scan detect_user_collisions used to do, for comparison.
+	int world_size = 64;
+	while(world_size*world_size < nobjects*4096) {
+		world_size *= 2;
+	}
+
+	std::vector<rect> rects = generate_rects(nobjects, world_size);
+	std::vector<std::pair<int, int>> pairs;
+	BENCHMARK_LOOP {
+		pairs.clear();
+		for(int i = 0; i != nobjects; ++i) {
+			for(int j = i+1; j != nobjects; ++j) {
+				if(inclusive_rects_overlap(rects[i], rects[j])) {
+					pairs.emplace_back(i, j);
+				}
+			}
+		}
+	}
+}
+
+BENCHMARK_ARG_CALL(user_collision_all_pairs, all_pairs_100, 100);
+BENCHMARK_ARG_CALL(user_collision_all_pairs, all_pairs_500, 500);
+BENCHMARK_ARG_CALL(user_collision_all_pairs, all_pairs_1000, 1000);
+BENCHMARK_ARG_CALL(user_collision_all_pairs, all_pairs_5000, 5000);
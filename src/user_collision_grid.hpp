@@ -0,0 +1,92 @@
+/*
+	Copyright (C) 2003-2014 by David White <davewx7@gmail.com>
+
+	This software is provided 'as-is', without any express or implied
+	warranty. In no event will the authors be held liable for any damages
+	arising from the use of this software.
+
+	Permission is granted to anyone to use this software for any purpose,
+	including commercial applications, and to alter it and redistribute it
+	freely, subject to the following restrictions:
+
+	   1. The origin of this software must not be misrepresented; you must not
+	   claim that you wrote the original software. If you use this software
+	   in a product, an acknowledgement in the product documentation would be
+	   appreciated but is not required.
+
+	   2. Altered source versions must be plainly marked as such, and must not be
+	   misrepresented as being the original software.
+
+	   3. This notice may not be removed or altered from any source
+	   distribution.
+*/
+
+#pragma once
+
+#include <cstdint>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "geometry.hpp"
+
+//A uniform grid used as the broad-phase of user collision detection.
+//
+//Each cycle the caller feeds in every entry which may collide along with
+//its bounding rectangle. The grid remembers which cells each entry
+//occupied last cycle, so entries that stay within the same cells cost
+//only a lookup and only entries which moved between cells get rebucketed.
+//Entries not updated during a cycle are dropped at endUpdate().
+class UserCollisionGrid
+{
+public:
+	static const int DefaultCellSize = 128;
+
+	explicit UserCollisionGrid(int cell_size=DefaultCellSize);
+
+	void beginUpdate();
+
+	//'key' identifies the entry between cycles, 'index' is the value that
+	//will be reported back in candidate pairs for this cycle.
+	void update(const void* key, int index, const rect& area);
+
+	void endUpdate();
+
+	//gets all pairs of indexes whose areas share at least one cell. Each
+	//pair has first < second and the result is sorted, so the order is
+	//deterministic regardless of how entries are bucketed.
+	void getCandidatePairs(std::vector<std::pair<int, int>>* pairs) const;
+
+	void clear();
+
+	int size() const { return static_cast<int>(slots_.size()); }
+	int cellSize() const { return cell_size_; }
+private:
+	struct Record {
+		const void* key;
+		int index;
+		int x1, y1, x2, y2;
+		unsigned int stamp;
+		bool oversized;
+	};
+
+	void insertRecord(int slot);
+	void eraseRecord(int slot);
+
+	static uint64_t cellKey(int x, int y) {
+		return (static_cast<uint64_t>(static_cast<uint32_t>(x)) << 32) | static_cast<uint32_t>(y);
+	}
+
+	int cell_size_;
+	unsigned int stamp_;
+
+	std::vector<Record> records_;
+	std::vector<int> free_records_;
+	std::unordered_map<const void*, int> slots_;
+
+	std::unordered_map<uint64_t, std::vector<int>> cells_;
+
+	//entries which span so many cells that it's cheaper to test them
+	//against everything than to bucket them.
+	std::vector<int> oversized_;
+};
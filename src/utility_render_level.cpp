@@ -21,11 +21,14 @@
 	   distribution.
 */
 
+#include <chrono>
 #include <string>
 #include <vector>
 
 #include "DisplayDevice.hpp"
+#include "DisplayDeviceNull.hpp"
 #include "ModelMatrixScope.hpp"
+#include "RenderCommandBuffer.hpp"
 #include "RenderTarget.hpp"
 #include "WindowManager.hpp"
 
@@ -73,7 +76,18 @@ UTILITY(render_level)
 		}
 
 		std::cout << "\n  {\n  \"name\": \"" << lvl->id() << "\","
-		             << "\n  \"dimensions\": [" << lvl->boundaries().x() << "," << lvl->boundaries().y() << "," << lvl->boundaries().w() << "," << lvl->boundaries().h() << "]\n  }";
+		             << "\n  \"dimensions\": [" << lvl->boundaries().x() << "," << lvl->boundaries().y() << "," << lvl->boundaries().w() << "," << lvl->boundaries().h() << "]";
+
+		// With the null display device (--renderer=null) the level is drawn by
+		// the software rasterizer and what it was drawn with is reported.
+		auto null_device = std::dynamic_pointer_cast<KRE::DisplayDeviceNull>(KRE::DisplayDevice::getCurrent());
+		if(null_device) {
+			null_device->setRasterizing(true);
+			null_device->clearRecording();
+			null_device->startRecording();
+		}
+		KRE::reset_render_stats();
+		std::chrono::high_resolution_clock::duration draw_time(0);
 
 		auto wnd = KRE::WindowManager::getMainWindow();
 
@@ -90,7 +104,9 @@ UTILITY(render_level)
 				fbo->apply();
 				fbo->clear();
 				KRE::ModelManager2D mm(-x, -y);
+				const auto draw_start = std::chrono::high_resolution_clock::now();
 				lvl->draw(x, y, seg_width, seg_height);
+				draw_time += std::chrono::high_resolution_clock::now() - draw_start;
 
 				auto s = fbo->readToSurface(nullptr);
 
@@ -104,6 +120,31 @@ UTILITY(render_level)
 		}
 
 		level_surface->savePng(output);
+
+		if(null_device) {
+			null_device->stopRecording();
+
+			const KRE::RenderStats& stats = KRE::get_render_stats();
+			std::cout << ",\n  \"draw_ms\": " << std::chrono::duration_cast<std::chrono::microseconds>(draw_time).count() / 1000.0
+			          << ",\n  \"render_stats\": {"
+			          << "\"renderables\": " << stats.renderables
+			          << ", \"draw_calls\": " << stats.draw_calls
+			          << ", \"target_changes\": " << stats.target_changes
+			          << ", \"shader_changes\": " << stats.shader_changes
+			          << ", \"texture_changes\": " << stats.texture_changes
+			          << ", \"blend_changes\": " << stats.blend_changes
+			          << ", \"depth_changes\": " << stats.depth_changes
+			          << ", \"uniform_writes\": " << stats.uniform_writes
+			          << ", \"uniform_writes_elided\": " << stats.uniform_writes_elided
+			          << "},\n  \"events\": {";
+			for(int type = 0; type <= static_cast<int>(KRE::RenderEvent::Type::SWAP); ++type) {
+				const auto t = static_cast<KRE::RenderEvent::Type>(type);
+				std::cout << (type != 0 ? ", " : "") << "\"" << KRE::get_render_event_name(t) << "\": " << null_device->countEvents(t);
+			}
+			std::cout << "}";
+		}
+
+		std::cout << "\n  }";
 	}
 
 	std::cout << "]";
@@ -21,8 +21,10 @@
 	   distribution.
 */
 
+#include <atomic>
 #include <cctype>
 #include <cmath>
+#include <functional>
 #include <set>
 #include <stdlib.h>
 #include <stdio.h>
@@ -136,6 +138,8 @@ void variant::registerThread()
 
 void variant::unregisterThread()
 {
+	delete g_variant_thread_info;
+	g_variant_thread_info = nullptr;
 }
 
 void init_call_stack(int min_size)
@@ -333,18 +337,38 @@ struct variant_list : public GarbageCollectible {
 	std::vector<variant>::iterator begin, end;
 };
 
+namespace {
+	//a hash which is never 0, so 0 can mean a hash hasn't been calculated.
+	size_t hash_map_key(const std::string& s) {
+		return std::hash<std::string>()(s) | 1;
+	}
+}
+
 struct variant_string {
 	variant::debug_info info;
 	ffl::IntrusivePtr<const game_logic::FormulaExpression> expression;
 
-	variant_string() : refcount(0), str_len(0)
+	variant_string() : refcount(0), str_len(0), hash(0)
 	{}
-	variant_string(const variant_string& o) : str(o.str), translated_from(o.translated_from), refcount(1), str_len(o.str_len)
+	variant_string(const variant_string& o) : str(o.str), translated_from(o.translated_from), refcount(1), str_len(o.str_len), hash(o.hash.load(std::memory_order_relaxed))
 	{}
-	explicit variant_string(const std::string& s) : str(s), refcount(0) {
+	explicit variant_string(const std::string& s) : str(s), refcount(0), hash(0) {
 		str_len = utils::str_len_utf8(str);
 	}
 
+	//strings are immutable so the hash is calculated the first time it's
+	//needed and kept. Keys such as those in formulas are looked up many
+	//times using the same string.
+	size_t getHash() const {
+		size_t result = hash.load(std::memory_order_relaxed);
+		if(result == 0) {
+			result = hash_map_key(str);
+			hash.store(result, std::memory_order_relaxed);
+		}
+
+		return result;
+	}
+
 	std::string str, translated_from;
 	IntRefCount refcount;
 
@@ -354,6 +378,8 @@ struct variant_string {
 	//extended utf-8 characters.
 	size_t str_len;
 
+	mutable std::atomic<size_t> hash;
+
 	private:
 	void operator=(const variant_string&);
 };
@@ -362,11 +388,12 @@ struct variant_map : public GarbageCollectible {
 	variant::debug_info info;
 	ffl::IntrusivePtr<const game_logic::FormulaExpression> expression;
 
-	variant_map() : GarbageCollectible(), modcount(0)
+	variant_map() : GarbageCollectible(), modcount(0), num_indexed(0)
 	{
 	}
-	variant_map(const variant_map& o) : GarbageCollectible(o), expression(o.expression), elements(o.elements), modcount(0)
+	variant_map(const variant_map& o) : GarbageCollectible(o), expression(o.expression), elements(o.elements), modcount(0), num_indexed(0)
 	{
+		rebuildIndex();
 	}
 
 	~variant_map()
@@ -406,10 +433,156 @@ struct variant_map : public GarbageCollectible {
 		return res;
 	}
 
+	typedef std::pair<const variant,variant> Entry;
+
+	//elements is read directly, but must only be modified through these
+	//functions so the index is kept up to date.
+	Entry* find(const variant& key) {
+		if(!index.empty() && key.is_string()) {
+			return findString(key.string_->str, key.string_->getHash());
+		}
+
+		auto i = elements.find(key);
+		return i == elements.end() ? nullptr : &*i;
+	}
+
+	const Entry* find(const variant& key) const {
+		return const_cast<variant_map*>(this)->find(key);
+	}
+
+	Entry* findString(const std::string& key, size_t hash) {
+		if(index.empty()) {
+			auto i = elements.find(variant(key));
+			return i == elements.end() ? nullptr : &*i;
+		}
+
+		const size_t mask = index.size() - 1;
+		for(size_t n = hash&mask; index[n].entry != nullptr; n = (n+1)&mask) {
+			if(index[n].hash == hash && index[n].entry->first.string_->str == key) {
+				return index[n].entry;
+			}
+		}
+
+		return nullptr;
+	}
+
+	void set(const variant& key, const variant& value) {
+		auto res = elements.emplace(key, value);
+		if(!res.second) {
+			res.first->second = value;
+		} else if(!index.empty()) {
+			if(key.is_string()) {
+				if((num_indexed+1)*2 > index.size()) {
+					rebuildIndex();
+				} else {
+					addToIndex(&*res.first);
+				}
+			}
+		} else if(elements.size() >= MinIndexedSize) {
+			rebuildIndex();
+		}
+	}
+
+	void erase(const variant& key) {
+		auto i = elements.find(key);
+		if(i == elements.end()) {
+			return;
+		}
+
+		if(!index.empty() && key.is_string()) {
+			eraseFromIndex(&*i);
+		}
+
+		elements.erase(i);
+	}
+
+	void swapElements(std::map<variant,variant>& m) {
+		elements.swap(m);
+		rebuildIndex();
+	}
+
 	std::map<variant,variant> elements;
 	int modcount;
 private:
 	void operator=(const variant_map&);
+
+	//maps with at least this many elements have an index of their string
+	//keys, so looking them up is a hash probe rather than a walk down the
+	//tree doing string comparisons.
+	static const size_t MinIndexedSize = 8;
+
+	struct IndexSlot {
+		size_t hash;
+		Entry* entry;
+	};
+
+	void rebuildIndex() {
+		index.clear();
+		num_indexed = 0;
+		if(elements.size() < MinIndexedSize) {
+			return;
+		}
+
+		size_t nstrings = 0;
+		for(const Entry& p : elements) {
+			if(p.first.is_string()) {
+				++nstrings;
+			}
+		}
+
+		size_t capacity = 16;
+		while(capacity < nstrings*2) {
+			capacity *= 2;
+		}
+
+		const IndexSlot empty_slot = { 0, nullptr };
+		index.resize(capacity, empty_slot);
+		for(Entry& p : elements) {
+			if(p.first.is_string()) {
+				addToIndex(&p);
+			}
+		}
+	}
+
+	void addToIndex(Entry* entry) {
+		const size_t hash = entry->first.string_->getHash();
+		const size_t mask = index.size() - 1;
+		size_t n = hash&mask;
+		while(index[n].entry != nullptr) {
+			n = (n+1)&mask;
+		}
+
+		index[n].hash = hash;
+		index[n].entry = entry;
+		++num_indexed;
+	}
+
+	void eraseFromIndex(Entry* entry) {
+		const size_t mask = index.size() - 1;
+		size_t n = entry->first.string_->getHash()&mask;
+		while(index[n].entry != entry) {
+			ASSERT_LOG(index[n].entry != nullptr, "Map entry missing from index");
+			n = (n+1)&mask;
+		}
+
+		//shift back any following entries which were displaced past this
+		//slot, so probing never stops early at the hole.
+		for(size_t m = (n+1)&mask; index[m].entry != nullptr; m = (m+1)&mask) {
+			const size_t home = index[m].hash&mask;
+			const bool between = n <= m ? (n < home && home <= m) : (n < home || home <= m);
+			if(!between) {
+				index[n] = index[m];
+				n = m;
+			}
+		}
+
+		index[n].hash = 0;
+		index[n].entry = nullptr;
+		--num_indexed;
+	}
+
+	std::vector<IndexSlot> index;
+	size_t num_indexed;
 };
 
 struct variant_fn : public GarbageCollectible {
@@ -817,7 +990,7 @@ variant::variant(std::map<variant,variant>* map)
 	assert(map);
 	map_ = new variant_map;
 	map_->add_reference();
-	map_->elements.swap(*map);
+	map_->swapElements(*map);
 
 	registerGlobalVariant(this);
 }
@@ -958,8 +1131,8 @@ const variant& variant::operator[](const variant& v) const
 
 	if(type_ == VARIANT_TYPE_MAP) {
 		assert(map_);
-		std::map<variant,variant>::const_iterator i = map_->elements.find(v);
-		if (i == map_->elements.end())
+		const variant_map::Entry* i = map_->find(v);
+		if (i == nullptr)
 		{
 			g_variant_thread_info->last_failed_query_map = *this;
 			g_variant_thread_info->last_failed_query_key = v;
@@ -984,6 +1157,16 @@ const variant& variant::operator[](const variant& v) const
 
 const variant& variant::operator[](const std::string& key) const
 {
+	if(type_ == VARIANT_TYPE_MAP) {
+		//look up the string directly so a variant only needs to be made
+		//for it if it isn't found.
+		const variant_map::Entry* i = map_->findString(key, hash_map_key(key));
+		if(i != nullptr) {
+			g_variant_thread_info->last_query_map = *this;
+			return i->second;
+		}
+	}
+
 	return (*this)[variant(key)];
 }
 
@@ -993,8 +1176,8 @@ bool variant::has_key(const variant& key) const
 		return false;
 	}
 
-	std::map<variant,variant>::const_iterator i = map_->elements.find(key);
-	if(i != map_->elements.end() && i->second.is_null() == false) {
+	const variant_map::Entry* i = map_->find(key);
+	if(i != nullptr && i->second.is_null() == false) {
 		return true;
 	} else {
 		return false;
@@ -1003,7 +1186,12 @@ bool variant::has_key(const variant& key) const
 
 bool variant::has_key(const std::string& key) const
 {
-	return has_key(variant(key));
+	if(type_ != VARIANT_TYPE_MAP) {
+		return false;
+	}
+
+	const variant_map::Entry* i = map_->findString(key, hash_map_key(key));
+	return i != nullptr && i->second.is_null() == false;
 }
 
 variant variant::getKeys() const
@@ -1596,7 +1784,7 @@ variant variant::add_attr(variant key, variant value)
 		}
 
 		make_unique();
-		map_->elements[key] = value;
+		map_->set(key, value);
 		return *this;
 	} else {
 		return variant();
@@ -1615,7 +1803,7 @@ variant variant::remove_attr(variant key)
 		}
 
 		make_unique();
-		map_->elements.erase(key);
+		map_->erase(key);
 		return *this;
 	} else {
 		return variant();
@@ -1625,7 +1813,7 @@ variant variant::remove_attr(variant key)
 void variant::add_attr_mutation(variant key, variant value)
 {
 	if(is_map()) {
-		map_->elements[key] = value;
+		map_->set(key, value);
 		map_->modcount++;
 	}
 }
@@ -1633,7 +1821,7 @@ void variant::add_attr_mutation(variant key, variant value)
 void variant::remove_attr_mutation(variant key)
 {
 	if(is_map()) {
-		map_->elements.erase(key);
+		map_->erase(key);
 		map_->modcount++;
 	}
 }
@@ -1641,8 +1829,8 @@ void variant::remove_attr_mutation(variant key)
 variant* variant::get_attr_mutable(variant key)
 {
 	if(is_map()) {
-		std::map<variant,variant>::iterator i = map_->elements.find(key);
-		if(i != map_->elements.end()) {
+		variant_map::Entry* i = map_->find(key);
+		if(i != nullptr) {
 			map_->modcount++;
 			return &i->second;
 		}
@@ -2628,7 +2816,7 @@ void variant::make_unique()
 		variant_map* vm = new variant_map;
 		vm->add_reference();
 		vm->info = map_->info;
-		vm->elements.swap(m);
+		vm->swapElements(m);
 		map_ = vm;
 		break;
 	}
@@ -5128,4 +5316,42 @@ UNIT_TEST(serialize_map_backslash_values) {
 	s2.erase(std::remove_if(s2.begin(), s2.end(), isspace), s2.end());
 	CHECK_EQ("{\"\\\\\":\"\\\\\"}", s1);
 	CHECK_EQ("{\"\\\\\":\"\\\\\"}", s2);
-}
\ No newline at end of file
+}
+
+UNIT_TEST(map_string_key_index) {
+	//grow a map past the size where its string keys are indexed, then
+	//remove keys, checking lookups agree with the underlying tree.
+	variant m;
+	{
+		std::map<variant, variant> empty;
+		m = variant(&empty);
+	}
+
+	for(int n = 0; n != 200; ++n) {
+		m.add_attr_mutation(variant("key" + std::to_string(n)), variant(n));
+		m.add_attr_mutation(variant(n), variant(-n));
+	}
+
+	for(int n = 0; n < 200; n += 3) {
+		m.remove_attr_mutation(variant("key" + std::to_string(n)));
+	}
+
+	for(int n = 0; n != 200; ++n) {
+		const std::string key = "key" + std::to_string(n);
+		const bool removed = n%3 == 0;
+		CHECK_EQ(m.has_key(key), !removed);
+		CHECK_EQ(m.has_key(variant(key)), !removed);
+		CHECK_EQ(m.as_map().count(variant(key)) == 1, !removed);
+		if(!removed) {
+			CHECK_EQ(m[key].as_int(), n);
+			CHECK_EQ(m[variant(key)].as_int(), n);
+		}
+
+		CHECK_EQ(m[variant(n)].as_int(), -n);
+	}
+
+	variant copy = m;
+	copy = copy.add_attr(variant("key0"), variant(1000));
+	CHECK_EQ(copy["key0"].as_int(), 1000);
+	CHECK_EQ(m.has_key("key0"), false);
+}
@@ -125,6 +125,8 @@ public:
 
 	friend class GarbageCollectorImpl;
 	friend class GarbageCollectorAnalyzer;
+	friend class IncrementalGarbageCollector;
+	friend struct variant_map;
 
 	static void registerThread();
 	static void unregisterThread();
@@ -291,6 +293,10 @@ public:
 	//when high performance is needed.
 	int& int_addr() { return int_value_; }
 
+	//unsafe function which is called on a boolean variant and returns
+	//its value without checking the type.
+	bool as_bool_unsafe() const { return bool_value_; }
+
 	bool is_string() const { return type_ == VARIANT_TYPE_STRING; }
 	bool is_enum() const { return type_ == VARIANT_TYPE_ENUM; }
 	bool is_null() const { return type_ == VARIANT_TYPE_NULL; }
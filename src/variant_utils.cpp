@@ -231,6 +231,25 @@ variant deep_copy_variant(variant v)
 	}
 }
 
+size_t variant_memory_usage(const variant& v)
+{
+	size_t result = sizeof(variant);
+	if(v.is_string()) {
+		result += v.as_string().capacity();
+	} else if(v.is_list()) {
+		for(int n = 0; n != v.num_elements(); ++n) {
+			result += variant_memory_usage(v[static_cast<size_t>(n)]);
+		}
+	} else if(v.is_map()) {
+		for(const std::pair<const variant,variant>& p : v.as_map()) {
+			//the map node's pointers and colour as well as the key and value.
+			result += 4*sizeof(void*) + variant_memory_usage(p.first) + variant_memory_usage(p.second);
+		}
+	}
+
+	return result;
+}
+
 variant interpolate_variants(variant a, variant b, decimal ratio)
 {
 	if(a.is_numeric() && b.is_numeric()) {
@@ -72,6 +72,10 @@ void visitVariants(variant v, std::function<void (variant)> fn);
 
 variant deep_copy_variant(variant v);
 
+//the approximate number of bytes held by v and the lists, maps and strings
+//within it. Objects it refers to aren't counted.
+size_t variant_memory_usage(const variant& v);
+
 //function which interpolates two variants. ratio is between 0 and 1.
 //a and b must be of the same type and must be decimals, ints,
 //or lists or maps of interpolatable values.
@@ -21,6 +21,8 @@
 	   distribution.
 */
 
+#include <functional>
+
 #include <boost/algorithm/string.hpp>
 
 #include "asserts.hpp"
@@ -143,9 +145,7 @@ namespace css
 			{
 				auto class_attr = element->getAttribute("class");
 				if(class_attr) {
-					std::vector<std::string> strs;
-					boost::split(strs, class_attr->getValue(), boost::is_any_of(" \n\r\t\f"), boost::token_compress_on);
-					for(auto& cn : strs) {
+					for(auto& cn : split_class_names(class_attr->getValue())) {
 						if(class_name_ == cn) {
 							return true;
 						}
@@ -157,6 +157,7 @@ namespace css
 			{
 				return "." + class_name_;
 			}
+			const std::string& getClassName() const { return class_name_; }
 			std::array<int,3> calculateSpecificity() override {
 				std::array<int,3> specificity;
 				for(int n = 0; n != 3; ++n) {
@@ -182,6 +183,7 @@ namespace css
 			{
 				return "#" + id_;
 			}
+			const std::string& getIdName() const { return id_; }
 			std::array<int,3> calculateSpecificity() override {
 				std::array<int,3> specificity;
 				for(int n = 0; n != 3; ++n) {
@@ -503,7 +505,8 @@ namespace css
 	}
 
 	Selector::Selector()
-		: selector_chain_()
+		: selector_chain_(),
+		  ancestor_hashes_()
 	{
 		specificity_[0] = specificity_[1] = specificity_[2] = 0;
 	}
@@ -514,6 +517,7 @@ namespace css
 
 		for(auto& selector : parser.getSelectors()) {
 			selector->calculateSpecificity();
+			selector->calculateAncestorHashes();
 		}
 
 		return parser.getSelectors();
@@ -530,6 +534,39 @@ namespace css
 		}
 	}
 
+	void Selector::calculateAncestorHashes()
+	{
+		// Walking left from the subject, the simple selectors reached through child
+		// and descendent combinators match ancestors of the element. Those past a
+		// sibling combinator match something else, so are left out.
+		ancestor_hashes_.clear();
+		for(int n = static_cast<int>(selector_chain_.size()) - 2; n >= 0; --n) {
+			if(selector_chain_[n+1]->getCombinator() == Combinator::SIBLING) {
+				break;
+			}
+			auto& simple = selector_chain_[n];
+			if(simple->getElementId() != xhtml::ElementId::ANY) {
+				ancestor_hashes_.emplace_back(hash_tag(simple->getElementId()));
+			}
+			if(!simple->getIdName().empty()) {
+				ancestor_hashes_.emplace_back(hash_id_name(simple->getIdName()));
+			}
+			for(auto& cn : simple->getClassNames()) {
+				ancestor_hashes_.emplace_back(hash_class_name(cn));
+			}
+		}
+	}
+
+	bool Selector::mightMatch(const AncestorFilter& filter) const
+	{
+		for(auto hash : ancestor_hashes_) {
+			if(!filter.mightContain(hash)) {
+				return false;
+			}
+		}
+		return true;
+	}
+
 	std::string Selector::toString() const
 	{
 		std::ostringstream ss;
@@ -543,6 +580,8 @@ namespace css
 	SimpleSelector::SimpleSelector()
 		: element_(xhtml::ElementId::ANY),
 		  filters_(),
+		  id_name_(),
+		  class_names_(),
 		  combinator_(Combinator::NONE)
 	{
 		for(int n = 0; n != 3; ++n) {
@@ -556,6 +595,11 @@ namespace css
 		for(int n = 0; n != 3; ++n) {
 			specificity_[n] += s[n];
 		}
+		if(f->id() == FilterId::ID) {
+			id_name_ = static_cast<const IdSelector*>(f.get())->getIdName();
+		} else if(f->id() == FilterId::CLASS) {
+			class_names_.emplace_back(static_cast<const ClassSelector*>(f.get())->getClassName());
+		}
 		filters_.emplace_back(f);
 	}
 
@@ -644,6 +688,63 @@ namespace css
 		specificity_[2] = 1;
 	}
 
+	std::size_t hash_tag(xhtml::ElementId id)
+	{
+		return (static_cast<std::size_t>(id) + 1) * 2654435761u;
+	}
+
+	std::size_t hash_id_name(const std::string& id)
+	{
+		return std::hash<std::string>()(id) * 31 + 1;
+	}
+
+	std::size_t hash_class_name(const std::string& class_name)
+	{
+		return std::hash<std::string>()(class_name) * 31 + 2;
+	}
+
+	std::vector<std::string> split_class_names(const std::string& classes)
+	{
+		std::vector<std::string> strs;
+		boost::split(strs, classes, boost::is_any_of(" \n\r\t\f"), boost::token_compress_on);
+		return strs;
+	}
+
+	AncestorFilter::AncestorFilter()
+		: bits_()
+	{
+	}
+
+	void AncestorFilter::addElement(const xhtml::NodePtr& element)
+	{
+		if(element->id() != xhtml::NodeId::ELEMENT) {
+			return;
+		}
+		addHash(hash_tag(static_cast<const xhtml::Element*>(element.get())->getElementId()));
+		auto id_attr = element->getAttribute("id");
+		if(id_attr != nullptr) {
+			addHash(hash_id_name(id_attr->getValue()));
+		}
+		auto class_attr = element->getAttribute("class");
+		if(class_attr != nullptr) {
+			for(auto& cn : split_class_names(class_attr->getValue())) {
+				addHash(hash_class_name(cn));
+			}
+		}
+	}
+
+	// Two bits are set per hash, taken from different parts of it.
+	void AncestorFilter::addHash(std::size_t hash)
+	{
+		bits_.set(hash % FILTER_BITS);
+		bits_.set((hash / FILTER_BITS) % FILTER_BITS);
+	}
+
+	bool AncestorFilter::mightContain(std::size_t hash) const
+	{
+		return bits_.test(hash % FILTER_BITS) && bits_.test((hash / FILTER_BITS) % FILTER_BITS);
+	}
+
 	FilterSelector::FilterSelector(FilterId id)
 		: id_(id)
 	{
@@ -24,6 +24,7 @@
 #pragma once
 
 #include <array>
+#include <bitset>
 #include <map>
 #include <memory>
 #include <string>
@@ -110,14 +111,42 @@ namespace css
 		xhtml::ElementId getElementId() const { return element_; }
 		std::string toString() const;
 		const Specificity& getSpecificity() const { return specificity_; }
+		// The id and class names this selector requires of an element, if any.
+		const std::string& getIdName() const { return id_name_; }
+		const std::vector<std::string>& getClassNames() const { return class_names_; }
 	private:
 		xhtml::ElementId element_;
 		std::vector<FilterSelectorPtr> filters_;
+		std::string id_name_;
+		std::vector<std::string> class_names_;
 		Combinator combinator_;
 		Specificity specificity_;
 	};
 	typedef std::shared_ptr<SimpleSelector> SimpleSelectorPtr;
 
+	// Hashes of the tag, id and class names of elements, as used by the ancestor filter.
+	std::size_t hash_tag(xhtml::ElementId id);
+	std::size_t hash_id_name(const std::string& id);
+	std::size_t hash_class_name(const std::string& class_name);
+
+	// Splits the value of a class attribute into the class names in it.
+	std::vector<std::string> split_class_names(const std::string& classes);
+
+	// A Bloom filter over the tags, ids and classes of the ancestors of an
+	// element. A selector needing an ancestor with something not in the filter
+	// can't match, so can be rejected without walking up the tree.
+	class AncestorFilter
+	{
+	public:
+		AncestorFilter();
+		void addElement(const xhtml::NodePtr& element);
+		void addHash(std::size_t hash);
+		bool mightContain(std::size_t hash) const;
+	private:
+		enum { FILTER_BITS = 1024 };
+		std::bitset<FILTER_BITS> bits_;
+	};
+
 	class Selector
 	{
 	public:
@@ -128,9 +157,16 @@ namespace css
 		std::string toString() const;
 		void calculateSpecificity();
 		const Specificity& getSpecificity() const { return specificity_; }
+		// The rightmost simple selector, which is matched against the element itself.
+		const SimpleSelectorPtr& getSubject() const { return selector_chain_.back(); }
+		// false if an ancestor this selector needs isn't in the filter.
+		bool mightMatch(const AncestorFilter& filter) const;
 	private:
+		void calculateAncestorHashes();
 		std::vector<SimpleSelectorPtr> selector_chain_;
 		Specificity specificity_;
+		// Hashes of what must be present on some ancestor for this to match.
+		std::vector<std::size_t> ancestor_hashes_;
 	};
 
 	struct SpecificityOrdering
@@ -21,21 +21,49 @@
 	   distribution.
 */
 
+#include <algorithm>
+#include <sstream>
+
+#include "css_parser.hpp"
 #include "css_stylesheet.hpp"
+#include "unit_test.hpp"
+#include "xhtml_element.hpp"
 #include "xhtml_node.hpp"
+#include "xhtml_parser.hpp"
 
 namespace css
 {
 	// StyleSheet functions
 	StyleSheet::StyleSheet()
-		: rules_()
+		: rules_(),
+		  id_index_(),
+		  class_index_(),
+		  tag_index_(),
+		  universal_(),
+		  candidates_()
 	{
 	}
 
 	void StyleSheet::addRule(const CssRulePtr& rule)
 	{
+		const int rule_index = static_cast<int>(rules_.size());
 		rules_.emplace_back(rule);
 		//std::stable_sort(rules_.begin(), rules_.end(), sort_fn);
+
+		int order = 0;
+		for(auto& s : rule->selectors) {
+			auto& subject = s->getSubject();
+			IndexedSelector is(rule_index, order++, s);
+			if(!subject->getIdName().empty()) {
+				id_index_[subject->getIdName()].emplace_back(is);
+			} else if(!subject->getClassNames().empty()) {
+				class_index_[subject->getClassNames().front()].emplace_back(is);
+			} else if(subject->getElementId() != xhtml::ElementId::ANY) {
+				tag_index_[subject->getElementId()].emplace_back(is);
+			} else {
+				universal_.emplace_back(is);
+			}
+		}
 	}
 
 	std::string StyleSheet::toString() const
@@ -53,19 +81,169 @@ namespace css
 		return ss.str();
 	}
 
-	void StyleSheet::applyRulesToElement(xhtml::NodePtr n)
+	void StyleSheet::applyRulesToElement(xhtml::NodePtr n, const AncestorFilter* filter)
 	{
-		if(n->id() == xhtml::NodeId::ELEMENT) {
-			n->clearProperties();
-			for(auto& r : rules_) {
-				for(auto& s : r->selectors) {
-					if(s->match(n)) {
-						//LOG_INFO("merge for node: " << n->toString() << ", selector: " << s->toString() << ", spec: " << s->getSpecificity()[0] << "," << s->getSpecificity()[1] << "," << s->getSpecificity()[2]);
-						n->mergeProperties(s->getSpecificity(), r->declaractions);
-						break;
-					}
+		if(n->id() != xhtml::NodeId::ELEMENT) {
+			return;
+		}
+		n->clearProperties();
+
+		auto add_candidates = [this](const IndexedSelectorList& list) {
+			for(auto& is : list) {
+				candidates_.emplace_back(&is);
+			}
+		};
+
+		candidates_.clear();
+		add_candidates(universal_);
+		auto it = tag_index_.find(static_cast<const xhtml::Element*>(n.get())->getElementId());
+		if(it != tag_index_.end()) {
+			add_candidates(it->second);
+		}
+		auto id_attr = n->getAttribute("id");
+		if(id_attr != nullptr) {
+			auto it = id_index_.find(id_attr->getValue());
+			if(it != id_index_.end()) {
+				add_candidates(it->second);
+			}
+		}
+		auto class_attr = n->getAttribute("class");
+		if(class_attr != nullptr && !class_index_.empty()) {
+			auto class_names = split_class_names(class_attr->getValue());
+			std::sort(class_names.begin(), class_names.end());
+			class_names.erase(std::unique(class_names.begin(), class_names.end()), class_names.end());
+			for(auto& cn : class_names) {
+				auto it = class_index_.find(cn);
+				if(it != class_index_.end()) {
+					add_candidates(it->second);
 				}
 			}
 		}
+
+		// Rules are merged in the order they were added, using the first selector
+		// of each which matches.
+		std::sort(candidates_.begin(), candidates_.end(), [](const IndexedSelector* a, const IndexedSelector* b) {
+			return a->rule == b->rule ? a->order < b->order : a->rule < b->rule;
+		});
+
+		int last_matched_rule = -1;
+		for(auto is : candidates_) {
+			if(is->rule == last_matched_rule) {
+				continue;
+			}
+			if(filter != nullptr && !is->selector->mightMatch(*filter)) {
+				continue;
+			}
+			if(is->selector->match(n)) {
+				//LOG_INFO("merge for node: " << n->toString() << ", selector: " << is->selector->toString());
+				n->mergeProperties(is->selector->getSpecificity(), rules_[is->rule]->declaractions);
+				last_matched_rule = is->rule;
+			}
+		}
+	}
+}
+
+namespace
+{
+	// Applies the rules of the style sheet to n by testing every selector of
+	// every rule, as applyRulesToElement would without the index.
+	css::PropertyList apply_rules_unindexed(const css::StyleSheetPtr& ss, const xhtml::NodePtr& n)
+	{
+		css::PropertyList plist;
+		for(auto& r : ss->getRules()) {
+			for(auto& s : r->selectors) {
+				if(s->match(n)) {
+					plist.merge(s->getSpecificity(), r->declaractions);
+					break;
+				}
+			}
+		}
+		return plist;
+	}
+
+	bool same_properties(const css::PropertyList& a, const css::PropertyList& b)
+	{
+		auto it = b.begin();
+		for(auto& p : a) {
+			if(it == b.end() || it->first != p.first || it->second.style != p.second.style) {
+				return false;
+			}
+			++it;
+		}
+		return it == b.end();
+	}
+
+	xhtml::DocumentPtr create_test_document(const std::string& css, const std::string& html)
+	{
+		auto ss = std::make_shared<css::StyleSheet>();
+		css::Parser::parse(ss, css);
+		auto doc = xhtml::Document::create(ss);
+		doc->addChild(xhtml::parse_from_string(html, doc), doc);
+		doc->processStyleRules();
+		return doc;
+	}
+
+	const char* test_css =
+		"p { color: red; }\n"
+		".a { color: blue; }\n"
+		"div.b p { color: green; }\n"
+		"#x, em { font-style: italic; }\n"
+		"* > span { font-weight: bold; }\n"
+		"em + span { text-align: center; }\n";
+}
+
+UNIT_TEST(css_indexed_rules)
+{
+	auto doc = create_test_document(test_css,
+		"<div class=\"b\"><p>one</p><p class=\"a\">two</p></div>"
+		"<div><p id=\"x\">three</p><em>four</em><span>five</span><span style=\"color: red\">six</span></div>");
+
+	auto check_all = [&doc]() {
+		bool matched = true;
+		doc->preOrderTraversal([&doc, &matched](xhtml::NodePtr n) {
+			if(n->id() == xhtml::NodeId::ELEMENT && n->getAttribute("style") == nullptr) {
+				matched &= same_properties(n->getProperties(), apply_rules_unindexed(doc->getStyleSheet(), n));
+			}
+			return true;
+		});
+		return matched;
+	};
+	CHECK_EQ(check_all(), true);
+
+	auto x = doc->getElementById("x");
+	CHECK_EQ(x->getProperties().hasProperty(css::Property::FONT_STYLE), true);
+	CHECK_EQ(x->getRight()->getRight()->getRight()->getProperties().hasProperty(css::Property::COLOR), true);
+
+	// Changing an attribute only restyles the subtree it's on.
+	doc->preOrderTraversal([](xhtml::NodePtr n) {
+		n->clearStyleChanges();
+		return true;
+	});
+	auto first_div = doc->getChildren().front();
+	auto two = first_div->getChildren().back();
+	two->setAttribute("class", "c");
+	CHECK_EQ(doc->needsRestyle(), true);
+	doc->processStyleRules();
+	CHECK_EQ(doc->needsRestyle(), false);
+	CHECK_EQ(check_all(), true);
+	CHECK_EQ(two->isStyleChanged(), true);
+	CHECK_EQ(two->getChildren().front()->isStyleChanged(), true);
+	CHECK_EQ(first_div->isStyleChanged(), false);
+	CHECK_EQ(first_div->getChildren().front()->isStyleChanged(), false);
+	CHECK_EQ(x->getParent()->hasStyleChanges(), false);
+}
+
+BENCHMARK(css_restyle_single_node)
+{
+	std::ostringstream html;
+	for(int n = 0; n != 500; ++n) {
+		html << "<div class=\"b\"><p>one</p><p class=\"a\">two</p><em>three</em><span>four</span></div>";
+	}
+	auto doc = create_test_document(test_css, html.str());
+	auto node = doc->getChildren()[250];
+	int n = 0;
+	BENCHMARK_LOOP {
+		node->setAttribute("class", (++n % 2) ? "a" : "b");
+		doc->processStyleRules();
 	}
 }
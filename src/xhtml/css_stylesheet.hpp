@@ -36,6 +36,9 @@ namespace css
 	};
 	typedef std::shared_ptr<CssRule> CssRulePtr;
 
+	// Selectors are indexed by the id, class or tag their rightmost simple
+	// selector needs, so only the ones which could match an element are tested
+	// against it, in the order the rules were added.
 	class StyleSheet
 	{
 	public:
@@ -44,9 +47,26 @@ namespace css
 		std::string toString() const;
 
 		const std::vector<CssRulePtr>& getRules() const { return rules_; }
-		void applyRulesToElement(xhtml::NodePtr n);
+		// If given, filter holds the ancestors of n, to reject selectors needing
+		// an ancestor it doesn't have.
+		void applyRulesToElement(xhtml::NodePtr n, const AncestorFilter* filter=nullptr);
 	private:
+		struct IndexedSelector
+		{
+			IndexedSelector(int r, int o, const SelectorPtr& s) : rule(r), order(o), selector(s) {}
+			int rule;
+			int order;
+			SelectorPtr selector;
+		};
+		typedef std::vector<IndexedSelector> IndexedSelectorList;
+
 		std::vector<CssRulePtr> rules_;
+		std::map<std::string, IndexedSelectorList> id_index_;
+		std::map<std::string, IndexedSelectorList> class_index_;
+		std::map<xhtml::ElementId, IndexedSelectorList> tag_index_;
+		IndexedSelectorList universal_;
+		// Reused between calls to applyRulesToElement
+		std::vector<const IndexedSelector*> candidates_;
 	};
 	typedef std::shared_ptr<StyleSheet> StyleSheetPtr;
 }
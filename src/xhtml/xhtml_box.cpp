@@ -74,7 +74,12 @@ namespace xhtml
 		  is_replaceable_(false),
 		  is_first_inline_child_(false),
 		  is_last_inline_child_(false),
-		  scene_tree_(nullptr)
+		  scene_tree_(nullptr),
+		  layout_containing_(),
+		  layout_parent_offset_(),
+		  layout_engine_offset_(),
+		  layout_reusable_(false),
+		  laid_out_(false)
 	{
 		if(getNode() != nullptr && getNode()->id() == NodeId::ELEMENT) {
 			is_replaceable_ = getNode()->isReplaced();
@@ -195,6 +200,34 @@ namespace xhtml
 			fcm.reset(new LayoutEngine::FloatContextManager(eng, FloatList()));
 		}
 
+		const point parent_offset = getParent() != nullptr ? getParent()->getOffset() : point();
+		if(canReuseLayout(eng, ocontaining, parent_offset)) {
+			// Leave the cursor where laying out the box again would have.
+			point p;
+			p.y = getTop() + precss_content_height_ + getMBPBottom();
+			p.x = eng.getXAtPosition(p.y, p.y + getLineHeight());
+			eng.setCursor(p);
+			eng.closeLineBox();
+			return;
+		}
+
+		if(laid_out_) {
+			dimensions_ = Dimensions();
+			boxes_.clear();
+			absolute_boxes_.clear();
+		}
+		laid_out_ = true;
+		layout_containing_ = ocontaining.content_;
+		layout_parent_offset_ = parent_offset;
+		layout_engine_offset_ = eng.getOffset();
+
+		// Floats and fixed boxes are kept outside of the box, and list items
+		// numbered by a counter outside of it, so a box is only reused if it
+		// doesn't touch any of them.
+		const bool had_floats = !eng.getFloatList().left_.empty() || !eng.getFloatList().right_.empty();
+		const size_t fixed_count = eng.getRoot() != nullptr ? eng.getRoot()->getFixed().size() : 0;
+		const int list_item_count = eng.getListItemCount();
+
 		point cursor;
 		// If we have a clear flag set, then move the cursor in the layout engine to clear appropriate floats.
 		if(node_ != nullptr) {
@@ -277,9 +310,38 @@ namespace xhtml
 			}
 		}
 
+		layout_reusable_ = id_ == BoxId::BLOCK
+			&& node_ != nullptr
+			&& !isFloat()
+			&& node_->getPosition() != Position::FIXED
+			&& !had_floats
+			&& eng.getFloatList().left_.empty()
+			&& eng.getFloatList().right_.empty()
+			&& (eng.getRoot() != nullptr ? eng.getRoot()->getFixed().size() : 0) == fixed_count
+			&& eng.getListItemCount() == list_item_count;
+		if(node_ != nullptr) {
+			if(id_ == BoxId::BLOCK) {
+				node_->setLayoutBox(shared_from_this());
+			}
+			node_->layoutComplete();
+		}
+
 		eng.closeLineBox();
 	}
 
+	bool Box::canReuseLayout(LayoutEngine& eng, const Dimensions& containing, const point& parent_offset) const
+	{
+		if(!laid_out_ || !layout_reusable_ || node_ == nullptr || node_->needsLayout()) {
+			return false;
+		}
+		if(!eng.getFloatList().left_.empty() || !eng.getFloatList().right_.empty()) {
+			return false;
+		}
+		return layout_containing_ == containing.content_
+			&& layout_parent_offset_ == parent_offset
+			&& layout_engine_offset_ == eng.getOffset();
+	}
+
 	void Box::calculateVertMPB(FixedPoint containing_height)
 	{
 		auto styles = getStyleNode();
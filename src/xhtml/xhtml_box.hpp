@@ -234,6 +234,7 @@ namespace xhtml
 		virtual void handleCreateSceneTree(KRE::SceneTreePtr scene_parent) {}
 
 		void init();
+		bool canReuseLayout(LayoutEngine& eng, const Dimensions& containing, const point& parent_offset) const;
 
 		BoxId id_;
 		StyleNodePtr node_;
@@ -258,6 +259,15 @@ namespace xhtml
 		bool is_last_inline_child_;
 
 		KRE::SceneTreePtr scene_tree_;
+
+		// What this box was last laid out against. If the same again, and the
+		// style node under it is unchanged, laying it out would give the same
+		// result so the previous one is kept.
+		Rect layout_containing_;
+		point layout_parent_offset_;
+		point layout_engine_offset_;
+		bool layout_reusable_;
+		bool laid_out_;
 	};
 
 	std::ostream& operator<<(std::ostream& os, const Rect& r);
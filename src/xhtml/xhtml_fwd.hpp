@@ -60,6 +60,16 @@ namespace xhtml
 		FixedPoint height;
 	};
 
+	inline bool operator==(const Rect& a, const Rect& b)
+	{
+		return a.x == b.x && a.y == b.y && a.width == b.width && a.height == b.height;
+	}
+
+	inline bool operator!=(const Rect& a, const Rect& b)
+	{
+		return !(a == b);
+	}
+
 	class LayoutEngine;
 	class Box;
 	class RootBox;
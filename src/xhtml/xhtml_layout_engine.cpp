@@ -21,6 +21,11 @@
 	   distribution.
 */
 
+#include <sstream>
+
+#include "unit_test.hpp"
+
+#include "css_parser.hpp"
 #include "xhtml_layout_engine.hpp"
 #include "xhtml_absolute_box.hpp"
 #include "xhtml_block_box.hpp"
@@ -28,6 +33,7 @@
 #include "xhtml_inline_element_box.hpp"
 #include "xhtml_line_box.hpp"
 #include "xhtml_listitem_box.hpp"
+#include "xhtml_parser.hpp"
 #include "xhtml_root_box.hpp"
 #include "xhtml_text_box.hpp"
 #include "xhtml_text_node.hpp"
@@ -93,7 +99,13 @@ namespace xhtml
 	void LayoutEngine::layoutRoot(StyleNodePtr node, BoxPtr parent, const point& container)
 	{
 		if(root_ == nullptr) {
-			root_ = std::make_shared<RootBox>(nullptr, node);
+			// The root box is kept from the previous layout, along with any
+			// boxes under it which can be reused.
+			root_ = std::dynamic_pointer_cast<RootBox>(node->getLayoutBox());
+			if(root_ == nullptr) {
+				root_ = std::make_shared<RootBox>(nullptr, node);
+			}
+			root_->clearFixed();
 			dims_.content_ = Rect(0, 0, container.x, container.y);
 
 			Dimensions root_dims;
@@ -219,7 +231,7 @@ namespace xhtml
 						}
 						case Display::BLOCK: {
 							open_line_box_.reset();
-							res.emplace_back(std::make_shared<BlockBox>(parent, child, root_));
+							res.emplace_back(reuseBlockBox(child, parent));
 							break;
 						}
 						case Display::INLINE_BLOCK: {
@@ -263,6 +275,16 @@ namespace xhtml
 		return res;
 	}
 
+	BoxPtr LayoutEngine::reuseBlockBox(const StyleNodePtr& node, const BoxPtr& parent)
+	{
+		auto box = node->getLayoutBox();
+		if(box != nullptr && box->id() == BoxId::BLOCK && box->getRoot() == root_) {
+			box->setParent(parent);
+			return box;
+		}
+		return std::make_shared<BlockBox>(parent, node, root_);
+	}
+
 	FixedPoint LayoutEngine::getDescent() const
 	{
 		return ctx_.getFontHandle()->getDescender();
@@ -378,3 +400,42 @@ namespace xhtml
 		return float_list_.top();
 	}
 }
+
+// Lays out a document of 5000 nodes once, then times laying it out again after
+// changing the class of a single element.
+BENCHMARK(xhtml_relayout_single_node)
+{
+	auto ss = std::make_shared<css::StyleSheet>();
+	css::Parser::parse(ss, "div { margin: 2px; } .wide { padding-left: 4px; }");
+	auto doc = xhtml::Document::create(ss);
+
+	std::ostringstream html;
+	html << "<html><body>";
+	for(int n = 0; n != 1000; ++n) {
+		html << "<div><p>item " << n << "</p><span>text</span></div>";
+	}
+	html << "</body></html>";
+	doc->addChild(xhtml::parse_from_string(html.str(), doc), doc);
+
+	xhtml::RenderContext::get().setViewport(point(800, 600));
+	doc->processStyleRules();
+	auto style_tree = xhtml::StyleNode::createStyleTree(doc);
+	auto layout = xhtml::Box::createLayout(style_tree, 800, 600);
+
+	xhtml::NodePtr body;
+	doc->preOrderTraversal([&body](xhtml::NodePtr n) {
+		if(n->id() == xhtml::NodeId::ELEMENT && n->hasTag(xhtml::ElementId::BODY)) {
+			body = n;
+			return false;
+		}
+		return true;
+	});
+	auto node = body->getChildren()[body->getChildren().size()/2];
+	int n = 0;
+	BENCHMARK_LOOP {
+		node->setAttribute("class", (++n % 2) ? "wide" : "");
+		doc->processStyleRules();
+		style_tree->updateStyles();
+		layout = xhtml::Box::createLayout(style_tree, 800, 600);
+	}
+}
@@ -75,7 +75,11 @@ namespace xhtml
 		void resetCursor() { cursor_.x = cursor_.y = 0; }
 
 		void closeLineBox() { open_line_box_.reset(); }
+
+		int getListItemCount() const { return list_item_counter_.top(); }
 	private:
+		BoxPtr reuseBlockBox(const StyleNodePtr& node, const BoxPtr& parent);
+
 		RootBoxPtr root_;
 		Dimensions dims_;
 		RenderContext& ctx_;
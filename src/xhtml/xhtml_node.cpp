@@ -121,7 +121,13 @@ namespace xhtml
 		  script_handler_(nullptr),
 		  active_handlers_(),
 		  mouse_entered_(false),
-		  style_node_()
+		  style_node_(),
+		  style_dirty_(true),
+		  descendant_style_dirty_(false),
+		  style_changed_(false),
+		  descendant_style_changed_(false),
+		  inline_style_source_(),
+		  inline_style_()
 	{
 		active_handlers_.resize(static_cast<int>(EventHandlerId::MAX_EVENT_HANDLERS));
 	}
@@ -172,6 +178,7 @@ namespace xhtml
 			children_.emplace_back(child);
 			child->setParent(shared_from_this());
 		}
+		markStyleDirty();
 	}
 
 	void Node::removeChild(NodePtr child)
@@ -191,6 +198,7 @@ namespace xhtml
 				}
 			}
 			child->left_ = child->right_ = std::weak_ptr<Node>();
+			markStyleDirty();
 		} else {
 			ASSERT_LOG(false, "Tried to remove child node which doesn't belong to us.");
 		}
@@ -200,11 +208,74 @@ namespace xhtml
 	{
 		a->setParent(shared_from_this());
 		attributes_[a->getName()] = a;
+		markStyleDirty();
 	}
 
 	void Node::setAttribute(const std::string& name, const std::string& value)
 	{
 		attributes_[name] = Attribute::create(name, value, getOwnerDoc());
+		markStyleDirty();
+		auto owner = getOwnerDoc();
+		if(owner != nullptr) {
+			owner->triggerLayout();
+		}
+	}
+
+	void Node::markStyleDirty()
+	{
+		style_dirty_ = true;
+		for(auto right = getRight(); right != nullptr; right = right->getRight()) {
+			if(right->id() == NodeId::ELEMENT) {
+				right->style_dirty_ = true;
+				break;
+			}
+		}
+		// Ancestors already flagged have had the rest of theirs flagged too.
+		for(auto parent = getParent(); parent != nullptr && !parent->descendant_style_dirty_; parent = parent->getParent()) {
+			parent->descendant_style_dirty_ = true;
+		}
+	}
+
+	bool Node::restyle(const css::StyleSheetPtr& ss, const css::AncestorFilter& filter, bool force)
+	{
+		force |= style_dirty_;
+		if(force) {
+			if(id() == NodeId::ELEMENT) {
+				ss->applyRulesToElement(shared_from_this(), &filter);
+				applyInlineStyle();
+				markTransitions();
+			}
+			style_changed_ = true;
+		}
+
+		if(force || descendant_style_dirty_) {
+			css::AncestorFilter child_filter(filter);
+			child_filter.addElement(shared_from_this());
+			for(auto& c : children_) {
+				if(c->restyle(ss, child_filter, force)) {
+					descendant_style_changed_ = true;
+				}
+			}
+		}
+
+		style_dirty_ = descendant_style_dirty_ = false;
+		return style_changed_ || descendant_style_changed_;
+	}
+
+	void Node::applyInlineStyle()
+	{
+		auto attr = getAttribute("style");
+		if(attr == nullptr) {
+			inline_style_source_.clear();
+			inline_style_.clear();
+			return;
+		}
+		if(attr->getValue() != inline_style_source_) {
+			inline_style_source_ = attr->getValue();
+			inline_style_ = css::Parser::parseDeclarationList(inline_style_source_);
+		}
+		css::Specificity specificity = {{9999, 9999, 9999}};
+		mergeProperties(specificity, inline_style_);
 	}
 
 	bool Node::preOrderTraversal(std::function<bool(NodePtr)> fn)
@@ -438,12 +509,14 @@ namespace xhtml
 			if((active_pclass_ & css::PseudoClass::FOCUS) != css::PseudoClass::FOCUS) {
 				active_pclass_ = active_pclass_ | css::PseudoClass::FOCUS;
 				getOwnerDoc()->setActiveElement(shared_from_this());
+				markStyleDirty();
 				*trigger = true;
 			}
 			return true;
 		} else if((active_pclass_ & css::PseudoClass::FOCUS) == css::PseudoClass::FOCUS) {
 			active_pclass_ = active_pclass_ & ~css::PseudoClass::FOCUS;
 			getOwnerDoc()->setActiveElement(nullptr);
+			markStyleDirty();
 			*trigger = true;
 		}
 
@@ -530,11 +603,13 @@ namespace xhtml
 		if(mouse_entered_) {
 			if((active_pclass_ & css::PseudoClass::HOVER) != css::PseudoClass::HOVER) {
 				active_pclass_ = active_pclass_ | css::PseudoClass::HOVER;
+				markStyleDirty();
 				*trigger = true;
 			}
 			return true;
 		} else if(mouse_left && (active_pclass_ & css::PseudoClass::HOVER) == css::PseudoClass::HOVER) {
 			active_pclass_ = active_pclass_ & ~css::PseudoClass::HOVER;
+			markStyleDirty();
 			*trigger = true;
 		}
 		return true;
@@ -727,7 +802,8 @@ namespace xhtml
 		  layout_x_(0),
 		  layout_y_(0),
 		  active_element_(),
-		  event_listeners_()
+		  event_listeners_(),
+		  layout_()
 	{
 	}
 
@@ -762,38 +838,17 @@ namespace xhtml
 			return true;
 		});
 
+		// The rules may have changed, so need applying to everything.
+		markStyleDirty();
 		processStyleRules();
 	}
 
 	void Document::processStyleRules()
 	{
-		auto& ss = style_sheet_;
-		preOrderTraversal([&ss](NodePtr n) {
-			ss->applyRulesToElement(n);
-			return true;
-		});
-
-		// Parse and apply specific element style rules from attributes here.
-		preOrderTraversal([](NodePtr n) {
-			if(n->id() == NodeId::ELEMENT) {
-				// XXX: we should cache this and only re-parse if it changes.
-				auto attr = n->getAttribute("style");
-				if(attr) {
-					auto plist = css::Parser::parseDeclarationList(attr->getValue());
-					css::Specificity specificity = {{9999, 9999, 9999}};
-					n->mergeProperties(specificity, plist);
-				}
-			}
-			return true;
-		});
-
-		static bool marked_transtions = false;
-		if(!marked_transtions) {
-			//marked_transtions = true;
-			preOrderTraversal([](NodePtr n) {
-				n->markTransitions();
-				return true;
-			});
+		// Only the subtrees of nodes which changed are restyled, with their
+		// inline style attributes re-parsed only if they changed.
+		if(needsRestyle()) {
+			restyle(style_sheet_, css::AncestorFilter(), false);
 		}
 	}
 
@@ -812,6 +867,7 @@ namespace xhtml
 			LOG_INFO("Rebuild layout!");
 #endif
 			style_tree.reset();
+			layout_.reset();
 			trigger_rebuild_ = false;
 			triggerLayout();
 		}
@@ -820,11 +876,14 @@ namespace xhtml
 #if defined(ENABLE_PROFILING)
 			LOG_INFO("Triggered layout!");
 #endif
+			// Computed values may depend on the size of the viewport.
+			if(RenderContext::get().getViewport() != point(w, h)) {
+				markStyleDirty();
+			}
 			RenderContext::get().setViewport(point(w, h));
 
 			clearEventListeners();
 
-			// XXX should we should have a re-process styles flag here.
 			{
 #if defined(ENABLE_PROFILING)
 				profile::manager pman("apply styles");
@@ -848,7 +907,7 @@ namespace xhtml
 #if defined(ENABLE_PROFILING)
 				profile::manager pman("layout");
 #endif
-				layout = Box::createLayout(style_tree, w, h);
+				layout = layout_ = Box::createLayout(style_tree, w, h);
 			}
 
 			triggerRender();
@@ -180,6 +180,21 @@ namespace xhtml
 		void clearProperties() { properties_.clear(); }
 		void inheritProperties();
 
+		// Marks the style rules as needing re-applying to this node and its
+		// descendants, along with the next element sibling, which sibling
+		// selectors may match relative to this one.
+		void markStyleDirty();
+		bool needsRestyle() const { return style_dirty_ || descendant_style_dirty_; }
+		// Re-applies style rules to the dirty nodes under this one, or all of
+		// them if force is set. filter holds the ancestors of this node.
+		// Returns true if any node was restyled.
+		bool restyle(const css::StyleSheetPtr& ss, const css::AncestorFilter& filter, bool force);
+		// Whether the properties of this node, or of any of its descendants,
+		// changed since the computed styles were last updated from them.
+		bool isStyleChanged() const { return style_changed_; }
+		bool hasStyleChanges() const { return style_changed_ || descendant_style_changed_; }
+		void clearStyleChanges() { style_changed_ = descendant_style_changed_ = false; }
+
 		// for elements
 		const rect& getDimensions() { return dimensions_; }
 		void setDimensions(const rect& r) { dimensions_ = r; handleSetDimensions(r); }
@@ -211,6 +226,7 @@ namespace xhtml
 		virtual bool handleMouseWheelInt(bool* trigger, const point& p, const point& delta, int direction) { return true; }
 		virtual void handleSetDimensions(const rect& r) {}
 		virtual void handleSetActiveRect(const rect& r) {}
+		void applyInlineStyle();
 
 		NodeId id_;
 		NodeList children_;
@@ -239,6 +255,15 @@ namespace xhtml
 
 		// back reference to the tree node holding computer values for us.
 		WeakStyleNodePtr style_node_;
+
+		bool style_dirty_;
+		bool descendant_style_dirty_;
+		bool style_changed_;
+		bool descendant_style_changed_;
+
+		// The last parsed value of the style attribute.
+		std::string inline_style_source_;
+		css::PropertyList inline_style_;
 	};
 
 	class Document : public Node
@@ -248,6 +273,7 @@ namespace xhtml
 		std::string toString() const override;
 		void processStyles();
 		void processStyleRules();
+		const css::StyleSheetPtr& getStyleSheet() const { return style_sheet_; }
 
 		bool handleMouseMotion(bool claimed, int x, int y);
 		bool handleMouseButtonDown(bool claimed, int x, int y, unsigned button);
@@ -291,6 +317,9 @@ namespace xhtml
 
 		WeakNodePtr active_element_;
 		std::set<EventListenerPtr> event_listeners_;
+
+		// The last layout, kept so the next can reuse boxes from it.
+		RootBoxPtr layout_;
 	};
 
 	class DocumentFragment : public Node
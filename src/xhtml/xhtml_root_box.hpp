@@ -36,6 +36,7 @@ namespace xhtml
 		void addFixed(BoxPtr fixed);
 		void layoutFixed(LayoutEngine& eng, const Dimensions& containing);
 		const std::vector<BoxPtr>& getFixed() const { return fixed_boxes_; }
+		void clearFixed() { fixed_boxes_.clear(); }
 		void setLayoutDimensions(int cw, int ch) { layout_dims_.x = cw; layout_dims_.y = ch; }
 		const point& getLayoutDimensions() const { return layout_dims_; }
 	private:
@@ -31,6 +31,7 @@ namespace xhtml
 
 	StyleNode::StyleNode(const NodePtr& node)
 		: node_(node),
+		  parent_(),
 		  children_(),
 		  transitions_(),
 		  acc_(0.0f),
@@ -104,7 +105,10 @@ namespace xhtml
 		  border_image_repeat_vert_(CssBorderImageRepeat::REPEAT),
 		  background_clip_(BackgroundClip::BORDER_BOX),
 		  filters_(nullptr),
-		  transform_(nullptr)
+		  transform_(nullptr),
+		  layout_box_(),
+		  layout_dirty_(true),
+		  child_layout_dirty_(false)
 	{
 	}
 
@@ -117,10 +121,12 @@ namespace xhtml
 			rcm.reset(new RenderContext::Manager(node->getProperties()));
 		}
 		StyleNodePtr style_child = std::make_shared<StyleNode>(node);
+		style_child->parent_ = parent;
 		node->setStylePointer(style_child);
 		if(is_element || is_text) {
 			style_child->processStyles(true);
 		}
+		node->clearStyleChanges();
 
 		parent->children_.emplace_back(style_child);
 
@@ -148,12 +154,20 @@ namespace xhtml
 		std::unique_ptr<RenderContext::Manager> rcm;
 		auto node = node_.lock();
 		if(node != nullptr) {
+			// Nothing under here was restyled, so the computed values still hold.
+			if(!node->hasStyleChanges()) {
+				return;
+			}
 			bool is_element = node->id() == NodeId::ELEMENT;
 			bool is_text = node->id() == NodeId::TEXT;
 			if(is_element || is_text) {
 				rcm.reset(new RenderContext::Manager(node->getProperties()));
-				processStyles(false);
+				if(node->isStyleChanged()) {
+					processStyles(false);
+					markLayoutDirty();
+				}
 			}
+			node->clearStyleChanges();
 		}
 
 		for(auto& child : getChildren()) {
@@ -161,6 +175,14 @@ namespace xhtml
 		}
 	}
 
+	void StyleNode::markLayoutDirty()
+	{
+		layout_dirty_ = true;
+		for(auto parent = parent_.lock(); parent != nullptr; parent = parent->parent_.lock()) {
+			parent->child_layout_dirty_ = true;
+		}
+	}
+
 	void StyleNode::process(float dt)
 	{
 		auto node = getNode();
@@ -654,6 +676,9 @@ namespace xhtml
 		ASSERT_LOG(node != nullptr, "No node associated with this style node.");
 		DocumentPtr doc = node->getOwnerDoc();
 		ASSERT_LOG(doc != nullptr, "No owner document found.");
+		// Boxes keep some values, such as border radii, worked out from the
+		// styles when laid out, so any change stops the box being reused.
+		markLayoutDirty();
 		if(doc!= nullptr && (sp->requiresLayout(p) || force_layout)) {
 			//LOG_ERROR("Layout triggered from style.");
 			doc->triggerLayout();
@@ -743,6 +768,7 @@ namespace xhtml
 		for(auto& child : doc->getChildren()) {
 			root->parseNode(root, child);
 		}
+		doc->clearStyleChanges();
 		return root;
 	}
 }
@@ -151,6 +151,15 @@ namespace xhtml
 
 		void updateStyles();
 		void inheritProperties(const StyleNodePtr& new_styles);
+
+		// The block box this node was last laid out as. The next layout reuses
+		// it, and keeps its children too unless this node, or any node under it,
+		// has changed since.
+		BoxPtr getLayoutBox() const { return layout_box_.lock(); }
+		void setLayoutBox(const BoxPtr& box) { layout_box_ = box; }
+		void markLayoutDirty();
+		bool needsLayout() const { return layout_dirty_ || child_layout_dirty_; }
+		void layoutComplete() { layout_dirty_ = child_layout_dirty_ = false; }
 	private:
 		void processStyles(bool created);
 		void processColor(bool created, css::Property p, KRE::ColorPtr& color);
@@ -159,6 +168,7 @@ namespace xhtml
 		void processFilter(bool created);
 		void processTransform(bool created);
 		WeakNodePtr node_;
+		WeakStyleNodePtr parent_;
 		std::vector<StyleNodePtr> children_;
 		std::vector<css::TransitionPtr> transitions_;
 		float acc_;
@@ -321,5 +331,9 @@ namespace xhtml
 		std::shared_ptr<css::FilterStyle> filters_;
 		//TRANSFORM
 		std::shared_ptr<css::TransformStyle> transform_;
+
+		std::weak_ptr<Box> layout_box_;
+		bool layout_dirty_;
+		bool child_layout_dirty_;
 	};
 }